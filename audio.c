@@ -1,27 +1,168 @@
 #include "cMusix.h"
 
-int audio_file(const char* filename) {
-    if (!filename) return 0;
-    
-    const char* ext = strrchr(filename, '.');
-    if (!ext) return 0;
-    
-    // Convert extension to lowercase for comparison
-    char lower_ext[10];
-    int i = 0;
-    while (ext[i] && i < 9) {
-        lower_ext[i] = tolower(ext[i]);
-        i++;
-    }
-    lower_ext[i] = '\0';
-    
-    // Check for supported audio file extensions
-    return (strcmp(lower_ext, ".mp3") == 0 || 
-            strcmp(lower_ext, ".wav") == 0 || 
-            strcmp(lower_ext, ".flac") == 0 || 
-            strcmp(lower_ext, ".ogg") == 0 ||
-            strcmp(lower_ext, ".m4a") == 0 ||
-            strcmp(lower_ext, ".aac") == 0);
+#define MISSING_SKIP_MAX 64    // playlist entries stat()ed per play
+#define LATER_WARNINGS 8        // kept for the exit summary, the rest dropped
+
+// Output device as opened, see open_device()
+static int requested_rate = 0;
+static int device_rate = 0;
+static Uint16 device_format = AUDIO_S16SYS;
+static int device_channels = 2;
+static int device_frame_bytes = 4;
+static unsigned long reopens = 0;
+
+// Threads decoding to the device format with Mix_LoadWAV() take its spec
+// from audio_device_spec() and check the generation once done: a reopen
+// does not wait for them, it makes their result stale
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+static int device_closing = 0;
+static unsigned long device_generation = 0;
+
+// Latency measurement (config.latency_report). The main thread stamps a
+// play request, the audio thread times it to the first callback that
+// carries the new track and keeps callback periods and its own CPU time.
+static uint64_t play_requested = 0;
+static uint64_t last_callback = 0;    // audio thread, 0 right after opening
+static uint64_t first_callback = 0;
+static uint64_t first_cpu = 0;
+static uint64_t last_cpu = 0;
+static int callback_frames = 0;
+static unsigned long periods = 0;
+static uint64_t period_total_ns = 0;
+static uint64_t period_max_ns = 0;
+static unsigned long starts = 0;
+static uint64_t start_last_ns = 0;
+static uint64_t start_total_ns = 0;
+static uint64_t start_max_ns = 0;
+
+// Audio thread, so only stamp the time and wake the main loop
+static void music_finished() {
+    position_set_running(0);
+    preload_mark_finished();
+    event_notify_finished();
+}
+
+static uint64_t thread_cpu_ns() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Audio thread
+static void measure_callback(int len) {
+    uint64_t now = now_ns();
+    uint64_t cpu = thread_cpu_ns();
+    if (last_callback) {
+        uint64_t period = now - last_callback;
+        __atomic_fetch_add(&period_total_ns, period, __ATOMIC_RELAXED);
+        if (period > __atomic_load_n(&period_max_ns, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&period_max_ns, period, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&periods, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&first_callback, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&first_cpu, cpu, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&last_callback, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&last_cpu, cpu, __ATOMIC_RELAXED);
+    __atomic_store_n(&callback_frames, len / device_frame_bytes, __ATOMIC_RELAXED);
+
+    uint64_t requested = __atomic_load_n(&play_requested, __ATOMIC_ACQUIRE);
+    if (requested && position_seconds() > 0 &&
+        __atomic_compare_exchange_n(&play_requested, &requested, 0, 0, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED)) {
+        uint64_t start = now - requested;
+        __atomic_store_n(&start_last_ns, start, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&start_total_ns, start, __ATOMIC_RELAXED);
+        if (start > __atomic_load_n(&start_max_ns, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&start_max_ns, start, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&starts, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Audio thread: every mixed buffer passes through here on its way out
+static void postmix(void* udata, Uint8* stream, int len) {
+    (void)udata;
+    // The engine counts the frames it delivers itself
+    if (!engine_hooked()) position_feed(len);
+    spectrum_feed(stream, len);
+    if (config.latency_report) measure_callback(len);
+}
+
+static int open_device(int rate) {
+    if (Mix_OpenAudio(rate, config.audio_format, config.channels, config.chunk_frames) < 0) {
+        return 0;
+    }
+    requested_rate = rate;
+    if (!Mix_QuerySpec(&device_rate, &device_format, &device_channels)) return 0;
+    device_frame_bytes = (SDL_AUDIO_BITSIZE(device_format) / 8) * device_channels;
+    if (device_frame_bytes <= 0) device_frame_bytes = 4;
+
+    // Wake the main loop instead of polling Mix_PlayingMusic()
+    Mix_HookMusicFinished(music_finished);
+    position_init();
+    spectrum_init();
+    last_callback = 0;
+    Mix_SetPostMix(postmix, NULL);
+    return 1;
+}
+
+// Format of the open device and its generation. Returns 0 while it is
+// being reopened.
+int audio_device_spec(int* rate, Uint16* format, int* channels, unsigned long* generation) {
+    pthread_mutex_lock(&device_lock);
+    int ok = !device_closing && Mix_QuerySpec(rate, format, channels);
+    *generation = device_generation;
+    pthread_mutex_unlock(&device_lock);
+    return ok;
+}
+
+unsigned long audio_device_generation() {
+    pthread_mutex_lock(&device_lock);
+    unsigned long generation = device_generation;
+    pthread_mutex_unlock(&device_lock);
+    return generation;
+}
+
+// Native-rate mode: reopen the device at rate. Everything decoded for the
+// old format is dropped first; the engine comes back with a ring sized for
+// the new one.
+static void reopen_device(int rate) {
+    preload_flush();
+    engine_shutdown();
+    if (player.current_music) {
+        Mix_HaltMusic();
+        Mix_FreeMusic(player.current_music);
+        player.current_music = NULL;
+        player.music_index = -1;
+    }
+
+    pthread_mutex_lock(&device_lock);
+    device_closing = 1;
+    device_generation++;
+    pthread_mutex_unlock(&device_lock);
+
+    // Let the device play out the buffer it already holds
+    SDL_Delay(config.chunk_frames * 1000 / (device_rate > 0 ? device_rate : rate) + 1);
+    int previous = requested_rate;
+    Mix_CloseAudio();
+    if (!open_device(rate)) open_device(previous);
+    reopens++;
+
+    pthread_mutex_lock(&device_lock);
+    device_closing = 0;
+    pthread_mutex_unlock(&device_lock);
+
+    if (config.buffer_ms > 0) engine_init(config.buffer_ms);
+}
+
+// Rate index decodes at in native-rate mode, 0 if it can stay on the device
+static int track_rate(int index) {
+    if (!config.native_rate || index < 0 || index >= player.tracks.count) return 0;
+    int rate = media_sample_rate(track_path(index));
+    if (rate < 8000 || rate > 384000 || rate == requested_rate) return 0;
+    return rate;
 }
 
 int init_audio() {
@@ -29,14 +170,96 @@ int init_audio() {
         return 0;
     }
 
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0) {
+    if (!open_device(config.sample_rate)) {
         return 0;
     }
 
+    if (config.buffer_ms > 0 && !engine_init(config.buffer_ms)) {
+        printf("Warning: Could not start the playback engine, decoding in the audio callback\n");
+    }
+
+    if (!preload_init()) {
+        printf("Warning: Could not start preloader, track changes will block\n");
+    }
+    if (!prefetch_init()) {
+        printf("Warning: Could not start read-ahead\n");
+    }
+
     return 1;
 }
 
+void audio_latency(AudioLatency* out) {
+    memset(out, 0, sizeof(*out));
+    out->rate = device_rate;
+    out->format = device_format;
+    out->channels = device_channels;
+    out->frames = __atomic_load_n(&callback_frames, __ATOMIC_RELAXED);
+    if (out->frames == 0) out->frames = config.chunk_frames;
+    out->buffer_ms = device_rate > 0 ? out->frames * 1000.0 / device_rate : 0;
+    out->reopens = reopens;
+
+    out->starts = __atomic_load_n(&starts, __ATOMIC_RELAXED);
+    out->start_last_ms = __atomic_load_n(&start_last_ns, __ATOMIC_RELAXED) / 1e6;
+    out->start_max_ms = __atomic_load_n(&start_max_ns, __ATOMIC_RELAXED) / 1e6;
+    if (out->starts) {
+        out->start_avg_ms = __atomic_load_n(&start_total_ns, __ATOMIC_RELAXED) / 1e6 / out->starts;
+    }
+
+    unsigned long count = __atomic_load_n(&periods, __ATOMIC_RELAXED);
+    out->period_max_ms = __atomic_load_n(&period_max_ns, __ATOMIC_RELAXED) / 1e6;
+    if (count) {
+        out->period_avg_ms = __atomic_load_n(&period_total_ns, __ATOMIC_RELAXED) / 1e6 / count;
+    }
+
+    // Since the device was last opened
+    uint64_t wall = __atomic_load_n(&last_callback, __ATOMIC_RELAXED) -
+                    __atomic_load_n(&first_callback, __ATOMIC_RELAXED);
+    uint64_t cpu = __atomic_load_n(&last_cpu, __ATOMIC_RELAXED) -
+                   __atomic_load_n(&first_cpu, __ATOMIC_RELAXED);
+    if (wall > 0) out->cpu_percent = cpu * 100.0 / wall;
+}
+
+// Warnings raised while the interface owns the screen, printed with the
+// exit summary
+static char* later_warnings[LATER_WARNINGS];
+static int later_count = 0;
+
+// A warning from the event loop. Headless nothing is drawn and it goes out
+// at once; otherwise it would land on top of the frame, so it waits for
+// cleanup().
+void warn_later(const char* fmt, ...) {
+    char text[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    if (config.headless) {
+        printf("Warning: %s\n", text);
+        fflush(stdout);
+        return;
+    }
+    if (later_count == LATER_WARNINGS) return;
+    char* copy = strdup(text);
+    if (copy) later_warnings[later_count++] = copy;
+}
+
 void cleanup() {
+    // Runs both from the quit keys and from atexit()
+    static int cleaned_up = 0;
+    if (cleaned_up) return;
+    cleaned_up = 1;
+
+    // Its workers read the index and add watches
+    scan_stop();
+    index_close();
+    preload_shutdown();
+    prefetch_shutdown();
+    watch_stop();
+    control_stop();
+    engine_shutdown();
+    loudness_close();
+    dedup_close();
+
     // Stop and free music
     if (player.current_music) {
         Mix_HaltMusic();
@@ -44,41 +267,306 @@ void cleanup() {
         player.current_music = NULL;
     }
     
+    search_free();
+    track_free(&player.tracks);
+
     // Close audio systems
     Mix_CloseAudio();
     SDL_Quit();
     
-    // Restore terminal state
-    clear_screen();
-    move_cursor(1, 1);
-    show_cursor();
-    reset_color();
-    
-    // Restore normal terminal mode
-    rawModeOff();
+    if (!config.headless) {
+        // Restore terminal state
+        clear_screen();
+        move_cursor(1, 1);
+        show_cursor();
+        reset_color();
+
+        // Restore normal terminal mode
+        rawModeOff();
+    }
     
     // Print a nice goodbye message
+    unsigned long long bytes;
+    unsigned long frames;
+    screen_stats(NULL, &bytes, &frames);
+    screen_free();
     printf("You are now exiting cMusix...\n");
+    if (frames > 0) {
+        printf("Rendered %lu frames, %.0f bytes/frame on average\n",
+               frames, (double)bytes / frames);
+    }
+    unsigned long transitions;
+    double gap_avg, gap_max;
+    preload_stats(&transitions, NULL, &gap_avg, &gap_max);
+    if (transitions > 0) {
+        printf("Track transitions: %lu, end-to-next-audio %.2f ms avg, %.2f ms max\n",
+               transitions, gap_avg, gap_max);
+    }
+    unsigned long prefetch_hits, prefetch_misses;
+    unsigned long long prefetch_bytes;
+    prefetch_stats(&prefetch_hits, &prefetch_misses, &prefetch_bytes);
+    if (prefetch_hits + prefetch_misses > 0) {
+        printf("Read-ahead: %lu of %lu tracks started warm, %.1f MB read ahead\n",
+               prefetch_hits, prefetch_hits + prefetch_misses, prefetch_bytes / 1048576.0);
+    }
+    ScanStats scan;
+    if (scan_stats(&scan)) {
+        int hits, misses;
+        index_stats(&hits, &misses);
+        double rate = scan.seconds > 0 ? scan.files / scan.seconds : 0;
+        printf("Library: %d tracks from %ld directories in %.2fs (%.0f files/s, %d threads), "
+               "first track after %.0f ms; %d directories from the index, %d read\n",
+               scan.added, scan.dirs, scan.seconds, rate, scan.threads,
+               scan.first_seconds * 1000, hits, misses);
+        if (scan.failed > 0) {
+            printf("Warning: %ld directories could not be opened\n", scan.failed);
+        }
+        if (scan.tags_dropped > 0) {
+            printf("Warning: Out of memory, %ld tracks listed without their tags\n",
+                   scan.tags_dropped);
+        }
+    }
+    unsigned long batches, updates, unwatched;
+    watch_stats(&batches, &updates, &unwatched);
+    if (batches > 0) {
+        printf("Live library updates: %lu batches, %lu tracks changed\n", batches, updates);
+    }
+    if (unwatched > 0) {
+        printf("Warning: Out of inotify watches, %lu folders did not update live\n", unwatched);
+    }
+    unsigned long plays, underruns, gapless, bypassed;
+    double missing_ms;
+    int ring_ms;
+    engine_stats(&plays, &underruns, &missing_ms, &gapless, &bypassed, &ring_ms);
+    unsigned long analysed, cached;
+    loudness_stats(&analysed, &cached, NULL);
+    if (analysed > 0) {
+        printf("Loudness: %lu tracks measured, %lu from cache\n", analysed, cached);
+    }
+    unsigned long measured, hashed, dedup_cached, duplicates;
+    unsigned long long hashed_bytes;
+    dedup_stats(&measured, &hashed, &hashed_bytes, &dedup_cached, &duplicates);
+    if (measured + dedup_cached > 0) {
+        printf("Duplicates: %lu removed; %lu tracks measured, %lu hashed (%.1f MB), %lu from cache\n",
+               duplicates, measured, hashed, hashed_bytes / 1048576.0, dedup_cached);
+    }
+    unsigned long spectrum_frames, spectrum_dropped;
+    double spectrum_us;
+    spectrum_stats(&spectrum_frames, &spectrum_dropped, &spectrum_us);
+    if (spectrum_frames > 0) {
+        printf("Spectrum: %lu frames, %lu dropped, %.0f us per frame\n",
+               spectrum_frames, spectrum_dropped, spectrum_us);
+    }
+    if (plays > 0) {
+        printf("Playback buffer: %d ms, %lu underruns (%.1f ms of silence), %lu gapless transitions\n",
+               ring_ms, underruns, missing_ms, gapless);
+    }
+    if (bypassed > 0) {
+        printf("Playback buffer: %lu tracks were not WAV or AIFF and played unbuffered\n", bypassed);
+    }
+    unsigned long input_keys, input_bursts, input_coalesced;
+    double input_avg_ms, input_max_ms;
+    input_stats(&input_keys, &input_bursts, &input_coalesced, &input_avg_ms, &input_max_ms);
+    if (input_keys > 0) {
+        printf("Input: %lu keys in %lu bursts, %lu coalesced, key to screen %.2f ms avg, %.2f ms max\n",
+               input_keys, input_bursts, input_coalesced, input_avg_ms, input_max_ms);
+    }
+    unsigned long control_commands, control_events, control_dropped;
+    control_stats(&control_commands, &control_events, &control_dropped);
+    if (control_commands > 0) {
+        printf("Control socket: %lu commands, %lu event updates, %lu slow clients dropped\n",
+               control_commands, control_events, control_dropped);
+    }
+    if (config.instrument_path[0] && !instrument_dump(config.instrument_path)) {
+        printf("Warning: Could not write timing probes to %s\n", config.instrument_path);
+    }
+    if (config.latency_report) {
+        AudioLatency latency;
+        audio_latency(&latency);
+        printf("Audio output: %d Hz %s, %d channels, %d-frame buffer (%.1f ms), %lu reopens\n",
+               latency.rate, config_format_name(latency.format), latency.channels,
+               latency.frames, latency.buffer_ms, latency.reopens);
+        if (latency.starts > 0) {
+            printf("Start latency: %.1f ms avg, %.1f ms max over %lu plays, plus the buffer\n",
+                   latency.start_avg_ms, latency.start_max_ms, latency.starts);
+        }
+        printf("Audio callbacks: every %.1f ms, at worst %.1f ms; audio thread %.2f%% CPU\n",
+               latency.period_avg_ms, latency.period_max_ms, latency.cpu_percent);
+    }
+    for (int i = 0; i < later_count; i++) {
+        printf("Warning: %s\n", later_warnings[i]);
+        free(later_warnings[i]);
+    }
+    later_count = 0;
     fflush(stdout);
 }
 
-void playSong() {
-    if (player.count == 0) return;
+// Track nextSong() will move to, so the preloader can open it early
+int upcoming_index() {
+    if (player.tracks.count == 0) return -1;
 
-    if (player.current_music) {
-        Mix_FreeMusic(player.current_music);
+    if (player.shuffle) return shuffle_peek();
+
+    // A search filter limits playback to its matches
+    if (search_filtered() && search_count() > 0) return search_step(player.current_index, 1);
+    return (player.current_index + 1) % player.tracks.count;
+}
+
+// Up to max tracks in the order nextSong() will reach them, for read-ahead.
+// Repeat restarts the loaded track: nothing follows it.
+int upcoming_tracks(int* tracks, int max) {
+    if (player.tracks.count == 0 || player.repeat) return 0;
+    if (player.shuffle) return shuffle_ahead(tracks, max);
+
+    int filtered = search_filtered() && search_count() > 0;
+    int others = (filtered ? search_count() : player.tracks.count) - 1;
+    int index = player.current_index;
+    int n = 0;
+    while (n < max && n < others) {
+        index = filtered ? search_step(index, 1) : (index + 1) % player.tracks.count;
+        tracks[n++] = index;
+    }
+    return n;
+}
+
+// Open whatever follows the current track in the background, and read
+// ahead the ones after it
+void preload_upcoming() {
+    prefetch_upcoming();
+    if (player.repeat) return; // repeat restarts the loaded track
+    int index = upcoming_index();
+    if (track_rate(index)) return; // opened now, it would be at the wrong rate
+    preload_request(index);
+}
+
+// Mix_Music cannot boost, so it takes the track's levelling only down to unity
+static int music_volume() {
+    float gain = 1.0f;
+    if (player.tracks.count > 0) gain = loudness_gain(track_path(player.current_index));
+    if (gain > 1.0f) gain = 1.0f;
+    return (int)(player.volume * gain * 128);
+}
+
+// Mix_Music path, for tracks the engine does not take
+static int play_music() {
+    engine_stop();
+
+    if (!player.current_music || player.music_index != player.current_index) {
+        Mix_Music* music = preload_take(player.current_index);
+        if (!music) {
+            PROBE_START(load_start);
+            music = Mix_LoadMUS(track_path(player.current_index));
+            PROBE_STOP(PROBE_TRACK_LOAD, load_start);
+        }
+
+        if (player.current_music) {
+            Mix_FreeMusic(player.current_music);
+        }
+        player.current_music = music;
+        player.music_index = player.current_index;
+        if (!player.current_music) return 0;
+    }
+
+    Mix_VolumeMusic(music_volume());
+
+    position_set_running(0);
+    if (Mix_PlayMusic(player.current_music, 0) == -1) return 0;
+
+    if (track_duration(player.current_index) <= 0) {
+#if SDL_MIXER_VERSION_ATLEAST(2, 6, 0)
+        // Formats without a usable header: ask the decoder
+        double duration = Mix_MusicDuration(player.current_music);
+        if (duration > 0) player.tracks.duration[player.current_index] = (float)duration;
+#endif
     }
+    return 1;
+}
+
+// Track previousSong() moves to, -1 at the start of the shuffle history
+static int previous_index() {
+    // Back through what was actually played
+    if (player.shuffle) return shuffle_prev();
+    if (search_filtered() && search_count() > 0) return search_step(player.current_index, -1);
+    return (player.current_index - 1 + player.tracks.count) % player.tracks.count;
+}
+
+// Playlist entries are not checked when loaded: step over the ones that are
+// gone, the way the user is going (step 1 or -1). At most
+// MISSING_SKIP_MAX are looked at, so a playlist of a drive that is not
+// mounted costs one short stall per key. Returns 0 if none was there.
+static int skip_missing(int step) {
+    int tries = player.tracks.count < MISSING_SKIP_MAX ? player.tracks.count : MISSING_SKIP_MAX;
+    for (int i = 0; i < tries; i++) {
+        struct stat st;
+        if (stat(track_path(player.current_index), &st) == 0) return 1;
+        int next;
+        if (step < 0) {
+            next = previous_index();
+        } else {
+            next = player.shuffle ? shuffle_next() : upcoming_index();
+        }
+        if (next < 0) return 0;
+        player.current_index = next;
+    }
+    return 0;
+}
 
-    player.current_music = Mix_LoadMUS(player.songs[player.current_index].path);
-    if (!player.current_music) return;
+// Start the current track, skipping missing ones in the direction of step
+static void play_current(int step) {
+    if (player.tracks.count == 0) return;
+    if (!skip_missing(step)) return;
+    PROBE_START(play_start);
+    prefetch_played(track_path(player.current_index));
 
-    Mix_VolumeMusic((int)(player.volume * 128));
+    int rate = track_rate(player.current_index);
+    if (rate) reopen_device(rate);
 
-    if (Mix_PlayMusic(player.current_music, 0) == -1) return;
+    int continued = 0;
+    if (engine_play(player.current_index, &continued)) {
+        engine_set_volume((int)(player.volume * 128));
+        if (player.current_music) {
+            Mix_HaltMusic();
+            Mix_FreeMusic(player.current_music);
+            player.current_music = NULL;
+            player.music_index = -1;
+        }
+    } else if (!play_music()) {
+        return;
+    }
+
+    // After a gapless change the engine restarted the position itself
+    if (!continued) {
+        position_reset();
+        if (config.latency_report) __atomic_store_n(&play_requested, now_ns(), __ATOMIC_RELEASE);
+    }
+    position_set_running(1);
+    preload_end_transition();
+    shuffle_played(player.current_index);
 
     player.is_playing = 1;
     player.is_paused = 0;
-    player.song_start_time = time(NULL);
+
+    preload_upcoming();
+    PROBE_STOP(PROBE_PLAY, play_start);
+}
+
+void playSong() {
+    play_current(1);
+}
+
+// End of track, delivered through the event loop
+void songFinished() {
+    if (player.is_playing && !Mix_PlayingMusic() && !engine_playing()) {
+        preload_begin_transition();
+        if (engine_failed()) {
+            // The engine could not read it, Mix_Music may
+            playSong();
+        } else if (player.repeat) {
+            playSong();
+        } else {
+            nextSong();
+        }
+    }
 }
 
 void pauseResume() {
@@ -91,36 +579,36 @@ void pauseResume() {
         Mix_PauseMusic();
         player.is_paused = 1;
     }
+    engine_pause(player.is_paused);
+    position_set_running(!player.is_paused);
 }
 
 void stopPlayback() {
+    position_set_running(0);
     Mix_HaltMusic();
+    engine_stop();
     player.is_playing = 0;
     player.is_paused = 0;
 }
 
 void nextSong() {
-    if (player.count == 0) return;
+    if (player.tracks.count == 0) return;
 
-    if (player.shuffle) {
-        player.current_index = rand() % player.count;
-    } else {
-        player.current_index = (player.current_index + 1) % player.count;
-    }
+    int next = player.shuffle ? shuffle_next() : upcoming_index();
+    if (next < 0) return;
+    player.current_index = next;
 
     playSong();
 }
 
 void previousSong() {
-    if (player.count == 0) return;
+    if (player.tracks.count == 0) return;
 
-    if (player.shuffle) {
-        player.current_index = rand() % player.count;
-    } else {
-        player.current_index = (player.current_index - 1 + player.count) % player.count;
-    }
+    // At the start of the shuffle history, replay
+    int previous = previous_index();
+    if (previous >= 0) player.current_index = previous;
 
-    playSong();
+    play_current(-1);
 }
 
 void set_volume(float volume) {
@@ -128,13 +616,17 @@ void set_volume(float volume) {
     if (player.volume < 0.0f) player.volume = 0.0f;
     if (player.volume > 1.0f) player.volume = 1.0f;
 
-    Mix_VolumeMusic((int)(player.volume * 128));
+    Mix_VolumeMusic(music_volume());
+    engine_set_volume((int)(player.volume * 128));
 }
 
 void shuffleFunction() {
     player.shuffle = !player.shuffle;
+    if (player.shuffle) shuffle_reshuffle();
+    if (player.is_playing) preload_upcoming();
 }
 
 void repeatFunction() {
     player.repeat = !player.repeat;
+    if (player.is_playing) preload_upcoming();
 }
\ No newline at end of file
@@ -0,0 +1,553 @@
+#include "../cMusix.h"
+
+// Benchmark driver for `make bench`.
+//
+// Links against the player's objects (everything but main.o) and times the
+// hot paths on a library made by genlib: scanning with and without the
+// on-disk index (and how soon the first track is playable), audio_file()
+// name checks, content sniffing through io_uring and through pread(),
+// createInterface() frames written into a pipe, bursts of keys from input
+// to frame, track loading under SDL's dummy audio driver, the spectrum
+// panel's per-frame analysis and playlist files. All chatter from the code
+// under test is sent to /dev/null; the result is one JSON object on a
+// single line of stdout, so runs can be appended to a file and compared
+// across releases.
+
+#define RENDER_FRAMES 500
+#define CLASSIFY_NAMES 100000
+#define CLASSIFY_PASSES 20
+#define LOAD_SAMPLES 32
+#define LOUDNESS_SECONDS 60
+#define GAIN_PASSES 20
+#define SPECTRUM_FRAMES 2000
+#define PLAYLIST_ENTRIES 100000
+#define INPUT_BURSTS 200
+
+MusicPlayer player = {0};
+Config config = {0};
+
+void looper() {
+}
+
+static int saved_stdout = -1;
+static char cache_dir[64];
+
+static double now_ms() {
+    return now_ns() / 1e6;
+}
+
+static void quiet() {
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+}
+
+static void loud() {
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double* sorted, int count, double p) {
+    if (count == 0) return 0;
+    int i = (int)(p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+// Forget the on-disk index so the next load is cold
+static void drop_index() {
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/cmusix", cache_dir);
+    DIR* dir = opendir(path);
+    if (!dir) return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char file[MAX_PATH_LENGTH + 256];
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        unlink(file);
+    }
+    closedir(dir);
+}
+
+// load_folder() as at startup: until it returns (the interface could be
+// drawn), until the first track is playable and until the whole library is in
+static void load_timed(const char* root, double* ready_ms, double* first_ms, double* total_ms) {
+    double start = now_ms();
+    load_folder(root);
+    *ready_ms = now_ms() - start;
+    scan_wait();
+    *total_ms = now_ms() - start;
+    ScanStats stats;
+    *first_ms = scan_stats(&stats) ? stats.first_seconds * 1000 : 0;
+}
+
+static void bench_scan(const char* root) {
+    quiet();
+    track_clear(&player.tracks);
+    double start = now_ms();
+    scan_directory(root);
+    double scan_ms = now_ms() - start;
+    int scanned = player.tracks.count;
+
+    double cold_ready, cold_first, cold_ms;
+    double warm_ready, warm_first, warm_ms;
+    drop_index();
+    load_timed(root, &cold_ready, &cold_first, &cold_ms);
+    load_timed(root, &warm_ready, &warm_first, &warm_ms);
+    loud();
+
+    printf("\"scan\":{\"threads\":%d,\"tracks\":%d,\"scan_directory_ms\":%.3f,"
+           "\"load_folder_cold_ms\":%.3f,\"load_folder_warm_ms\":%.3f,"
+           "\"ready_cold_ms\":%.3f,\"first_track_cold_ms\":%.3f,"
+           "\"ready_warm_ms\":%.3f,\"first_track_warm_ms\":%.3f,\"track_store_kb\":%zu},",
+           config.scan_threads, scanned, scan_ms, cold_ms, warm_ms,
+           cold_ready, cold_first, warm_ready, warm_first,
+           track_memory(&player.tracks) / 1024);
+}
+
+static void bench_classify() {
+    static const char* exts[] = { ".mp3", ".flac", ".ogg", ".m4a", ".wav", ".aac", ".MP3",
+                                  ".jpg", ".txt", ".cue", ".m3u", "" };
+    int ext_count = sizeof(exts) / sizeof(exts[0]);
+
+    char* names = malloc((size_t)CLASSIFY_NAMES * 48);
+    if (!names) return;
+    for (int i = 0; i < CLASSIFY_NAMES; i++) {
+        snprintf(names + (size_t)i * 48, 48, "%02d - Track %06d%s", i % 100, i, exts[i % ext_count]);
+    }
+
+    long audio = 0;
+    double start = now_ms();
+    for (int pass = 0; pass < CLASSIFY_PASSES; pass++) {
+        for (int i = 0; i < CLASSIFY_NAMES; i++) {
+            audio += audio_file(names + (size_t)i * 48);
+        }
+    }
+    double ms = now_ms() - start;
+    free(names);
+
+    double total = (double)CLASSIFY_NAMES * CLASSIFY_PASSES;
+    printf("\"audio_file\":{\"names\":%.0f,\"audio\":%ld,\"ms\":%.3f,\"ns_per_name\":%.2f,"
+           "\"names_per_sec\":%.0f},",
+           total, audio, ms, ms * 1e6 / total, ms > 0 ? total / (ms / 1000) : 0);
+}
+
+// Sniff every track of the library again, batched as the scanner does
+static double sniff_pass(Sniffer* sniffer, const char** paths, int count, long* audio) {
+    AudioKind kinds[SNIFF_BATCH];
+    *audio = 0;
+    double start = now_ms();
+    for (int base = 0; base < count; base += SNIFF_BATCH) {
+        int n = count - base < SNIFF_BATCH ? count - base : SNIFF_BATCH;
+        sniff_files(sniffer, AT_FDCWD, paths + base, n, kinds);
+        for (int i = 0; i < n; i++) *audio += kinds[i] != AUDIO_NONE;
+    }
+    return now_ms() - start;
+}
+
+static void bench_sniff() {
+    int count = player.tracks.count;
+    const char** paths = malloc((count ? count : 1) * sizeof(char*));
+    if (!paths) return;
+    for (int i = 0; i < count; i++) paths[i] = track_path(i);
+
+    Sniffer* sniffer = sniff_open();
+    long audio_uring = 0, audio_pread = 0;
+    double uring_ms = sniff_pass(sniffer, paths, count, &audio_uring);
+    double pread_ms = sniff_pass(NULL, paths, count, &audio_pread);
+    printf("\"sniff\":{\"files\":%d,\"audio\":%ld,\"uring\":%s,\"batched_ms\":%.3f,"
+           "\"pread_ms\":%.3f,\"us_per_file\":%.2f},",
+           count, audio_uring, sniff_uring(sniffer) ? "true" : "false", uring_ms, pread_ms,
+           count ? uring_ms * 1000 / count : 0);
+    sniff_close(sniffer);
+    free(paths);
+}
+
+// Analysis and the gain stage on a minute of synthetic stereo PCM
+static void bench_loudness() {
+    size_t samples = (size_t)LOUDNESS_SECONDS * 44100 * 2;
+    int16_t* pcm = malloc(samples * sizeof(*pcm));
+    if (!pcm) return;
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < samples; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        pcm[i] = (int16_t)((int32_t)(seed >> 16) - 32768) / 4;
+    }
+
+    float peak;
+    double start = now_ms();
+    double lufs = loudness_measure((const Uint8*)pcm, samples * sizeof(*pcm), AUDIO_S16SYS, 2,
+                                   44100, &peak);
+    double measure_ms = now_ms() - start;
+
+    start = now_ms();
+    for (int pass = 0; pass < GAIN_PASSES; pass++) {
+        loudness_apply((Uint8*)pcm, samples * sizeof(*pcm), AUDIO_S16SYS, pass % 2 ? 1.25f : 0.8f);
+    }
+    double gain_ms = now_ms() - start;
+    free(pcm);
+
+    printf("\"loudness\":{\"seconds\":%d,\"lufs\":%.2f,\"measure_ms\":%.3f,"
+           "\"x_realtime\":%.0f,\"gain_ns_per_sample\":%.3f},",
+           LOUDNESS_SECONDS, lufs, measure_ms,
+           measure_ms > 0 ? LOUDNESS_SECONDS * 1000.0 / measure_ms : 0,
+           gain_ms * 1e6 / ((double)samples * GAIN_PASSES));
+}
+
+// One spectrum frame's worth of audio through the tap, then the analysis,
+// against the SPECTRUM_FPS frame budget
+static void bench_spectrum() {
+    int freq, channels;
+    Uint16 format;
+    spectrum_toggle();
+    if (!spectrum_visible() || !Mix_QuerySpec(&freq, &format, &channels) ||
+        format != AUDIO_S16SYS) {
+        printf("\"spectrum\":null");
+        return;
+    }
+
+    int count = freq / SPECTRUM_FPS;
+    int16_t* pcm = malloc((size_t)count * channels * sizeof(*pcm));
+    if (!pcm) return;
+    uint32_t seed = 12345;
+    double feed_ms = 0, tick_ms = 0, tick_max = 0;
+    for (int frame = 0; frame < SPECTRUM_FRAMES; frame++) {
+        for (int i = 0; i < count * channels; i++) {
+            seed = seed * 1664525u + 1013904223u;
+            pcm[i] = (int16_t)((int32_t)(seed >> 16) - 32768) / 4;
+        }
+        double start = now_ms();
+        spectrum_feed((const Uint8*)pcm, count * channels * (int)sizeof(*pcm));
+        double fed = now_ms();
+        spectrum_tick();
+        double done = now_ms();
+        feed_ms += fed - start;
+        tick_ms += done - fed;
+        if (done - fed > tick_max) tick_max = done - fed;
+    }
+    spectrum_toggle();
+    free(pcm);
+
+    double tick_us = tick_ms * 1000 / SPECTRUM_FRAMES;
+    printf("\"spectrum\":{\"frames\":%d,\"feed_us\":%.2f,\"tick_us\":%.2f,"
+           "\"tick_us_max\":%.2f,\"budget_pct\":%.3f}",
+           SPECTRUM_FRAMES, feed_ms * 1000 / SPECTRUM_FRAMES, tick_us, tick_max * 1000,
+           tick_us * SPECTRUM_FPS / 1e4);
+}
+
+// Save the library as a playlist, then load one of PLAYLIST_ENTRIES lines
+// made from it. Replaces the track store with the loaded playlist.
+static void bench_playlist() {
+    int count = player.tracks.count;
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/bench.m3u8", cache_dir);
+    if (count == 0) {
+        printf("\"playlist\":null");
+        return;
+    }
+
+    double start = now_ms();
+    int saved = save_playlist(path);
+    double save_ms = now_ms() - start;
+
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        printf("\"playlist\":null");
+        return;
+    }
+    fputs("#EXTM3U\n", file);
+    for (int i = 0; i < PLAYLIST_ENTRIES; i++) {
+        fprintf(file, "#EXTINF:-1,\n%s\n", track_path(i % count));
+    }
+    fclose(file);
+
+    preload_flush();
+    quiet();
+    start = now_ms();
+    load_folder(path);
+    double load_ms = now_ms() - start;
+    loud();
+    unlink(path);
+
+    printf("\"playlist\":{\"saved\":%d,\"save_ms\":%.3f,\"entries\":%d,\"load_ms\":%.3f}",
+           saved, save_ms, player.tracks.count, load_ms);
+}
+
+static long pipe_bytes = 0;
+
+static void* drain_pipe(void* arg) {
+    int fd = *(int*)arg;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) pipe_bytes += n;
+    return NULL;
+}
+
+typedef enum { FRAME_FULL, FRAME_IDLE, FRAME_SCROLL, FRAME_TRACK } FrameKind;
+
+typedef struct {
+    double us_per_frame;
+    double bytes_per_frame;
+} RenderResult;
+
+static RenderResult render_case(FrameKind kind) {
+    int count = player.tracks.count ? player.tracks.count : 1;
+    unsigned long long bytes_before, bytes_after;
+    screen_stats(NULL, &bytes_before, NULL);
+
+    double start = now_ms();
+    for (int i = 0; i < RENDER_FRAMES; i++) {
+        switch (kind) {
+            case FRAME_FULL:
+                screen_invalidate();
+                break;
+            case FRAME_IDLE:
+                break;
+            case FRAME_SCROLL:
+                player.list_offset = (player.list_offset + 1) % count;
+                break;
+            case FRAME_TRACK:
+                player.current_index = (player.current_index + 1) % count;
+                break;
+        }
+        createInterface();
+    }
+    double ms = now_ms() - start;
+
+    screen_stats(NULL, &bytes_after, NULL);
+    RenderResult result = { ms * 1000 / RENDER_FRAMES,
+                            (double)(bytes_after - bytes_before) / RENDER_FRAMES };
+    return result;
+}
+
+static pthread_t frame_reader;
+static int frame_fd = -1;
+
+// Frames go into a pipe drained by a thread; nothing else may print until
+// release_frames()
+static int capture_frames() {
+    int fds[2];
+    if (pipe(fds) != 0) return 0;
+    frame_fd = fds[0];
+    if (pthread_create(&frame_reader, NULL, drain_pipe, &frame_fd) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[1]);
+    return 1;
+}
+
+static void release_frames() {
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    pthread_join(frame_reader, NULL);
+    close(frame_fd);
+}
+
+static void bench_render() {
+    static const char* names[] = { "full", "idle", "scroll", "track_change" };
+    RenderResult results[4];
+
+    player.terminal_width = 120;
+    player.terminal_height = 40;
+    player.current_index = 0;
+    player.list_offset = 0;
+    if (!capture_frames()) return;
+
+    createInterface();
+    for (int i = 0; i < 4; i++) results[i] = render_case((FrameKind)i);
+    release_frames();
+
+    printf("\"render\":{\"width\":%d,\"height\":%d,\"frames\":%d,",
+           player.terminal_width, player.terminal_height, RENDER_FRAMES);
+    for (int i = 0; i < 4; i++) {
+        printf("\"%s\":{\"us_per_frame\":%.2f,\"bytes_per_frame\":%.1f},",
+               names[i], results[i].us_per_frame, results[i].bytes_per_frame);
+    }
+    printf("\"pipe_bytes\":%ld},", pipe_bytes);
+}
+
+// Bursts of held-key scrolling, arrows and page keys fed through a pipe on
+// stdin, each decoded by userInput() and drawn, as the event loop would
+static void bench_input() {
+    static const char burst[] =
+        "jjjjjjjjjjjjjjjjjjjj\x1b[B\x1b[B\x1b[B\x1b[B\x1bOB\x1bOB\x1b[6~\x1b[6~"
+        "kkkkkkkkkk\x1b[A\x1b[A\x1b[1;5A\x1b[5~\x1b[H\x1b[F";
+    int fds[2];
+    if (pipe(fds) != 0) return;
+    int saved_stdin = dup(STDIN_FILENO);
+    dup2(fds[0], STDIN_FILENO);
+    close(fds[0]);
+
+    player.list_offset = 0;
+    if (!capture_frames()) {
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+        close(fds[1]);
+        return;
+    }
+    unsigned long keys_before, bursts_before, coalesced_before;
+    input_stats(&keys_before, &bursts_before, &coalesced_before, NULL, NULL);
+
+    double decode_ms = 0, frame_ms = 0;
+    for (int i = 0; i < INPUT_BURSTS; i++) {
+        if (write(fds[1], burst, sizeof(burst) - 1) != (ssize_t)sizeof(burst) - 1) break;
+        double start = now_ms();
+        userInput();
+        double decoded = now_ms();
+        createInterface();
+        decode_ms += decoded - start;
+        frame_ms += now_ms() - decoded;
+    }
+    release_frames();
+    dup2(saved_stdin, STDIN_FILENO);
+    close(saved_stdin);
+    close(fds[1]);
+
+    unsigned long keys, bursts, coalesced;
+    double avg_ms, max_ms;
+    input_stats(&keys, &bursts, &coalesced, &avg_ms, &max_ms);
+    bursts -= bursts_before;
+    printf("\"input\":{\"bursts\":%lu,\"keys\":%lu,\"coalesced\":%lu,"
+           "\"decode_us_per_burst\":%.2f,\"frame_us_per_burst\":%.2f,"
+           "\"key_to_screen_ms_avg\":%.3f,\"key_to_screen_ms_max\":%.3f},",
+           bursts, keys - keys_before, coalesced - coalesced_before,
+           bursts ? decode_ms * 1000 / bursts : 0, bursts ? frame_ms * 1000 / bursts : 0,
+           avg_ms, max_ms);
+}
+
+static void bench_load() {
+    double load[LOAD_SAMPLES], play[LOAD_SAMPLES], audio[LOAD_SAMPLES];
+    int samples = 0;
+
+    quiet();
+    int audio_ok = init_audio();
+    loud();
+    if (!audio_ok) {
+        printf("\"track_load\":null,");
+        return;
+    }
+
+    // genlib gives the first .wav files real content
+    for (int i = 0; i < player.tracks.count && samples < LOAD_SAMPLES; i++) {
+        const char* name = track_name(i);
+        const char* ext = strrchr(name, '.');
+        struct stat st;
+        if (!ext || strcmp(ext, ".wav") != 0) continue;
+        if (stat(track_path(i), &st) != 0 || st.st_size == 0) continue;
+
+        double start = now_ms();
+        Mix_Music* music = Mix_LoadMUS(track_path(i));
+        double loaded = now_ms();
+        if (!music) continue;
+        Mix_FreeMusic(music);
+        load[samples] = loaded - start;
+
+        // Through the player, as a skip to this track would go
+        player.current_index = i;
+        start = now_ms();
+        playSong();
+        play[samples] = now_ms() - start;
+        // Until the device has actually been handed some of it
+        while (position_seconds() <= 0 && now_ms() - start < 1000) usleep(500);
+        audio[samples] = now_ms() - start;
+        stopPlayback();
+        samples++;
+    }
+
+    qsort(load, samples, sizeof(double), compare_doubles);
+    qsort(play, samples, sizeof(double), compare_doubles);
+    qsort(audio, samples, sizeof(double), compare_doubles);
+    unsigned long underruns;
+    int ring_ms;
+    engine_stats(NULL, &underruns, NULL, NULL, NULL, &ring_ms);
+    printf("\"track_load\":{\"driver\":\"%s\",\"samples\":%d,"
+           "\"load_ms_p50\":%.3f,\"load_ms_p95\":%.3f,\"load_ms_max\":%.3f,"
+           "\"play_ms_p50\":%.3f,\"play_ms_p95\":%.3f,\"play_ms_max\":%.3f,"
+           "\"audio_ms_p50\":%.3f,\"audio_ms_p95\":%.3f,\"audio_ms_max\":%.3f,"
+           "\"buffer_ms\":%d,\"underruns\":%lu},",
+           SDL_GetCurrentAudioDriver() ? SDL_GetCurrentAudioDriver() : "none", samples,
+           percentile(load, samples, 0.5), percentile(load, samples, 0.95),
+           samples ? load[samples - 1] : 0,
+           percentile(play, samples, 0.5), percentile(play, samples, 0.95),
+           samples ? play[samples - 1] : 0,
+           percentile(audio, samples, 0.5), percentile(audio, samples, 0.95),
+           samples ? audio[samples - 1] : 0,
+           config.buffer_ms > 0 ? ring_ms : 0, underruns);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <library> [revision]\n", argv[0]);
+        return 1;
+    }
+
+    char root[MAX_PATH_LENGTH];
+    if (!realpath(argv[1], root)) {
+        fprintf(stderr, "Error: Cannot resolve %s\n", argv[1]);
+        return 1;
+    }
+
+    // Keep the benchmark's index away from the user's cache
+    snprintf(cache_dir, sizeof(cache_dir), "/tmp/cmusix-bench-cache-XXXXXX");
+    if (!mkdtemp(cache_dir)) {
+        fprintf(stderr, "Error: Cannot create a cache directory\n");
+        return 1;
+    }
+    setenv("XDG_CACHE_HOME", cache_dir, 1);
+    if (!getenv("SDL_AUDIODRIVER")) setenv("SDL_AUDIODRIVER", "dummy", 1);
+
+    config_defaults();
+    config.watch = 0;
+    config.loudness = 0;
+    player.volume = 0.7f;
+    player.music_index = -1;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("{\"version\":1,\"revision\":\"%s\",\"time\":%ld,\"cpus\":%ld,",
+           argc > 2 ? argv[2] : "unknown", (long)time(NULL), cpus);
+
+    bench_scan(root);
+    bench_classify();
+    bench_sniff();
+    bench_loudness();
+    bench_render();
+    bench_input();
+    bench_load();
+    bench_spectrum();
+    printf(",");
+    bench_playlist();
+    printf("}\n");
+    fflush(stdout);
+
+    quiet();
+    preload_shutdown();
+    engine_shutdown();
+    if (player.current_music) Mix_FreeMusic(player.current_music);
+    Mix_CloseAudio();
+    SDL_Quit();
+    search_free();
+    track_free(&player.tracks);
+    screen_free();
+    drop_index();
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/cmusix", cache_dir);
+    rmdir(path);
+    rmdir(cache_dir);
+    loud();
+    return 0;
+}
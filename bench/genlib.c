@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Synthetic music library for `make bench`.
+//
+// Builds <root> with N directories arranged as an 8-ary tree and M files
+// spread over them round-robin, with the extension mix of a typical
+// collection plus the cover art, playlists and notes that sit next to it.
+// Audio files hold just the magic bytes of their format, enough for the
+// scanner's content check, except the first LOAD_TRACKS .wav files, which
+// hold a short silent clip so track loading can be timed. Everything else
+// is empty. A stamp file records the parameters; running again with the
+// same ones leaves the tree alone.
+
+#define LOAD_TRACKS 32
+#define WAV_RATE 44100
+#define WAV_SECONDS_X10 5  // half a second
+#define STAMP ".cmusix-bench"
+#define STAMP_VERSION 2
+
+typedef struct {
+    const char* ext;
+    int weight;
+} ExtWeight;
+
+// Out of 100
+static const ExtWeight mix[] = {
+    { "mp3", 40 }, { "flac", 20 }, { "ogg", 8 }, { "m4a", 8 },
+    { "wav", 6 }, { "aac", 4 }, { "MP3", 2 },
+    { "jpg", 5 }, { "txt", 2 }, { "cue", 2 }, { "m3u", 2 }, { "nfo", 1 },
+};
+
+static const char* pick_ext(unsigned int n) {
+    unsigned int slot = n % 100;
+    for (size_t i = 0; i < sizeof(mix) / sizeof(mix[0]); i++) {
+        if (slot < (unsigned int)mix[i].weight) return mix[i].ext;
+        slot -= mix[i].weight;
+    }
+    return "mp3";
+}
+
+static void put_le16(unsigned char* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    put_le16(p, v & 0xFFFF);
+    put_le16(p + 2, v >> 16);
+}
+
+static int write_wav(int fd) {
+    uint32_t data_len = WAV_RATE * WAV_SECONDS_X10 / 10 * 4;
+    unsigned char header[44];
+    memcpy(header, "RIFF", 4);
+    put_le32(header + 4, 36 + data_len);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le32(header + 16, 16);
+    put_le16(header + 20, 1);              // PCM
+    put_le16(header + 22, 2);              // stereo
+    put_le32(header + 24, WAV_RATE);
+    put_le32(header + 28, WAV_RATE * 4);
+    put_le16(header + 32, 4);
+    put_le16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put_le32(header + 40, data_len);
+
+    if (write(fd, header, sizeof(header)) != (ssize_t)sizeof(header)) return 0;
+    return ftruncate(fd, sizeof(header) + data_len) == 0;
+}
+
+typedef struct {
+    const char* ext;
+    const char* bytes;
+    size_t len;
+} Magic;
+
+static const Magic magics[] = {
+    { "mp3", "ID3\3\0\0\0\0\0\0", 10 },
+    { "MP3", "ID3\3\0\0\0\0\0\0", 10 },
+    { "flac", "fLaC\x80\0\0\x22", 8 },
+    { "ogg", "OggS\0\2", 6 },
+    { "m4a", "\0\0\0\x14" "ftypM4A \0\0\0\0M4A ", 20 },
+    { "aac", "\xFF\xF1\x50\x80\x01\x7F\xFC", 7 },
+    { "wav", "RIFF\x24\0\0\0WAVEfmt ", 16 },
+};
+
+// Start an audio file the way its format does
+static int write_magic(int fd, const char* ext) {
+    for (size_t i = 0; i < sizeof(magics) / sizeof(magics[0]); i++) {
+        if (strcmp(ext, magics[i].ext) == 0) {
+            return write(fd, magics[i].bytes, magics[i].len) == (ssize_t)magics[i].len;
+        }
+    }
+    return 1;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Path of directory i: the chain of its ancestors under root
+static int dir_path(char* buf, size_t size, const char* root, int i) {
+    if (i == 0) return snprintf(buf, size, "%s", root) < (int)size;
+
+    char parent[4096];
+    if (!dir_path(parent, sizeof(parent), root, (i - 1) / 8)) return 0;
+    return snprintf(buf, size, "%s/Artist %04d", parent, i) < (int)size;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        printf("Usage: %s <root> <directories> <files>\n", argv[0]);
+        return 1;
+    }
+
+    const char* root = argv[1];
+    int dirs = atoi(argv[2]);
+    int files = atoi(argv[3]);
+    if (dirs < 1) dirs = 1;
+    if (files < 0) files = 0;
+
+    char stamp[4096], expected[64];
+    snprintf(stamp, sizeof(stamp), "%s/%s", root, STAMP);
+    snprintf(expected, sizeof(expected), "%d %d v%d\n", dirs, files, STAMP_VERSION);
+
+    FILE* f = fopen(stamp, "r");
+    if (f) {
+        char line[64] = "";
+        int same = fgets(line, sizeof(line), f) && strcmp(line, expected) == 0;
+        fclose(f);
+        if (same) {
+            printf("Library already generated: %s (%d directories, %d files)\n", root, dirs, files);
+            return 0;
+        }
+        nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    } else if (access(root, F_OK) == 0) {
+        printf("Error: %s exists and was not made by this generator\n", root);
+        return 1;
+    }
+
+    char path[4096];
+    for (int i = 0; i < dirs; i++) {
+        if (!dir_path(path, sizeof(path), root, i) || (mkdir(path, 0755) != 0 && errno != EEXIST)) {
+            printf("Error: Could not create %s\n", path);
+            return 1;
+        }
+    }
+
+    int wavs = 0;
+    for (int i = 0; i < files; i++) {
+        // Scatter the extensions without clumping one per directory
+        const char* ext = pick_ext((unsigned int)i * 37u + 11u);
+        char dir[4096];
+        int fd = -1;
+        if (dir_path(dir, sizeof(dir), root, i % dirs) &&
+            snprintf(path, sizeof(path), "%s/%02d - Track %06d.%s", dir, i / dirs % 100, i, ext) <
+                (int)sizeof(path)) {
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (fd < 0) {
+            printf("Error: Could not create %s\n", path);
+            return 1;
+        }
+        if (strcmp(ext, "wav") == 0 && wavs < LOAD_TRACKS) {
+            if (!write_wav(fd)) printf("Warning: Could not write %s\n", path);
+            wavs++;
+        } else if (!write_magic(fd, ext)) {
+            printf("Warning: Could not write %s\n", path);
+        }
+        close(fd);
+    }
+
+    f = fopen(stamp, "w");
+    if (f) {
+        fputs(expected, f);
+        fclose(f);
+    }
+    printf("Generated %s: %d directories, %d files\n", root, dirs, files);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "cMusix.h"
+
+// Byte-level helpers shared by the file parsers and the on-disk caches.
+
+uint16_t be16(const unsigned char* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+uint16_t le16(const unsigned char* p) {
+    return (uint16_t)((p[1] << 8) | p[0]);
+}
+
+uint32_t be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+uint64_t be64(const unsigned char* p) {
+    return ((uint64_t)be32(p) << 32) | be32(p + 4);
+}
+
+uint32_t le32(const unsigned char* p) {
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+uint64_t le64(const unsigned char* p) {
+    return ((uint64_t)le32(p + 4) << 32) | le32(p);
+}
+
+// Size of a leading ID3v2 tag, header and footer included; 0 if there is
+// none. May run past len: only the header is read.
+size_t id3v2_size(const unsigned char* p, size_t len) {
+    if (len < 10 || memcmp(p, "ID3", 3) != 0) return 0;
+    size_t size = ((size_t)(p[6] & 0x7F) << 21) | ((p[7] & 0x7F) << 14) |
+                  ((p[8] & 0x7F) << 7) | (p[9] & 0x7F);
+    size += 10;
+    if (p[5] & 0x10) size += 10; // footer
+    return size;
+}
+
+// FNV-1a, for paths in hash tables and cache file names
+uint64_t hash_bytes(const char* s, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
@@ -3,26 +3,39 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <time.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <signal.h>
+#include <poll.h>
 #include <ctype.h>
+#include <wchar.h>
+#include <locale.h>
 #include <math.h>
+#include <pthread.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_mixer.h>
+#include "classify.h"
 
-#define MAX_SONGS 1000
 #define MAX_PATH_LENGTH 512
-#define MAX_FILENAME_LENGTH 256
 #define DISPLAY_SONGS 10
 
+#if defined(__APPLE__)
+#define ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
 // ANSI color codes
 #define COLOR_RESET     0
 #define COLOR_BOLD      1
@@ -40,14 +53,35 @@
 #define COLOR_BG_YELLOW 43
 #define COLOR_BG_BLUE   44
 
+// Track list in structure-of-arrays form, see tracks.c
+#define NO_TAGS UINT32_MAX
 typedef struct {
-    char path[MAX_PATH_LENGTH];
-    char name[MAX_FILENAME_LENGTH];
-} Song;
+    char* arena;
+    size_t arena_len;
+    size_t arena_cap;
+    size_t arena_dead;    // bytes no track refers to any more
+    uint32_t* path_off;
+    uint16_t* name_off;
+    float* duration;      // seconds, -1 until read, 0 if unknown
+    uint32_t* tag_off;    // title/artist/album in the arena, NO_TAGS if none
+    uint16_t* track_no;   // track number tag, 0 if none
+    int count;
+    int capacity;
+} TrackStore;
 
+// Where tracks went after the store changed, see track_map(). Either a
+// track_move() of [from, from + count) to to (to is -1 for track_remove()),
+// or with a table, a track_keep() from from on: table[i - from] is the new
+// index of track i, or -1 - the new index of the next one kept.
 typedef struct {
-    Song songs[MAX_SONGS];
+    int from;
     int count;
+    int to;
+    const int* table;
+} TrackMap;
+
+typedef struct {
+    TrackStore tracks;
     int current_index;
     int is_playing;
     int is_paused;
@@ -55,15 +89,135 @@ typedef struct {
     int shuffle;
     int repeat;
     Mix_Music* current_music;
+    int music_index;      // track current_music was loaded from
     int list_offset;
     int selected_index;
-    time_t song_start_time;
     int terminal_width;
     int terminal_height;
 } MusicPlayer;
 
+// Tags and duration read from a file's headers
+#define TAG_LENGTH 128
+typedef struct {
+    char title[TAG_LENGTH];
+    char artist[TAG_LENGTH];
+    char album[TAG_LENGTH];
+    int track;
+    double duration;
+    int sample_rate;      // Hz the decoder will produce, 0 if unknown
+} MediaInfo;
+
+// Command line / startup options
+typedef struct {
+    int scan_threads;
+    int read_tags;
+    int watch;            // follow changes to the library folder
+    int buffer_ms;        // playback engine ring depth, 0 leaves decoding to SDL_mixer
+    int loudness;         // measure tracks and level them to LOUDNESS_TARGET
+    int dedup;            // drop tracks whose audio another track already has
+    int prefetch;         // tracks to read ahead in play order, 0 for none
+    int prefetch_mb;      // at most this much read ahead at a time
+    int sample_rate;      // output device, see config.c
+    Uint16 audio_format;
+    int channels;
+    int chunk_frames;     // frames per audio callback
+    int native_rate;      // reopen the device at each track's own rate
+    int latency_report;   // measure and show output latency
+    int control;          // serve the control socket
+    char control_path[MAX_PATH_LENGTH];  // empty for the default, see control.c
+    int headless;         // no terminal: detached, driven by the control socket
+    char instrument_path[MAX_PATH_LENGTH];  // JSON dump of the probes, empty for none
+} Config;
+
+// Output device as opened and its measured latency, see audio.c
+typedef struct {
+    int rate;
+    Uint16 format;
+    int channels;
+    int frames;               // per audio callback, as the post-mix tap sees them
+    double buffer_ms;         // frames at rate
+    unsigned long starts;     // playSong() calls timed to their first audio
+    double start_last_ms;
+    double start_avg_ms;
+    double start_max_ms;
+    double period_avg_ms;     // between audio callbacks
+    double period_max_ms;
+    double cpu_percent;       // audio thread
+    unsigned long reopens;
+} AudioLatency;
+
+typedef struct {
+    int threads;
+    long dirs;
+    long files;
+    long failed;          // directories that could not be opened
+    long tags_dropped;    // tracks kept without their tags, out of memory
+    int added;
+    double seconds;
+    double first_seconds; // until the first track was in the playlist, 0 if none
+} ScanStats;
+
+// Results kept per file, stamped with its size and mtime, and the worker
+// pool that fills them in; see stampcache.c. The owner sets the first
+// block, the rest is private.
+#define STAMP_MAX_THREADS 8
+typedef struct {
+    char* path;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    int live;             // confirmed during the current pass
+} StampEntry;
+
+typedef struct {
+    const char* magic;    // 7 characters naming the file format
+    uint32_t version;
+    size_t value_size;    // bytes of result per file
+    int threads;
+    void (*job)(const char* path, int phase);   // worker, unlocked
+    int (*pass_end)();    // worker, lock held: 1 if it queued more jobs
+    void (*saved)();      // worker, unlocked: a pass is done and written out
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    pthread_t workers[STAMP_MAX_THREADS];
+    int worker_count;
+    int quit;
+    StampEntry* entries;  // under lock, as everything below
+    unsigned char* values;
+    int entry_count;
+    int entry_cap;
+    int* slots;           // indices into entries, -1 when free
+    size_t slot_mask;
+    int dirty;
+    char path[MAX_PATH_LENGTH];
+    char** jobs;
+    int job_count;
+    int job_next;
+    int busy;
+    int phase;            // bumped by stamp_queue() within a pass
+    int pass_done;
+} StampCache;
+
+// Uncompressed file read as PCM a block at a time, see pcmstream.c
+typedef struct {
+    int channels;         // as read
+    int rate;
+    int fd;
+    int64_t pos;          // next sample byte in the file
+    int64_t end;          // end of the samples
+    int bits;
+    int big;              // big-endian samples
+    int frame_bytes;      // in the file
+    size_t block_bytes;
+    unsigned char* block;
+    SDL_AudioStream* convert;
+    int flushed;          // the file is all in the converter
+} PcmStream;
+
 // Global player instance
 extern MusicPlayer player;
+extern Config config;
 
 // Terminal handling
 extern struct termios original_termios;
@@ -73,7 +227,6 @@ extern struct termios original_termios;
 void rawModeOff();
 void rawModeOn();
 void get_terminal_size();
-void resize(int sig);
 void clear_screen();
 void move_cursor(int row, int col);
 void hide_cursor();
@@ -81,11 +234,34 @@ void show_cursor();
 void set_color(int fg, int bg);
 void reset_color();
 
+// classify.c: declared in classify.h
+
+// config.c
+#define AUDIO_DEFAULT_RATE 44100
+#define AUDIO_DEFAULT_CHUNK 2048
+#define AUDIO_MAX_CHUNK 32768    // frames, so the largest post-mix buffer
+void config_defaults();
+int config_path(char* path, size_t size);
+int config_load();
+int config_parse_format(const char* name, Uint16* format);
+const char* config_format_name(Uint16 format);
+int config_set_rate(int value);
+int config_set_channels(int value);
+int config_set_chunk(int value);
+int config_set_socket(const char* value);
+
 // audio.c
-int audio_file(const char* filename);
 int init_audio();
+int audio_device_spec(int* rate, Uint16* format, int* channels, unsigned long* generation);
+unsigned long audio_device_generation();
+void audio_latency(AudioLatency* out);
+void warn_later(const char* fmt, ...);
 void cleanup();
+int upcoming_index();
+int upcoming_tracks(int* tracks, int max);
+void preload_upcoming();
 void playSong();
+void songFinished();
 void pauseResume();
 void stopPlayback();
 void nextSong();
@@ -94,20 +270,309 @@ void set_volume(float volume);
 void shuffleFunction();
 void repeatFunction();
 
+// bytes.c
+uint16_t be16(const unsigned char* p);
+uint16_t le16(const unsigned char* p);
+uint32_t be32(const unsigned char* p);
+uint64_t be64(const unsigned char* p);
+uint32_t le32(const unsigned char* p);
+uint64_t le64(const unsigned char* p);
+size_t id3v2_size(const unsigned char* p, size_t len);
+uint64_t hash_bytes(const char* s, size_t len);
+
+// tracks.c
+int track_add(TrackStore* store, const char* dir, const char* name);
+void track_clear(TrackStore* store);
+void track_free(TrackStore* store);
+const char* track_path(int index);
+const char* track_name(int index);
+int track_set_tags(TrackStore* store, int index, const char* title, const char* artist,
+                   const char* album, int track_no);
+int track_rename(TrackStore* store, int index, const char* path);
+int track_move(TrackStore* store, int from, int count, int to);
+void track_remove(TrackStore* store, int from, int count);
+int track_remap(int index, int from, int count, int to);
+void track_keep(TrackStore* store, int first, const char* keep, int* table);
+int track_map(const TrackMap* map, int index);
+int track_map_gap(const TrackMap* map, int index);
+int track_compact(TrackStore* store);
+int track_path_compare(const char* a, const char* b);
+int track_lower_bound(int limit, const char* path);
+int track_find(const char* path);
+const char* track_title(int index);
+const char* track_artist(int index);
+const char* track_album(int index);
+void track_display_name(int index, char* buf, size_t size);
+size_t track_memory(const TrackStore* store);
+
 // playlist.c
 void add_song(const char* filepath);
+int add_song_in(const char* dir, const char* name);
+void playlist_remap(int from, int count, int to);
+void playlist_follow(const TrackMap* map);
 void scan_directory(const char* dir_path);
 void load_folder(const char* folder_path);
+void playlist_added();
+void playlist_scanned(int ok);
+void playlist_play_when_ready();
+
+// playlistfile.c
+#define PLAYLIST_NONE 0
+#define PLAYLIST_M3U 1        // .m3u and .m3u8
+#define PLAYLIST_PLS 2
+int playlist_file_type(const char* path);
+int load_playlist(const char* path);
+int save_playlist(const char* path);
+
+// scanner.c
+int scan_default_threads();
+int scan_tree(const char* root, int threads, ScanStats* stats);
+int scan_start(const char* root, int threads);
+int scan_rescan(const char* root, int threads, void (*done)(int ok, int first));
+int scan_running();
+void scan_wait();
+void scan_stop();
+void scan_progress(long* dirs, long* files);
+int scan_stats(ScanStats* stats);
+
+// libindex.c
+#define INDEX_TAGGED 1        // file entries carry tags read from the files
+#define INDEX_FILE_FIELDS 6   // name, title, artist, album, track, duration
+typedef struct IndexDir IndexDir;
+int index_open(const char* root);
+const IndexDir* index_lookup(const char* dir_path, const struct stat* st, uint32_t flags);
+const char* index_entries(const IndexDir* dir);
+int index_entry_count(const IndexDir* dir);
+const char* index_next_entry(const char* entry);
+void index_store(const char* dir_path, const struct stat* st, uint32_t flags,
+                 const char* entries, size_t entries_len, int entry_count);
+void index_keep(const IndexDir* dir);
+int write_file_atomic(const char* path, int (*fill)(FILE* file, void* arg), void* arg);
+int index_save();
+int index_invalidate(const char* root, const char* dir_path);
+void index_close();
+void index_stats(int* hits, int* misses);
+int index_cache_path(const char* root, const char* ext, char* path, size_t size);
+
+// watch.c
+int watch_start(const char* root);
+void watch_add_dir(const char* path);
+void watch_flush();
+void watch_stop();
+void watch_stats(unsigned long* batch_count, unsigned long* track_count,
+                 unsigned long* unwatched_count);
+
+// screen.c
+int screen_resize(int width, int height);
+void screen_invalidate();
+void screen_clear();
+int utf8_columns(const char* text, int* bytes);
+int screen_put(int row, int col, const char* text, int fg, int bg);
+int screen_printf(int row, int col, int fg, int bg, const char* fmt, ...);
+int screen_fill(int row, int col, int count, const char* glyph, int fg, int bg);
+size_t screen_flush();
+void screen_stats(size_t* last_bytes, unsigned long long* bytes, unsigned long* frames);
+void screen_free();
 
 // interface.c
-void createLine(int width, char c);
-void progressBar(int width, float progress);
-void volumeBar(int width);
-void truncate_string(char* dest, const char* src, int max_width);
+void createLine(int row, int width, char c);
+void progressBar(int row, int col, int width, float progress);
+void volumeBar(int row, int col, int width);
+void truncate_string(char* dest, size_t size, const char* src, int max_width);
+int progress_changed();
+int progress_interval_ms();
+int list_rows();
 void createInterface();
 
 // input.c
 void userInput();
+void input_drawn();
+void input_stats(unsigned long* key_count, unsigned long* burst_count,
+                 unsigned long* coalesced_count, double* avg_ms, double* max_ms);
+
+// shuffle.c
+void shuffle_reshuffle();
+void shuffle_reset();
+int shuffle_peek();
+int shuffle_next();
+int shuffle_prev();
+void shuffle_played(int track);
+int shuffle_track(int slot);
+int shuffle_ahead(int* tracks, int max);
+void shuffle_remap(const TrackMap* map);
+
+// search.c
+void search_begin();
+void search_key(char ch);
+void search_clear();
+void search_reset();
+void search_remap(const TrackMap* map);
+void search_refresh();
+int search_out_of_memory();
+int search_editing();
+int search_filtered();
+const char* search_query();
+int search_count();
+double search_last_ms();
+int search_visible_count();
+int search_row_track(int row);
+int search_step(int index, int step);
+void search_free();
+
+// metadata.c
+void media_probe_fd(int fd, MediaInfo* info);
+int media_probe(const char* path, MediaInfo* info);
+double media_duration(const char* path);
+int media_sample_rate(const char* path);
+
+// position.c
+void position_init();
+void position_feed(int len);
+void position_reset();
+void position_set_running(int on);
+double position_seconds();
+double track_duration(int index);
+
+// preload.c
+int preload_init();
+void preload_request(int index);
+Mix_Music* preload_take(int index);
+void preload_remap(const TrackMap* map);
+void preload_flush();
+void preload_shutdown();
+void preload_mark_finished();
+void preload_begin_transition();
+void preload_end_transition();
+void preload_stats(unsigned long* count, double* last_ms, double* avg_ms, double* max_ms);
+
+// prefetch.c
+#define PREFETCH_DEFAULT 3        // tracks
+#define PREFETCH_DEFAULT_MB 64
+int prefetch_init();
+void prefetch_upcoming();
+void prefetch_played(const char* path);
+void prefetch_shutdown();
+void prefetch_stats(unsigned long* hit_count, unsigned long* miss_count,
+                    unsigned long long* byte_count);
+
+// pcmstream.c
+int pcm_supported(const char* path);
+PcmStream* pcm_open(const char* path, Uint16 format, int channels, int rate);
+int pcm_read(PcmStream* s, Uint8* buf, int len);
+void pcm_close(PcmStream* s);
+
+// engine.c
+#define ENGINE_BUFFER_MS 500
+int engine_init(int ms);
+int engine_accepts(int index);
+int engine_play(int index, int* continued);
+void engine_queue(const char* path);
+int engine_has_queued(const char* path);
+void engine_stop();
+void engine_pause(int on);
+void engine_set_volume(int vol);
+int engine_hooked();
+int engine_playing();
+int engine_failed();
+void engine_shutdown();
+void engine_stats(unsigned long* play_count, unsigned long* underrun_count, double* missing_ms,
+                  unsigned long* gapless_count, unsigned long* bypass_count, int* ring_ms);
+
+// stampcache.c
+int stamp_open(StampCache* cache, const char* root, const char* ext);
+void stamp_refresh(StampCache* cache);
+int stamp_close(StampCache* cache);
+int stamp_pending(StampCache* cache);
+int stamp_find(StampCache* cache, const char* path);
+int stamp_fresh(StampCache* cache, const char* path, const struct stat* st);
+int stamp_store(StampCache* cache, const char* path, const struct stat* st);
+void* stamp_value(StampCache* cache, int index);
+void stamp_queue(StampCache* cache, char** jobs, int count);
+
+// loudness.c
+#define LOUDNESS_TARGET -18.0f    // LUFS, the ReplayGain 2.0 reference
+#define LOUDNESS_UNKNOWN -999.0f
+int loudness_open(const char* root);
+void loudness_refresh();
+float loudness_gain(const char* path);
+double loudness_measure(const Uint8* pcm, size_t len, Uint16 fmt, int chans, int sample_rate,
+                        float* peak);
+void loudness_apply(Uint8* pcm, size_t len, Uint16 fmt, float gain);
+void loudness_close();
+void loudness_stats(unsigned long* analysed_count, unsigned long* cached_count, int* pending);
+
+// dedup.c
+int dedup_open(const char* root);
+void dedup_refresh();
+void dedup_close();
+void dedup_stats(unsigned long* measured_count, unsigned long* hashed_count,
+                 unsigned long long* hashed_byte_count, unsigned long* cached_count,
+                 unsigned long* removed_count);
+
+// spectrum.c
+#define SPECTRUM_ROWS 6       // height of the bars in lines
+#define SPECTRUM_FPS 30
+void spectrum_init();
+void spectrum_feed(const Uint8* stream, int len);
+int spectrum_visible();
+void spectrum_toggle();
+int spectrum_interval_ms();
+int spectrum_rows();
+int spectrum_tick();
+void spectrum_draw(int row, int width);
+void spectrum_stats(unsigned long* frame_count, unsigned long* dropped_count, double* avg_us);
+
+// instrument.c
+enum {
+    PROBE_TRACK_LOAD,     // Mix_LoadMUS() / Mix_LoadWAV(), any thread
+    PROBE_PLAY,           // playSong()
+    PROBE_FRAME,          // createInterface()
+    PROBE_FRAME_BYTES,    // written per frame
+    PROBE_INPUT,          // userInput()
+    PROBE_KEY_TO_SCREEN,
+    PROBE_SCAN_DIR,       // one directory read by a scanner worker
+    PROBE_SCAN_SNIFF,
+    PROBE_SCAN_TAGS,
+    PROBE_SCAN_MERGE,
+    PROBE_COUNT
+};
+#ifdef CMUSIX_INSTRUMENT
+#define PROBE_START(var) uint64_t var = now_ns()
+#define PROBE_STOP(probe, var) instrument_time(probe, var)
+#define PROBE_VALUE(probe, value) instrument_value(probe, value)
+void instrument_time(int probe, uint64_t start_ns);
+void instrument_value(int probe, uint64_t value);
+#else
+#define PROBE_START(var) do { } while (0)
+#define PROBE_STOP(probe, var) do { } while (0)
+#define PROBE_VALUE(probe, value) do { (void)sizeof(value); } while (0)
+#endif
+void instrument_toggle();
+int instrument_visible();
+void instrument_draw(int row, int rows, int width);
+int instrument_dump(const char* path);
+
+// control.c
+int control_start(const char* path);
+void control_publish();
+void control_stop();
+int control_subscribers();
+const char* control_path();
+void control_stats(unsigned long* command_count, unsigned long* event_count,
+                   unsigned long* dropped_count);
+
+// events.c
+uint64_t now_ns();
+typedef void (*EventHandler)(int fd, void* data);
+int events_init();
+int event_watch(int fd, EventHandler handler, void* data);
+void event_watch_output(int fd, int on);
+void event_unwatch(int fd);
+void event_request_redraw();
+void event_after(int ms, void (*fn)());
+void event_notify_finished();
+void event_update_timer();
+void event_loop_run();
 
 // main.c
 void looper();
@@ -0,0 +1,407 @@
+#include "classify.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+// IORING_OP_READ is an enum constant, so headers from 5.6 on, the first to
+// have it, are recognised by a flag macro added in the same release
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(IORING_FEAT_CUR_PERSONALITY)
+#define SNIFF_URING
+#endif
+
+// Audio file classifier.
+//
+// A file is audio when its first bytes say so: an ID3v2 tag or MPEG frame
+// sync (confirmed by a second frame header where the first frame ends),
+// ADTS sync, fLaC, OggS, RIFF/WAVE, FORM/AIFF or an MP4 ftyp box. The name
+// only decides whether a file is worth reading at all: files with a known
+// non-audio extension (cover art, playlists, notes) are skipped unread,
+// everything else is sniffed. Files with an audio extension are sniffed
+// leniently, searching the whole SNIFF_BYTES for MPEG sync so leading junk
+// does not drop a real MP3; everything else needs its magic at offset 0.
+//
+// Reads are batched per directory. On Linux a Sniffer owns a small
+// io_uring, set up with raw syscalls, so a batch of SNIFF_BATCH reads costs
+// one submission. Where io_uring is missing, disabled or too old for
+// IORING_OP_READ (kernels before 5.6 fail it with EINVAL), or the headers
+// predate it, every file is read with pread() instead, on the calling
+// thread; the scanner runs one Sniffer
+// per worker, so its pool is the fallback's parallelism. This file must
+// not include cMusix.h: folderLocator/musicFinder builds it without SDL.
+
+// Extensions are compared as zero-padded 8-byte keys, one word compare each
+#define EXT_KEY 8
+
+static const char audio_exts[][EXT_KEY] = {
+    "mp3", "wav", "flac", "ogg", "m4a", "aac"
+};
+
+// Never audio, not worth a read
+static const char skip_exts[][EXT_KEY] = {
+    "jpg", "jpeg", "png", "gif", "bmp", "webp", "tif", "tiff", "ico",
+    "txt", "nfo", "log", "cue", "m3u", "m3u8", "pls", "sfv", "md5", "ffp",
+    "pdf", "htm", "html", "xml", "json", "ini", "db", "url", "lrc", "accurip",
+    "zip", "rar", "7z", "gz", "tar", "exe",
+    "mkv", "mp4", "avi", "mov", "webm", "m4v"
+};
+
+static int extension_in(const char* filename, const char (*list)[EXT_KEY], size_t count) {
+    const char* ext = strrchr(filename, '.');
+    if (!ext) return 0;
+    ext++;
+
+    // Convert extension to lowercase for comparison
+    char lower_ext[EXT_KEY] = { 0 };
+    int i = 0;
+    while (ext[i] && i < EXT_KEY - 1) {
+        lower_ext[i] = tolower((unsigned char)ext[i]);
+        i++;
+    }
+    if (ext[i]) return 0;
+
+    for (size_t j = 0; j < count; j++) {
+        if (memcmp(lower_ext, list[j], EXT_KEY) == 0) return 1;
+    }
+    return 0;
+}
+
+// Extension check alone: the name promises audio
+int audio_file(const char* filename) {
+    if (!filename) return 0;
+    return extension_in(filename, audio_exts, sizeof(audio_exts) / EXT_KEY);
+}
+
+// Worth reading the first bytes of
+int audio_candidate(const char* filename) {
+    if (!filename) return 0;
+    return !extension_in(filename, skip_exts, sizeof(skip_exts) / EXT_KEY);
+}
+
+static const int mpeg_bitrates[2][3][15] = {
+    { // MPEG-1: layer I, II, III
+        { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+        { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+    },
+    { // MPEG-2 / 2.5
+        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+    },
+};
+
+static const int mpeg_rates[3] = { 44100, 48000, 32000 };
+
+// Decode the MPEG audio frame header at p (4 bytes). Returns 0 if it is
+// not a valid one.
+int mpeg_frame(const unsigned char* p, MpegFrame* frame) {
+    if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0) return 0;
+
+    int version = (p[1] >> 3) & 3;   // 0: 2.5, 2: 2, 3: 1
+    int layer = (p[1] >> 1) & 3;     // 1: III, 2: II, 3: I
+    int bitrate_index = p[2] >> 4;
+    int rate_index = (p[2] >> 2) & 3;
+    if (version == 1 || layer == 0 || bitrate_index == 0 ||
+        bitrate_index == 15 || rate_index == 3) {
+        return 0;
+    }
+
+    frame->mpeg1 = version == 3;
+    frame->layer = 4 - layer;
+    frame->rate = mpeg_rates[rate_index] >> (frame->mpeg1 ? 0 : (version == 2 ? 1 : 2));
+    frame->bitrate = mpeg_bitrates[frame->mpeg1 ? 0 : 1][frame->layer - 1][bitrate_index] * 1000;
+    frame->mono = (p[3] >> 6) == 3;
+    frame->samples = frame->layer == 1 ? 384 : (frame->layer == 3 && !frame->mpeg1) ? 576 : 1152;
+
+    int padding = (p[2] >> 1) & 1;
+    if (frame->layer == 1) {
+        frame->length = (12 * frame->bitrate / frame->rate + padding) * 4;
+    } else {
+        frame->length = frame->samples / 8 * frame->bitrate / frame->rate + padding;
+    }
+    return 1;
+}
+
+// A frame header whose successor is where it should be, or past the buffer
+static int mpeg_confirmed(const unsigned char* buf, size_t len, size_t at) {
+    MpegFrame frame, next;
+    if (at + 4 > len || !mpeg_frame(buf + at, &frame)) return 0;
+    size_t follow = at + (size_t)frame.length;
+    if (follow + 4 > len) return at == 0;
+    return mpeg_frame(buf + follow, &next);
+}
+
+static AudioKind sniff_at(const unsigned char* buf, size_t len, int lenient, int depth) {
+    if (len >= 10 && memcmp(buf, "ID3", 3) == 0 && buf[3] < 0xFF && buf[4] < 0xFF) {
+        // The tag is in front of the audio: look behind it when it fits
+        size_t size = 10 + (((size_t)buf[6] & 0x7F) << 21 | ((size_t)buf[7] & 0x7F) << 14 |
+                            ((size_t)buf[8] & 0x7F) << 7 | ((size_t)buf[9] & 0x7F));
+        if (buf[5] & 0x10) size += 10;  // footer
+        if (depth == 0 && size + 4 <= len) {
+            AudioKind inner = sniff_at(buf + size, len - size, 1, 1);
+            if (inner != AUDIO_NONE) return inner;
+        }
+        return AUDIO_MPEG;
+    }
+    if (len >= 4 && memcmp(buf, "fLaC", 4) == 0) return AUDIO_FLAC;
+    if (len >= 4 && memcmp(buf, "OggS", 4) == 0) return AUDIO_OGG;
+    if (len >= 12 && memcmp(buf, "RIFF", 4) == 0 && memcmp(buf + 8, "WAVE", 4) == 0) {
+        return AUDIO_WAVE;
+    }
+    if (len >= 12 && memcmp(buf, "FORM", 4) == 0 &&
+        (memcmp(buf + 8, "AIFF", 4) == 0 || memcmp(buf + 8, "AIFC", 4) == 0)) {
+        return AUDIO_AIFF;
+    }
+    if (len >= 8 && memcmp(buf + 4, "ftyp", 4) == 0) return AUDIO_MP4;
+
+    // ADTS: sync, layer 0, then a valid sampling index
+    if (len >= 7 && buf[0] == 0xFF && (buf[1] & 0xF6) == 0xF0 && ((buf[2] >> 2) & 0xF) < 13) {
+        return AUDIO_AAC;
+    }
+    if (mpeg_confirmed(buf, len, 0)) return AUDIO_MPEG;
+
+    if (lenient) {
+        for (size_t i = 1; i + 4 <= len; i++) {
+            if (buf[i] == 0xFF && mpeg_confirmed(buf, len, i)) return AUDIO_MPEG;
+        }
+    }
+    return AUDIO_NONE;
+}
+
+// What the first len bytes of a file are. lenient accepts MPEG sync
+// anywhere in the buffer, for files that are audio by name.
+AudioKind audio_sniff(const unsigned char* buf, size_t len, int lenient) {
+    return sniff_at(buf, len, lenient, 0);
+}
+
+const char* audio_kind_name(AudioKind kind) {
+    static const char* const names[] = { "none", "mpeg", "aac", "flac", "ogg", "wave", "aiff", "mp4" };
+    return kind <= AUDIO_MP4 ? names[kind] : "none";
+}
+
+struct Sniffer {
+    unsigned char* buffers;   // SNIFF_BATCH buffers of SNIFF_BYTES
+    int ring_fd;              // -1 without io_uring
+#ifdef SNIFF_URING
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+#endif
+};
+
+#ifdef SNIFF_URING
+
+static int ring_setup(Sniffer* s) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, SNIFF_BATCH, &params);
+    if (fd < 0) return 0;
+    s->ring_fd = fd;
+
+    s->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    s->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (s->cq_ring_size > s->sq_ring_size) s->sq_ring_size = s->cq_ring_size;
+        s->cq_ring_size = s->sq_ring_size;
+    }
+
+    s->sq_ring = mmap(NULL, s->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+    if (s->sq_ring == MAP_FAILED) {
+        s->sq_ring = NULL;
+        return 0;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        s->cq_ring = s->sq_ring;
+    } else {
+        s->cq_ring = mmap(NULL, s->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_CQ_RING);
+        if (s->cq_ring == MAP_FAILED) {
+            s->cq_ring = NULL;
+            return 0;
+        }
+    }
+
+    s->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    s->sqes = mmap(NULL, s->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if (s->sqes == MAP_FAILED) {
+        s->sqes = NULL;
+        return 0;
+    }
+
+    char* sq = s->sq_ring;
+    char* cq = s->cq_ring;
+    s->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    s->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    s->sq_array = (unsigned*)(sq + params.sq_off.array);
+    s->cq_head = (unsigned*)(cq + params.cq_off.head);
+    s->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    s->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    s->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 1;
+}
+
+static void ring_teardown(Sniffer* s) {
+    if (s->sqes) munmap(s->sqes, s->sqes_size);
+    if (s->cq_ring && s->cq_ring != s->sq_ring) munmap(s->cq_ring, s->cq_ring_size);
+    if (s->sq_ring) munmap(s->sq_ring, s->sq_ring_size);
+    if (s->ring_fd >= 0) close(s->ring_fd);
+    s->sqes = NULL;
+    s->sq_ring = NULL;
+    s->cq_ring = NULL;
+    s->ring_fd = -1;
+}
+
+// Read the start of fds[0..count) into the buffers, got[i] bytes each.
+// Returns 0 if the ring failed, or the kernel does not know the read
+// opcode, and nothing can be assumed about got[].
+static int ring_read(Sniffer* s, const int* fds, int count, int* got) {
+    unsigned tail = *s->sq_tail;
+    int queued = 0;
+    for (int i = 0; i < count; i++) {
+        got[i] = 0;
+        if (fds[i] < 0) continue;
+        unsigned slot = tail & *s->sq_mask;
+        struct io_uring_sqe* sqe = &s->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fds[i];
+        sqe->addr = (uint64_t)(uintptr_t)(s->buffers + (size_t)i * SNIFF_BYTES);
+        sqe->len = SNIFF_BYTES;
+        sqe->off = 0;
+        sqe->user_data = (uint64_t)i;
+        s->sq_array[slot] = slot;
+        tail++;
+        queued++;
+    }
+    __atomic_store_n(s->sq_tail, tail, __ATOMIC_RELEASE);
+    if (queued == 0) return 1;
+
+    int done = 0;
+    int submitted = 0;
+    int unsupported = 0;
+    while (done < queued) {
+        int to_submit = queued - submitted;
+        long ret = syscall(__NR_io_uring_enter, s->ring_fd, to_submit, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        submitted += (int)ret;
+
+        unsigned head = *s->cq_head;
+        unsigned cq_tail = __atomic_load_n(s->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != cq_tail) {
+            const struct io_uring_cqe* cqe = &s->cqes[head & *s->cq_mask];
+            int i = (int)cqe->user_data;
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) unsupported = 1;
+            if (i >= 0 && i < count) got[i] = cqe->res > 0 ? cqe->res : 0;
+            head++;
+            done++;
+        }
+        __atomic_store_n(s->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return !unsupported;
+}
+
+#endif
+
+Sniffer* sniff_open() {
+    Sniffer* s = calloc(1, sizeof(Sniffer));
+    if (!s) return NULL;
+    s->ring_fd = -1;
+    s->buffers = malloc((size_t)SNIFF_BATCH * SNIFF_BYTES);
+    if (!s->buffers) {
+        free(s);
+        return NULL;
+    }
+#ifdef SNIFF_URING
+    if (!ring_setup(s)) ring_teardown(s);
+#endif
+    return s;
+}
+
+void sniff_close(Sniffer* s) {
+    if (!s) return;
+#ifdef SNIFF_URING
+    ring_teardown(s);
+#endif
+    free(s->buffers);
+    free(s);
+}
+
+int sniff_uring(const Sniffer* s) {
+    return s && s->ring_fd >= 0;
+}
+
+// Classify names (relative to dir_fd, or absolute) in batches. Names with
+// a non-audio extension come back AUDIO_NONE without being opened.
+void sniff_files(Sniffer* s, int dir_fd, const char* const* names, int count, AudioKind* kinds) {
+    unsigned char single[SNIFF_BYTES];
+    int fds[SNIFF_BATCH];
+    int got[SNIFF_BATCH];
+
+    for (int base = 0; base < count; base += SNIFF_BATCH) {
+        int n = count - base < SNIFF_BATCH ? count - base : SNIFF_BATCH;
+        for (int i = 0; i < n; i++) {
+            const char* name = names[base + i];
+            fds[i] = audio_candidate(name) ? openat(dir_fd, name, O_RDONLY | O_CLOEXEC) : -1;
+        }
+
+        int read_done = 0;
+#ifdef SNIFF_URING
+        if (s && s->ring_fd >= 0) {
+            read_done = ring_read(s, fds, n, got);
+            if (!read_done) ring_teardown(s);  // fall back for good
+        }
+#endif
+        for (int i = 0; i < n; i++) {
+            unsigned char* buf = s ? s->buffers + (size_t)i * SNIFF_BYTES : single;
+            if (!read_done) {
+                got[i] = 0;
+                if (fds[i] >= 0) {
+                    ssize_t r = pread(fds[i], buf, SNIFF_BYTES, 0);
+                    got[i] = r > 0 ? (int)r : 0;
+                }
+            }
+            const char* name = names[base + i];
+            kinds[base + i] = fds[i] >= 0 ? audio_sniff(buf, got[i], audio_file(name)) : AUDIO_NONE;
+            if (fds[i] >= 0) close(fds[i]);
+        }
+    }
+}
+
+// One file, without a Sniffer
+AudioKind audio_file_at(int dir_fd, const char* name) {
+    AudioKind kind;
+    sniff_files(NULL, dir_fd, &name, 1, &kind);
+    return kind;
+}
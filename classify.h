@@ -0,0 +1,48 @@
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+#include <stddef.h>
+
+// Audio file classifier, see classify.c. Kept free of SDL so the tools in
+// folderLocator/ can build against it too.
+
+typedef enum {
+    AUDIO_NONE,
+    AUDIO_MPEG,
+    AUDIO_AAC,
+    AUDIO_FLAC,
+    AUDIO_OGG,
+    AUDIO_WAVE,
+    AUDIO_AIFF,
+    AUDIO_MP4
+} AudioKind;
+
+#define SNIFF_BYTES 4096   // read from the start of each file
+#define SNIFF_BATCH 32     // files read per submission
+
+// One MPEG audio frame header
+typedef struct {
+    int mpeg1;
+    int layer;      // 1, 2 or 3
+    int bitrate;    // bits per second
+    int rate;       // samples per second
+    int samples;    // per frame
+    int length;     // bytes, header included
+    int mono;
+} MpegFrame;
+
+typedef struct Sniffer Sniffer;
+
+int audio_file(const char* filename);
+int audio_candidate(const char* filename);
+int mpeg_frame(const unsigned char* p, MpegFrame* frame);
+AudioKind audio_sniff(const unsigned char* buf, size_t len, int lenient);
+const char* audio_kind_name(AudioKind kind);
+Sniffer* sniff_open();
+void sniff_close(Sniffer* sniffer);
+int sniff_uring(const Sniffer* sniffer);
+void sniff_files(Sniffer* sniffer, int dir_fd, const char* const* names, int count,
+                 AudioKind* kinds);
+AudioKind audio_file_at(int dir_fd, const char* name);
+
+#endif
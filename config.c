@@ -0,0 +1,214 @@
+#include "cMusix.h"
+
+// Configuration file.
+//
+// $XDG_CONFIG_HOME/cmusix/config (~/.config/cmusix/config by default) holds
+// "key = value" lines; '#' starts a comment. It is read before the command
+// line, so options given there win. Unknown keys and bad values are reported
+// and skipped, the rest of the file still applies.
+//
+//   rate = 48000          output sample rate in Hz
+//   format = s16          s16, s32 or f32
+//   channels = 2
+//   chunk = 1024          frames per audio callback: smaller is lower latency
+//                         and more wake-ups
+//   native_rate = yes     reopen the device at each track's own rate
+//   latency_report = yes  measure output latency, show it and sum it up on exit
+//   buffer_ms = 500       playback engine ring for WAV and AIFF, 0 decodes in
+//                         the audio callback; other formats always do
+//   threads = 4           directory scanner threads
+//   prefetch = 3          tracks to read ahead in play order, 0 for none
+//   prefetch_mb = 64      at most this much read ahead at a time
+//   tags = no
+//   watch = no
+//   loudness = no
+//   dedup = yes           drop tracks whose audio another one has, see dedup.c
+//   socket = off          or a path for the control socket, see control.c
+//   instrument = FILE     write the timing probes there as JSON on exit and on
+//                         SIGUSR1, see instrument.c
+
+#define CONFIG_LINE 256
+
+void config_defaults() {
+    config.scan_threads = scan_default_threads();
+    config.read_tags = 1;
+    config.watch = 1;
+    config.buffer_ms = ENGINE_BUFFER_MS;
+    config.loudness = 1;
+    config.dedup = 0;
+    config.prefetch = PREFETCH_DEFAULT;
+    config.prefetch_mb = PREFETCH_DEFAULT_MB;
+    config.sample_rate = AUDIO_DEFAULT_RATE;
+    config.audio_format = MIX_DEFAULT_FORMAT;
+    config.channels = 2;
+    config.chunk_frames = AUDIO_DEFAULT_CHUNK;
+    config.native_rate = 0;
+    config.latency_report = 0;
+    config.control = 1;
+    config.control_path[0] = '\0';
+    config.instrument_path[0] = '\0';
+}
+
+// "off" disables the control socket, anything else is where it goes
+int config_set_socket(const char* value) {
+    if (strcasecmp(value, "off") == 0 || strcasecmp(value, "no") == 0) {
+        config.control = 0;
+        return 1;
+    }
+    if (!*value || strlen(value) >= sizeof(config.control_path)) return 0;
+    config.control = 1;
+    strcpy(config.control_path, value);
+    return 1;
+}
+
+int config_parse_format(const char* name, Uint16* format) {
+    if (strcasecmp(name, "s16") == 0) *format = AUDIO_S16SYS;
+    else if (strcasecmp(name, "s32") == 0) *format = AUDIO_S32SYS;
+    else if (strcasecmp(name, "f32") == 0) *format = AUDIO_F32SYS;
+    else return 0;
+    return 1;
+}
+
+const char* config_format_name(Uint16 format) {
+    switch (format) {
+        case AUDIO_S16SYS: return "s16";
+        case AUDIO_S32SYS: return "s32";
+        case AUDIO_F32SYS: return "f32";
+        case AUDIO_U8: return "u8";
+        default: return "other";
+    }
+}
+
+// Range checks shared with the command line; 0 if value was rejected
+int config_set_rate(int value) {
+    if (value < 8000 || value > 384000) return 0;
+    config.sample_rate = value;
+    return 1;
+}
+
+int config_set_channels(int value) {
+    if (value < 1 || value > 8) return 0;
+    config.channels = value;
+    return 1;
+}
+
+// SDL wants a power of two
+int config_set_chunk(int value) {
+    if (value < 64 || value > AUDIO_MAX_CHUNK || (value & (value - 1)) != 0) return 0;
+    config.chunk_frames = value;
+    return 1;
+}
+
+static int parse_bool(const char* value, int* out) {
+    if (strcasecmp(value, "yes") == 0 || strcasecmp(value, "on") == 0 ||
+        strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0) {
+        *out = 1;
+    } else if (strcasecmp(value, "no") == 0 || strcasecmp(value, "off") == 0 ||
+               strcasecmp(value, "false") == 0 || strcmp(value, "0") == 0) {
+        *out = 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static char* trim(char* s) {
+    while (isspace((unsigned char)*s)) s++;
+    char* end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+static int apply(const char* key, const char* value) {
+    char* end;
+    long number = strtol(value, &end, 10);
+    int is_number = *value && *end == '\0';
+
+    if (strcmp(key, "rate") == 0) return is_number && config_set_rate((int)number);
+    if (strcmp(key, "format") == 0) return config_parse_format(value, &config.audio_format);
+    if (strcmp(key, "channels") == 0) return is_number && config_set_channels((int)number);
+    if (strcmp(key, "chunk") == 0) return is_number && config_set_chunk((int)number);
+    if (strcmp(key, "native_rate") == 0) return parse_bool(value, &config.native_rate);
+    if (strcmp(key, "latency_report") == 0) return parse_bool(value, &config.latency_report);
+    if (strcmp(key, "tags") == 0) return parse_bool(value, &config.read_tags);
+    if (strcmp(key, "watch") == 0) return parse_bool(value, &config.watch);
+    if (strcmp(key, "loudness") == 0) return parse_bool(value, &config.loudness);
+    if (strcmp(key, "dedup") == 0) return parse_bool(value, &config.dedup);
+    if (strcmp(key, "socket") == 0) return config_set_socket(value);
+    if (strcmp(key, "instrument") == 0) {
+        if (strlen(value) >= sizeof(config.instrument_path)) return 0;
+        strcpy(config.instrument_path, value);
+        return 1;
+    }
+    if (strcmp(key, "buffer_ms") == 0) {
+        if (!is_number || number < 0) return 0;
+        config.buffer_ms = (int)number;
+        return 1;
+    }
+    if (strcmp(key, "prefetch") == 0) {
+        if (!is_number || number < 0) return 0;
+        config.prefetch = (int)number;
+        return 1;
+    }
+    if (strcmp(key, "prefetch_mb") == 0) {
+        if (!is_number || number < 1) return 0;
+        config.prefetch_mb = (int)number;
+        return 1;
+    }
+    if (strcmp(key, "threads") == 0) {
+        if (!is_number || number < 1) return 0;
+        config.scan_threads = (int)number;
+        return 1;
+    }
+    return -1;
+}
+
+int config_path(char* path, size_t size) {
+    const char* base = getenv("XDG_CONFIG_HOME");
+    int n;
+    if (base && *base) {
+        n = snprintf(path, size, "%s/cmusix/config", base);
+    } else {
+        const char* home = getenv("HOME");
+        if (!home || !*home) return 0;
+        n = snprintf(path, size, "%s/.config/cmusix/config", home);
+    }
+    return n > 0 && (size_t)n < size;
+}
+
+// Returns 0 if there is no config file
+int config_load() {
+    char path[MAX_PATH_LENGTH];
+    if (!config_path(path, sizeof(path))) return 0;
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+
+    char line[CONFIG_LINE];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_no++;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char* key = trim(line);
+        if (!*key) continue;
+
+        char* eq = strchr(key, '=');
+        if (!eq) {
+            printf("Warning: %s:%d: expected key = value\n", path, line_no);
+            continue;
+        }
+        *eq = '\0';
+        key = trim(key);
+        char* value = trim(eq + 1);
+
+        int result = apply(key, value);
+        if (result < 0) {
+            printf("Warning: %s:%d: unknown setting '%s'\n", path, line_no, key);
+        } else if (result == 0) {
+            printf("Warning: %s:%d: bad value '%s' for %s\n", path, line_no, value, key);
+        }
+    }
+    fclose(file);
+    return 1;
+}
@@ -0,0 +1,495 @@
+#include "cMusix.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Control socket.
+//
+// A Unix-domain stream socket, by default $XDG_RUNTIME_DIR/cmusix.sock,
+// served from the main loop like stdin: the listening socket and every
+// client are non-blocking watches, so a client can never hold up input or
+// playback. The protocol is one line per request and per reply:
+//
+//   play [N]          start playing, or resume; N picks a track (from 1)
+//                     before the startup scan has found anything, plays
+//                     the first track as soon as it has
+//   pause             pause, if playing
+//   toggle            play or pause, as the space key
+//   stop | next | prev
+//   volume N|+N|-N    set or change the volume, in percent
+//   shuffle [on|off]  toggle, or set
+//   repeat [on|off]
+//   status            one "status key=value ..." line, the track name last
+//   subscribe         then "event ..." lines as things change:
+//                       event state playing|paused|stopped
+//                       event track N name
+//                       event volume N
+//                       event shuffle 0|1, event repeat 0|1
+//                       event position SECONDS DURATION (once a second)
+//   unsubscribe
+//   save PATH         write the playlist as shown and in playing order, M3U
+//                     or PLS by extension, see playlistfile.c
+//   quit              exit the player, as the q key; a headless one (-D) has
+//                     no other way short of a signal
+//
+// Commands answer "OK" or "ERR reason". State is sampled once per pass of
+// the main loop and the status line formatted at most once per pass, however
+// many clients ask. Output a client does not read is queued up to
+// CONTROL_MAX_PENDING bytes, then the client is dropped.
+
+#define CONTROL_MAX_CLIENTS 64
+#define CONTROL_LINE 512
+#define CONTROL_READ 4096           // per client and wakeup, so nobody starves the rest
+#define CONTROL_MAX_PENDING (64 << 10)
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+typedef struct {
+    int fd;                     // -1 when the slot is free
+    char in[CONTROL_LINE];
+    size_t in_len;
+    int overlong;               // discarding the rest of a line that did not fit
+    char* out;
+    size_t out_len;
+    size_t out_cap;
+    int subscribed;
+} ControlClient;
+
+// What subscribers were last told
+typedef struct {
+    int state;                  // 0 stopped, 1 playing, 2 paused
+    int index;
+    int volume;
+    int shuffle;
+    int repeat;
+    long position;
+} ControlState;
+
+static const char* state_names[] = { "stopped", "playing", "paused" };
+
+static int listen_fd = -1;
+static char socket_path[MAX_PATH_LENGTH];
+static ControlClient clients[CONTROL_MAX_CLIENTS];
+static int client_count = 0;
+static int subscribers = 0;
+
+static ControlState published;
+static ControlState current;
+static char status_line[CONTROL_LINE + 64];
+static int status_valid = 0;
+
+static unsigned long commands = 0;
+static unsigned long events_sent = 0;
+static unsigned long dropped_clients = 0;
+
+static void sample(ControlState* st) {
+    st->state = !player.is_playing ? 0 : player.is_paused ? 2 : 1;
+    st->index = player.tracks.count > 0 ? player.current_index : -1;
+    st->volume = (int)(player.volume * 100 + 0.5f);
+    st->shuffle = player.shuffle;
+    st->repeat = player.repeat;
+    st->position = st->state ? (long)position_seconds() : 0;
+}
+
+static void drop(ControlClient* c) {
+    event_unwatch(c->fd);
+    close(c->fd);
+    c->fd = -1;
+    if (c->subscribed) subscribers--;
+    c->subscribed = 0;
+    free(c->out);
+    c->out = NULL;
+    c->out_len = c->out_cap = 0;
+    c->in_len = 0;
+    c->overlong = 0;
+    client_count--;
+}
+
+// Returns 0 if the client had to be dropped
+static int flush(ControlClient* c) {
+    size_t sent = 0;
+    while (sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, SEND_FLAGS);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            drop(c);
+            return 0;
+        }
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+    event_watch_output(c->fd, c->out_len > 0);
+    return 1;
+}
+
+static void reply(ControlClient* c, const char* fmt, ...) {
+    char line[CONTROL_LINE + 128];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line) - 1, fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    if ((size_t)n > sizeof(line) - 2) n = sizeof(line) - 2;
+    line[n++] = '\n';
+
+    if (c->out_len + n > CONTROL_MAX_PENDING) {
+        // Not reading what it asked for
+        dropped_clients++;
+        drop(c);
+        return;
+    }
+    if (c->out_len + n > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap * 2 : 1024;
+        while (cap < c->out_len + n) cap *= 2;
+        char* grown = realloc(c->out, cap);
+        if (!grown) {
+            drop(c);
+            return;
+        }
+        c->out = grown;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, line, n);
+    c->out_len += n;
+}
+
+static const char* current_status() {
+    if (status_valid) return status_line;
+
+    char name[CONTROL_LINE];
+    name[0] = '\0';
+    double duration = 0;
+    if (current.index >= 0) {
+        track_display_name(current.index, name, sizeof(name));
+        duration = player.tracks.duration[current.index];
+    }
+    // The position moves on, so the line only lasts for this pass of the loop
+    snprintf(status_line, sizeof(status_line),
+             "status state=%s index=%d count=%d position=%.1f duration=%.1f volume=%d "
+             "shuffle=%d repeat=%d name=%s",
+             state_names[current.state], current.index + 1, player.tracks.count,
+             current.state ? position_seconds() : 0.0, duration > 0 ? duration : 0.0,
+             current.volume, current.shuffle, current.repeat, name);
+    status_valid = 1;
+    return status_line;
+}
+
+static int parse_switch(const char* arg, int now) {
+    if (!*arg) return !now;
+    if (strcmp(arg, "on") == 0 || strcmp(arg, "1") == 0) return 1;
+    if (strcmp(arg, "off") == 0 || strcmp(arg, "0") == 0) return 0;
+    return -1;
+}
+
+static void command(ControlClient* c, char* line) {
+    char* arg = line;
+    while (*arg && !isspace((unsigned char)*arg)) arg++;
+    if (*arg) *arg++ = '\0';
+    while (isspace((unsigned char)*arg)) arg++;
+    char* end = arg + strlen(arg);
+    while (end > arg && isspace((unsigned char)end[-1])) *--end = '\0';
+
+    commands++;
+    int changed = 1;
+    if (strcmp(line, "status") == 0) {
+        reply(c, "%s", current_status());
+        return;
+    } else if (strcmp(line, "subscribe") == 0) {
+        if (!c->subscribed) subscribers++;
+        c->subscribed = 1;
+        changed = 0;
+    } else if (strcmp(line, "unsubscribe") == 0) {
+        if (c->subscribed) subscribers--;
+        c->subscribed = 0;
+        changed = 0;
+    } else if (strcmp(line, "quit") == 0) {
+        reply(c, "OK");
+        flush(c);
+        cleanup();
+        exit(0);
+    } else if (strcmp(line, "save") == 0) {
+        if (!*arg) {
+            reply(c, "ERR save takes a path");
+        } else if (save_playlist(arg) < 0) {
+            reply(c, "ERR %s", strerror(errno));
+        } else {
+            reply(c, "OK");
+        }
+        return;
+    } else if (strcmp(line, "play") == 0) {
+        if (player.tracks.count == 0 && !*arg && scan_running()) {
+            // Starts with the first track the scan finds
+            playlist_play_when_ready();
+        } else if (player.tracks.count == 0) {
+            reply(c, "ERR no tracks");
+            return;
+        } else if (*arg) {
+            int n = atoi(arg);
+            if (n < 1 || n > player.tracks.count) {
+                reply(c, "ERR no track %s", arg);
+                return;
+            }
+            player.current_index = n - 1;
+            playSong();
+        } else if (!player.is_playing) {
+            playSong();
+        } else if (player.is_paused) {
+            pauseResume();
+        }
+    } else if (strcmp(line, "pause") == 0) {
+        if (player.is_playing && !player.is_paused) pauseResume();
+    } else if (strcmp(line, "toggle") == 0) {
+        if (!player.is_playing) {
+            playlist_play_when_ready();
+        } else {
+            pauseResume();
+        }
+    } else if (strcmp(line, "stop") == 0) {
+        stopPlayback();
+    } else if (strcmp(line, "next") == 0) {
+        nextSong();
+    } else if (strcmp(line, "prev") == 0 || strcmp(line, "previous") == 0) {
+        previousSong();
+    } else if (strcmp(line, "volume") == 0) {
+        char* rest;
+        long n = strtol(arg, &rest, 10);
+        if (!*arg || *rest) {
+            reply(c, "ERR volume takes N, +N or -N");
+            return;
+        }
+        int relative = *arg == '+' || *arg == '-';
+        set_volume(relative ? player.volume + n / 100.0f : n / 100.0f);
+    } else if (strcmp(line, "shuffle") == 0 || strcmp(line, "repeat") == 0) {
+        int is_shuffle = line[0] == 's';
+        int want = parse_switch(arg, is_shuffle ? player.shuffle : player.repeat);
+        if (want < 0) {
+            reply(c, "ERR %s takes on or off", line);
+            return;
+        }
+        if (is_shuffle && want != player.shuffle) shuffleFunction();
+        if (!is_shuffle && want != player.repeat) repeatFunction();
+    } else {
+        reply(c, "ERR unknown command %s", line);
+        return;
+    }
+
+    if (changed) {
+        sample(&current);
+        status_valid = 0;
+        event_request_redraw();
+    }
+    reply(c, "OK");
+}
+
+static void on_client(int fd, void* data) {
+    ControlClient* c = data;
+    (void)fd;
+
+    char buf[CONTROL_READ];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        drop(c);
+        return;
+    }
+
+    for (ssize_t i = 0; i < n && c->fd >= 0; i++) {
+        if (buf[i] == '\n') {
+            if (c->overlong) {
+                c->overlong = 0;
+                reply(c, "ERR line too long");
+            } else {
+                c->in[c->in_len] = '\0';
+                if (c->in_len > 0 && c->in[c->in_len - 1] == '\r') c->in[c->in_len - 1] = '\0';
+                if (c->in[0]) command(c, c->in);
+            }
+            c->in_len = 0;
+        } else if (c->in_len + 1 < sizeof(c->in)) {
+            c->in[c->in_len++] = buf[i];
+        } else {
+            c->overlong = 1;
+        }
+    }
+
+    if (c->fd >= 0) flush(c);
+}
+
+static void on_accept(int fd, void* data) {
+    (void)data;
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) return;
+        fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+        ControlClient* slot = NULL;
+        for (int i = 0; i < CONTROL_MAX_CLIENTS && !slot; i++) {
+            if (clients[i].fd < 0) slot = &clients[i];
+        }
+        if (!slot || !event_watch(client, on_client, slot)) {
+            static const char busy[] = "ERR too many clients\n";
+            send(client, busy, sizeof(busy) - 1, SEND_FLAGS);
+            close(client);
+            continue;
+        }
+        memset(slot, 0, sizeof(*slot));
+        slot->fd = client;
+        client_count++;
+    }
+}
+
+// Tell subscribers what changed since the last pass of the main loop
+void control_publish() {
+    status_valid = 0;
+    if (listen_fd < 0) return;
+
+    sample(&current);
+    if (subscribers == 0) {
+        published = current;
+        return;
+    }
+    if (memcmp(&current, &published, sizeof(current)) == 0) return;
+
+    char name[CONTROL_LINE];
+    if (current.index != published.index && current.index >= 0) {
+        track_display_name(current.index, name, sizeof(name));
+    }
+    double duration = current.index >= 0 ? player.tracks.duration[current.index] : 0;
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        ControlClient* c = &clients[i];
+        if (c->fd < 0 || !c->subscribed) continue;
+        if (current.index != published.index && current.index >= 0) {
+            reply(c, "event track %d %s", current.index + 1, name);
+        }
+        if (c->fd >= 0 && current.state != published.state) {
+            reply(c, "event state %s", state_names[current.state]);
+        }
+        if (c->fd >= 0 && current.volume != published.volume) {
+            reply(c, "event volume %d", current.volume);
+        }
+        if (c->fd >= 0 && current.shuffle != published.shuffle) {
+            reply(c, "event shuffle %d", current.shuffle);
+        }
+        if (c->fd >= 0 && current.repeat != published.repeat) {
+            reply(c, "event repeat %d", current.repeat);
+        }
+        if (c->fd >= 0 && current.state && current.position != published.position) {
+            reply(c, "event position %ld %.0f", current.position, duration > 0 ? duration : 0.0);
+        }
+        if (c->fd >= 0) {
+            events_sent++;
+            flush(c);
+        }
+    }
+    published = current;
+}
+
+static int default_path(char* path, size_t size) {
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    int n;
+    if (dir && *dir) {
+        n = snprintf(path, size, "%s/cmusix.sock", dir);
+    } else {
+        n = snprintf(path, size, "/tmp/cmusix-%ld.sock", (long)getuid());
+    }
+    return n > 0 && (size_t)n < size;
+}
+
+// Another player answering on path?
+static int in_use(const struct sockaddr_un* addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return 0;
+    int live = connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) == 0;
+    close(fd);
+    return live;
+}
+
+// Listen on path, or the default one if path is empty
+int control_start(const char* path) {
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) clients[i].fd = -1;
+
+    if (path && *path) {
+        snprintf(socket_path, sizeof(socket_path), "%s", path);
+    } else if (!default_path(socket_path, sizeof(socket_path))) {
+        return 0;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return 0;
+    strcpy(addr.sun_path, socket_path);
+
+    struct stat st;
+    if (lstat(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || in_use(&addr)) {
+            printf("Warning: %s is in use\n", socket_path);
+            socket_path[0] = '\0';
+            return 0;
+        }
+        unlink(socket_path); // left over from a crash
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) return 0;
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+    // Only this user may drive the player
+    mode_t old_mask = umask(0077);
+    int bound = bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!bound || listen(listen_fd, 16) != 0 || !event_watch(listen_fd, on_accept, NULL)) {
+        close(listen_fd);
+        listen_fd = -1;
+        if (bound) unlink(socket_path);
+        socket_path[0] = '\0';
+        return 0;
+    }
+
+    sample(&published);
+    current = published;
+    return 1;
+}
+
+void control_stop() {
+    if (listen_fd < 0) return;
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) drop(&clients[i]);
+    }
+    event_unwatch(listen_fd);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+}
+
+// Clients following events; a headless player only ticks for them
+int control_subscribers() {
+    return subscribers;
+}
+
+const char* control_path() {
+    return listen_fd >= 0 ? socket_path : NULL;
+}
+
+void control_stats(unsigned long* command_count, unsigned long* event_count,
+                   unsigned long* dropped_count) {
+    if (command_count) *command_count = commands;
+    if (event_count) *event_count = events_sent;
+    if (dropped_count) *dropped_count = dropped_clients;
+}
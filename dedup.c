@@ -0,0 +1,554 @@
+#include "cMusix.h"
+
+// Duplicate tracks.
+//
+// Merged libraries hold the same recording under several names. With -u
+// (or "dedup = yes") worker threads map every track and find its audio
+// payload: the file without a leading ID3v2 tag and trailing ID3v1, APEv2
+// or Lyrics3 tags for MP3 and ADTS, after the metadata blocks for FLAC,
+// the pages after the Vorbis/Opus headers for Ogg, the data, SSND or mdat
+// chunk for WAV, AIFF and MP4. Retagged copies share a payload.
+//
+// Only payloads whose length matches another track's can be duplicates, so
+// a pass first measures every payload, which touches a few pages per file,
+// and then hashes just the tracks in such groups with XXH64 over the
+// mapping. Lengths and hashes are kept in library-<hash>.dup next to the
+// index (a StampCache, see stampcache.c), so later runs neither map nor read
+// unchanged files.
+//
+// When a pass ends the event loop collapses each group of equal payloads to
+// its first track in playlist order (the current one, if it is in the group)
+// in one track_keep() pass, and playlist_follow() moves every index held.
+
+#define DUP_MAGIC "CMXDUP1"
+#define DUP_VERSION 2
+#define DUP_HASHED 1          // hash is set; the payload length always is
+
+// Value kept per file in the StampCache
+typedef struct {
+    int64_t payload;    // audio bytes, 0 if none were found
+    uint64_t hash;
+    uint32_t flags;
+} Dup;
+
+// Track waiting to be collapsed, see collapse()
+typedef struct {
+    uint64_t hash;
+    int64_t payload;
+    int index;
+} DupTrack;
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static void dedup_job(const char* path, int phase);
+static int queue_hashing();
+static void notify_pass_done();
+
+static StampCache cache = {
+    .magic = DUP_MAGIC,
+    .version = DUP_VERSION,
+    .value_size = sizeof(Dup),
+    .job = dedup_job,
+    .pass_end = queue_hashing,
+    .saved = notify_pass_done,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+static int notify_pipe[2] = { -1, -1 };
+
+// Counters, under cache.lock
+static unsigned long measured = 0;
+static unsigned long hashed = 0;
+static unsigned long cached = 0;
+static unsigned long long hashed_bytes = 0;
+static unsigned long removed = 0;   // main thread
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+// XXH64. Words are read in host order: the cache never leaves the machine.
+static uint64_t xxh64(const unsigned char* p, size_t len, uint64_t seed) {
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+        const unsigned char* limit = end - 32;
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h ^= (uint64_t)v * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// End of the data once trailing ID3v1, APEv2 and Lyrics3 tags are cut off,
+// in whatever order they were appended
+static size_t strip_trailers(const unsigned char* p, size_t start, size_t end) {
+    while (1) {
+        if (end - start >= 128 && memcmp(p + end - 128, "TAG", 3) == 0) {
+            end -= 128;
+        } else if (end - start >= 32 && memcmp(p + end - 32, "APETAGEX", 8) == 0) {
+            const unsigned char* footer = p + end - 32;
+            size_t size = le32(footer + 12);
+            if (le32(footer + 20) & 0x80000000u) size += 32; // header too
+            if (size < 32 || size > end - start) break;
+            end -= size;
+        } else if (end - start >= 15 && memcmp(p + end - 9, "LYRICS200", 9) == 0) {
+            size_t size = 0;
+            for (int i = 0; i < 6; i++) {
+                unsigned char c = p[end - 15 + i];
+                if (c < '0' || c > '9') return end;
+                size = size * 10 + (c - '0');
+            }
+            if (size + 15 > end - start) break;
+            end -= size + 15;
+        } else {
+            break;
+        }
+    }
+    return end;
+}
+
+// First Ogg page at or after pos whose granule position is set: the
+// headers (and with them the comments) all come before it
+static size_t ogg_audio(const unsigned char* p, size_t pos, size_t size) {
+    while (pos + 27 <= size && memcmp(p + pos, "OggS", 4) == 0) {
+        int segments = p[pos + 26];
+        if (pos + 27 + segments > size) break;
+        uint64_t granule = (uint64_t)le32(p + pos + 6) | ((uint64_t)le32(p + pos + 10) << 32);
+        if (granule != 0) return pos;
+        size_t body = 0;
+        for (int i = 0; i < segments; i++) body += p[pos + 27 + i];
+        pos += 27 + segments + body;
+    }
+    return size;
+}
+
+// Hash the bodies of the Ogg pages in [pos, end): page headers carry
+// sequence numbers and checksums that change when the comments do
+static uint64_t ogg_hash(const unsigned char* p, size_t pos, size_t end) {
+    uint64_t h = 0;
+    while (pos + 27 <= end && memcmp(p + pos, "OggS", 4) == 0) {
+        int segments = p[pos + 26];
+        if (pos + 27 + segments > end) break;
+        size_t body = 0;
+        for (int i = 0; i < segments; i++) body += p[pos + 27 + i];
+        pos += 27 + segments;
+        if (body > end - pos) body = end - pos;
+        h = xxh64(p + pos, body, h);
+        pos += body;
+    }
+    return h;
+}
+
+// Walk RIFF (little-endian sizes) or IFF (big-endian) chunks from pos for id
+static int find_chunk(const unsigned char* p, size_t pos, size_t size, const char* id, int big,
+                      size_t* start, size_t* end) {
+    while (pos + 8 <= size) {
+        size_t len = big ? be32(p + pos + 4) : le32(p + pos + 4);
+        if (memcmp(p + pos, id, 4) == 0) {
+            *start = pos + 8;
+            *end = len <= size - *start ? *start + len : size;
+            return 1;
+        }
+        pos += 8 + len + (len & 1);
+    }
+    return 0;
+}
+
+static int find_mdat(const unsigned char* p, size_t size, size_t* start, size_t* end) {
+    size_t pos = 0;
+    while (pos + 8 <= size) {
+        uint64_t len = be32(p + pos);
+        size_t header = 8;
+        if (len == 1 && pos + 16 <= size) {
+            len = ((uint64_t)be32(p + pos + 8) << 32) | be32(p + pos + 12);
+            header = 16;
+        } else if (len == 0) {
+            len = size - pos;
+        }
+        if (len < header || len > size - pos) break;
+        if (memcmp(p + pos + 4, "mdat", 4) == 0) {
+            *start = pos + header;
+            *end = pos + (size_t)len;
+            return 1;
+        }
+        pos += (size_t)len;
+    }
+    return 0;
+}
+
+// Where the audio sits in a mapped file. Returns 1 for Ogg, whose payload
+// is hashed page by page.
+static int payload_span(const unsigned char* p, size_t size, size_t* start, size_t* end) {
+    size_t pos = id3v2_size(p, size);
+    if (pos > size) pos = size;
+    *start = pos;
+    *end = size;
+    const unsigned char* head = p + pos;
+    size_t left = size - pos;
+
+    if (left >= 4 && memcmp(head, "fLaC", 4) == 0) {
+        // Metadata blocks up to the one flagged last
+        size_t block = pos + 4;
+        while (block + 4 <= size) {
+            int last = p[block] & 0x80;
+            block += 4 + (((size_t)p[block + 1] << 16) | (p[block + 2] << 8) | p[block + 3]);
+            if (last) break;
+        }
+        *start = block < size ? block : size;
+        *end = strip_trailers(p, *start, size);
+    } else if (left >= 4 && memcmp(head, "OggS", 4) == 0) {
+        *start = ogg_audio(p, pos, size);
+        return 1;
+    } else if (left >= 12 && memcmp(head, "RIFF", 4) == 0 && memcmp(head + 8, "WAVE", 4) == 0) {
+        find_chunk(p, pos + 12, size, "data", 0, start, end);
+    } else if (left >= 12 && memcmp(head, "FORM", 4) == 0 &&
+               (memcmp(head + 8, "AIFF", 4) == 0 || memcmp(head + 8, "AIFC", 4) == 0)) {
+        // SSND starts with an offset and a block size
+        if (find_chunk(p, pos + 12, size, "SSND", 1, start, end) && *end - *start >= 8) {
+            *start += 8;
+        }
+    } else if (left >= 8 && memcmp(head + 4, "ftyp", 4) == 0) {
+        find_mdat(p, size, start, end);
+    } else {
+        // MPEG audio or ADTS: frames between the tags
+        *end = strip_trailers(p, pos, size);
+    }
+    return 0;
+}
+
+// Map a file for reading. NULL for an empty or unreadable one.
+static const unsigned char* map_file(const char* path, struct stat* st) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    if (fstat(fd, st) != 0 || st->st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    void* data = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+// First step for every track: the payload length, unless the cache has it
+static void measure(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return;
+
+    pthread_mutex_lock(&cache.lock);
+    if (stamp_fresh(&cache, path, &st) >= 0) {
+        cached++;
+        pthread_mutex_unlock(&cache.lock);
+        return;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    int64_t payload = 0;
+    const unsigned char* data = map_file(path, &st);
+    if (data) {
+        size_t start, end;
+        payload_span(data, (size_t)st.st_size, &start, &end);
+        payload = (int64_t)(end - start);
+        munmap((void*)data, (size_t)st.st_size);
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    int i = stamp_store(&cache, path, &st);
+    if (i >= 0) {
+        Dup* dup = stamp_value(&cache, i);
+        dup->payload = payload;
+        dup->hash = 0;
+        dup->flags = 0;
+    }
+    measured++;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Second step, for tracks whose payload length is not unique
+static void digest(const char* path) {
+    struct stat st;
+    const unsigned char* data = map_file(path, &st);
+    if (!data) return;
+
+    size_t size = (size_t)st.st_size;
+    madvise((void*)data, size, MADV_SEQUENTIAL);
+    size_t start, end;
+    int ogg = payload_span(data, size, &start, &end);
+    uint64_t hash = ogg ? ogg_hash(data, start, end) : xxh64(data + start, end - start, 0);
+    munmap((void*)data, size);
+
+    pthread_mutex_lock(&cache.lock);
+    int i = stamp_fresh(&cache, path, &st);
+    // Changed since it was measured: the next pass starts over with it
+    if (i >= 0) {
+        Dup* dup = stamp_value(&cache, i);
+        if (dup->payload == (int64_t)(end - start)) {
+            dup->hash = hash;
+            dup->flags |= DUP_HASHED;
+            cache.dirty = 1;
+        }
+    }
+    hashed++;
+    hashed_bytes += end - start;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void dedup_job(const char* path, int phase) {
+    if (phase == 0) {
+        measure(path);
+    } else {
+        digest(path);
+    }
+}
+
+static int64_t entry_payload(int i) {
+    return ((const Dup*)stamp_value(&cache, i))->payload;
+}
+
+static int compare_payloads(const void* a, const void* b) {
+    int64_t x = entry_payload(*(const int*)a), y = entry_payload(*(const int*)b);
+    return (x > y) - (x < y);
+}
+
+// Lock held, measuring done: queue the tracks that share a payload length
+// and have no hash yet. Returns 1 if there are any.
+static int queue_hashing() {
+    if (cache.phase != 0) return 0;
+
+    int total = cache.entry_count;
+    int* order = malloc((total > 0 ? total : 1) * sizeof(int));
+    char** list = malloc((total > 0 ? total : 1) * sizeof(char*));
+    if (!order || !list) {
+        free(order);
+        free(list);
+        return 0;
+    }
+
+    int live = 0;
+    for (int i = 0; i < total; i++) {
+        if (cache.entries[i].live && entry_payload(i) > 0) order[live++] = i;
+    }
+    qsort(order, live, sizeof(int), compare_payloads);
+
+    int count = 0;
+    for (int i = 0; i < live;) {
+        int group = 1;
+        while (i + group < live && entry_payload(order[i + group]) == entry_payload(order[i])) {
+            group++;
+        }
+        for (int j = i; group > 1 && j < i + group; j++) {
+            const Dup* dup = stamp_value(&cache, order[j]);
+            if (dup->flags & DUP_HASHED) continue;
+            list[count] = strdup(cache.entries[order[j]].path);
+            if (list[count]) count++;
+        }
+        i += group;
+    }
+    free(order);
+    stamp_queue(&cache, list, count);
+    return count > 0;
+}
+
+// The event loop collapses what was found
+static void notify_pass_done() {
+    char c = 0;
+    write(notify_pipe[1], &c, 1);
+}
+
+static int compare_tracks(const void* a, const void* b) {
+    const DupTrack* x = a;
+    const DupTrack* y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    if (x->payload != y->payload) return x->payload < y->payload ? -1 : 1;
+    return x->index - y->index;
+}
+
+// Drop every track whose payload an earlier one (or the playing one) has
+static void collapse() {
+    int count = player.tracks.count;
+    DupTrack* list = malloc((count > 0 ? count : 1) * sizeof(DupTrack));
+    char* keep = malloc(count + 1);
+    int* table = malloc((count > 0 ? count : 1) * sizeof(int));
+    if (!list || !keep || !table) {
+        free(list);
+        free(keep);
+        free(table);
+        return;
+    }
+    memset(keep, 1, count + 1);
+
+    int n = 0;
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < count; i++) {
+        int e = stamp_find(&cache, track_path(i));
+        if (e < 0) continue;
+        const Dup* dup = stamp_value(&cache, e);
+        if (!(dup->flags & DUP_HASHED)) continue;
+        list[n].hash = dup->hash;
+        list[n].payload = dup->payload;
+        list[n].index = i;
+        n++;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    qsort(list, n, sizeof(DupTrack), compare_tracks);
+
+    // The loaded track stays, or else the selected one
+    int current = player.music_index >= 0 ? player.music_index : player.current_index;
+    for (int i = 0; i < n;) {
+        int group = 1;
+        while (i + group < n && list[i + group].hash == list[i].hash &&
+               list[i + group].payload == list[i].payload) {
+            group++;
+        }
+        int kept = list[i].index;
+        for (int j = i; j < i + group; j++) {
+            if (list[j].index == current) kept = current;
+        }
+        for (int j = i; group > 1 && j < i + group; j++) {
+            if (list[j].index != kept) keep[list[j].index] = 0;
+        }
+        i += group;
+    }
+    free(list);
+
+    int dropped = 0;
+    for (int i = 0; i < count; i++) dropped += !keep[i];
+    if (dropped == 0) {
+        free(keep);
+        free(table);
+        return;
+    }
+
+    // One pass over the store, and one over everything holding an index
+    track_keep(&player.tracks, 0, keep, table);
+    TrackMap map = { 0, count, -1, table };
+    playlist_follow(&map);
+    free(keep);
+    free(table);
+
+    removed += dropped;
+    track_compact(&player.tracks);
+    search_refresh();
+    if (player.is_playing) preload_upcoming();
+    event_request_redraw();
+}
+
+static void on_pass_done(int fd, void* data) {
+    (void)data;
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    collapse();
+}
+
+// Load the cache for a library root and start looking for duplicates
+int dedup_open(const char* root) {
+    dedup_close();
+
+    if (pipe(notify_pipe) != 0) return 0;
+    for (int i = 0; i < 2; i++) {
+        fcntl(notify_pipe[i], F_SETFL, fcntl(notify_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(notify_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    if (!event_watch(notify_pipe[0], on_pass_done, NULL)) {
+        dedup_close();
+        return 0;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    // Mostly waiting on the disk
+    cache.threads = cpus > 0 ? (int)cpus : 1;
+    if (!stamp_open(&cache, root, "dup")) {
+        dedup_close();
+        return 0;
+    }
+    return 1;
+}
+
+// Queue a pass over the library, after loading it or after a live update.
+// Tracks seen before are only stat()ed.
+void dedup_refresh() {
+    stamp_refresh(&cache);
+}
+
+void dedup_close() {
+    if (!stamp_close(&cache)) warn_later("Could not write duplicate cache");
+    if (notify_pipe[0] >= 0) {
+        event_unwatch(notify_pipe[0]);
+        close(notify_pipe[0]);
+        close(notify_pipe[1]);
+        notify_pipe[0] = notify_pipe[1] = -1;
+    }
+}
+
+void dedup_stats(unsigned long* measured_count, unsigned long* hashed_count,
+                 unsigned long long* hashed_byte_count, unsigned long* cached_count,
+                 unsigned long* removed_count) {
+    pthread_mutex_lock(&cache.lock);
+    if (measured_count) *measured_count = measured;
+    if (hashed_count) *hashed_count = hashed;
+    if (hashed_byte_count) *hashed_byte_count = hashed_bytes;
+    if (cached_count) *cached_count = cached;
+    pthread_mutex_unlock(&cache.lock);
+    if (removed_count) *removed_count = removed;
+}
@@ -0,0 +1,522 @@
+#include "cMusix.h"
+
+// Playback engine.
+//
+// SDL_mixer decodes a Mix_Music from inside its audio callback, so a slow
+// read or an expensive frame becomes an underrun. Here the callback only
+// copies PCM out of a single-producer/single-consumer ring, and a decoder
+// thread keeps that ring full. SDL_mixer has no way to pull PCM out of a
+// Mix_Music, so the engine takes the files it can read itself: uncompressed
+// WAV and AIFF, through pcmstream.c, one block at a time in the mixer's
+// output format. It has no decoder of its own for MP3, FLAC, Ogg or any
+// other compressed format; those are still decoded in the callback, and
+// engine_stats() counts them so the exit summary says so. The decoder opens a track started by hand, the preload
+// worker the one that follows; the decoder appends that straight behind the
+// current one, without a gap. Between blocks it looks for a new request, so
+// a skip is heard within a block, and what a track holds in memory is that
+// block plus the ring.
+//
+// Ring positions are byte counts that only grow. The decoder owns head, the
+// callback owns tail, and neither takes a lock. A track change does not touch
+// tail: the decoder publishes flush_to and the callback skips up to it.
+// Compressed files, and any pcm_open() refuses, play through Mix_Music as
+// before (audio.c).
+
+#define ENGINE_BLOCK (32u << 10)         // PCM bytes decoded at a time
+#define ENGINE_MIN_RING (16u << 10)
+#define NO_END UINT64_MAX
+
+typedef struct {
+    PcmStream* pcm;
+    char* path;
+    int drained;        // all of it is in the ring
+    float gain;         // loudness levelling, applied on the way into the ring
+} Source;
+
+static pthread_t decoder;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+static int quit = 0;
+
+// Output format
+static Uint16 format = AUDIO_S16SYS;
+static int channels = 2;
+static int rate = 44100;
+static int bytes_per_second = 44100 * 4;
+static int buffer_ms = 0;
+static int period_ms = 0;           // decoder wake-up while the ring is full
+
+// Ring
+static Uint8* ring = NULL;
+static size_t ring_size = 0;        // power of two
+static uint64_t head = 0;           // decoder
+static uint64_t tail = 0;           // callback
+static uint64_t flush_to = 0;       // decoder: callback drops everything before it
+static uint64_t end_at = NO_END;    // decoder: end of the playing track
+static int end_next = 0;            // decoder: the queued track follows end_at
+static uint64_t end_done = NO_END;  // callback: last end it reported
+
+// Decoder: the block read last, and how much of it is in the ring
+static Uint8* block = NULL;
+static size_t block_size = 0;       // whole frames
+static size_t block_len = 0;
+static size_t block_pos = 0;
+
+// Requests, under lock. request_gen is also read by the callback.
+static uint64_t request_gen = 0;    // bumped by every engine_play()/engine_stop()
+static char* request_path = NULL;   // NULL stops
+static uint64_t ring_gen = 0;       // decoder: request the ring holds
+static Source queued = {0};         // opened ahead by the preload worker
+static char* crossing_path = NULL;  // track appended at end_at
+static char* failed_path = NULL;    // last file pcm_open() refused
+static uint64_t failed_gen = 0;
+
+// Audio thread state
+static int paused = 0;
+static int volume = MIX_MAX_VOLUME;
+static uint64_t crossed = 0;        // request in which the callback passed end_at into the queued track
+
+// Main thread
+static int hooked = 0;
+static int active = 0;
+
+// Counters
+static unsigned long underruns = 0;
+static uint64_t missing_bytes = 0;
+static unsigned long gapless = 0;
+static unsigned long plays = 0;
+static unsigned long bypassed = 0;  // started while running, but left to Mix_Music
+
+static void release(Source* src) {
+    pcm_close(src->pcm);
+    free(src->path);
+    memset(src, 0, sizeof(*src));
+}
+
+// Lock held
+static void wait_ms(int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)ms * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&cond, &lock, &ts);
+}
+
+// Decoder: copy as much of the block as fits into the ring, reading the
+// next block of src once it is used up. Sets src->drained at the end.
+static void write_pcm(Source* src, size_t space) {
+    if (block_pos == block_len) {
+        int got = pcm_read(src->pcm, block, (int)block_size);
+        if (got <= 0) {
+            // A read error ends the track where it is
+            src->drained = 1;
+            return;
+        }
+        block_len = (size_t)got;
+        block_pos = 0;
+    }
+
+    size_t n = block_len - block_pos;
+    if (n > space) n = space;
+    size_t off = head & (ring_size - 1);
+    size_t first = ring_size - off;
+    if (first > n) first = n;
+    memcpy(ring + off, block + block_pos, first);
+    memcpy(ring, block + block_pos + first, n - first);
+    loudness_apply(ring + off, first, format, src->gain);
+    loudness_apply(ring, n - first, format, src->gain);
+    block_pos += n;
+    __atomic_store_n(&head, head + n, __ATOMIC_RELEASE);
+}
+
+// Decoder: the playing track ends at the current head
+static void publish_end(int next) {
+    __atomic_store_n(&end_next, next, __ATOMIC_RELAXED);
+    __atomic_store_n(&end_at, head, __ATOMIC_RELEASE);
+}
+
+// Decoder: switch the ring over to request gen. Called unlocked; path is
+// taken over, next is the preloaded source if it matched.
+static void start_track(Source* cur, uint64_t gen, char* path, Source next) {
+    // Whatever is in the ring belongs to the previous request
+    __atomic_store_n(&end_at, NO_END, __ATOMIC_RELAXED);
+    __atomic_store_n(&flush_to, head, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring_gen, gen, __ATOMIC_RELEASE);
+    release(cur);
+    block_len = block_pos = 0;
+
+    if (path && !next.pcm) {
+        PROBE_START(load_start);
+        next.pcm = pcm_open(path, format, channels, rate);
+        PROBE_STOP(PROBE_TRACK_LOAD, load_start);
+        if (!next.pcm) {
+            pthread_mutex_lock(&lock);
+            free(failed_path);
+            failed_path = path;
+            failed_gen = gen;
+            pthread_mutex_unlock(&lock);
+            path = NULL;
+            // Report the end right away so the player can fall back
+            publish_end(0);
+        }
+    }
+    if (next.pcm && !next.path) {
+        next.path = path;
+        path = NULL;
+    }
+    free(path);
+
+    next.drained = 0;
+    next.gain = next.pcm ? loudness_gain(next.path) : 1.0f;
+    *cur = next;
+}
+
+static void* decoder_main(void* arg) {
+    (void)arg;
+    uint64_t gen = 0;
+    Source cur = {0};
+    int ended = 1;  // nothing left to write: idle, or the end is published
+
+    pthread_mutex_lock(&lock);
+    while (!quit) {
+        if (request_gen != gen) {
+            gen = request_gen;
+            char* path = request_path;
+            request_path = NULL;
+            Source next = {0};
+            if (path && queued.pcm && strcmp(queued.path, path) == 0) {
+                next = queued;
+                memset(&queued, 0, sizeof(queued));
+            }
+            pthread_mutex_unlock(&lock);
+
+            start_track(&cur, gen, path, next);
+            ended = cur.pcm == NULL;
+
+            pthread_mutex_lock(&lock);
+            continue;
+        }
+
+        if (ended) {
+            pthread_cond_wait(&cond, &lock);
+            continue;
+        }
+
+        if (!cur.drained) {
+            size_t space = ring_size - (size_t)(head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE));
+            if (space < ring_size / 4) {
+                wait_ms(period_ms);
+                continue;
+            }
+            pthread_mutex_unlock(&lock);
+            write_pcm(&cur, space);
+            pthread_mutex_lock(&lock);
+            continue;
+        }
+
+        // A track shorter than the ring: wait until its start has been played
+        uint64_t end = __atomic_load_n(&end_at, __ATOMIC_RELAXED);
+        if (end != NO_END && __atomic_load_n(&end_done, __ATOMIC_ACQUIRE) != end) {
+            wait_ms(period_ms);
+            continue;
+        }
+
+        if (queued.pcm) {
+            // Gapless: the preloaded track goes right behind this one
+            free(crossing_path);
+            crossing_path = strdup(queued.path);
+            publish_end(1);
+            release(&cur);
+            cur = queued;
+            cur.drained = 0;
+            cur.gain = loudness_gain(cur.path);
+            memset(&queued, 0, sizeof(queued));
+            continue;
+        }
+
+        // The preloaded track may still arrive while the ring drains
+        uint64_t left = head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        if (left > (uint64_t)bytes_per_second * period_ms / 1000) {
+            wait_ms(period_ms);
+            continue;
+        }
+
+        publish_end(0);
+        ended = 1;
+    }
+    pthread_mutex_unlock(&lock);
+
+    release(&cur);
+    return NULL;
+}
+
+// Audio thread, in place of SDL_mixer's music decoding. The stream has been
+// cleared to silence before this runs.
+static void engine_mix(void* udata, Uint8* stream, int len) {
+    (void)udata;
+    if (__atomic_load_n(&paused, __ATOMIC_RELAXED)) return;
+
+    // Silent until the decoder has switched to the latest request
+    uint64_t gen = __atomic_load_n(&request_gen, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&ring_gen, __ATOMIC_ACQUIRE) != gen) return;
+
+    uint64_t start = __atomic_load_n(&flush_to, __ATOMIC_ACQUIRE);
+    uint64_t t = tail > start ? tail : start;
+    uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint64_t end = __atomic_load_n(&end_at, __ATOMIC_ACQUIRE);
+    int next = __atomic_load_n(&end_next, __ATOMIC_RELAXED);
+    int vol = __atomic_load_n(&volume, __ATOMIC_RELAXED);
+    size_t want = (size_t)len;
+    size_t done = 0;
+
+    for (;;) {
+        if (end != NO_END && t == end && end_done != end) {
+            // crossed first: the main thread reads end_done to see the end
+            if (next) {
+                __atomic_store_n(&crossed, gen, __ATOMIC_RELEASE);
+                __atomic_fetch_add(&gapless, 1, __ATOMIC_RELAXED);
+                position_reset();
+            } else {
+                position_set_running(0);
+                preload_mark_finished();
+            }
+            __atomic_store_n(&end_done, end, __ATOMIC_RELEASE);
+            event_notify_finished();
+        }
+        if (done == want || t == h) break;
+
+        size_t n = want - done;
+        if (n > h - t) n = (size_t)(h - t);
+        if (end != NO_END && end > t && n > end - t) n = (size_t)(end - t);
+        size_t off = t & (ring_size - 1);
+        if (n > ring_size - off) n = ring_size - off;
+
+        SDL_MixAudioFormat(stream + done, ring + off, format, (Uint32)n, vol);
+        position_feed((int)n);
+        done += n;
+        t += n;
+    }
+    __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+
+    // Short of data in the middle of a track
+    int over = end != NO_END && t == end && !next;
+    if (done < want && h > start && !over) {
+        __atomic_fetch_add(&underruns, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&missing_bytes, (uint64_t)(want - done), __ATOMIC_RELAXED);
+    }
+}
+
+int engine_init(int ms) {
+    if (running) return 1;
+
+    if (!Mix_QuerySpec(&rate, &format, &channels)) return 0;
+    int frame_bytes = channels * (SDL_AUDIO_BITSIZE(format) / 8);
+    bytes_per_second = rate * frame_bytes;
+    if (bytes_per_second <= 0) return 0;
+
+    size_t want = (size_t)bytes_per_second * ms / 1000;
+    ring_size = ENGINE_MIN_RING;
+    while (ring_size < want) ring_size <<= 1;
+    block_size = ENGINE_BLOCK - ENGINE_BLOCK % frame_bytes;
+    ring = malloc(ring_size);
+    block = malloc(block_size);
+    if (!ring || !block) {
+        free(ring);
+        free(block);
+        ring = block = NULL;
+        return 0;
+    }
+    buffer_ms = (int)(ring_size * 1000 / bytes_per_second);
+    period_ms = buffer_ms / 4 > 5 ? buffer_ms / 4 : 5;
+
+    quit = 0;
+    if (pthread_create(&decoder, NULL, decoder_main, NULL) != 0) {
+        free(ring);
+        free(block);
+        ring = block = NULL;
+        return 0;
+    }
+    running = 1;
+    return 1;
+}
+
+// Whether the engine can read index itself. Main thread.
+int engine_accepts(int index) {
+    if (!running || index < 0 || index >= player.tracks.count) return 0;
+
+    const char* path = track_path(index);
+    if (!pcm_supported(path)) return 0;
+
+    pthread_mutex_lock(&lock);
+    int failed = failed_path && strcmp(failed_path, path) == 0;
+    pthread_mutex_unlock(&lock);
+    return !failed;
+}
+
+// Play index through the engine. Returns 0 if the engine does not take it;
+// *continued is set when the track is already playing because the engine
+// moved on to it by itself.
+int engine_play(int index, int* continued) {
+    *continued = 0;
+    if (!engine_accepts(index)) {
+        if (running) bypassed++;
+        return 0;
+    }
+
+    const char* path = track_path(index);
+    pthread_mutex_lock(&lock);
+    if (active && __atomic_load_n(&crossed, __ATOMIC_ACQUIRE) == request_gen &&
+        crossing_path && strcmp(crossing_path, path) == 0) {
+        __atomic_store_n(&crossed, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lock);
+        *continued = 1;
+        return 1;
+    }
+
+    char* copy = strdup(path);
+    if (!copy) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    free(request_path);
+    request_path = copy;
+    __atomic_store_n(&request_gen, request_gen + 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+
+    __atomic_store_n(&paused, 0, __ATOMIC_RELAXED);
+    if (!hooked) {
+        Mix_HookMusic(engine_mix, NULL);
+        hooked = 1;
+    }
+    active = 1;
+    plays++;
+    return 1;
+}
+
+// Preload worker: open the track expected next, for the decoder to append.
+// The device cannot change format meanwhile, see preload_flush().
+void engine_queue(const char* path) {
+    if (!running) return;
+
+    PcmStream* pcm = pcm_open(path, format, channels, rate);
+    char* copy = strdup(path);
+    pthread_mutex_lock(&lock);
+    if (!pcm || !copy) {
+        if (!pcm && copy) {
+            // Mix_Music will have to play it
+            free(failed_path);
+            failed_path = copy;
+            copy = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+        free(copy);
+        pcm_close(pcm);
+        return;
+    }
+    release(&queued);
+    queued.pcm = pcm;
+    queued.path = copy;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+int engine_has_queued(const char* path) {
+    pthread_mutex_lock(&lock);
+    int found = queued.pcm && strcmp(queued.path, path) == 0;
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+// Hand the music hook back to SDL_mixer
+void engine_stop() {
+    if (!running) return;
+
+    if (active) {
+        pthread_mutex_lock(&lock);
+        free(request_path);
+        request_path = NULL;
+        __atomic_store_n(&request_gen, request_gen + 1, __ATOMIC_RELEASE);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+        active = 0;
+    }
+    if (hooked) {
+        Mix_HookMusic(NULL, NULL);
+        hooked = 0;
+    }
+}
+
+void engine_pause(int on) {
+    __atomic_store_n(&paused, on, __ATOMIC_RELAXED);
+}
+
+void engine_set_volume(int vol) {
+    __atomic_store_n(&volume, vol, __ATOMIC_RELAXED);
+}
+
+// Audio thread: the mixer's music goes through engine_mix()
+int engine_hooked() {
+    return running && __atomic_load_n(&hooked, __ATOMIC_RELAXED);
+}
+
+// The playing track still has audio to come
+int engine_playing() {
+    if (!active) return 0;
+    // Passed into the queued track, which the player has not caught up with
+    if (__atomic_load_n(&crossed, __ATOMIC_ACQUIRE) == request_gen) return 0;
+    if (__atomic_load_n(&ring_gen, __ATOMIC_ACQUIRE) != request_gen) return 1;
+
+    uint64_t end;
+    int next;
+    do {
+        end = __atomic_load_n(&end_at, __ATOMIC_ACQUIRE);
+        next = __atomic_load_n(&end_next, __ATOMIC_RELAXED);
+    } while (end != __atomic_load_n(&end_at, __ATOMIC_ACQUIRE));
+    // An end that led into the queued track was taken by engine_play()
+    return end == NO_END || __atomic_load_n(&end_done, __ATOMIC_ACQUIRE) != end || next;
+}
+
+// The last engine_play() ended because the file could not be decoded
+int engine_failed() {
+    if (!active) return 0;
+    pthread_mutex_lock(&lock);
+    int failed = failed_gen == request_gen;
+    pthread_mutex_unlock(&lock);
+    return failed;
+}
+
+void engine_shutdown() {
+    if (!running) return;
+
+    engine_stop();
+    pthread_mutex_lock(&lock);
+    quit = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(decoder, NULL);
+    running = 0;
+
+    release(&queued);
+    free(request_path);
+    free(crossing_path);
+    free(failed_path);
+    request_path = crossing_path = failed_path = NULL;
+    free(ring);
+    free(block);
+    ring = block = NULL;
+}
+
+void engine_stats(unsigned long* play_count, unsigned long* underrun_count, double* missing_ms,
+                  unsigned long* gapless_count, unsigned long* bypass_count, int* ring_ms) {
+    if (play_count) *play_count = plays;
+    if (bypass_count) *bypass_count = bypassed;
+    if (underrun_count) *underrun_count = __atomic_load_n(&underruns, __ATOMIC_RELAXED);
+    if (missing_ms) {
+        *missing_ms = (double)__atomic_load_n(&missing_bytes, __ATOMIC_RELAXED) * 1000 / bytes_per_second;
+    }
+    if (gapless_count) *gapless_count = __atomic_load_n(&gapless, __ATOMIC_RELAXED);
+    if (ring_ms) *ring_ms = buffer_ms;
+}
@@ -0,0 +1,383 @@
+#include "cMusix.h"
+
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#endif
+
+// Event-driven main loop.
+//
+// Everything the player reacts to is a file descriptor watched by poll():
+// stdin, signals, the progress timer and the end of a track. The timer runs
+// only while a track is playing, at the rate the progress line (or the
+// spectrum panel, when shown) can visibly change, and a tick only redraws
+// if it actually did. When nothing is playing and no key is pressed the
+// process sleeps in poll() indefinitely. On Linux resizes arrive through a
+// signalfd, the progress tick through a timerfd and track ends through an
+// eventfd. Elsewhere a self-pipe carries the signal and track-end
+// notifications and the progress tick becomes the poll() timeout.
+//
+// SIGTERM, SIGINT and SIGHUP arrive the same way and quit through cleanup();
+// SIGUSR1 writes out the timing probes. Headless there is no stdin and
+// nothing is drawn; the timer only runs while a control client subscribes
+// to the position. One deferred call (event_after()) shortens the poll()
+// timeout while it is due.
+
+#define MAX_WATCHES 128
+
+typedef struct {
+    int fd;
+    short events;       // POLLIN, plus POLLOUT while a handler has output queued
+    EventHandler handler;
+    void* data;
+} Watch;
+
+static Watch watches[MAX_WATCHES];
+static int watch_count = 0;
+static int redraw_pending = 1;
+static int timer_armed = 0;
+static int timer_interval = 0;
+static void (*after_call)() = NULL;
+static uint64_t after_at = 0;
+
+#ifdef __linux__
+static int signal_fd = -1;
+static int timer_fd = -1;
+static int finished_fd = -1;
+#else
+static int wake_pipe[2] = { -1, -1 };
+static struct timespec next_tick;
+#endif
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int event_watch(int fd, EventHandler handler, void* data) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].fd == fd) {
+            watches[i].handler = handler;
+            watches[i].data = data;
+            return 1;
+        }
+    }
+    if (watch_count >= MAX_WATCHES) return 0;
+
+    watches[watch_count].fd = fd;
+    watches[watch_count].events = POLLIN;
+    watches[watch_count].handler = handler;
+    watches[watch_count].data = data;
+    watch_count++;
+    return 1;
+}
+
+// Also wake the handler when fd can take more output
+void event_watch_output(int fd, int on) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].fd == fd) {
+            watches[i].events = on ? POLLIN | POLLOUT : POLLIN;
+            return;
+        }
+    }
+}
+
+void event_unwatch(int fd) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].fd == fd) {
+            watches[i] = watches[--watch_count];
+            return;
+        }
+    }
+}
+
+static int is_watched(int fd) {
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].fd == fd) return 1;
+    }
+    return 0;
+}
+
+void event_request_redraw() {
+    redraw_pending = 1;
+}
+
+// Call fn from the loop once ms have passed, in place of any call still
+// waiting
+void event_after(int ms, void (*fn)()) {
+    after_call = fn;
+    after_at = now_ns() + (uint64_t)ms * 1000000ULL;
+}
+
+static void drain(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+}
+
+static void on_resize() {
+    get_terminal_size();
+    event_request_redraw();
+}
+
+static void on_quit() {
+    cleanup();
+    exit(0);
+}
+
+static void on_dump() {
+    if (config.instrument_path[0]) instrument_dump(config.instrument_path);
+}
+
+static void on_track_finished() {
+    songFinished();
+    event_request_redraw();
+}
+
+static void on_stdin(int fd, void* data) {
+    (void)data;
+
+    // A closed terminal would otherwise wake us up forever
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) &&
+        !(pfd.revents & POLLIN)) {
+        event_unwatch(fd);
+        return;
+    }
+
+    userInput();
+    event_request_redraw();
+}
+
+#ifdef __linux__
+
+static void on_signal(int fd, void* data) {
+    (void)data;
+    struct signalfd_siginfo info;
+    int resized = 0, quit = 0, dump = 0;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGWINCH) resized = 1;
+        else if (info.ssi_signo == SIGUSR1) dump = 1;
+        else quit = 1;
+    }
+    if (dump) on_dump();
+    if (quit) on_quit();
+    if (resized) on_resize();
+}
+
+static void on_timer(int fd, void* data) {
+    (void)data;
+    drain(fd);
+    // Headless the tick only wakes the loop for control_publish()
+    if (config.headless) return;
+    // Both always run: the spectrum must analyse every tick it gets
+    int changed = spectrum_tick();
+    if (progress_changed() || changed) event_request_redraw();
+}
+
+static void on_finished(int fd, void* data) {
+    (void)data;
+    drain(fd);
+    on_track_finished();
+}
+
+#else
+
+static void wake_handler(int sig) {
+    // Only async-signal-safe work here: push a byte into the pipe
+    int saved = errno;
+    char c = sig == SIGWINCH ? 'w' : sig == SIGUSR1 ? 'u' : sig == 0 ? 'f' : 'q';
+    if (wake_pipe[1] >= 0) write(wake_pipe[1], &c, 1);
+    errno = saved;
+}
+
+static void on_wake(int fd, void* data) {
+    (void)data;
+    char buf[64];
+    ssize_t n;
+    int resized = 0, finished = 0, quit = 0, dump = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] == 'w') resized = 1;
+            if (buf[i] == 'f') finished = 1;
+            if (buf[i] == 'q') quit = 1;
+            if (buf[i] == 'u') dump = 1;
+        }
+    }
+    if (dump) on_dump();
+    if (quit) on_quit();
+    if (resized) on_resize();
+    if (finished) on_track_finished();
+}
+
+static long ms_until(const struct timespec* when) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (when->tv_sec - now.tv_sec) * 1000 + (when->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? ms : 0;
+}
+
+static void schedule_tick() {
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
+    next_tick.tv_sec += timer_interval / 1000;
+    next_tick.tv_nsec += (timer_interval % 1000) * 1000000L;
+    if (next_tick.tv_nsec >= 1000000000L) {
+        next_tick.tv_sec++;
+        next_tick.tv_nsec -= 1000000000L;
+    }
+}
+
+#endif
+
+// Must run before any other thread exists (SDL's audio thread, the scanner
+// pool) so they all inherit the blocked signals and they are only ever
+// delivered through the signalfd.
+int events_init() {
+#ifdef __linux__
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) return 0;
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    finished_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (signal_fd < 0 || timer_fd < 0 || finished_fd < 0) return 0;
+
+    event_watch(signal_fd, on_signal, NULL);
+    event_watch(timer_fd, on_timer, NULL);
+    event_watch(finished_fd, on_finished, NULL);
+#else
+    if (pipe(wake_pipe) != 0) return 0;
+    for (int i = 0; i < 2; i++) {
+        fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wake_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    event_watch(wake_pipe[0], on_wake, NULL);
+#endif
+    return 1;
+}
+
+// Called from SDL's audio thread via Mix_HookMusicFinished
+void event_notify_finished() {
+#ifdef __linux__
+    uint64_t one = 1;
+    if (finished_fd >= 0) write(finished_fd, &one, sizeof(one));
+#else
+    wake_handler(0);
+#endif
+}
+
+// Tick the progress display only while it can actually move
+void event_update_timer() {
+    int want = player.is_playing && !player.is_paused;
+    int interval = 0;
+    if (want && config.headless) {
+        // Nothing to draw: only position events need a clock, once a second
+        want = control_subscribers() > 0;
+        interval = 1000;
+    } else if (want) {
+        interval = progress_interval_ms();
+        // A visible spectrum needs its own frame rate, faster than the clock
+        if (spectrum_visible() && spectrum_interval_ms() < interval) {
+            interval = spectrum_interval_ms();
+        }
+    }
+    if (want == timer_armed && interval == timer_interval) return;
+    timer_armed = want;
+    timer_interval = interval;
+
+#ifdef __linux__
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (want) {
+        spec.it_value.tv_sec = interval / 1000;
+        spec.it_value.tv_nsec = (interval % 1000) * 1000000L;
+        spec.it_interval = spec.it_value;
+    }
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+#else
+    if (want) schedule_tick();
+#endif
+}
+
+void event_loop_run() {
+    if (!config.headless) event_watch(STDIN_FILENO, on_stdin, NULL);
+
+    struct pollfd fds[MAX_WATCHES];
+    Watch active[MAX_WATCHES];
+
+    while (1) {
+        event_update_timer();
+        control_publish();
+        if (redraw_pending && !config.headless) {
+            redraw_pending = 0;
+            createInterface();
+        }
+
+        // Handlers may add or remove watches, so dispatch from a copy
+        int count = watch_count;
+        memcpy(active, watches, count * sizeof(Watch));
+        for (int i = 0; i < count; i++) {
+            fds[i].fd = active[i].fd;
+            fds[i].events = active[i].events;
+            fds[i].revents = 0;
+        }
+
+        int timeout = -1;
+#ifndef __linux__
+        if (timer_armed) timeout = (int)ms_until(&next_tick);
+#endif
+        if (after_call) {
+            uint64_t now = now_ns();
+            int after = after_at > now ? (int)((after_at - now + 999999) / 1000000) : 0;
+            if (timeout < 0 || after < timeout) timeout = after;
+        }
+
+        int ready = poll(fds, count, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+#ifndef __linux__
+        if (timer_armed && ms_until(&next_tick) == 0) {
+            schedule_tick();
+            if (!config.headless) {
+                int changed = spectrum_tick();
+                if (progress_changed() || changed) event_request_redraw();
+            }
+        }
+#endif
+        if (after_call && now_ns() >= after_at) {
+            void (*fn)() = after_call;
+            after_call = NULL;
+            fn();
+        }
+
+        for (int i = 0; i < count && ready > 0; i++) {
+            if (!fds[i].revents) continue;
+            ready--;
+            if (!is_watched(active[i].fd)) continue;
+            active[i].handler(active[i].fd, active[i].data);
+        }
+    }
+}
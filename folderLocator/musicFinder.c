@@ -6,30 +6,8 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <ctype.h>
-
-int audio_file(const char* filename) {
-    if (!filename) return 0;
-    
-    const char* ext = strrchr(filename, '.');
-    if (!ext) return 0;
-    
-    // Convert extension to lowercase for comparison
-    char lower_ext[10];
-    int i = 0;
-    while (ext[i] && i < 9) {
-        lower_ext[i] = tolower(ext[i]);
-        i++;
-    }
-    lower_ext[i] = '\0';
-    
-    // Check for supported audio file extensions
-    return (strcmp(lower_ext, ".mp3") == 0 || 
-            strcmp(lower_ext, ".wav") == 0 || 
-            strcmp(lower_ext, ".flac") == 0 || 
-            strcmp(lower_ext, ".ogg") == 0 ||
-            strcmp(lower_ext, ".m4a") == 0 ||
-            strcmp(lower_ext, ".aac") == 0);
-}
+#include <fcntl.h>
+#include "../classify.h"
 
 void scan_for_music(const char* dir_path, int depth) {
     if (depth > 3) return; // Limit recursion depth
@@ -64,7 +42,7 @@ void scan_for_music(const char* dir_path, int depth) {
                             
                             struct stat music_stat;
                             if (stat(music_path, &music_stat) == 0 && S_ISREG(music_stat.st_mode)) {
-                                if (audio_file(music_entry->d_name)) {
+                                if (audio_file_at(AT_FDCWD, music_path) != AUDIO_NONE) {
                                     printf("  -> %s\n", music_entry->d_name);
                                     music_count++;
                                 }
@@ -77,7 +55,7 @@ void scan_for_music(const char* dir_path, int depth) {
                     // Recursively search other directories
                     scan_for_music(full_path, depth + 1);
                 }
-            } else if (S_ISREG(file_stat.st_mode) && audio_file(entry->d_name)) {
+            } else if (S_ISREG(file_stat.st_mode) && audio_file_at(AT_FDCWD, full_path) != AUDIO_NONE) {
                 // Found an audio file in current directory
                 printf("Audio file in %s: %s\n", dir_path, entry->d_name);
             }
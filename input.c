@@ -1,77 +1,157 @@
 #include "cMusix.h"
 
-// Handle keyboard input
-void userInput() {
-    fd_set fds;
-    struct timeval tv;
-    
-    FD_ZERO(&fds);
-    FD_SET(STDIN_FILENO, &fds);
-    
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    
-    // Check if input is available
-    if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) <= 0) {
+// Keyboard input.
+//
+// Every wakeup drains all the bytes the terminal has queued, so a held key
+// or a paste never lags behind the keyboard, and decodes them with a small
+// state machine: plain bytes, ESC, CSI (ESC [ parameters final) and SS3
+// (ESC O final). A sequence split across reads carries over to the next
+// read; a lone ESC is only taken as the key once nothing has followed it for
+// ESC_WAIT_MS.
+//
+// Scrolling and volume steps are applied to a pending copy as they are
+// decoded and committed once at the end of the burst, or before any other
+// command, so a burst costs one state update and, through the event loop,
+// one redraw. Each burst is stamped when read and the next frame put on
+// screen closes the measurement (input_drawn()): keystroke-to-screen latency.
+
+#define INPUT_BUFFER 256
+#define ESC_WAIT_MS 25
+#define VOLUME_STEP 0.1f
+
+// Decoded keys beyond plain bytes
+enum {
+    KEY_ESC = 256,
+    KEY_UP,
+    KEY_DOWN,
+    KEY_LEFT,
+    KEY_RIGHT,
+    KEY_HOME,
+    KEY_END,
+    KEY_PAGE_UP,
+    KEY_PAGE_DOWN,
+    KEY_DELETE
+};
+
+typedef enum { STATE_GROUND, STATE_ESC, STATE_CSI, STATE_SS3 } InputState;
+
+static InputState state = STATE_GROUND;
+static int csi_param = 0;       // first numeric parameter, modifiers ignored
+static int csi_param_done = 0;
+
+// Navigation waiting to be committed
+static int pending = 0;
+static int pending_offset;
+static float pending_volume;
+static int volume_pending = 0;
+
+static uint64_t burst_stamp = 0;   // read time of the oldest burst not yet drawn
+static unsigned long keys = 0;
+static unsigned long bursts = 0;
+static unsigned long coalesced = 0;
+static unsigned long drawn = 0;
+static double latency_total_ms = 0;
+static double latency_max_ms = 0;
+
+static void commit() {
+    if (!pending) return;
+    player.list_offset = pending_offset;
+    if (volume_pending) set_volume(pending_volume);
+    pending = 0;
+    volume_pending = 0;
+}
+
+// Navigation keys move the pending copy, clamped at every step as the keys
+// would have been one by one
+static void begin_navigation() {
+    if (pending) {
+        coalesced++;
         return;
     }
-    
-    char ch;
-    if (read(STDIN_FILENO, &ch, 1) != 1) {
+    pending = 1;
+    pending_offset = player.list_offset;
+    pending_volume = player.volume;
+}
+
+static void scroll(int rows) {
+    begin_navigation();
+    int last = search_visible_count() - list_rows();
+    if (last < 0) last = 0;
+    pending_offset += rows;
+    if (pending_offset > last) pending_offset = last;
+    if (pending_offset < 0) pending_offset = 0;
+}
+
+static void step_volume(float step) {
+    begin_navigation();
+    volume_pending = 1;
+    pending_volume += step;
+    if (pending_volume < 0.0f) pending_volume = 0.0f;
+    if (pending_volume > 1.0f) pending_volume = 1.0f;
+}
+
+static void command(int key) {
+    // The search prompt takes every key until ENTER or ESC
+    if (search_editing()) {
+        commit();
+        if (key == KEY_ESC) search_key(27);
+        else if (key < 256) search_key((char)key);
         return;
     }
-    
-    // Handle escape sequences (arrow keys, etc.)
-    if (ch == 27) {  // ESC
-        // Check if this is part of an escape sequence
-        char seq[3];
-        
-        // Set a very short timeout to check for sequence
-        tv.tv_sec = 0;
-        tv.tv_usec = 10000;  // 10ms
-        
-        FD_ZERO(&fds);
-        FD_SET(STDIN_FILENO, &fds);
-        
-        if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0) {
-            // This is an escape sequence, read and ignore it
-            if (read(STDIN_FILENO, &seq[0], 1) == 1) {
-                if (seq[0] == '[') {
-                    read(STDIN_FILENO, &seq[1], 1);
-                    // Ignore the escape sequence
-                    return;
-                }
-            }
+
+    switch (key) {
+        case 'j':
+        case 'J':
+        case KEY_DOWN:
+            scroll(1);
+            return;
+        case 'k':
+        case 'K':
+        case KEY_UP:
+            scroll(-1);
+            return;
+        case KEY_PAGE_DOWN:
+            scroll(list_rows());
+            return;
+        case KEY_PAGE_UP:
+            scroll(-list_rows());
+            return;
+        case KEY_HOME:
+            scroll(-player.tracks.count);
+            return;
+        case KEY_END:
+            scroll(player.tracks.count);
+            return;
+        case '+':
+        case '=':
+            step_volume(VOLUME_STEP);
+            return;
+        case '-':
+        case '_':
+            step_volume(-VOLUME_STEP);
             return;
-        }
-        // If no sequence follows, treat as actual ESC key press
-        // Fall through to quit
     }
-    
-    switch (ch) {
+
+    commit();
+    switch (key) {
         case ' ':
-            if (!player.is_playing && player.count > 0) {
-                playSong();
+            if (!player.is_playing) {
+                // Still scanning: plays the first track as soon as it is found
+                playlist_play_when_ready();
             } else {
                 pauseResume();
             }
             break;
         case 'n':
         case 'N':
+        case KEY_RIGHT:
             nextSong();
             break;
         case 'p':
         case 'P':
+        case KEY_LEFT:
             previousSong();
             break;
-        case '+':
-        case '=':
-            set_volume(player.volume + 0.1f);
-            break;
-        case '-':
-        case '_':
-            set_volume(player.volume - 0.1f);
-            break;
         case 's':
         case 'S':
             shuffleFunction();
@@ -85,24 +165,161 @@ void userInput() {
             cleanup();
             exit(0);
             break;
-        case 27: // ESC key (only reaches here if not part of sequence)
+        case KEY_ESC:
+            // First ESC drops a search filter
+            if (search_filtered()) {
+                search_clear();
+                break;
+            }
             cleanup();
             exit(0);
             break;
-        case 'j':
-        case 'J':
-            if (player.list_offset + DISPLAY_SONGS < player.count) {
-                player.list_offset++;
-            }
+        case '/':
+            search_begin();
             break;
-        case 'k':
-        case 'K':
-            if (player.list_offset > 0) {
-                player.list_offset--;
-            }
+        case 'v':
+        case 'V':
+            spectrum_toggle();
+            break;
+        case 'i':
+        case 'I':
+            instrument_toggle();
             break;
         default:
             // Ignore unrecognized keys instead of crashing
             break;
     }
-}
\ No newline at end of file
+}
+
+// Final byte of a CSI or SS3 sequence
+static void sequence_end(unsigned char final) {
+    int key = 0;
+    switch (final) {
+        case 'A': key = KEY_UP; break;
+        case 'B': key = KEY_DOWN; break;
+        case 'C': key = KEY_RIGHT; break;
+        case 'D': key = KEY_LEFT; break;
+        case 'H': key = KEY_HOME; break;
+        case 'F': key = KEY_END; break;
+        case '~':
+            // VT style: ESC [ n ~
+            switch (csi_param) {
+                case 1: case 7: key = KEY_HOME; break;
+                case 4: case 8: key = KEY_END; break;
+                case 3: key = KEY_DELETE; break;
+                case 5: key = KEY_PAGE_UP; break;
+                case 6: key = KEY_PAGE_DOWN; break;
+            }
+            break;
+    }
+    state = STATE_GROUND;
+    if (key) {
+        keys++;
+        command(key);
+    }
+}
+
+static void feed(unsigned char c) {
+    switch (state) {
+        case STATE_GROUND:
+            if (c == 27) {
+                state = STATE_ESC;
+            } else {
+                keys++;
+                command(c);
+            }
+            break;
+        case STATE_ESC:
+            if (c == '[') {
+                state = STATE_CSI;
+                csi_param = 0;
+                csi_param_done = 0;
+            } else if (c == 'O') {
+                state = STATE_SS3;
+                csi_param = 0;
+            } else if (c == 27) {
+                // ESC ESC: the first one was a key of its own
+                keys++;
+                command(KEY_ESC);
+            } else {
+                // Alt+key: not bound, and not worth quitting over
+                state = STATE_GROUND;
+            }
+            break;
+        case STATE_CSI:
+            if (c >= '0' && c <= '9') {
+                if (!csi_param_done && csi_param < 10000) csi_param = csi_param * 10 + (c - '0');
+            } else if (c >= 0x20 && c <= 0x3F) {
+                // ';' and the rest: modifiers and further parameters
+                csi_param_done = 1;
+            } else if (c >= 0x40 && c <= 0x7E) {
+                sequence_end(c);
+            } else {
+                // Not a sequence after all
+                state = STATE_GROUND;
+            }
+            break;
+        case STATE_SS3:
+            sequence_end(c);
+            break;
+    }
+}
+
+// Whatever the terminal has ready, waiting up to wait_ms for it
+static ssize_t read_ready(unsigned char* buf, int wait_ms) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&pfd, 1, wait_ms) <= 0 || !(pfd.revents & POLLIN)) return 0;
+    ssize_t n = read(STDIN_FILENO, buf, INPUT_BUFFER);
+    return n > 0 ? n : 0;
+}
+
+// Handle keyboard input
+void userInput() {
+    uint64_t stamp = now_ns();
+    PROBE_START(input_start);
+    unsigned long keys_before = keys;
+    unsigned char buf[INPUT_BUFFER];
+
+    while (1) {
+        // An unfinished sequence gets a moment for its remaining bytes
+        ssize_t n = read_ready(buf, 0);
+        if (n == 0 && state != STATE_GROUND) n = read_ready(buf, ESC_WAIT_MS);
+        if (n == 0) break;
+        for (ssize_t i = 0; i < n; i++) feed(buf[i]);
+    }
+
+    // Nothing followed: a lone ESC is the key, a cut-off sequence is dropped
+    if (state == STATE_ESC) {
+        keys++;
+        state = STATE_GROUND;
+        command(KEY_ESC);
+    }
+    state = STATE_GROUND;
+    commit();
+    PROBE_STOP(PROBE_INPUT, input_start);
+
+    if (keys != keys_before) {
+        bursts++;
+        if (!burst_stamp) burst_stamp = stamp;
+    }
+}
+
+// A frame reached the terminal: it shows every key read before it
+void input_drawn() {
+    if (!burst_stamp) return;
+    PROBE_STOP(PROBE_KEY_TO_SCREEN, burst_stamp);
+    double ms = (now_ns() - burst_stamp) / 1e6;
+    burst_stamp = 0;
+    drawn++;
+    latency_total_ms += ms;
+    if (ms > latency_max_ms) latency_max_ms = ms;
+}
+
+void input_stats(unsigned long* key_count, unsigned long* burst_count,
+                 unsigned long* coalesced_count, double* avg_ms, double* max_ms) {
+    if (key_count) *key_count = keys;
+    if (burst_count) *burst_count = bursts;
+    if (coalesced_count) *coalesced_count = coalesced;
+    if (avg_ms) *avg_ms = drawn ? latency_total_ms / drawn : 0;
+    if (max_ms) *max_ms = latency_max_ms;
+}
@@ -0,0 +1,192 @@
+#include "cMusix.h"
+
+// Hot-path instrumentation.
+//
+// Each probe is a count, a sum, a maximum and a histogram of fixed
+// power-of-two buckets: bucket b holds values in [2^(b-1), 2^b), in
+// microseconds for timers and in bytes for sizes. Recording is a handful of
+// relaxed atomic adds, so scanner, preload and decoder threads record
+// without locks. Percentiles are read off the histogram as the upper edge
+// of the bucket they fall in.
+//
+// The 'i' key overlays the table on the playlist, and -P FILE (or
+// "instrument = FILE" in the config) writes it out as JSON on exit and on
+// SIGUSR1.
+//
+// The PROBE_* macros in cMusix.h compile to nothing unless the build
+// defines CMUSIX_INSTRUMENT (make INSTRUMENT=0 leaves it out); this file
+// then only keeps stubs for the cold entry points.
+
+#ifdef CMUSIX_INSTRUMENT
+
+#define PROBE_BUCKETS 32
+
+typedef struct {
+    const char* name;
+    const char* unit;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[PROBE_BUCKETS];
+} ProbeData;
+
+static ProbeData probes[PROBE_COUNT] = {
+    [PROBE_TRACK_LOAD] = { "track_load", "us", 0, 0, 0, {0} },
+    [PROBE_PLAY] = { "play", "us", 0, 0, 0, {0} },
+    [PROBE_FRAME] = { "frame", "us", 0, 0, 0, {0} },
+    [PROBE_FRAME_BYTES] = { "frame_bytes", "bytes", 0, 0, 0, {0} },
+    [PROBE_INPUT] = { "input", "us", 0, 0, 0, {0} },
+    [PROBE_KEY_TO_SCREEN] = { "key_to_screen", "us", 0, 0, 0, {0} },
+    [PROBE_SCAN_DIR] = { "scan_dir", "us", 0, 0, 0, {0} },
+    [PROBE_SCAN_SNIFF] = { "scan_sniff", "us", 0, 0, 0, {0} },
+    [PROBE_SCAN_TAGS] = { "scan_tags", "us", 0, 0, 0, {0} },
+    [PROBE_SCAN_MERGE] = { "scan_merge", "us", 0, 0, 0, {0} },
+};
+
+static int overlay = 0;
+
+void instrument_value(int probe, uint64_t value) {
+    ProbeData* p = &probes[probe];
+    int bucket = 0;
+    if (value > 0) {
+        bucket = 64 - __builtin_clzll(value);
+        if (bucket >= PROBE_BUCKETS) bucket = PROBE_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&p->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&p->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&p->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void instrument_time(int probe, uint64_t start_ns) {
+    instrument_value(probe, (now_ns() - start_ns) / 1000);
+}
+
+// A consistent enough copy: the fields are read one by one while other
+// threads may still be adding
+static void snapshot(int probe, ProbeData* out) {
+    const ProbeData* p = &probes[probe];
+    out->name = p->name;
+    out->unit = p->unit;
+    out->count = __atomic_load_n(&p->count, __ATOMIC_RELAXED);
+    out->sum = __atomic_load_n(&p->sum, __ATOMIC_RELAXED);
+    out->max = __atomic_load_n(&p->max, __ATOMIC_RELAXED);
+    for (int b = 0; b < PROBE_BUCKETS; b++) {
+        out->buckets[b] = __atomic_load_n(&p->buckets[b], __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t percentile(const ProbeData* p, double fraction) {
+    uint64_t total = 0;
+    for (int b = 0; b < PROBE_BUCKETS; b++) total += p->buckets[b];
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(fraction * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < PROBE_BUCKETS; b++) {
+        seen += p->buckets[b];
+        if (seen >= rank) {
+            uint64_t upper = b == 0 ? 0 : (1ULL << b) - 1;
+            return upper < p->max ? upper : p->max;
+        }
+    }
+    return p->max;
+}
+
+void instrument_toggle() {
+    overlay = !overlay;
+}
+
+int instrument_visible() {
+    return overlay;
+}
+
+static void format_value(char* buf, size_t size, const ProbeData* p, double value) {
+    if (strcmp(p->unit, "us") != 0) {
+        snprintf(buf, size, "%.0f B", value);
+    } else if (value >= 1000) {
+        snprintf(buf, size, "%.2f ms", value / 1000);
+    } else {
+        snprintf(buf, size, "%.0f us", value);
+    }
+}
+
+// Over the playlist: one line per probe that has seen anything
+void instrument_draw(int row, int rows, int width) {
+    if (!overlay || rows < 1) return;
+
+    screen_fill(row, 1, width, " ", COLOR_BLACK, COLOR_BG_YELLOW);
+    screen_printf(row, 1, COLOR_BLACK, COLOR_BG_YELLOW, " %-14s %8s %10s %10s %10s %10s",
+                  "probe", "count", "avg", "p50", "p95", "max");
+    int line = 1;
+    for (int i = 0; i < PROBE_COUNT && line < rows; i++) {
+        ProbeData p;
+        snapshot(i, &p);
+        if (p.count == 0) continue;
+
+        char avg[24], p50[24], p95[24], max[24];
+        format_value(avg, sizeof(avg), &p, (double)p.sum / p.count);
+        format_value(p50, sizeof(p50), &p, (double)percentile(&p, 0.5));
+        format_value(p95, sizeof(p95), &p, (double)percentile(&p, 0.95));
+        format_value(max, sizeof(max), &p, (double)p.max);
+        screen_fill(row + line, 1, width, " ", COLOR_WHITE, COLOR_BG_BLUE);
+        screen_printf(row + line, 1, COLOR_WHITE, COLOR_BG_BLUE, " %-14s %8llu %10s %10s %10s %10s",
+                      p.name, (unsigned long long)p.count, avg, p50, p95, max);
+        line++;
+    }
+}
+
+static int write_probes(FILE* file, void* arg) {
+    (void)arg;
+    fprintf(file, "{\"time\":%ld,\"bucket_edges\":\"2^(b-1) to 2^b\",\"probes\":{", (long)time(NULL));
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        ProbeData p;
+        snapshot(i, &p);
+        fprintf(file, "%s\"%s\":{\"unit\":\"%s\",\"count\":%llu,\"avg\":%.2f,\"p50\":%llu,"
+                "\"p95\":%llu,\"p99\":%llu,\"max\":%llu,\"buckets\":[",
+                i ? "," : "", p.name, p.unit, (unsigned long long)p.count,
+                p.count ? (double)p.sum / p.count : 0.0,
+                (unsigned long long)percentile(&p, 0.5), (unsigned long long)percentile(&p, 0.95),
+                (unsigned long long)percentile(&p, 0.99), (unsigned long long)p.max);
+        // Trailing empty buckets are left out
+        int last = PROBE_BUCKETS - 1;
+        while (last >= 0 && p.buckets[last] == 0) last--;
+        for (int b = 0; b <= last; b++) {
+            fprintf(file, "%s%llu", b ? "," : "", (unsigned long long)p.buckets[b]);
+        }
+        fputs("]}", file);
+    }
+    fputs("}}\n", file);
+    return 1;
+}
+
+// Write every probe as JSON. Returns 0 if the file could not be written.
+int instrument_dump(const char* path) {
+    if (!path || !*path) return 0;
+    return write_file_atomic(path, write_probes, NULL);
+}
+
+#else
+
+void instrument_toggle() {
+}
+
+int instrument_visible() {
+    return 0;
+}
+
+void instrument_draw(int row, int rows, int width) {
+    (void)row;
+    (void)rows;
+    (void)width;
+}
+
+int instrument_dump(const char* path) {
+    (void)path;
+    return 0;
+}
+
+#endif
@@ -1,169 +1,267 @@
 #include "cMusix.h"
 
-void createLine(int width, char c) {
-    for (int i = 0; i < width; i++) {
-        printf("%c", c);
-    }
+void createLine(int row, int width, char c) {
+    char glyph[2] = { c, '\0' };
+    screen_fill(row, 1, width, glyph, COLOR_WHITE, COLOR_BG_BLACK);
 }
 
-void progressBar(int width, float progress) {
-    int filled = (int)(progress * width);
-    printf("[");
-    for (int i = 0; i < width - 2; i++) {
-        if (i < filled) {
-            set_color(COLOR_GREEN, COLOR_BG_BLACK);
-            printf("█");
-        } else {
-            set_color(COLOR_WHITE, COLOR_BG_BLACK);
-            printf("░");
-        }
-    }
-    reset_color();
-    printf("]");
+void progressBar(int row, int col, int width, float progress) {
+    int filled = (int)(progress * (width - 2));
+    col += screen_put(row, col, "[", COLOR_RESET, COLOR_RESET);
+    if (filled > width - 2) filled = width - 2;
+    if (filled < 0) filled = 0;
+    col += screen_fill(row, col, filled, "█", COLOR_GREEN, COLOR_BG_BLACK);
+    col += screen_fill(row, col, width - 2 - filled, "░", COLOR_WHITE, COLOR_BG_BLACK);
+    screen_put(row, col, "]", COLOR_RESET, COLOR_RESET);
 }
 
-void volumeBar(int width) {
+void volumeBar(int row, int col, int width) {
     int filled = (int)(player.volume * width);
-    printf("Vol: ");
-    for (int i = 0; i < width; i++) {
-        if (i < filled) {
-            set_color(COLOR_CYAN, COLOR_BG_BLACK);
-            printf("█");
-        } else {
-            set_color(COLOR_WHITE, COLOR_BG_BLACK);
-            printf("░");
+    col += screen_put(row, col, "Vol: ", COLOR_RESET, COLOR_RESET);
+    col += screen_fill(row, col, filled, "█", COLOR_CYAN, COLOR_BG_BLACK);
+    col += screen_fill(row, col, width - filled, "░", COLOR_WHITE, COLOR_BG_BLACK);
+    screen_printf(row, col, COLOR_RESET, COLOR_RESET, " %d%%", (int)(player.volume * 100));
+}
+
+// Fit src into max_width terminal columns and size bytes of dest, cutting
+// between whole glyphs and ending in "..." when anything was cut
+void truncate_string(char* dest, size_t size, const char* src, int max_width) {
+    if (max_width < 4) max_width = 4;
+    size_t pos = 0, cut = 0;
+    int columns = 0;
+    while (src[pos]) {
+        int len;
+        int width = utf8_columns(src + pos, &len);
+        if (width < 0 || columns + width > max_width || pos + len >= size) break;
+        columns += width;
+        pos += len;
+        // Where to cut if "..." has to follow
+        if (columns <= max_width - 3 && pos + 3 < size) cut = pos;
+    }
+    if (!src[pos]) {
+        memcpy(dest, src, pos);
+        dest[pos] = '\0';
+        return;
+    }
+    memcpy(dest, src, cut);
+    strcpy(dest + cut, "...");
+}
+
+// What the progress line showed last frame, to skip redundant redraws
+static int last_bar_cells = -1;
+static long last_elapsed = -1;
+
+static void format_time(char* buf, size_t size, double seconds) {
+    long s = seconds > 0 ? (long)seconds : 0;
+    snprintf(buf, size, "%ld:%02ld", s / 60, s % 60);
+}
+
+static float current_progress(double* elapsed, double* total) {
+    *elapsed = 0;
+    *total = 0;
+    if (!player.is_playing || player.tracks.count == 0) return 0.0f;
+
+    *elapsed = position_seconds();
+    *total = player.tracks.duration[player.current_index];
+    if (*total <= 0) return 0.0f;
+    if (*elapsed > *total) *elapsed = *total;
+    return (float)(*elapsed / *total);
+}
+
+static int progress_cells(float progress) {
+    int cells = player.terminal_width - 22;
+    return cells > 0 ? (int)(progress * cells) : 0;
+}
+
+// Would the progress line look different from the last frame?
+int progress_changed() {
+    double elapsed, total;
+    float progress = current_progress(&elapsed, &total);
+    return progress_cells(progress) != last_bar_cells || (long)elapsed != last_elapsed;
+}
+
+// How often the progress line can change: once a second for the clock, or
+// faster when one bar cell covers less than a second
+int progress_interval_ms() {
+    int interval = 1000;
+    int cells = player.terminal_width - 22;
+    if (player.tracks.count > 0 && cells > 0) {
+        double total = player.tracks.duration[player.current_index];
+        if (total > 0 && total * 1000 / cells < interval) {
+            interval = (int)(total * 1000 / cells);
         }
     }
-    reset_color();
-    printf(" %d%%", (int)(player.volume * 100));
+    return interval < 50 ? 50 : interval;
 }
 
-void truncate_string(char* dest, const char* src, int max_width) {
-    if ((int)strlen(src) <= max_width) {
-        strcpy(dest, src);
-    } else {
-        strncpy(dest, src, max_width - 3);
-        dest[max_width - 3] = '\0';
-        strcat(dest, "...");
+// Lines the spectrum panel takes, when shown and the playlist keeps a few
+static int panel_rows() {
+    if (spectrum_visible() && player.terminal_height - 15 - spectrum_rows() >= 3) {
+        return spectrum_rows();
     }
+    return 0;
+}
+
+// Lines of the playlist on screen, a page for scrolling
+int list_rows() {
+    int rows = player.terminal_height - 15 - panel_rows();
+    return rows > 1 ? rows : 1;
 }
 
 void createInterface() {
-    clear_screen();
-    hide_cursor();
-    
+    PROBE_START(frame_start);
     int width = player.terminal_width;
     int height = player.terminal_height;
+
+    screen_resize(width, height);
+    screen_clear();
+
+    // Names are truncated into a fixed buffer
+    int name_width = width - 10;
+    if (name_width > 255) name_width = 255;
     
     // Header
-    move_cursor(1, 1);
-    set_color(COLOR_BOLD, COLOR_BG_BLUE);
-    printf("  cMusix  ");
-    for (int i = 10; i < width; i++) printf(" ");
-    reset_color();
+    screen_put(1, 1, "  cMusix  ", COLOR_BOLD, COLOR_BG_BLUE);
+    screen_fill(1, 11, width - 10, " ", COLOR_BOLD, COLOR_BG_BLUE);
     
     // Current song info
-    move_cursor(3, 1);
-    if (player.count > 0) {
-        char truncated_name[256];
-        truncate_string(truncated_name, player.songs[player.current_index].name, width - 10);
+    if (player.tracks.count > 0) {
+        char display[512], truncated_name[256];
+        track_display_name(player.current_index, display, sizeof(display));
+        truncate_string(truncated_name, sizeof(truncated_name), display, name_width);
         
-        set_color(COLOR_BOLD, COLOR_BG_BLACK);
-        printf("♪ Now Playing: ");
-        set_color(COLOR_YELLOW, COLOR_BG_BLACK);
-        printf("%s", truncated_name);
-        reset_color();
+        int col = 1 + screen_put(3, 1, "♪ Now Playing: ", COLOR_BOLD, COLOR_BG_BLACK);
+        screen_put(3, col, truncated_name, COLOR_YELLOW, COLOR_BG_BLACK);
         
-        move_cursor(4, 1);
-        printf("Track %d of %d", player.current_index + 1, player.count);
+        screen_printf(4, 1, COLOR_RESET, COLOR_RESET, "Track %d of %d",
+                      player.current_index + 1, player.tracks.count);
+    } else if (scan_running()) {
+        screen_put(3, 1, "Looking for music...", COLOR_YELLOW, COLOR_BG_BLACK);
     } else {
-        set_color(COLOR_RED, COLOR_BG_BLACK);
-        printf("No songs loaded");
-        reset_color();
+        screen_put(3, 1, "No songs loaded", COLOR_RED, COLOR_BG_BLACK);
     }
     
     // Status line
-    move_cursor(6, 1);
     const char* status = "⏹ Stopped";
     if (player.is_playing) {
         status = player.is_paused ? "⏸ Paused" : "▶ Playing";
     }
-    
-    set_color(COLOR_GREEN, COLOR_BG_BLACK);
-    printf("Status: %s", status);
-    reset_color();
-    
-    // Progress bar (placeholder - SDL_mixer doesn't provide position info easily)
-    move_cursor(7, 1);
-    time_t current_time = time(NULL);
-    float fake_progress = 0.0f;
-    if (player.is_playing && !player.is_paused) {
-        fake_progress = fmod((current_time - player.song_start_time) / 30.0f, 1.0f);
+    int col = 1 + screen_printf(6, 1, COLOR_GREEN, COLOR_BG_BLACK, "Status: %s", status);
+    if (config.loudness && player.tracks.count > 0) {
+        float gain = loudness_gain(track_path(player.current_index));
+        if (gain != 1.0f) {
+            col += 2 + screen_printf(6, col + 2, COLOR_RESET, COLOR_RESET, "Level %+.1f dB",
+                                     20.0f * log10f(gain));
+        }
+    }
+    if (search_out_of_memory()) {
+        screen_put(6, col + 2, "Search unavailable: out of memory", COLOR_RED, COLOR_BG_BLACK);
     }
-    progressBar(width - 20, fake_progress);
+    
+    // Progress bar with elapsed / total time
+    double elapsed, total;
+    float progress = current_progress(&elapsed, &total);
+    progressBar(7, 1, width - 20, progress);
+    char elapsed_text[32], total_text[32];
+    format_time(elapsed_text, sizeof(elapsed_text), elapsed);
+    format_time(total_text, sizeof(total_text), total);
+    screen_printf(7, width - 18, COLOR_RESET, COLOR_RESET, "%s / %s",
+                  elapsed_text, total > 0 ? total_text : "--:--");
+    last_bar_cells = progress_cells(progress);
+    last_elapsed = (long)elapsed;
     
     // Volume bar
-    move_cursor(8, 1);
-    volumeBar(20);
+    volumeBar(8, 1, 20);
     
     // Mode indicators
-    move_cursor(8, width - 30);
+    int mode_col = width - 30;
+    if (mode_col < 1) mode_col = 1;
     if (player.shuffle) {
-        set_color(COLOR_MAGENTA, COLOR_BG_BLACK);
-        printf("SHUFFLE");
-        reset_color();
+        mode_col += screen_put(8, mode_col, "SHUFFLE", COLOR_MAGENTA, COLOR_BG_BLACK);
     }
     if (player.repeat) {
-        set_color(COLOR_CYAN, COLOR_BG_BLACK);
-        printf("REPEAT");
-        reset_color();
+        screen_put(8, mode_col, "REPEAT", COLOR_CYAN, COLOR_BG_BLACK);
+    }
+
+    // Output format and measured latency
+    if (config.latency_report) {
+        AudioLatency latency;
+        audio_latency(&latency);
+        col = 1 + screen_printf(9, 1, COLOR_RESET, COLOR_RESET, "Out: %d Hz %s %dch, %d frames = %.1f ms",
+                                latency.rate, config_format_name(latency.format), latency.channels,
+                                latency.frames, latency.buffer_ms);
+        if (latency.starts > 0) {
+            col += 1 + screen_printf(9, col + 1, COLOR_RESET, COLOR_RESET, "| start %.1f ms",
+                                     latency.start_last_ms);
+        }
+        screen_printf(9, col + 1, COLOR_RESET, COLOR_RESET, "| audio thread %.1f%% CPU",
+                      latency.cpu_percent);
     }
     
     // Separator
-    move_cursor(10, 1);
-    set_color(COLOR_WHITE, COLOR_BG_BLACK);
-    createLine(width, '-');
-    reset_color();
+    createLine(10, width, '-');
+
+    // Spectrum panel, when shown and the playlist keeps a few lines
+    int panel = panel_rows();
+    if (panel > 0) spectrum_draw(11, width);
     
-    // Playlist
-    move_cursor(11, 1);
-    set_color(COLOR_BOLD, COLOR_BG_BLACK);
-    printf("PLAYLIST:");
-    reset_color();
+    // Playlist, or the tracks matching the search
+    if (search_filtered()) {
+        screen_printf(11 + panel, 1, COLOR_BOLD, COLOR_BG_BLACK, "PLAYLIST: %d matches for \"%s\" (%.2f ms)",
+                      search_count(), search_query(), search_last_ms());
+    } else {
+        col = 1 + screen_put(11 + panel, 1, "PLAYLIST:", COLOR_BOLD, COLOR_BG_BLACK);
+        // Progress of the startup scan while tracks are still coming in
+        if (scan_running()) {
+            long dirs;
+            scan_progress(&dirs, NULL);
+            screen_printf(11 + panel, col + 1, COLOR_YELLOW, COLOR_BG_BLACK,
+                          "scanning... %d tracks in %ld folders so far", player.tracks.count, dirs);
+        }
+    }
     
-    int list_height = height - 15;
-    int start_row = 12;
+    int list_height = height - 15 - panel;
+    int start_row = 12 + panel;
+    int rows = search_visible_count();
     
-    for (int i = 0; i < list_height && i < player.count; i++) {
-        int song_index = player.list_offset + i;
-        if (song_index >= player.count) break;
+    for (int i = 0; i < list_height && i < rows; i++) {
+        int row = player.list_offset + i;
+        if (row >= rows) break;
+        int song_index = search_row_track(row);
         
-        move_cursor(start_row + i, 1);
-        
-        char truncated_name[256];
-        truncate_string(truncated_name, player.songs[song_index].name, width - 10);
+        char display[512], truncated_name[256];
+        track_display_name(song_index, display, sizeof(display));
+        truncate_string(truncated_name, sizeof(truncated_name), display, name_width);
         
         // Highlight current song
         if (song_index == player.current_index) {
-            set_color(COLOR_BLACK, COLOR_BG_GREEN);
-            printf("▶ %3d. %s", song_index + 1, truncated_name);
-            for (int j = (int)strlen(truncated_name) + 7; j < width; j++) printf(" ");
-            reset_color();
+            int col = 1 + screen_printf(start_row + i, 1, COLOR_BLACK, COLOR_BG_GREEN,
+                                        "▶ %3d. %s", song_index + 1, truncated_name);
+            screen_fill(start_row + i, col, width, " ", COLOR_BLACK, COLOR_BG_GREEN);
         } else {
-            printf("  %3d. %s", song_index + 1, truncated_name);
+            screen_printf(start_row + i, 1, COLOR_RESET, COLOR_RESET,
+                          "  %3d. %s", song_index + 1, truncated_name);
         }
     }
     
+    // Probe table over the playlist, when toggled
+    instrument_draw(start_row, list_height, width);
+
     // Controls help
-    move_cursor(height - 3, 1);
-    set_color(COLOR_WHITE, COLOR_BG_BLACK);
-    createLine(width, '-');
-    reset_color();
+    createLine(height - 3, width, '-');
     
-    move_cursor(height - 2, 1);
-    set_color(COLOR_CYAN, COLOR_BG_BLACK);
-    printf("CONTROLS: [SPACE]Play/Pause [n]Next [p]Previous [+/-]Volume [s]Shuffle [r]Repeat [q]Quit");
-    reset_color();
+    if (search_editing()) {
+        int col = 1 + screen_printf(height - 2, 1, COLOR_YELLOW, COLOR_BG_BLACK, "/%s", search_query());
+        screen_put(height - 2, col, "_", COLOR_YELLOW, COLOR_BG_BLACK);
+        screen_put(height - 2, col + 2, "[ENTER]Play matches [ESC]Cancel", COLOR_CYAN, COLOR_BG_BLACK);
+    } else {
+        screen_put(height - 2, 1,
+                   "CONTROLS: [SPACE]Play/Pause [n]Next [p]Previous [+/-]Volume [s]Shuffle [r]Repeat [/]Search [v]Spectrum [q]Quit",
+                   COLOR_CYAN, COLOR_BG_BLACK);
+    }
     
-    fflush(stdout);
-}
\ No newline at end of file
+    size_t bytes = screen_flush();
+    PROBE_VALUE(PROBE_FRAME_BYTES, bytes);
+    PROBE_STOP(PROBE_FRAME, frame_start);
+    input_drawn();
+}
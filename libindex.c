@@ -0,0 +1,349 @@
+#include "cMusix.h"
+
+// On-disk library index.
+//
+// The index is a flat file of directory records, one per scanned directory,
+// keyed by absolute path and stamped with the directory's mtime. A directory's
+// mtime only changes when entries are added, removed or renamed inside it, so
+// on a warm start we can skip readdir()/stat() and content sniffing for every
+// directory whose mtime still matches and take its entries straight from the
+// memory-mapped index. Files rewritten in place leave the mtime alone, so
+// when the live updates read a file's tags again, index_invalidate() marks
+// its directory's record stale in the saved index.
+
+#define INDEX_MAGIC "CMXIDX1"
+#define INDEX_VERSION 4
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t dir_count;
+} IndexHeader;
+
+// Record layout: IndexDir, path bytes + NUL, entries, padding to 8 bytes.
+// Entries are stored sorted by name, the order the scanner merges them in,
+// so a warm start yields the same playlist as a cold one. Each entry is a
+// type byte ('f' audio file, 'd' directory) followed by the NUL-terminated
+// name. Audio files carry INDEX_FILE_FIELDS - 1 more NUL-terminated fields
+// after the name: title, artist, album, track number and duration in
+// milliseconds. Records written without reading tags (-T) leave them empty
+// and lack INDEX_TAGGED, so a later run that wants tags rescans them.
+struct IndexDir {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t record_size;
+    uint32_t path_len;
+    uint32_t entry_count;
+    uint32_t entries_len;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+// Previous index, mapped read-only. index_lookup() is called from scanner
+// worker threads; everything else runs on the main thread.
+static char* map_data = NULL;
+static size_t map_size = 0;
+static const IndexDir** table = NULL;
+static size_t table_mask = 0;
+
+// Index being built for this run
+static char* out_data = NULL;
+static size_t out_len = 0;
+static size_t out_cap = 0;
+static uint32_t out_dirs = 0;
+
+static char index_path[MAX_PATH_LENGTH];
+
+static int index_hits = 0;
+static int index_misses = 0;
+
+static const char* record_path(const IndexDir* dir) {
+    return (const char*)(dir + 1);
+}
+
+const char* index_entries(const IndexDir* dir) {
+    return record_path(dir) + dir->path_len + 1;
+}
+
+int index_entry_count(const IndexDir* dir) {
+    return (int)dir->entry_count;
+}
+
+// Step over one entry: type byte, name and, for files, the tag fields
+const char* index_next_entry(const char* entry) {
+    int fields = *entry == 'f' ? INDEX_FILE_FIELDS : 1;
+    const char* p = entry + 1;
+    for (int i = 0; i < fields; i++) p += strlen(p) + 1;
+    return p;
+}
+
+// Cache file for a library root:
+// $XDG_CACHE_HOME/cmusix/library-<hash>.<ext> (or ~/.cache/cmusix/...)
+int index_cache_path(const char* root, const char* ext, char* path, size_t size) {
+    char dir[MAX_PATH_LENGTH];
+    const char* cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int ret;
+
+    if (cache && cache[0]) {
+        mkdir(cache, 0755);
+        ret = snprintf(dir, sizeof(dir), "%s/cmusix", cache);
+    } else if (home && home[0]) {
+        ret = snprintf(dir, sizeof(dir), "%s/.cache", home);
+        if (ret < (int)sizeof(dir)) mkdir(dir, 0755);
+        ret = snprintf(dir, sizeof(dir), "%s/.cache/cmusix", home);
+    } else {
+        return 0;
+    }
+    if (ret >= (int)sizeof(dir)) return 0;
+    mkdir(dir, 0755);
+
+    ret = snprintf(path, size, "%s/library-%016llx.%s",
+                   dir, (unsigned long long)hash_bytes(root, strlen(root)), ext);
+    return ret < (int)size;
+}
+
+static void map_index() {
+    int fd = open(index_path, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(IndexHeader)) {
+        close(fd);
+        return;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return;
+
+    map_data = data;
+    map_size = (size_t)st.st_size;
+
+    const IndexHeader* header = (const IndexHeader*)map_data;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != INDEX_VERSION) {
+        munmap(map_data, map_size);
+        map_data = NULL;
+        map_size = 0;
+        return;
+    }
+
+    // Open-addressed hash table of record pointers
+    size_t slots = 16;
+    while (slots < (size_t)header->dir_count * 2) slots <<= 1;
+    table = calloc(slots, sizeof(*table));
+    if (!table) return;
+    table_mask = slots - 1;
+
+    size_t pos = sizeof(IndexHeader);
+    for (uint32_t i = 0; i < header->dir_count; i++) {
+        if (pos + sizeof(IndexDir) > map_size) break;
+        const IndexDir* dir = (const IndexDir*)(map_data + pos);
+        if (dir->record_size < sizeof(IndexDir) ||
+            pos + dir->record_size > map_size ||
+            sizeof(IndexDir) + dir->path_len + 1 + dir->entries_len > dir->record_size) {
+            break; // truncated or corrupt, keep what we have
+        }
+
+        size_t slot = hash_bytes(record_path(dir), dir->path_len) & table_mask;
+        while (table[slot]) slot = (slot + 1) & table_mask;
+        table[slot] = dir;
+        pos += dir->record_size;
+    }
+}
+
+int index_open(const char* root) {
+    index_close();
+    index_hits = 0;
+    index_misses = 0;
+
+    if (!index_cache_path(root, "idx", index_path, sizeof(index_path))) return 0;
+    map_index();
+
+    out_cap = 64 * 1024;
+    out_data = malloc(out_cap);
+    if (!out_data) return 0;
+    out_len = sizeof(IndexHeader);
+    out_dirs = 0;
+    return 1;
+}
+
+const IndexDir* index_lookup(const char* dir_path, const struct stat* st, uint32_t flags) {
+    if (!table) {
+        __atomic_fetch_add(&index_misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    size_t len = strlen(dir_path);
+    size_t slot = hash_bytes(dir_path, len) & table_mask;
+    while (table[slot]) {
+        const IndexDir* dir = table[slot];
+        if (dir->path_len == len && memcmp(record_path(dir), dir_path, len) == 0) {
+            if (dir->mtime_sec == (int64_t)st->st_mtime &&
+                dir->mtime_nsec == (int64_t)ST_MTIME_NSEC(st) &&
+                (dir->flags & flags) == flags) {
+                __atomic_fetch_add(&index_hits, 1, __ATOMIC_RELAXED);
+                return dir;
+            }
+            break;
+        }
+        slot = (slot + 1) & table_mask;
+    }
+
+    __atomic_fetch_add(&index_misses, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static char* reserve(size_t len) {
+    if (!out_data) return NULL;
+    if (out_len + len > out_cap) {
+        size_t cap = out_cap;
+        while (out_len + len > cap) cap *= 2;
+        char* grown = realloc(out_data, cap);
+        if (!grown) return NULL;
+        out_data = grown;
+        out_cap = cap;
+    }
+    char* p = out_data + out_len;
+    out_len += len;
+    return p;
+}
+
+void index_store(const char* dir_path, const struct stat* st, uint32_t flags,
+                 const char* entries, size_t entries_len, int entry_count) {
+    size_t path_len = strlen(dir_path);
+    size_t size = sizeof(IndexDir) + path_len + 1 + entries_len;
+    size = (size + 7) & ~(size_t)7;
+
+    char* p = reserve(size);
+    if (!p) return;
+    memset(p, 0, size);
+
+    IndexDir* dir = (IndexDir*)p;
+    dir->mtime_sec = (int64_t)st->st_mtime;
+    dir->mtime_nsec = (int64_t)ST_MTIME_NSEC(st);
+    dir->record_size = (uint32_t)size;
+    dir->path_len = (uint32_t)path_len;
+    dir->entry_count = (uint32_t)entry_count;
+    dir->entries_len = (uint32_t)entries_len;
+    dir->flags = flags;
+
+    memcpy(p + sizeof(IndexDir), dir_path, path_len + 1);
+    memcpy(p + sizeof(IndexDir) + path_len + 1, entries, entries_len);
+    out_dirs++;
+}
+
+void index_keep(const IndexDir* dir) {
+    char* p = reserve(dir->record_size);
+    if (!p) return;
+    memcpy(p, dir, dir->record_size);
+    out_dirs++;
+}
+
+// Replace path with what fill() writes, through a temp file that is synced
+// and renamed over it, so a crash leaves either the old file or the new one,
+// never a torn one. fill() returns 0 if it failed. Returns 0 with errno set
+// if the file could not be written.
+int write_file_atomic(const char* path, int (*fill)(FILE* file, void* arg), void* arg) {
+    char tmp_path[MAX_PATH_LENGTH + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* file = fopen(tmp_path, "wb");
+    if (!file) return 0;
+
+    int ok = fill(file, arg) && fflush(file) == 0 && !ferror(file) && fsync(fileno(file)) == 0;
+    int saved = errno;
+    if (fclose(file) != 0 && ok) {
+        ok = 0;
+        saved = errno;
+    }
+    if (ok && rename(tmp_path, path) == 0) return 1;
+    if (ok) saved = errno;
+    unlink(tmp_path);
+    errno = saved;
+    return 0;
+}
+
+static int write_index(FILE* file, void* arg) {
+    (void)arg;
+    return fwrite(out_data, 1, out_len, file) == out_len;
+}
+
+int index_save() {
+    if (!out_data || index_path[0] == '\0') return 0;
+
+    IndexHeader* header = (IndexHeader*)out_data;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->version = INDEX_VERSION;
+    header->dir_count = out_dirs;
+
+    return write_file_atomic(index_path, write_index, NULL);
+}
+
+// Mark dir_path's record in root's saved index as stale, so the next start
+// reads the directory again. Patched in place: called for the odd file
+// rewritten after the scan, not worth writing the whole index for.
+int index_invalidate(const char* root, const char* dir_path) {
+    char path[MAX_PATH_LENGTH];
+    if (!index_cache_path(root, "idx", path, sizeof(path))) return 0;
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(IndexHeader)) {
+        close(fd);
+        return 0;
+    }
+    char* data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+
+    size_t size = (size_t)st.st_size;
+    const IndexHeader* header = (const IndexHeader*)data;
+    size_t len = strlen(dir_path);
+    int found = 0;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == INDEX_VERSION) {
+        size_t pos = sizeof(IndexHeader);
+        for (uint32_t i = 0; i < header->dir_count && pos + sizeof(IndexDir) <= size; i++) {
+            IndexDir* dir = (IndexDir*)(data + pos);
+            if (dir->record_size < sizeof(IndexDir) || pos + dir->record_size > size ||
+                sizeof(IndexDir) + dir->path_len + 1 > dir->record_size) {
+                break;
+            }
+            if (dir->path_len == len && memcmp(record_path(dir), dir_path, len) == 0) {
+                // No directory has this mtime, so the lookup misses
+                dir->mtime_sec = -1;
+                dir->mtime_nsec = -1;
+                found = 1;
+                break;
+            }
+            pos += dir->record_size;
+        }
+    }
+    munmap(data, size);
+    return found;
+}
+
+void index_close() {
+    if (map_data) {
+        munmap(map_data, map_size);
+        map_data = NULL;
+        map_size = 0;
+    }
+    free(table);
+    table = NULL;
+    table_mask = 0;
+
+    free(out_data);
+    out_data = NULL;
+    out_len = 0;
+    out_cap = 0;
+    out_dirs = 0;
+}
+
+void index_stats(int* hits, int* misses) {
+    if (hits) *hits = index_hits;
+    if (misses) *misses = index_misses;
+}
@@ -0,0 +1,435 @@
+#include "cMusix.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Loudness levelling.
+//
+// Worker threads decode every track once, measure its integrated loudness
+// (ITU-R BS.1770 / EBU R128: K-weighting, 400 ms blocks every 100 ms, an
+// absolute gate at -70 LUFS and a relative one 10 LU below) and its sample
+// peak, and keep the result in library-<hash>.gain next to the library index
+// (a StampCache, see stampcache.c), so later runs only analyse new or changed
+// files. The workers run at idle priority and never compete with the decoder
+// or the audio thread for a core.
+//
+// The meter takes PCM a block at a time and keeps only 8 bytes per 100 ms.
+// WAV and AIFF are read through pcmstream.c at their own rate. Compressed
+// files can only be decoded whole, with Mix_LoadWAV() in the device format:
+// their decoded size is capped, at most LOUDNESS_DECODES run at once, and a
+// result is dropped if the device was reopened meanwhile.
+//
+// The gain brings a track to LOUDNESS_TARGET, as far as its peak allows
+// without clipping. The engine applies it while copying PCM into its ring;
+// Mix_Music can only attenuate, so that path clamps it at unity.
+
+#define GAIN_MAGIC "CMXGAIN"
+#define GAIN_VERSION 2
+#define LOUDNESS_MAX_DECODED (128u << 20)  // PCM bytes, bigger tracks are not decoded whole
+#define LOUDNESS_DECODES 2                 // whole-file decodes at once
+#define LOUDNESS_BLOCK (64u << 10)         // PCM bytes read at a time from WAV and AIFF
+#define LOUDNESS_MAX_GAIN 3.98f       // +12 dB, quiet tracks are not pushed further
+#define MAX_CHANNELS 8
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Value kept per file in the StampCache
+typedef struct {
+    float lufs;         // LOUDNESS_UNKNOWN if the file could not be measured
+    float peak;
+} Gain;
+
+typedef struct {
+    double b0, b1, b2, a1, a2;
+    double z1, z2;
+} Biquad;
+
+// Integrated loudness, measured as PCM comes in
+typedef struct {
+    Uint16 fmt;
+    int chans;
+    size_t sample_bytes;
+    double weight[MAX_CHANNELS];
+    Biquad shelf[MAX_CHANNELS];
+    Biquad highpass[MAX_CHANNELS];
+    size_t step;                // frames per 100 ms step, a quarter block
+    size_t filled;              // frames in the current step
+    double sum[MAX_CHANNELS];
+    double* energy;             // weighted mean square per step
+    size_t steps;
+    size_t cap;
+    double peak;
+    int failed;
+} Meter;
+
+static void analyse(const char* path, int phase);
+
+static StampCache cache = {
+    .magic = GAIN_MAGIC,
+    .version = GAIN_VERSION,
+    .value_size = sizeof(Gain),
+    .job = analyse,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned long analysed = 0;  // under cache.lock
+static unsigned long cached = 0;
+
+// Whole-file decodes running
+static pthread_mutex_t decode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decode_cond = PTHREAD_COND_INITIALIZER;
+static int decodes = 0;
+
+static void k_weighting(Biquad* shelf, Biquad* highpass, int sample_rate) {
+    double f0 = 1681.974450955533;
+    double gain_db = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / sample_rate);
+    double vh = pow(10.0, gain_db / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    memset(shelf, 0, sizeof(*shelf));
+    shelf->b0 = (vh + vb * k / q + k * k) / a0;
+    shelf->b1 = 2.0 * (k * k - vh) / a0;
+    shelf->b2 = (vh - vb * k / q + k * k) / a0;
+    shelf->a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf->a2 = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / sample_rate);
+    a0 = 1.0 + k / q + k * k;
+    memset(highpass, 0, sizeof(*highpass));
+    highpass->b0 = 1.0;
+    highpass->b1 = -2.0;
+    highpass->b2 = 1.0;
+    highpass->a1 = 2.0 * (k * k - 1.0) / a0;
+    highpass->a2 = (1.0 - k / q + k * k) / a0;
+}
+
+static inline double biquad(Biquad* f, double x) {
+    double y = f->b0 * x + f->z1;
+    f->z1 = f->b1 * x - f->a1 * y + f->z2;
+    f->z2 = f->b2 * x - f->a2 * y;
+    return y;
+}
+
+static inline double sample_at(const Uint8* p, Uint16 fmt) {
+    switch (fmt) {
+        case AUDIO_S16SYS: { int16_t v; memcpy(&v, p, 2); return v / 32768.0; }
+        case AUDIO_S32SYS: { int32_t v; memcpy(&v, p, 4); return v / 2147483648.0; }
+        case AUDIO_F32SYS: { float v; memcpy(&v, p, 4); return v; }
+        default: return (p[0] - 128) / 128.0; // AUDIO_U8
+    }
+}
+
+// Start measuring PCM in fmt. Returns 0 for a format we do not read.
+static int meter_init(Meter* m, Uint16 fmt, int chans, int sample_rate) {
+    memset(m, 0, sizeof(*m));
+    if (fmt != AUDIO_S16SYS && fmt != AUDIO_S32SYS && fmt != AUDIO_F32SYS && fmt != AUDIO_U8) {
+        return 0;
+    }
+    if (chans < 1 || chans > MAX_CHANNELS || sample_rate < 10) return 0;
+
+    m->fmt = fmt;
+    m->chans = chans;
+    m->sample_bytes = SDL_AUDIO_BITSIZE(fmt) / 8;
+    m->step = (size_t)sample_rate / 10;
+
+    // Channel weights: LFE does not count, surrounds count 1.41
+    for (int c = 0; c < chans; c++) m->weight[c] = 1.0;
+    if (chans == 4) m->weight[2] = m->weight[3] = 1.41;
+    if (chans == 6) {
+        m->weight[3] = 0.0;
+        m->weight[4] = m->weight[5] = 1.41;
+    }
+    for (int c = 0; c < chans; c++) k_weighting(&m->shelf[c], &m->highpass[c], sample_rate);
+    return 1;
+}
+
+// Measure len bytes of interleaved PCM, whole frames
+static void meter_feed(Meter* m, const Uint8* pcm, size_t len) {
+    size_t frames = len / (m->sample_bytes * m->chans);
+    const Uint8* p = pcm;
+    for (size_t i = 0; i < frames && !m->failed; i++) {
+        for (int c = 0; c < m->chans; c++) {
+            double x = sample_at(p, m->fmt);
+            p += m->sample_bytes;
+            if (fabs(x) > m->peak) m->peak = fabs(x);
+            double y = biquad(&m->highpass[c], biquad(&m->shelf[c], x));
+            m->sum[c] += y * y;
+        }
+        if (++m->filled < m->step) continue;
+
+        if (m->steps == m->cap) {
+            size_t cap = m->cap ? m->cap * 2 : 1024;
+            double* grown = realloc(m->energy, cap * sizeof(*grown));
+            if (!grown) {
+                m->failed = 1;
+                break;
+            }
+            m->energy = grown;
+            m->cap = cap;
+        }
+        double z = 0;
+        for (int c = 0; c < m->chans; c++) {
+            z += m->weight[c] * m->sum[c];
+            m->sum[c] = 0;
+        }
+        m->energy[m->steps++] = z / m->step;
+        m->filled = 0;
+    }
+}
+
+// Integrated loudness in LUFS, LOUDNESS_UNKNOWN if what was fed is shorter
+// than one block or silent
+static double meter_finish(Meter* m, float* peak) {
+    double* energy = m->energy;
+    size_t steps = m->failed ? 0 : m->steps;
+    if (peak) *peak = (float)m->peak;
+
+    // 400 ms blocks overlapping by 75%, gated twice
+    double lufs = LOUDNESS_UNKNOWN;
+    if (steps >= 4) {
+        size_t blocks = steps - 3;
+        double absolute = pow(10.0, (-70.0 + 0.691) / 10.0);
+        double total = 0;
+        size_t count = 0;
+        for (size_t b = 0; b < blocks; b++) {
+            double z = (energy[b] + energy[b + 1] + energy[b + 2] + energy[b + 3]) / 4;
+            if (z > absolute) {
+                total += z;
+                count++;
+            }
+        }
+        if (count > 0) {
+            double relative = total / count / 10.0;  // -10 LU
+            total = 0;
+            count = 0;
+            for (size_t b = 0; b < blocks; b++) {
+                double z = (energy[b] + energy[b + 1] + energy[b + 2] + energy[b + 3]) / 4;
+                if (z > absolute && z > relative) {
+                    total += z;
+                    count++;
+                }
+            }
+            if (count > 0) lufs = -0.691 + 10.0 * log10(total / count);
+        }
+    }
+    free(energy);
+    m->energy = NULL;
+    return lufs;
+}
+
+// Integrated loudness of interleaved PCM in LUFS, LOUDNESS_UNKNOWN if it is
+// shorter than one block, silent or in a format we do not read
+double loudness_measure(const Uint8* pcm, size_t len, Uint16 fmt, int chans, int sample_rate,
+                        float* peak) {
+    Meter m;
+    if (!meter_init(&m, fmt, chans, sample_rate)) {
+        if (peak) *peak = 0;
+        return LOUDNESS_UNKNOWN;
+    }
+    meter_feed(&m, pcm, len);
+    return meter_finish(&m, peak);
+}
+
+static void gain_s16(int16_t* s, size_t count, float gain) {
+    // Q12, so up to +18 dB
+    long q = lrintf(gain * 4096.0f);
+    if (q > 32767) q = 32767;
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i g = _mm_set1_epi16((short)q);
+    __m128i round = _mm_set1_epi32(1 << 11);
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i lo = _mm_mullo_epi16(x, g);
+        __m128i hi = _mm_mulhi_epi16(x, g);
+        __m128i a = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 12);
+        __m128i b = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 12);
+        _mm_storeu_si128((__m128i*)(s + i), _mm_packs_epi32(a, b));
+    }
+#endif
+    for (; i < count; i++) {
+        int32_t v = (s[i] * (int32_t)q + (1 << 11)) >> 12;
+        s[i] = (int16_t)(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+    }
+}
+
+static void gain_f32(float* s, size_t count, float gain) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(s + i, _mm_mul_ps(_mm_loadu_ps(s + i), g));
+    }
+#endif
+    for (; i < count; i++) s[i] *= gain;
+}
+
+static void gain_s32(int32_t* s, size_t count, float gain) {
+    int64_t q = llrintf(gain * 65536.0f);
+    for (size_t i = 0; i < count; i++) {
+        int64_t v = ((int64_t)s[i] * q) >> 16;
+        s[i] = (int32_t)(v > INT32_MAX ? INT32_MAX : v < INT32_MIN ? INT32_MIN : v);
+    }
+}
+
+// Scale PCM in place; formats other than native 16/32-bit and float pass as is
+void loudness_apply(Uint8* pcm, size_t len, Uint16 fmt, float gain) {
+    if (gain == 1.0f) return;
+    switch (fmt) {
+        case AUDIO_S16SYS: gain_s16((int16_t*)pcm, len / 2, gain); break;
+        case AUDIO_S32SYS: gain_s32((int32_t*)pcm, len / 4, gain); break;
+        case AUDIO_F32SYS: gain_f32((float*)pcm, len / 4, gain); break;
+        default: break;
+    }
+}
+
+// WAV and AIFF, a block at a time at the file's own rate. Returns 0 if
+// pcm_open() will not take the file.
+static int measure_stream(const char* path, double* lufs, float* peak) {
+    PcmStream* pcm = pcm_open(path, AUDIO_F32SYS, 0, 0);
+    if (!pcm) return 0;
+    Uint8* block = malloc(LOUDNESS_BLOCK);
+    Meter m;
+    if (block && meter_init(&m, AUDIO_F32SYS, pcm->channels, pcm->rate)) {
+        int len = (int)(LOUDNESS_BLOCK - LOUDNESS_BLOCK % (pcm->channels * 4));
+        int got;
+        while ((got = pcm_read(pcm, block, len)) > 0) meter_feed(&m, block, (size_t)got);
+        *lufs = meter_finish(&m, peak);
+    }
+    free(block);
+    pcm_close(pcm);
+    return 1;
+}
+
+// Anything else through Mix_LoadWAV(), whole, in the device format. Returns
+// 0 if the device changed meanwhile: the chunk's format is not known.
+static int measure_decoded(const char* path, off_t size, double* lufs, float* peak) {
+    int rate, channels;
+    Uint16 format;
+    unsigned long generation;
+    if (!audio_device_spec(&rate, &format, &channels, &generation)) return 0;
+
+    double decoded = 0;
+    MediaInfo info;
+    if (media_probe(path, &info) && info.duration > 0) {
+        decoded = info.duration * rate * channels * (SDL_AUDIO_BITSIZE(format) / 8);
+    } else {
+        // No duration: assume the file is compressed about 1:16
+        decoded = (double)size * 16;
+    }
+    // Stored as unknown, so not tried again until the file changes
+    if (decoded > LOUDNESS_MAX_DECODED) return 1;
+
+    pthread_mutex_lock(&decode_lock);
+    while (decodes >= LOUDNESS_DECODES) pthread_cond_wait(&decode_cond, &decode_lock);
+    decodes++;
+    pthread_mutex_unlock(&decode_lock);
+
+    Mix_Chunk* chunk = Mix_LoadWAV(path);
+    int same = audio_device_generation() == generation;
+    if (chunk && same) {
+        Meter m;
+        if (meter_init(&m, format, channels, rate)) {
+            meter_feed(&m, chunk->abuf, chunk->alen);
+            *lufs = meter_finish(&m, peak);
+        }
+    }
+    if (chunk) Mix_FreeChunk(chunk);
+
+    pthread_mutex_lock(&decode_lock);
+    decodes--;
+    pthread_cond_signal(&decode_cond);
+    pthread_mutex_unlock(&decode_lock);
+    return same;
+}
+
+static void analyse(const char* path, int phase) {
+    (void)phase;
+    struct stat st;
+    if (stat(path, &st) != 0) return;
+
+    pthread_mutex_lock(&cache.lock);
+    if (stamp_fresh(&cache, path, &st) >= 0) {
+        cached++;
+        pthread_mutex_unlock(&cache.lock);
+        return;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    float peak = 0;
+    double lufs = LOUDNESS_UNKNOWN;
+    if (!measure_stream(path, &lufs, &peak) &&
+        !measure_decoded(path, st.st_size, &lufs, &peak)) {
+        // Left for the next pass
+        return;
+    }
+
+    // Failures are stored too, so they are not retried until the file changes
+    pthread_mutex_lock(&cache.lock);
+    int i = stamp_store(&cache, path, &st);
+    if (i >= 0) {
+        Gain* gain = stamp_value(&cache, i);
+        gain->lufs = (float)lufs;
+        gain->peak = peak;
+    }
+    analysed++;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Load the cache for a library root and start measuring its tracks
+int loudness_open(const char* root) {
+    loudness_close();
+
+    if (!Mix_QuerySpec(NULL, NULL, NULL)) return 0;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    // Leave a core to playback
+    cache.threads = cpus > 1 ? (int)cpus - 1 : 1;
+    return stamp_open(&cache, root, "gain");
+}
+
+// Queue a pass over the library, after loading it or after a live update
+void loudness_refresh() {
+    stamp_refresh(&cache);
+}
+
+// Linear gain for a track, 1 until it has been measured
+float loudness_gain(const char* path) {
+    if (!path) return 1.0f;
+
+    float lufs = LOUDNESS_UNKNOWN, peak = 0;
+    pthread_mutex_lock(&cache.lock);
+    int i = stamp_find(&cache, path);
+    if (i >= 0) {
+        const Gain* found = stamp_value(&cache, i);
+        lufs = found->lufs;
+        peak = found->peak;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (lufs == LOUDNESS_UNKNOWN) return 1.0f;
+    float gain = powf(10.0f, (LOUDNESS_TARGET - lufs) / 20.0f);
+    if (gain > LOUDNESS_MAX_GAIN) gain = LOUDNESS_MAX_GAIN;
+    if (peak > 0 && gain * peak > 1.0f) gain = 1.0f / peak;
+    return gain;
+}
+
+void loudness_close() {
+    if (!stamp_close(&cache)) warn_later("Could not write loudness cache");
+}
+
+void loudness_stats(unsigned long* analysed_count, unsigned long* cached_count, int* pending) {
+    pthread_mutex_lock(&cache.lock);
+    if (analysed_count) *analysed_count = analysed;
+    if (cached_count) *cached_count = cached;
+    pthread_mutex_unlock(&cache.lock);
+    if (pending) *pending = stamp_pending(&cache);
+}
@@ -1,28 +1,185 @@
 #include "cMusix.h"
 
 MusicPlayer player = {0};
+Config config = {0};
+
+static void usage(const char* prog) {
+    char path[MAX_PATH_LENGTH];
+    printf("Usage: %s [-j threads] [-b ms] [-r rate] [-f format] [-c channels] [-k frames]\n"
+           "          [-a tracks] [-N] [-l] [-S path] [-D] [-P file] [-L] [-T] [-W] [-u] [music folder | playlist]\n", prog);
+    printf("  -j N   Number of directory scanner threads (default: %d)\n", scan_default_threads());
+    printf("  -b MS  Playback buffer for WAV and AIFF in milliseconds, 0 for none; other\n"
+           "         formats always decode in the audio callback (default: %d)\n",
+           ENGINE_BUFFER_MS);
+    printf("  -r HZ  Output sample rate (default: %d)\n", AUDIO_DEFAULT_RATE);
+    printf("  -f FMT Output sample format: s16, s32 or f32 (default: s16)\n");
+    printf("  -c N   Output channels (default: 2)\n");
+    printf("  -k N   Frames per audio callback, a power of two; lower means less latency\n"
+           "         and more CPU (default: %d)\n", AUDIO_DEFAULT_CHUNK);
+    printf("  -a N   Tracks to read ahead in play order, 0 for none (default: %d)\n", PREFETCH_DEFAULT);
+    printf("  -N     Reopen the output at each track's own sample rate\n");
+    printf("  -l     Measure output latency, show it and report it on exit\n");
+    printf("  -S P   Control socket path, or \"off\" (default: $XDG_RUNTIME_DIR/cmusix.sock)\n");
+    printf("  -D     Run headless in the background, controlled through the socket only\n");
+    printf("  -P F   Write timing probes to F as JSON on exit and on SIGUSR1\n");
+    printf("  -L     Don't level track loudness\n");
+    printf("  -T     Don't read tags, show file names only\n");
+    printf("  -W     Don't watch the music folder for changes\n");
+    printf("  -u     Drop duplicate tracks: the same audio under other names or tags\n");
+    if (config_path(path, sizeof(path))) {
+        printf("Defaults for all of these can be set in %s\n", path);
+    }
+}
 
 void looper() {
-    while (1) {
-        get_terminal_size();
-        createInterface();
+    if (!config.headless) get_terminal_size();
+    event_loop_run();
+}
 
-        if (player.is_playing && !Mix_PlayingMusic()) {
-            if (player.repeat) {
-                playSong();
-            } else {
-                nextSong();
-            }
+// First of the usual places that exists, NULL if there is none
+static const char* default_music_dir() {
+    static const char* music_dirs[] = {
+        "./Music/",
+        "./Music",
+        "Music/",
+        "Music",
+        "~/Music/",
+        "~/Music",
+        NULL
+    };
+    for (int i = 0; music_dirs[i] != NULL; i++) {
+        struct stat dir_stat;
+        if (stat(music_dirs[i], &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode)) {
+            return music_dirs[i];
         }
+    }
+    return NULL;
+}
 
-        userInput();
-        usleep(100000); // 0.1 second delay
+// Headless: leave the terminal to the shell and carry on in the background.
+// Only the calling thread survives fork(), so this must run before SDL or the
+// scanner start theirs. The working directory stays, relative paths still work.
+static int detach() {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) return 0;
+    if (pid > 0) {
+        printf("cMusix is playing in the background (pid %ld), control socket %s\n",
+               (long)pid, control_path());
+        fflush(stdout);
+        _exit(0);
     }
+
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) close(null_fd);
+    }
+    return 1;
 }
 
 int main(int argc, char* argv[]) {
     srand(time(NULL));
 
+    // The screen measures glyphs with wcwidth(), which only knows UTF-8
+    // under a UTF-8 locale; the interface prints UTF-8 regardless
+    const char* ctype = setlocale(LC_CTYPE, "");
+    if (!ctype || (!strstr(ctype, "UTF-8") && !strstr(ctype, "utf8"))) {
+        setlocale(LC_CTYPE, "C.UTF-8");
+    }
+
+    config_defaults();
+    config_load();
+
+    // Before SDL or the scanner start any threads
+    if (!events_init()) {
+        printf("Failed to initialize event loop\n");
+        return 1;
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:b:r:f:c:k:a:NlS:DP:LTWuh")) != -1) {
+        switch (opt) {
+            case 'j':
+                config.scan_threads = atoi(optarg);
+                if (config.scan_threads < 1) config.scan_threads = 1;
+                break;
+            case 'b':
+                config.buffer_ms = atoi(optarg);
+                if (config.buffer_ms < 0) config.buffer_ms = 0;
+                break;
+            case 'r':
+                if (!config_set_rate(atoi(optarg))) {
+                    printf("Warning: Ignoring sample rate %s\n", optarg);
+                }
+                break;
+            case 'f':
+                if (!config_parse_format(optarg, &config.audio_format)) {
+                    printf("Warning: Unknown sample format %s, use s16, s32 or f32\n", optarg);
+                }
+                break;
+            case 'c':
+                if (!config_set_channels(atoi(optarg))) {
+                    printf("Warning: Ignoring channel count %s\n", optarg);
+                }
+                break;
+            case 'k':
+                if (!config_set_chunk(atoi(optarg))) {
+                    printf("Warning: Ignoring chunk size %s, it must be a power of two from 64 to %d\n",
+                           optarg, AUDIO_MAX_CHUNK);
+                }
+                break;
+            case 'a':
+                config.prefetch = atoi(optarg);
+                if (config.prefetch < 0) config.prefetch = 0;
+                break;
+            case 'N':
+                config.native_rate = 1;
+                break;
+            case 'l':
+                config.latency_report = 1;
+                break;
+            case 'S':
+                if (!config_set_socket(optarg)) {
+                    printf("Warning: Ignoring control socket path %s\n", optarg);
+                }
+                break;
+            case 'D':
+                config.headless = 1;
+                break;
+            case 'P':
+                snprintf(config.instrument_path, sizeof(config.instrument_path), "%s", optarg);
+                break;
+            case 'L':
+                config.loudness = 0;
+                break;
+            case 'T':
+                config.read_tags = 0;
+                break;
+            case 'W':
+                config.watch = 0;
+                break;
+            case 'u':
+                config.dedup = 1;
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+#ifndef CMUSIX_INSTRUMENT
+    if (config.instrument_path[0]) {
+        printf("Warning: Built without instrumentation (make INSTRUMENT=1), no probes for %s\n",
+               config.instrument_path);
+        config.instrument_path[0] = '\0';
+    }
+#endif
+
     // Initialize player
     player.volume = 0.7f;
     player.shuffle = 0;
@@ -30,73 +187,67 @@ int main(int argc, char* argv[]) {
     player.is_playing = 0;
     player.is_paused = 0;
     player.current_music = NULL;
+    player.music_index = -1;
     player.list_offset = 0;
 
+    // Use the command line argument, or try the common music directory names
+    const char* folder = optind < argc ? argv[optind] : default_music_dir();
+
+    if (config.headless) {
+        // Nothing to prompt with and nothing but the socket to take commands
+        if (!folder) {
+            printf("No Music directory found, give the music folder on the command line\n");
+            return 1;
+        }
+        if (!config.control || !control_start(config.control_path)) {
+            printf("Headless mode needs the control socket\n");
+            return 1;
+        }
+        if (!detach()) {
+            printf("Failed to start in the background\n");
+            return 1;
+        }
+    }
+
     if (!init_audio()) {
         printf("Failed to initialize audio\n");
         return 1;
     }
 
-    // Setup terminal
-    rawModeOn();
-    get_terminal_size();
-    signal(SIGWINCH, resize);
+    if (!config.headless) {
+        if (config.control && !control_start(config.control_path)) {
+            printf("Warning: Could not open the control socket, scripts cannot reach this player\n");
+        }
+
+        // Setup terminal
+        rawModeOn();
+        get_terminal_size();
+    }
 
     // Register cleanup
     atexit(cleanup);
 
-    if (argc > 1) {
-        // Use command line argument
-        load_folder(argv[1]);
+    if (folder) {
+        if (optind >= argc) printf("Found %s directory, loading...\n", folder);
+        load_folder(folder);
     } else {
-        // Try multiple common music directory names
-        const char* music_dirs[] = {
-            "./Music/",
-            "./Music",
-            "Music/",
-            "Music",
-            "~/Music/",
-            "~/Music",
-            NULL
-        };
-        
-        int found_music_dir = 0;
-        for (int i = 0; music_dirs[i] != NULL; i++) {
-            struct stat dir_stat;
-            if (stat(music_dirs[i], &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode)) {
-                printf("Found %s directory, loading...\n", music_dirs[i]);
-                load_folder(music_dirs[i]);
-                found_music_dir = 1;
-                break;
-            }
-        }
-        
-        if (!found_music_dir) {
-            // Ask for folder input
-            show_cursor();
-            printf("No Music directory found.\n");
-            printf("Enter music folder path (or press Enter for current directory): ");
-            fflush(stdout);
-            char folder_path[MAX_PATH_LENGTH];
-            if (fgets(folder_path, sizeof(folder_path), stdin)) {
-                folder_path[strcspn(folder_path, "\n")] = 0;
-                if (strlen(folder_path) == 0) {
-                    strcpy(folder_path, ".");
-                }
-                load_folder(folder_path);
+        // Ask for folder input
+        show_cursor();
+        printf("No Music directory found.\n");
+        printf("Enter music folder path (or press Enter for current directory): ");
+        fflush(stdout);
+        char folder_path[MAX_PATH_LENGTH];
+        if (fgets(folder_path, sizeof(folder_path), stdin)) {
+            folder_path[strcspn(folder_path, "\n")] = 0;
+            if (strlen(folder_path) == 0) {
+                strcpy(folder_path, ".");
             }
+            load_folder(folder_path);
         }
     }
 
-    if (player.count == 0) {
-        printf("No audio files found! Press any key to continue...\n");
-        getchar();
-    } else {
-        printf("Press any key to start cMusix...\n");
-        getchar();
-    }
-
-    // Start main loop
+    // Straight into the interface: a folder is still being scanned in the
+    // background and fills the playlist as it goes
     looper();
 
     return 0;
@@ -0,0 +1,634 @@
+#include "cMusix.h"
+
+// Container header and tag parsing.
+//
+// Tags come from ID3v2 (falling back to ID3v1) for MP3, Vorbis comments for
+// FLAC and Ogg, and the ilst atoms for MP4. Only the tag blocks are read,
+// never audio: at most TAG_BLOCK_READ bytes of a comment block, and frames
+// or atoms we don't use (cover art above all) are skipped by offset.
+//
+// Durations are read from the few bytes of header each format keeps them
+// in, never by decoding audio:
+//   WAV   data chunk size / byte rate from the fmt chunk
+//   FLAC  total samples / sample rate from STREAMINFO
+//   Ogg   granule position of the last page / rate from the first packet
+//   MP3   Xing/Info or VBRI frame count, else file size / CBR bitrate
+//   MP4   duration / timescale from the mvhd atom
+// Every parser reads a few KB through pread(); Ogg additionally reads the
+// last 64 KB to find the final page. The same headers give the sample rate,
+// except for MP4, where it stays unknown.
+
+#define HEADER_READ 4096
+#define OGG_TAIL_READ 65536
+#define TAG_BLOCK_READ 16384
+#define TAG_FRAME_READ 512
+#define MAX_TAG_FRAMES 64
+
+static int read_at(int fd, void* buf, size_t len, off_t offset) {
+    ssize_t n = pread(fd, buf, len, offset);
+    return n < 0 ? 0 : (int)n;
+}
+
+// Append a code point as UTF-8 to dest of size bytes, never splitting a
+// sequence at the end
+static void put_utf8(char* dest, size_t size, size_t* pos, uint32_t cp) {
+    char buf[4];
+    size_t len;
+    if (cp < 0x80) {
+        buf[0] = (char)cp;
+        len = 1;
+    } else if (cp < 0x800) {
+        buf[0] = (char)(0xC0 | (cp >> 6));
+        buf[1] = (char)(0x80 | (cp & 0x3F));
+        len = 2;
+    } else if (cp < 0x10000) {
+        buf[0] = (char)(0xE0 | (cp >> 12));
+        buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (cp & 0x3F));
+        len = 3;
+    } else {
+        buf[0] = (char)(0xF0 | (cp >> 18));
+        buf[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        buf[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[3] = (char)(0x80 | (cp & 0x3F));
+        len = 4;
+    }
+    if (*pos + len >= size) return;
+    memcpy(dest + *pos, buf, len);
+    *pos += len;
+    dest[*pos] = '\0';
+}
+
+// Copy a tag value into dest of size bytes unless an earlier source
+// already filled it
+static void copy_tag(char* dest, size_t size, const char* src, size_t len) {
+    if (dest[0]) return;
+    size_t pos = 0;
+    while (pos < len && src[pos] && pos + 1 < size) {
+        dest[pos] = src[pos];
+        pos++;
+    }
+    // Don't leave half a UTF-8 sequence behind
+    if (pos + 1 >= size) {
+        while (pos > 0 && ((unsigned char)dest[pos - 1] & 0xC0) == 0x80) pos--;
+        if (pos > 0 && ((unsigned char)dest[pos - 1] & 0xC0) == 0xC0) pos--;
+    }
+    dest[pos] = '\0';
+    // Trim trailing spaces (ID3v1 pads with them)
+    while (pos > 0 && dest[pos - 1] == ' ') dest[--pos] = '\0';
+}
+
+static void set_tag(char* dest, const char* src, size_t len) {
+    copy_tag(dest, TAG_LENGTH, src, len);
+}
+
+static void set_track(MediaInfo* info, const char* text, size_t len) {
+    if (info->track) return;
+    int track = 0;
+    for (size_t i = 0; i < len && text[i] >= '0' && text[i] <= '9'; i++) {
+        track = track * 10 + (text[i] - '0');
+    }
+    info->track = track;
+}
+
+// ID3v2 text frame body: encoding byte then text, into dest of size bytes.
+// Latin-1 and UTF-16 grow when converted, so size bounds every write.
+static void id3_text(char* dest, size_t size, const unsigned char* body, size_t len) {
+    if (dest[0] || len < 2) return;
+
+    int encoding = body[0];
+    const unsigned char* p = body + 1;
+    len--;
+
+    if (encoding == 3) {
+        copy_tag(dest, size, (const char*)p, len);
+        return;
+    }
+
+    size_t pos = 0;
+    dest[0] = '\0';
+    if (encoding == 0) {
+        for (size_t i = 0; i < len && p[i]; i++) put_utf8(dest, size, &pos, p[i]);
+        return;
+    }
+
+    int big_endian = encoding == 2;
+    if (encoding == 1 && len >= 2) {
+        if (p[0] == 0xFF && p[1] == 0xFE) {
+            big_endian = 0;
+            p += 2;
+            len -= 2;
+        } else if (p[0] == 0xFE && p[1] == 0xFF) {
+            big_endian = 1;
+            p += 2;
+            len -= 2;
+        }
+    }
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        uint32_t unit = big_endian ? (p[i] << 8) | p[i + 1] : (p[i + 1] << 8) | p[i];
+        if (unit == 0) break;
+        if (unit >= 0xD800 && unit < 0xDC00 && i + 3 < len) {
+            uint32_t low = big_endian ? (p[i + 2] << 8) | p[i + 3] : (p[i + 3] << 8) | p[i + 2];
+            unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+            i += 2;
+        }
+        put_utf8(dest, size, &pos, unit);
+    }
+}
+
+static void id3_frame(MediaInfo* info, const char* id, const unsigned char* body, size_t len) {
+    if (memcmp(id, "TIT2", 4) == 0 || memcmp(id, "TT2", 3) == 0) {
+        id3_text(info->title, TAG_LENGTH, body, len);
+    } else if (memcmp(id, "TPE1", 4) == 0 || memcmp(id, "TP1", 3) == 0) {
+        id3_text(info->artist, TAG_LENGTH, body, len);
+    } else if (memcmp(id, "TALB", 4) == 0 || memcmp(id, "TAL", 3) == 0) {
+        id3_text(info->album, TAG_LENGTH, body, len);
+    } else if (memcmp(id, "TRCK", 4) == 0 || memcmp(id, "TRK", 3) == 0) {
+        char text[16];
+        text[0] = '\0';
+        id3_text(text, sizeof(text), body, len);
+        set_track(info, text, strlen(text));
+    }
+}
+
+static void read_id3v2(int fd, const unsigned char* head, int head_len, MediaInfo* info) {
+    off_t tag_size = id3v2_size(head, head_len);
+    if (tag_size == 0) return;
+
+    int version = head[3];
+    int flags = head[5];
+    off_t end = tag_size - ((flags & 0x10) ? 10 : 0);
+
+    unsigned char* buf = malloc(TAG_BLOCK_READ);
+    if (!buf) return;
+    off_t buf_start = 0;
+    int buf_len = read_at(fd, buf, TAG_BLOCK_READ, 0);
+
+    off_t pos = 10;
+    if ((flags & 0x40) && buf_len >= 14) {
+        // Extended header
+        uint32_t ext = version == 4 ?
+            ((buf[10] & 0x7F) << 21) | ((buf[11] & 0x7F) << 14) | ((buf[12] & 0x7F) << 7) | (buf[13] & 0x7F) :
+            be32(buf + 10) + 4;
+        pos += ext;
+    }
+
+    int header_len = version == 2 ? 6 : 10;
+    unsigned char frame[TAG_FRAME_READ];
+    for (int frames = 0; frames < MAX_TAG_FRAMES && pos + header_len <= end; frames++) {
+        const unsigned char* h;
+        unsigned char header[10];
+        if (pos + header_len <= buf_start + buf_len) {
+            h = buf + (pos - buf_start);
+        } else {
+            if (read_at(fd, header, header_len, pos) < header_len) break;
+            h = header;
+        }
+        if (h[0] == 0) break; // padding
+
+        char id[5] = { 0 };
+        uint32_t size;
+        int frame_flags = 0;
+        if (version == 2) {
+            memcpy(id, h, 3);
+            size = ((uint32_t)h[3] << 16) | (h[4] << 8) | h[5];
+        } else {
+            memcpy(id, h, 4);
+            size = version == 4 ?
+                ((h[4] & 0x7F) << 21) | ((h[5] & 0x7F) << 14) | ((h[6] & 0x7F) << 7) | (h[7] & 0x7F) :
+                be32(h + 4);
+            frame_flags = (h[8] << 8) | h[9];
+        }
+
+        off_t body = pos + header_len;
+        pos = body + size;
+        if (id[0] != 'T' || size == 0 || body + size > end) continue;
+
+        // Compressed or encrypted frames are not worth decoding here
+        if (version == 4 && (frame_flags & 0x000C)) continue;
+        if (version == 3 && (frame_flags & 0x00C0)) continue;
+
+        size_t want = size < TAG_FRAME_READ ? size : TAG_FRAME_READ;
+        const unsigned char* data;
+        if (body + (off_t)want <= buf_start + buf_len) {
+            data = buf + (body - buf_start);
+        } else {
+            if (read_at(fd, frame, want, body) < (int)want) break;
+            data = frame;
+        }
+        if (version == 4 && (frame_flags & 0x0001) && want > 4) {
+            data += 4; // data length indicator
+            want -= 4;
+        }
+        id3_frame(info, id, data, want);
+
+        if (info->title[0] && info->artist[0] && info->album[0] && info->track) break;
+    }
+    free(buf);
+}
+
+static void read_id3v1(int fd, MediaInfo* info) {
+    struct stat st;
+    unsigned char tag[128];
+    if (fstat(fd, &st) != 0 || st.st_size < 128) return;
+    if (read_at(fd, tag, 128, st.st_size - 128) < 128 || memcmp(tag, "TAG", 3) != 0) return;
+
+    char text[30 * 2 + 1];  // Latin-1 takes up to two bytes in UTF-8
+    size_t pos;
+    const int fields[3] = { 3, 33, 63 };
+    char* dest[3] = { info->title, info->artist, info->album };
+    for (int f = 0; f < 3; f++) {
+        if (dest[f][0]) continue;
+        pos = 0;
+        text[0] = '\0';
+        for (int i = 0; i < 30 && tag[fields[f] + i]; i++) put_utf8(text, sizeof(text), &pos, tag[fields[f] + i]);
+        set_tag(dest[f], text, strlen(text));
+    }
+    if (!info->track && tag[125] == 0) info->track = tag[126];
+}
+
+// Vorbis comment block (FLAC VORBIS_COMMENT, Ogg comment packet)
+static void vorbis_comments(const unsigned char* p, size_t len, MediaInfo* info) {
+    if (len < 8) return;
+    size_t pos = 4 + le32(p);
+    if (pos + 4 > len) return;
+    uint32_t count = le32(p + pos);
+    pos += 4;
+
+    for (uint32_t i = 0; i < count && pos + 4 <= len; i++) {
+        uint32_t field_len = le32(p + pos);
+        pos += 4;
+        if (field_len > len - pos) break;
+
+        const char* field = (const char*)p + pos;
+        const char* eq = memchr(field, '=', field_len);
+        pos += field_len;
+        if (!eq) continue;
+
+        size_t key_len = eq - field;
+        const char* value = eq + 1;
+        size_t value_len = field_len - key_len - 1;
+        if (key_len == 5 && strncasecmp(field, "TITLE", 5) == 0) {
+            set_tag(info->title, value, value_len);
+        } else if (key_len == 6 && strncasecmp(field, "ARTIST", 6) == 0) {
+            set_tag(info->artist, value, value_len);
+        } else if (key_len == 5 && strncasecmp(field, "ALBUM", 5) == 0) {
+            set_tag(info->album, value, value_len);
+        } else if (key_len == 11 && strncasecmp(field, "TRACKNUMBER", 11) == 0) {
+            set_track(info, value, value_len);
+        }
+    }
+}
+
+static double wav_duration(int fd, int* rate) {
+    unsigned char buf[16];
+    if (read_at(fd, buf, 12, 0) < 12 || memcmp(buf, "RIFF", 4) != 0 ||
+        memcmp(buf + 8, "WAVE", 4) != 0) {
+        return -1;
+    }
+
+    uint32_t byte_rate = 0;
+    off_t pos = 12;
+    for (int chunks = 0; chunks < 64; chunks++) {
+        if (read_at(fd, buf, 16, pos) < 8) break;
+        uint32_t size = le32(buf + 4);
+        if (memcmp(buf, "fmt ", 4) == 0) {
+            if (read_at(fd, buf, 16, pos + 8) < 12) break;
+            *rate = (int)le32(buf + 4);
+            byte_rate = le32(buf + 8);
+        } else if (memcmp(buf, "data", 4) == 0) {
+            return byte_rate ? (double)size / byte_rate : -1;
+        }
+        pos += 8 + size + (size & 1);
+    }
+    return -1;
+}
+
+static void flac_probe(int fd, const unsigned char* head, int len, MediaInfo* info) {
+    off_t pos = id3v2_size(head, len) + 4;
+
+    for (int blocks = 0; blocks < MAX_TAG_FRAMES; blocks++) {
+        unsigned char header[4 + 34];
+        int got = read_at(fd, header, sizeof(header), pos);
+        if (got < 4) return;
+
+        int last = header[0] & 0x80;
+        int type = header[0] & 0x7F;
+        uint32_t size = ((uint32_t)header[1] << 16) | (header[2] << 8) | header[3];
+
+        if (type == 0 && got >= 4 + 18) {
+            // STREAMINFO
+            const unsigned char* si = header + 4;
+            uint32_t rate = ((uint32_t)si[10] << 12) | ((uint32_t)si[11] << 4) | (si[12] >> 4);
+            uint64_t samples = ((uint64_t)(si[13] & 0x0F) << 32) | be32(si + 14);
+            info->sample_rate = (int)rate;
+            if (rate && samples) info->duration = (double)samples / rate;
+        } else if (type == 4) {
+            // VORBIS_COMMENT
+            size_t want = size < TAG_BLOCK_READ ? size : TAG_BLOCK_READ;
+            unsigned char* block = malloc(want);
+            if (!block) return;
+            int block_len = read_at(fd, block, want, pos + 4);
+            vorbis_comments(block, block_len, info);
+            free(block);
+        }
+
+        if (last) return;
+        pos += 4 + size;
+    }
+}
+
+// Reassemble the Ogg comment packet (the second packet) from the first
+// pages and parse it
+static void ogg_comments(int fd, MediaInfo* info) {
+    unsigned char* buf = malloc(TAG_BLOCK_READ);
+    unsigned char* packet = malloc(TAG_BLOCK_READ);
+    if (!buf || !packet) {
+        free(buf);
+        free(packet);
+        return;
+    }
+
+    int len = read_at(fd, buf, TAG_BLOCK_READ, 0);
+    int pos = 0;
+    int packet_no = 0;
+    size_t packet_len = 0;
+    int done = 0;
+
+    while (!done && pos + 27 <= len && memcmp(buf + pos, "OggS", 4) == 0) {
+        int segments = buf[pos + 26];
+        if (pos + 27 + segments > len) break;
+        const unsigned char* lacing = buf + pos + 27;
+        int data = pos + 27 + segments;
+
+        for (int i = 0; i < segments && !done; i++) {
+            int seg = lacing[i];
+            if (packet_no == 1) {
+                int avail = data + seg <= len ? seg : len - data;
+                if (avail > 0 && packet_len + avail <= TAG_BLOCK_READ) {
+                    memcpy(packet + packet_len, buf + data, avail);
+                    packet_len += avail;
+                }
+                if (data + seg > len) done = 1;
+            }
+            data += seg;
+            if (seg < 255) {
+                if (packet_no == 1) done = 1;
+                packet_no++;
+            }
+        }
+        pos = data;
+    }
+
+    if (packet_len > 7 && memcmp(packet, "\x03vorbis", 7) == 0) {
+        vorbis_comments(packet + 7, packet_len - 7, info);
+    } else if (packet_len > 8 && memcmp(packet, "OpusTags", 8) == 0) {
+        vorbis_comments(packet + 8, packet_len - 8, info);
+    } else if (packet_len > 4 && (packet[0] & 0x7F) == 4) {
+        // FLAC in Ogg: the second packet is a VORBIS_COMMENT metadata block
+        vorbis_comments(packet + 4, packet_len - 4, info);
+    }
+
+    free(buf);
+    free(packet);
+}
+
+static double ogg_duration(int fd, const unsigned char* head, int len, int* rate_out) {
+    if (len < 28 || memcmp(head, "OggS", 4) != 0) return -1;
+
+    // First packet follows the segment table of the first page
+    int segments = head[26];
+    int packet = 27 + segments;
+    if (packet + 20 > len) return -1;
+
+    uint32_t rate = 0;
+    uint64_t pre_skip = 0;
+    if (memcmp(head + packet, "\x01vorbis", 7) == 0) {
+        rate = le32(head + packet + 12);
+    } else if (memcmp(head + packet, "OpusHead", 8) == 0) {
+        rate = 48000; // Opus granules count, and decoders produce, 48 kHz samples
+        pre_skip = head[packet + 10] | (head[packet + 11] << 8);
+    } else if (memcmp(head + packet, "\x7f" "FLAC", 5) == 0 && packet + 13 + 4 + 18 <= len) {
+        const unsigned char* si = head + packet + 13 + 4;
+        rate = ((uint32_t)si[10] << 12) | ((uint32_t)si[11] << 4) | (si[12] >> 4);
+    }
+    if (rate == 0) return -1;
+    *rate_out = (int)rate;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    off_t tail = st.st_size > OGG_TAIL_READ ? st.st_size - OGG_TAIL_READ : 0;
+
+    unsigned char* buf = malloc(OGG_TAIL_READ);
+    if (!buf) return -1;
+    int got = read_at(fd, buf, OGG_TAIL_READ, tail);
+
+    // The last page carries the final granule position
+    double duration = -1;
+    for (int i = got - 14; i >= 0; i--) {
+        if (buf[i] == 'O' && memcmp(buf + i, "OggS", 4) == 0) {
+            uint64_t granule = le64(buf + i + 6);
+            if (granule != UINT64_MAX && granule > pre_skip) {
+                duration = (double)(granule - pre_skip) / rate;
+            }
+            break;
+        }
+    }
+    free(buf);
+    return duration;
+}
+
+static double mp3_duration(int fd, const unsigned char* head, int len, int* rate_out) {
+    off_t start = id3v2_size(head, len);
+    unsigned char buf[HEADER_READ];
+    int got = read_at(fd, buf, sizeof(buf), start);
+
+    // Find the first plausible frame header
+    for (int i = 0; i + 4 <= got; i++) {
+        MpegFrame frame;
+        if (buf[i] != 0xFF || !mpeg_frame(buf + i, &frame)) continue;
+        int rate = frame.rate;
+        int bitrate = frame.bitrate;
+        int samples_per_frame = frame.samples;
+        *rate_out = rate;
+
+        // Xing/Info sits after the side information
+        int side = frame.mpeg1 ? (frame.mono ? 17 : 32) : (frame.mono ? 9 : 17);
+        const unsigned char* xing = buf + i + 4 + side;
+        if (xing + 12 <= buf + got &&
+            (memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0) &&
+            (be32(xing + 4) & 1)) {
+            uint32_t frames = be32(xing + 8);
+            if (frames) return (double)frames * samples_per_frame / rate;
+        }
+
+        const unsigned char* vbri = buf + i + 4 + 32;
+        if (vbri + 18 <= buf + got && memcmp(vbri, "VBRI", 4) == 0) {
+            uint32_t frames = be32(vbri + 14);
+            if (frames) return (double)frames * samples_per_frame / rate;
+        }
+
+        // Constant bitrate: the file size tells us the rest
+        struct stat st;
+        if (fstat(fd, &st) != 0) return -1;
+        off_t audio = st.st_size - start - i;
+        if (audio > 128) {
+            unsigned char tag[3];
+            if (read_at(fd, tag, 3, st.st_size - 128) == 3 && memcmp(tag, "TAG", 3) == 0) {
+                audio -= 128; // ID3v1
+            }
+        }
+        return audio > 0 ? (double)audio * 8 / bitrate : -1;
+    }
+    return -1;
+}
+
+// Walk sibling atoms in [pos, end) looking for type
+static off_t mp4_find(int fd, off_t pos, off_t end, const char* type, uint64_t* size_out) {
+    unsigned char buf[16];
+    while (pos + 8 <= end) {
+        if (read_at(fd, buf, 16, pos) < 8) return -1;
+        uint64_t size = be32(buf);
+        int header = 8;
+        if (size == 1) {
+            size = be64(buf + 8);
+            header = 16;
+        } else if (size == 0) {
+            size = end - pos;
+        }
+        if (size < (uint64_t)header) return -1;
+        if (memcmp(buf + 4, type, 4) == 0) {
+            *size_out = size - header;
+            return pos + header;
+        }
+        pos += size;
+    }
+    return -1;
+}
+
+static double mp4_duration(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+
+    uint64_t moov_size, mvhd_size;
+    off_t moov = mp4_find(fd, 0, st.st_size, "moov", &moov_size);
+    if (moov < 0) return -1;
+    off_t mvhd = mp4_find(fd, moov, moov + moov_size, "mvhd", &mvhd_size);
+    if (mvhd < 0) return -1;
+
+    unsigned char buf[32];
+    int got = read_at(fd, buf, sizeof(buf), mvhd);
+    if (got < 20 || (buf[0] == 1 && got < 32)) return -1;
+
+    uint32_t timescale;
+    uint64_t duration;
+    if (buf[0] == 1) {
+        timescale = be32(buf + 20);
+        duration = be64(buf + 24);
+    } else {
+        timescale = be32(buf + 12);
+        duration = be32(buf + 16);
+    }
+    return timescale ? (double)duration / timescale : -1;
+}
+
+// iTunes-style metadata: moov/udta/meta/ilst/<item>/data
+static void mp4_tags(int fd, MediaInfo* info) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return;
+
+    uint64_t size;
+    off_t moov = mp4_find(fd, 0, st.st_size, "moov", &size);
+    if (moov < 0) return;
+    off_t udta = mp4_find(fd, moov, moov + size, "udta", &size);
+    if (udta < 0) return;
+    off_t meta = mp4_find(fd, udta, udta + size, "meta", &size);
+    if (meta < 0 || size < 4) return;
+    // meta is a full box: skip version and flags
+    off_t ilst = mp4_find(fd, meta + 4, meta + size, "ilst", &size);
+    if (ilst < 0) return;
+
+    off_t pos = ilst;
+    off_t end = ilst + size;
+    unsigned char buf[TAG_FRAME_READ];
+    for (int items = 0; items < MAX_TAG_FRAMES && pos + 8 <= end; items++) {
+        if (read_at(fd, buf, 8, pos) < 8) return;
+        uint32_t item_size = be32(buf);
+        if (item_size < 8) return;
+
+        char* dest = NULL;
+        int is_track = 0;
+        if (memcmp(buf + 4, "\xa9nam", 4) == 0) dest = info->title;
+        else if (memcmp(buf + 4, "\xa9" "ART", 4) == 0) dest = info->artist;
+        else if (memcmp(buf + 4, "\xa9" "alb", 4) == 0) dest = info->album;
+        else if (memcmp(buf + 4, "trkn", 4) == 0) is_track = 1;
+
+        if (dest || is_track) {
+            // data atom: size, "data", type, locale, value
+            size_t want = item_size - 8 < TAG_FRAME_READ ? item_size - 8 : TAG_FRAME_READ;
+            int got = read_at(fd, buf, want, pos + 8);
+            if (got >= 16 && memcmp(buf + 4, "data", 4) == 0) {
+                uint32_t data_size = be32(buf);
+                size_t value_len = data_size > 16 ? data_size - 16 : 0;
+                if (value_len > (size_t)got - 16) value_len = got - 16;
+                if (dest) {
+                    set_tag(dest, (const char*)buf + 16, value_len);
+                } else if (value_len >= 4 && !info->track) {
+                    info->track = (buf[16 + 2] << 8) | buf[16 + 3];
+                }
+            }
+        }
+        pos += item_size;
+    }
+}
+
+// Read tags and duration from an open file
+void media_probe_fd(int fd, MediaInfo* info) {
+    memset(info, 0, sizeof(*info));
+    info->duration = -1;
+
+    unsigned char head[HEADER_READ];
+    int len = read_at(fd, head, sizeof(head), 0);
+
+    if (len >= 12 && memcmp(head, "RIFF", 4) == 0) {
+        info->duration = wav_duration(fd, &info->sample_rate);
+    } else if (len >= 8 && memcmp(head + 4, "ftyp", 4) == 0) {
+        info->duration = mp4_duration(fd);
+        mp4_tags(fd, info);
+    } else if (len >= 4 && memcmp(head, "OggS", 4) == 0) {
+        info->duration = ogg_duration(fd, head, len, &info->sample_rate);
+        ogg_comments(fd, info);
+    } else {
+        off_t skip = id3v2_size(head, len);
+        unsigned char magic[4];
+        if (read_at(fd, magic, 4, skip) == 4 && memcmp(magic, "fLaC", 4) == 0) {
+            flac_probe(fd, head, len, info);
+        } else {
+            info->duration = mp3_duration(fd, head, len, &info->sample_rate);
+            read_id3v2(fd, head, len, info);
+            if (!info->title[0] || !info->artist[0]) read_id3v1(fd, info);
+        }
+    }
+}
+
+int media_probe(const char* path, MediaInfo* info) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    media_probe_fd(fd, info);
+    close(fd);
+    return 1;
+}
+
+// Duration in seconds from container headers, or -1 if unknown
+double media_duration(const char* path) {
+    MediaInfo info;
+    if (!media_probe(path, &info)) return -1;
+    return info.duration;
+}
+
+// Sample rate from container headers, or 0 if unknown
+int media_sample_rate(const char* path) {
+    MediaInfo info;
+    if (!media_probe(path, &info)) return 0;
+    return info.sample_rate;
+}
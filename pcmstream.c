@@ -0,0 +1,240 @@
+#include "cMusix.h"
+
+// Uncompressed files, read a block at a time.
+//
+// Mix_LoadWAV() decodes a whole file before it returns, which is a long
+// wait and a lot of memory for a long track. WAV and AIFF hold plain PCM,
+// so for those the header is parsed here and the samples are read with
+// pread() as they are needed, then converted to the caller's format with an
+// SDL_AudioStream. What is held at any time is one block of the file and
+// whatever the converter keeps back.
+//
+// PCM, IEEE float and WAVE_FORMAT_EXTENSIBLE WAV; AIFF and AIFC with NONE,
+// sowt or fl32. 24-bit samples are widened to 32 bits on the way in, since
+// SDL has no 24-bit format. Anything else is refused and left to SDL_mixer.
+
+#define PCM_BLOCK (32u << 10)   // file bytes read at a time
+#define PCM_HEADER 64           // enough of any chunk header we parse
+
+// Name suggests a file pcm_open() may take. Cheap, for the main thread;
+// pcm_open() has the last word.
+int pcm_supported(const char* path) {
+    const char* ext = strrchr(path, '.');
+    if (!ext) return 0;
+    ext++;
+    return strcasecmp(ext, "wav") == 0 || strcasecmp(ext, "wave") == 0 ||
+           strcasecmp(ext, "aif") == 0 || strcasecmp(ext, "aiff") == 0 ||
+           strcasecmp(ext, "aifc") == 0;
+}
+
+// SDL format for samples of bits bits, 0 if there is none
+static Uint16 sample_format(int bits, int is_float, int big, int u8) {
+    if (is_float) {
+        if (bits != 32) return 0;
+        return big ? AUDIO_F32MSB : AUDIO_F32LSB;
+    }
+    switch (bits) {
+    case 8: return u8 ? AUDIO_U8 : AUDIO_S8;
+    case 16: return big ? AUDIO_S16MSB : AUDIO_S16LSB;
+    case 24: // widened
+    case 32: return big ? AUDIO_S32MSB : AUDIO_S32LSB;
+    default: return 0;
+    }
+}
+
+// AIFF sample rates are 80-bit extended floats
+static int extended_rate(const unsigned char* p) {
+    int exponent = be16(p) & 0x7FFF;
+    uint64_t mantissa = be64(p + 2);
+    int shift = 16383 + 63 - exponent;
+    if (shift < 0 || shift > 63) return 0;
+    return (int)(mantissa >> shift);
+}
+
+// Walk the chunks from pos to the sample data. Fills in what the header
+// says; returns 0 for anything not plain PCM.
+static int parse_wave(PcmStream* s, int64_t size, int* channels, int* rate, Uint16* format) {
+    unsigned char h[PCM_HEADER];
+    int64_t pos = 12;
+    int have_format = 0;
+    while (pos + 8 <= size) {
+        if (pread(s->fd, h, 8, (off_t)pos) != 8) return 0;
+        int64_t len = le32(h + 4);
+        if (memcmp(h, "fmt ", 4) == 0) {
+            if (len < 16 || pread(s->fd, h, len < 40 ? (size_t)len : 40, (off_t)(pos + 8)) < 16) return 0;
+            int tag = le16(h);
+            if (tag == 0xFFFE && len >= 40) tag = le16(h + 24);
+            *channels = le16(h + 2);
+            *rate = (int)le32(h + 4);
+            s->bits = le16(h + 14);
+            if (tag != 1 && tag != 3) return 0;
+            *format = sample_format(s->bits, tag == 3, 0, 1);
+            have_format = *format != 0;
+            s->big = 0;
+        } else if (memcmp(h, "data", 4) == 0) {
+            s->pos = pos + 8;
+            // Streamed files leave the length unset
+            s->end = len <= size - s->pos ? s->pos + len : size;
+            return have_format;
+        }
+        pos += 8 + len + (len & 1);
+    }
+    return 0;
+}
+
+static int parse_aiff(PcmStream* s, int64_t size, int aifc, int* channels, int* rate,
+                      Uint16* format) {
+    unsigned char h[PCM_HEADER];
+    int64_t pos = 12;
+    int have_format = 0;
+    while (pos + 8 <= size) {
+        if (pread(s->fd, h, 8, (off_t)pos) != 8) return 0;
+        int64_t len = be32(h + 4);
+        if (memcmp(h, "COMM", 4) == 0) {
+            if (len < 18 || pread(s->fd, h, 22, (off_t)(pos + 8)) < 18) return 0;
+            *channels = be16(h);
+            s->bits = be16(h + 6);
+            *rate = extended_rate(h + 8);
+            int big = 1, is_float = 0;
+            if (aifc) {
+                if (len < 22) return 0;
+                if (memcmp(h + 18, "sowt", 4) == 0) {
+                    big = 0;
+                } else if (memcmp(h + 18, "fl32", 4) == 0 || memcmp(h + 18, "FL32", 4) == 0) {
+                    is_float = 1;
+                } else if (memcmp(h + 18, "NONE", 4) != 0) {
+                    return 0;
+                }
+            }
+            *format = sample_format(s->bits, is_float, big, 0);
+            have_format = *format != 0;
+            s->big = big;
+        } else if (memcmp(h, "SSND", 4) == 0) {
+            // Starts with an offset to the samples and a block size
+            if (len < 8 || pread(s->fd, h, 8, (off_t)(pos + 8)) != 8) return 0;
+            int64_t offset = be32(h);
+            s->pos = pos + 16 + offset;
+            s->end = len <= size - (pos + 8) ? pos + 8 + len : size;
+            return have_format && s->pos <= s->end;
+        }
+        pos += 8 + len + (len & 1);
+    }
+    return 0;
+}
+
+// Open path for reading as PCM in the given format; channels or rate 0 keep
+// the file's. NULL if it is not an uncompressed WAV or AIFF file, or cannot
+// be read.
+PcmStream* pcm_open(const char* path, Uint16 format, int channels, int rate) {
+    PcmStream* s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    unsigned char h[12];
+    if (s->fd < 0 || fstat(s->fd, &st) != 0 || pread(s->fd, h, 12, 0) != 12) {
+        pcm_close(s);
+        return NULL;
+    }
+
+    int file_channels = 0, file_rate = 0, ok = 0;
+    Uint16 file_format = 0;
+    int64_t size = (int64_t)st.st_size;
+    if (memcmp(h, "RIFF", 4) == 0 && memcmp(h + 8, "WAVE", 4) == 0) {
+        ok = parse_wave(s, size, &file_channels, &file_rate, &file_format);
+    } else if (memcmp(h, "FORM", 4) == 0 &&
+               (memcmp(h + 8, "AIFF", 4) == 0 || memcmp(h + 8, "AIFC", 4) == 0)) {
+        ok = parse_aiff(s, size, h[11] == 'C', &file_channels, &file_rate, &file_format);
+    }
+    if (!ok || file_channels < 1 || file_channels > 8 || file_rate <= 0) {
+        pcm_close(s);
+        return NULL;
+    }
+
+    s->channels = channels > 0 ? channels : file_channels;
+    s->rate = rate > 0 ? rate : file_rate;
+    s->frame_bytes = file_channels * s->bits / 8;
+    s->block_bytes = PCM_BLOCK - PCM_BLOCK % s->frame_bytes;
+    s->block = malloc(s->bits == 24 ? s->block_bytes / 3 * 4 : s->block_bytes);
+    s->convert = SDL_NewAudioStream(file_format, (Uint8)file_channels, file_rate,
+                                    format, (Uint8)s->channels, s->rate);
+    if (!s->block || !s->convert) {
+        pcm_close(s);
+        return NULL;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return s;
+}
+
+// 24-bit samples to 32, in place: the block was read into its tail
+static void widen(PcmStream* s, size_t samples) {
+    unsigned char* out = s->block;
+    const unsigned char* in = s->block + samples;
+    for (size_t i = 0; i < samples; i++, in += 3, out += 4) {
+        if (s->big) {
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+            out[3] = 0;
+        } else {
+            out[0] = 0;
+            out[1] = in[0];
+            out[2] = in[1];
+            out[3] = in[2];
+        }
+    }
+}
+
+// Next block of the file into the converter. 0 at the end.
+static int feed(PcmStream* s) {
+    int64_t left = s->end - s->pos;
+    size_t want = left < (int64_t)s->block_bytes ? (size_t)left : s->block_bytes;
+    want -= want % s->frame_bytes;
+    if (want == 0) return 0;
+
+    // Widening needs a quarter more room, in front
+    size_t samples = s->bits == 24 ? want / 3 : 0;
+    unsigned char* dest = s->block + samples;
+    ssize_t n = pread(s->fd, dest, want, (off_t)s->pos);
+    if (n <= 0) return 0;
+    n -= n % s->frame_bytes;
+    if (n == 0) return 0;
+    s->pos += n;
+
+    size_t put = (size_t)n;
+    if (s->bits == 24) {
+        samples = put / 3;
+        if (dest != s->block + samples) memmove(s->block + samples, dest, put);
+        widen(s, samples);
+        put = samples * 4;
+    }
+    return SDL_AudioStreamPut(s->convert, s->block, (int)put) == 0;
+}
+
+// Up to len bytes of converted PCM, a whole number of frames. Returns the
+// bytes written, 0 at the end of the file, -1 on error.
+int pcm_read(PcmStream* s, Uint8* buf, int len) {
+    int done = 0;
+    while (done < len) {
+        int got = SDL_AudioStreamGet(s->convert, buf + done, len - done);
+        if (got < 0) return -1;
+        done += got;
+        if (got > 0) continue;
+        if (s->flushed) break;
+        if (!feed(s)) {
+            // Out of file: let the converter give up what it held back
+            SDL_AudioStreamFlush(s->convert);
+            s->flushed = 1;
+        }
+    }
+    return done;
+}
+
+void pcm_close(PcmStream* s) {
+    if (!s) return;
+    if (s->fd >= 0) close(s->fd);
+    if (s->convert) SDL_FreeAudioStream(s->convert);
+    free(s->block);
+    free(s);
+}
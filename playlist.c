@@ -1,74 +1,78 @@
 #include "cMusix.h"
 
 void add_song(const char* filepath) {
-    if (player.count >= MAX_SONGS) {
-        return;
+    if (track_add(&player.tracks, NULL, filepath) < 0) {
+        printf("Warning: Out of memory, skipping: %s\n", filepath);
     }
+}
+
+int add_song_in(const char* dir, const char* name) {
+    int index = track_add(&player.tracks, dir, name);
+    if (index < 0) {
+        printf("Warning: Out of memory, skipping: %s/%s\n", dir, name);
+    }
+    return index;
+}
 
-    strncpy(player.songs[player.count].path, filepath, MAX_PATH_LENGTH - 1);
-    player.songs[player.count].path[MAX_PATH_LENGTH - 1] = '\0';
+// The track store moved or removed tracks (see track_remap()): follow them
+// everywhere an index is held, so what plays and what is on screen stay put
+void playlist_remap(int from, int count, int to) {
+    TrackMap map = { from, count, to, NULL };
+    playlist_follow(&map);
+}
 
-    const char* filename = strrchr(filepath, '/');
-    if (filename) {
-        filename++;
-    } else {
-        filename = filepath;
+// As playlist_remap(), for any change a TrackMap describes
+void playlist_follow(const TrackMap* map) {
+    int current = track_map(map, player.current_index);
+    if (current < 0) {
+        // The music already loaded plays on; point at the track after it
+        current = track_map_gap(map, player.current_index);
+        if (current >= player.tracks.count) current = player.tracks.count - 1;
+        if (current < 0) current = 0;
     }
+    player.current_index = current;
+    player.music_index = track_map(map, player.music_index);
 
-    strncpy(player.songs[player.count].name, filename, MAX_FILENAME_LENGTH - 1);
-    player.songs[player.count].name[MAX_FILENAME_LENGTH - 1] = '\0';
-    player.count++;
+    if (!search_filtered()) {
+        int offset = track_map(map, player.list_offset);
+        player.list_offset = offset < 0 ? track_map_gap(map, player.list_offset) : offset;
+        if (player.list_offset >= player.tracks.count) {
+            player.list_offset = player.tracks.count > 0 ? player.tracks.count - 1 : 0;
+        }
+    }
+
+    preload_remap(map);
+    shuffle_remap(map);
+    search_remap(map);
 }
 
 void scan_directory(const char* dir_path) {
-    DIR* dir = opendir(dir_path);
-    if (!dir) {
-        printf("Warning: Could not open directory: %s\n", dir_path);
+    ScanStats stats;
+    if (!scan_tree(dir_path, config.scan_threads, &stats)) {
+        printf("Warning: Could not scan directory: %s\n", dir_path);
         return;
     }
-    
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip hidden files and current/parent directory entries
-        if (entry->d_name[0] == '.') continue;
-        
-        char full_path[MAX_PATH_LENGTH];
-        int ret = snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-        
-        // Check if path was truncated
-        if (ret >= (int)sizeof(full_path)) {
-            printf("Warning: Path too long, skipping: %s/%s\n", dir_path, entry->d_name);
-            continue;
-        }
-        
-        struct stat file_stat;
-        if (stat(full_path, &file_stat) == 0) {
-            if (S_ISDIR(file_stat.st_mode)) {
-                // Recursively scan subdirectory
-                printf("  Scanning subdirectory: %s\n", entry->d_name);
-                scan_directory(full_path);
-            } else if (S_ISREG(file_stat.st_mode)) {
-                // Check if it's an audio file
-                printf("  Checking file: %s", entry->d_name);
-                if (audio_file(entry->d_name)) {
-                    add_song(full_path);
-                    printf(" -> ADDED\n");
-                } else {
-                    printf(" -> skipped (not audio)\n");
-                }
-            }
-        } else {
-            printf("Warning: Could not stat file: %s\n", full_path);
-        }
+
+    double rate = stats.seconds > 0 ? stats.files / stats.seconds : 0;
+    printf("Scanned %ld directories, %ld files in %.3fs (%.0f files/s, %d threads)\n",
+           stats.dirs, stats.files, stats.seconds, rate, stats.threads);
+    if (stats.tags_dropped > 0) {
+        printf("Warning: Out of memory, %ld tracks listed without their tags\n", stats.tags_dropped);
     }
-    
-    closedir(dir);
 }
 
+// Library being scanned, for what happens once it is in
+static char library_root[MAX_PATH_LENGTH];
+static int play_pending = 0;
+
 void load_folder(const char* folder_path) {
-    player.count = 0;
+    scan_stop();
+    search_reset();
+    shuffle_reset();
+    track_clear(&player.tracks);
     player.current_index = 0;
     player.list_offset = 0;
+    play_pending = 0;
     
     // Try to resolve relative path, but continue even if realpath fails
     char resolved_path[MAX_PATH_LENGTH];
@@ -85,38 +89,83 @@ void load_folder(const char* folder_path) {
         return;
     }
     
+    if (S_ISREG(dir_stat.st_mode) && playlist_file_type(path_to_use) != PLAYLIST_NONE) {
+        uint64_t start = now_ns();
+        int added = load_playlist(path_to_use);
+        if (added < 0) {
+            printf("Error: Cannot read playlist: %s\n", path_to_use);
+            return;
+        }
+        printf("Loaded %d tracks from %s in %.1f ms\n", added, path_to_use,
+               (now_ns() - start) / 1e6);
+        // The playlist names the gain cache; nothing to watch
+        if (config.loudness && !loudness_open(path_to_use)) {
+            printf("Warning: Could not start loudness analysis\n");
+        }
+        return;
+    }
+
     if (!S_ISDIR(dir_stat.st_mode)) {
-        printf("Error: Path is not a directory: %s\n", path_to_use);
+        printf("Error: Path is not a directory or playlist: %s\n", path_to_use);
         return;
     }
     
-    printf("Scanning directory: %s\n", path_to_use);
-    
-    // First, try to list directory contents to debug
-    DIR* test_dir = opendir(path_to_use);
-    if (!test_dir) {
-        printf("Error: Cannot open directory: %s\n", path_to_use);
+    // Scan in the background, reusing the on-disk index where possible: the
+    // interface comes up at once and the tracks stream in (playlist_added()).
+    // The scanner adds the live-update watches as it goes.
+    if (config.watch && !watch_start(path_to_use)) {
+        printf("Warning: Could not watch %s for changes\n", path_to_use);
+    }
+    snprintf(library_root, sizeof(library_root), "%s", path_to_use);
+    index_open(path_to_use);
+    if (!scan_start(path_to_use, config.scan_threads)) {
+        index_close();
+        printf("Warning: Could not scan directory: %s\n", path_to_use);
+    }
+}
+
+// A background scan appended tracks to the playlist. They come in their
+// final order, so nothing on screen or playing moves.
+void playlist_added() {
+    if (play_pending && player.tracks.count > 0) {
+        play_pending = 0;
+        playSong();
+    } else if (player.is_playing) {
+        // The track after the last one may just have arrived
+        preload_upcoming();
+    }
+    search_refresh();
+}
+
+// The background scan is done: keep the index, then start what needs the
+// whole library
+void playlist_scanned(int ok) {
+    play_pending = 0;
+    if (!ok) {
+        index_close();
         return;
     }
-    
-    printf("Directory contents:\n");
-    struct dirent* entry;
-    while ((entry = readdir(test_dir)) != NULL) {
-        if (entry->d_name[0] != '.') {
-            printf("  Found: %s\n", entry->d_name);
-        }
+    if (!index_save()) {
+        warn_later("Could not write library index");
     }
-    closedir(test_dir);
-    
-    // Now do the actual scan
-    scan_directory(path_to_use);
-    printf("Total found: %d audio files\n", player.count);
-    
-    // Debug: List all found songs
-    if (player.count > 0) {
-        printf("\nFound audio files:\n");
-        for (int i = 0; i < player.count; i++) {
-            printf("  %d: %s\n", i + 1, player.songs[i].name);
-        }
+    index_close();
+
+    // Measures in the background, playback picks the gains up as they land
+    if (config.loudness && !loudness_open(library_root)) {
+        warn_later("Could not start loudness analysis");
+    }
+    if (config.dedup && !dedup_open(library_root)) {
+        warn_later("Could not start looking for duplicates");
     }
-}
\ No newline at end of file
+    // Changes seen during the scan waited for the whole tree
+    watch_flush();
+}
+
+// Play asked for before the scan found anything: start with the first track
+void playlist_play_when_ready() {
+    if (player.tracks.count > 0) {
+        playSong();
+    } else if (scan_running()) {
+        play_pending = 1;
+    }
+}
@@ -0,0 +1,374 @@
+#include "cMusix.h"
+
+// M3U/M3U8 and PLS playlists.
+//
+// A playlist is read through a read-only mapping, one line at a time, with
+// nothing but the track store growing as it goes. Entries are not stat()ed
+// here: a 100k-line playlist costs one pass over the file, and entries that
+// have gone missing are skipped when playSong() reaches them. Relative
+// entries resolve against the playlist's own directory, "file://" URLs are
+// decoded and other URLs (streams) are skipped.
+//
+// #EXTINF lines (M3U) and TitleN/LengthN keys (PLS) give a track's length and
+// its "Artist - Title" before any tags have been read. PLS keys may come in
+// any order; Title and Length are matched to their File by number.
+//
+// Saving writes what the playlist shows, in the order it would play: the
+// search matches while a filter is active, the shuffle order while shuffle
+// is on. Paths under the saved file's directory are written relative to it.
+
+#define PLAYLIST_BUFFER (64 << 10)
+
+typedef struct {
+    char dir[MAX_PATH_LENGTH];    // relative entries resolve against this
+    size_t dir_len;
+    double duration;              // from the last #EXTINF, -1 if none
+    const char* title;            // in the mapping, only copied if used
+    size_t title_len;
+    int* pls_index;               // PLS entry number - 1 to track, -1 if none yet
+    int pls_count;
+    long pls_max;                 // no more entries than the file has lines
+    int added;
+    int skipped;
+} PlaylistReader;
+
+int playlist_file_type(const char* path) {
+    const char* ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/')) return PLAYLIST_NONE;
+    if (strcasecmp(ext, ".m3u") == 0 || strcasecmp(ext, ".m3u8") == 0) return PLAYLIST_M3U;
+    if (strcasecmp(ext, ".pls") == 0) return PLAYLIST_PLS;
+    return PLAYLIST_NONE;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Drop "." and empty components and fold ".." into its parent, in place.
+// path is absolute.
+static void normalize(char* path) {
+    char* out = path;
+    const char* in = path;
+    while (*in) {
+        while (*in == '/') in++;
+        const char* end = in;
+        while (*end && *end != '/') end++;
+        size_t len = (size_t)(end - in);
+
+        if (len == 0 || (len == 1 && in[0] == '.')) {
+            // nothing to keep
+        } else if (len == 2 && in[0] == '.' && in[1] == '.') {
+            while (out > path && *--out != '/') {
+            }
+        } else {
+            *out++ = '/';
+            memmove(out, in, len);
+            out += len;
+        }
+        in = end;
+    }
+    if (out == path) *out++ = '/';
+    *out = '\0';
+}
+
+// Turn an entry into an absolute path. Returns 0 for entries that are not
+// local files or do not fit.
+static int resolve(const PlaylistReader* reader, const char* entry, size_t len, char* out) {
+    int url = 0;
+    if (len >= 7 && strncasecmp(entry, "file://", 7) == 0) {
+        entry += 7;
+        len -= 7;
+        if (len >= 9 && strncasecmp(entry, "localhost", 9) == 0) {
+            entry += 9;
+            len -= 9;
+        }
+        url = 1;
+    } else {
+        const char* scheme = entry;
+        while (scheme < entry + len && (isalnum((unsigned char)*scheme) || *scheme == '+' ||
+                                        *scheme == '-' || *scheme == '.')) {
+            scheme++;
+        }
+        if (scheme > entry + 1 && entry + len - scheme >= 3 && memcmp(scheme, "://", 3) == 0) {
+            return 0;
+        }
+    }
+
+    size_t pos = 0;
+    if (entry[0] != '/' && entry[0] != '\\') {
+        if (reader->dir_len + 1 >= MAX_PATH_LENGTH) return 0;
+        memcpy(out, reader->dir, reader->dir_len);
+        pos = reader->dir_len;
+        out[pos++] = '/';
+    }
+    // Playlists written on Windows separate with backslashes
+    int windows = !memchr(entry, '/', len);
+    for (size_t i = 0; i < len; i++) {
+        char c = entry[i];
+        if (url && c == '%' && i + 2 < len && hex_value(entry[i + 1]) >= 0 &&
+            hex_value(entry[i + 2]) >= 0) {
+            c = (char)(hex_value(entry[i + 1]) * 16 + hex_value(entry[i + 2]));
+            i += 2;
+        } else if (windows && c == '\\') {
+            c = '/';
+        }
+        if (c == '\0' || pos + 1 >= MAX_PATH_LENGTH) return 0;
+        out[pos++] = c;
+    }
+    out[pos] = '\0';
+    normalize(out);
+    return 1;
+}
+
+static void copy_field(char* dest, size_t size, const char* src, size_t len) {
+    if (len >= size) len = size - 1;
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+// "Artist - Title" as tags, unless it only repeats the file name
+static void apply_title(int index, const char* text, size_t len) {
+    if (len == 0 || !config.read_tags) return;
+    char title[MAX_PATH_LENGTH];
+    copy_field(title, sizeof(title), text, len);
+    if (strcmp(title, track_name(index)) == 0) return;
+    const char* dash = strstr(title, " - ");
+    if (dash) {
+        char artist[TAG_LENGTH];
+        copy_field(artist, sizeof(artist), title, (size_t)(dash - title));
+        track_set_tags(&player.tracks, index, dash + 3, artist, "", 0);
+    } else {
+        track_set_tags(&player.tracks, index, title, "", "", 0);
+    }
+}
+
+static void apply_duration(int index, double seconds) {
+    if (seconds > 0) player.tracks.duration[index] = (float)seconds;
+}
+
+static int add_entry(PlaylistReader* reader, const char* entry, size_t len) {
+    char path[MAX_PATH_LENGTH];
+    if (!resolve(reader, entry, len, path)) {
+        reader->skipped++;
+        return -1;
+    }
+    int index = track_add(&player.tracks, NULL, path);
+    if (index < 0) {
+        reader->skipped++;
+        return -1;
+    }
+    reader->added++;
+    return index;
+}
+
+static void m3u_line(PlaylistReader* reader, const char* line, size_t len) {
+    if (line[0] != '#') {
+        int index = add_entry(reader, line, len);
+        if (index >= 0) {
+            apply_duration(index, reader->duration);
+            apply_title(index, reader->title, reader->title_len);
+        }
+        reader->duration = -1;
+        reader->title_len = 0;
+        return;
+    }
+
+    // #EXTINF:seconds [attributes],Artist - Title
+    if (len > 8 && strncasecmp(line, "#EXTINF:", 8) == 0) {
+        const char* comma = memchr(line, ',', len);
+        size_t number_len = (size_t)((comma ? comma : line + len) - (line + 8));
+        char number[32];
+        copy_field(number, sizeof(number), line + 8, number_len);
+        reader->duration = strtod(number, NULL);
+        if (comma) {
+            reader->title = comma + 1;
+            reader->title_len = (size_t)(line + len - reader->title);
+        }
+    }
+}
+
+// Track for PLS entry number n, growing the table as numbers appear
+static int* pls_slot(PlaylistReader* reader, long n) {
+    if (n < 1 || n > reader->pls_max) return NULL;
+    if (n > reader->pls_count) {
+        int count = reader->pls_count ? reader->pls_count : 64;
+        while (count < n) count *= 2;
+        int* grown = realloc(reader->pls_index, count * sizeof(int));
+        if (!grown) return NULL;
+        for (int i = reader->pls_count; i < count; i++) grown[i] = -1;
+        reader->pls_index = grown;
+        reader->pls_count = count;
+    }
+    return &reader->pls_index[n - 1];
+}
+
+static void pls_line(PlaylistReader* reader, const char* line, size_t len) {
+    const char* eq = memchr(line, '=', len);
+    if (!eq) return;
+    const char* value = eq + 1;
+    size_t value_len = (size_t)(line + len - value);
+
+    // Key is a name and an entry number: File12, Title12, Length12
+    const char* digits = line;
+    while (digits < eq && !isdigit((unsigned char)*digits)) digits++;
+    size_t key_len = (size_t)(digits - line);
+    char number[16];
+    copy_field(number, sizeof(number), digits, (size_t)(eq - digits));
+    int* slot = pls_slot(reader, strtol(number, NULL, 10));
+    if (!slot) return;
+
+    if (key_len == 4 && strncasecmp(line, "File", 4) == 0) {
+        if (*slot < 0) *slot = add_entry(reader, value, value_len);
+    } else if (*slot < 0) {
+        // Title or Length ahead of its File: not worth a second pass
+    } else if (key_len == 5 && strncasecmp(line, "Title", 5) == 0) {
+        apply_title(*slot, value, value_len);
+    } else if (key_len == 6 && strncasecmp(line, "Length", 6) == 0) {
+        char seconds[32];
+        copy_field(seconds, sizeof(seconds), value, value_len);
+        apply_duration(*slot, strtod(seconds, NULL));
+    }
+}
+
+// Append the entries of a playlist to the track store. Returns the number
+// added, -1 if the file could not be read.
+int load_playlist(const char* path) {
+    int type = playlist_file_type(path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE; // read from end to end anyway, fault it in at once
+#endif
+    char* data = mmap(NULL, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    PlaylistReader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.duration = -1;
+    reader.pls_max = st.st_size < INT32_MAX / 2 ? (long)st.st_size : INT32_MAX / 2;
+    const char* slash = strrchr(path, '/');
+    if (slash) {
+        reader.dir_len = (size_t)(slash - path);
+        copy_field(reader.dir, sizeof(reader.dir), path, reader.dir_len);
+    } else if (getcwd(reader.dir, sizeof(reader.dir))) {
+        reader.dir_len = strlen(reader.dir);
+    }
+    if (reader.dir_len >= sizeof(reader.dir)) reader.dir_len = sizeof(reader.dir) - 1;
+
+    const char* p = data;
+    const char* end = data + st.st_size;
+    if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3;
+    while (p < end) {
+        const char* eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        const char* line = p;
+        const char* line_end = eol;
+        p = eol + 1;
+
+        while (line < line_end && isspace((unsigned char)*line)) line++;
+        while (line_end > line && isspace((unsigned char)line_end[-1])) line_end--;
+        if (line == line_end) continue;
+
+        if (type == PLAYLIST_PLS) {
+            pls_line(&reader, line, (size_t)(line_end - line));
+        } else {
+            m3u_line(&reader, line, (size_t)(line_end - line));
+        }
+    }
+
+    munmap(data, (size_t)st.st_size);
+    free(reader.pls_index);
+    if (reader.skipped > 0) {
+        printf("Warning: Skipped %d playlist entries that are not local files\n", reader.skipped);
+    }
+    return reader.added;
+}
+
+// Write a line's worth of text with no line breaks in it
+static void put_text(FILE* file, const char* text) {
+    for (; *text; text++) fputc(*text == '\n' || *text == '\r' ? ' ' : *text, file);
+}
+
+typedef struct {
+    int type;
+    const char* dir;    // relative paths start from here
+    size_t dir_len;
+    int count;
+} PlaylistOut;
+
+static int write_playlist(FILE* file, void* arg) {
+    PlaylistOut* out = arg;
+    setvbuf(file, NULL, _IOFBF, PLAYLIST_BUFFER);
+
+    int count = search_visible_count();
+    fputs(out->type == PLAYLIST_PLS ? "[playlist]\n" : "#EXTM3U\n", file);
+    char display[MAX_PATH_LENGTH];
+    for (int i = 0; i < count; i++) {
+        int index = player.shuffle ? shuffle_track(i) : search_row_track(i);
+        const char* track = track_path(index);
+        if (out->dir_len > 0 && strncmp(track, out->dir, out->dir_len) == 0 && track[out->dir_len] == '/') {
+            track += out->dir_len + 1;
+        }
+        track_display_name(index, display, sizeof(display));
+        double duration = player.tracks.duration[index];
+        int seconds = duration > 0 ? (int)(duration + 0.5) : -1;
+
+        if (out->type == PLAYLIST_PLS) {
+            fprintf(file, "File%d=", i + 1);
+            put_text(file, track);
+            fprintf(file, "\nTitle%d=", i + 1);
+            put_text(file, display);
+            fprintf(file, "\nLength%d=%d\n", i + 1, seconds);
+        } else {
+            fprintf(file, "#EXTINF:%d,", seconds);
+            put_text(file, display);
+            fputc('\n', file);
+            put_text(file, track);
+            fputc('\n', file);
+        }
+    }
+    if (out->type == PLAYLIST_PLS) fprintf(file, "NumberOfEntries=%d\nVersion=2\n", count);
+    out->count = count;
+    return 1;
+}
+
+// Save the playlist as shown, see above. The format follows the extension,
+// M3U unless it is .pls. Returns the number of tracks written, -1 on error.
+int save_playlist(const char* path) {
+    PlaylistOut out = { playlist_file_type(path), NULL, 0, 0 };
+
+    // Where relative paths start from
+    char dir[MAX_PATH_LENGTH];
+    const char* slash = strrchr(path, '/');
+    int have_dir;
+    if (slash) {
+        char parent[MAX_PATH_LENGTH];
+        copy_field(parent, sizeof(parent), path, slash > path ? (size_t)(slash - path) : 1);
+        have_dir = realpath(parent, dir) != NULL;
+    } else {
+        have_dir = getcwd(dir, sizeof(dir)) != NULL;
+    }
+    if (have_dir) {
+        out.dir = dir;
+        out.dir_len = strlen(dir);
+        if (out.dir_len == 1) out.dir_len = 0; // "/": everything is absolute anyway
+    }
+
+    if (!write_file_atomic(path, write_playlist, &out)) return -1;
+    return out.count;
+}
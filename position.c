@@ -0,0 +1,55 @@
+#include "cMusix.h"
+
+// Playback position.
+//
+// The post-mix tap counts every frame the mixer hands to the device while a
+// track is running, so the position is exact to the frame and stops when
+// paused. Durations come from container headers (metadata.c) and are cached
+// per track in the track store.
+
+static uint64_t frames_played = 0;
+static int running = 0;
+static int frame_bytes = 4;
+static int sample_rate = 44100;
+
+void position_init() {
+    int freq, channels;
+    Uint16 format;
+    if (Mix_QuerySpec(&freq, &format, &channels)) {
+        sample_rate = freq;
+        frame_bytes = (SDL_AUDIO_BITSIZE(format) / 8) * channels;
+        if (frame_bytes <= 0) frame_bytes = 4;
+    }
+}
+
+// Audio thread
+void position_feed(int len) {
+    if (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&frames_played, (uint64_t)(len / frame_bytes), __ATOMIC_RELAXED);
+    }
+}
+
+void position_reset() {
+    __atomic_store_n(&frames_played, 0, __ATOMIC_RELAXED);
+}
+
+void position_set_running(int on) {
+    __atomic_store_n(&running, on, __ATOMIC_RELAXED);
+}
+
+double position_seconds() {
+    return (double)__atomic_load_n(&frames_played, __ATOMIC_RELAXED) / sample_rate;
+}
+
+// Cached duration in seconds, 0 if it cannot be determined
+double track_duration(int index) {
+    if (index < 0 || index >= player.tracks.count) return 0;
+
+    float duration = player.tracks.duration[index];
+    if (duration < 0) {
+        double parsed = media_duration(track_path(index));
+        duration = parsed > 0 ? (float)parsed : 0;
+        player.tracks.duration[index] = duration;
+    }
+    return duration;
+}
@@ -0,0 +1,216 @@
+#include "cMusix.h"
+
+// Read-ahead.
+//
+// The preloader opens the next track, but on NFS or a spinning disk that
+// first read is where the time goes, and a skip past it pays the same again.
+// A worker thread asks the kernel to read the next config.prefetch tracks in
+// play order (upcoming_tracks(): sequential, search filter, shuffle) into
+// the page cache with posix_fadvise(POSIX_FADV_WILLNEED), or reads them
+// through once where that is missing. Mix_LoadMUS() and Mix_LoadWAV() then
+// find them in memory. The page cache is the cache: nothing is copied, and
+// config.prefetch_mb bounds how much one window may pull in, nearest track
+// first, the head of a track before its tail.
+//
+// A track counts as a hit when it starts after being read ahead, a miss
+// otherwise.
+
+#define PREFETCH_MAX 16         // tracks ahead, at most
+#define PREFETCH_WARM (PREFETCH_MAX * 2)
+#define PREFETCH_READ (256 * 1024)
+
+typedef struct {
+    char* path;
+    int64_t size;
+    int64_t mtime;
+} WarmTrack;
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+static int quit = 0;
+
+// Window to read, nearest first, under lock. A new window replaces the old
+// one, even halfway through.
+static char* jobs[PREFETCH_MAX];
+static int job_count = 0;
+static int job_next = 0;
+static long long job_budget = 0;
+static unsigned long window = 0;    // counts windows, so a stale read is not charged
+
+// Tracks read ahead and not played yet, oldest first, under lock
+static WarmTrack warm[PREFETCH_WARM];
+static int warm_count = 0;
+
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+static unsigned long long prefetched = 0;
+
+static int warm_find(const char* path) {
+    for (int i = 0; i < warm_count; i++) {
+        if (strcmp(warm[i].path, path) == 0) return i;
+    }
+    return -1;
+}
+
+static void warm_drop(int i) {
+    free(warm[i].path);
+    memmove(&warm[i], &warm[i + 1], (warm_count - i - 1) * sizeof(warm[0]));
+    warm_count--;
+}
+
+// Lock held
+static void warm_add(const char* path, const struct stat* st) {
+    char* copy = strdup(path);
+    if (!copy) return;
+    if (warm_count == PREFETCH_WARM) warm_drop(0);
+    warm[warm_count].path = copy;
+    warm[warm_count].size = (int64_t)st->st_size;
+    warm[warm_count].mtime = (int64_t)st->st_mtime;
+    warm_count++;
+}
+
+static void free_jobs() {
+    for (int i = 0; i < job_count; i++) free(jobs[i]);
+    job_count = 0;
+    job_next = 0;
+}
+
+// Start reading up to limit bytes of path. Returns the bytes asked for.
+static long long read_ahead(const char* path, long long limit, struct stat* st) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return 0;
+    }
+    long long len = (long long)st->st_size < limit ? (long long)st->st_size : limit;
+
+#ifdef POSIX_FADV_WILLNEED
+    // Queues the reads and returns; the disk works while we move on
+    if (len > 0 && posix_fadvise(fd, 0, (off_t)len, POSIX_FADV_WILLNEED) != 0) len = 0;
+#else
+    static char scratch[PREFETCH_READ];
+    long long done = 0;
+    while (done < len) {
+        size_t want = len - done < PREFETCH_READ ? (size_t)(len - done) : PREFETCH_READ;
+        ssize_t n = pread(fd, scratch, want, (off_t)done);
+        if (n <= 0) break;
+        done += n;
+    }
+    len = done;
+#endif
+    close(fd);
+    return len;
+}
+
+static void* prefetch_worker(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    while (!quit) {
+        if (job_next >= job_count || job_budget <= 0) {
+            pthread_cond_wait(&cond, &lock);
+            continue;
+        }
+
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s", jobs[job_next++]);
+        long long budget = job_budget;
+        unsigned long read_for = window;
+        pthread_mutex_unlock(&lock);
+
+        struct stat st;
+        long long bytes = read_ahead(path, budget, &st);
+
+        pthread_mutex_lock(&lock);
+        if (bytes > 0) {
+            prefetched += bytes;
+            int i = warm_find(path);
+            if (i >= 0) warm_drop(i);
+            warm_add(path, &st);
+        }
+        if (read_for == window) job_budget -= bytes;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int prefetch_init() {
+    if (running) return 1;
+    if (config.prefetch <= 0) return 1;
+    quit = 0;
+    if (pthread_create(&worker, NULL, prefetch_worker, NULL) != 0) return 0;
+    running = 1;
+    return 1;
+}
+
+// The play order moved: read ahead the tracks that follow the current one.
+// Tracks still warm from an earlier window are not read again.
+void prefetch_upcoming() {
+    if (!running) return;
+
+    int count = config.prefetch < PREFETCH_MAX ? config.prefetch : PREFETCH_MAX;
+    int tracks[PREFETCH_MAX];
+    count = upcoming_tracks(tracks, count);
+
+    pthread_mutex_lock(&lock);
+    free_jobs();
+    window++;
+    job_budget = (long long)config.prefetch_mb << 20;
+    for (int i = 0; i < count; i++) {
+        const char* path = track_path(tracks[i]);
+        int w = warm_find(path);
+        if (w >= 0) {
+            // Counts against this window all the same
+            job_budget -= warm[w].size;
+            continue;
+        }
+        jobs[job_count] = strdup(path);
+        if (jobs[job_count]) job_count++;
+    }
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+// A track starts: was it read ahead?
+void prefetch_played(const char* path) {
+    if (!running || !path) return;
+
+    struct stat st;
+    int changed = stat(path, &st) != 0;
+    pthread_mutex_lock(&lock);
+    int i = warm_find(path);
+    if (i >= 0 && !changed && warm[i].size == (int64_t)st.st_size &&
+        warm[i].mtime == (int64_t)st.st_mtime) {
+        hits++;
+    } else {
+        misses++;
+    }
+    if (i >= 0) warm_drop(i);
+    pthread_mutex_unlock(&lock);
+}
+
+void prefetch_shutdown() {
+    if (!running) return;
+
+    pthread_mutex_lock(&lock);
+    quit = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(worker, NULL);
+    running = 0;
+
+    free_jobs();
+    while (warm_count > 0) warm_drop(warm_count - 1);
+}
+
+void prefetch_stats(unsigned long* hit_count, unsigned long* miss_count,
+                    unsigned long long* byte_count) {
+    pthread_mutex_lock(&lock);
+    if (hit_count) *hit_count = hits;
+    if (miss_count) *miss_count = misses;
+    if (byte_count) *byte_count = prefetched;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,220 @@
+#include "cMusix.h"
+
+// Background preloader.
+//
+// While a track plays, a worker thread opens the one that will follow it
+// with Mix_LoadMUS(), so the switch at end-of-stream only has to call
+// Mix_PlayMusic() on an already parsed Mix_Music. Requests are keyed by
+// track index; asking for a different index discards a stale result.
+// Mix_Music objects the player never used are freed here, on the worker,
+// since they were never handed to the mixer.
+//
+// A track the playback engine will take (engine.c) is opened for the engine
+// instead with engine_queue(), so it can append it to the one playing.
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+static int quit = 0;
+
+static int job_index = -1;      // track to load next, -1 when idle
+static char* job_path = NULL;
+static int job_decode = 0;      // open for the engine instead
+static int loading_index = -1;  // track the worker is loading right now
+static int ready_index = -1;    // track held in ready_music
+static Mix_Music* ready_music = NULL;
+
+// End-of-track to next-audio timing
+static uint64_t finished_at = 0;
+static int measuring = 0;
+static unsigned long transitions = 0;
+static double gap_total_ms = 0;
+static double gap_max_ms = 0;
+static double gap_last_ms = 0;
+
+static void* preload_worker(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    while (!quit) {
+        if (job_index < 0) {
+            pthread_cond_wait(&cond, &lock);
+            continue;
+        }
+
+        int index = job_index;
+        char* path = job_path;
+        int decode = job_decode;
+        job_index = -1;
+        job_path = NULL;
+        loading_index = index;
+        pthread_mutex_unlock(&lock);
+
+        PROBE_START(load_start);
+        if (decode) {
+            engine_queue(path);
+            PROBE_STOP(PROBE_TRACK_LOAD, load_start);
+            free(path);
+            pthread_mutex_lock(&lock);
+            loading_index = -1;
+            pthread_cond_broadcast(&cond);
+            continue;
+        }
+
+        Mix_Music* music = Mix_LoadMUS(path);
+        PROBE_STOP(PROBE_TRACK_LOAD, load_start);
+        free(path);
+
+        pthread_mutex_lock(&lock);
+        // The library may have moved the track meanwhile, see preload_remap()
+        index = loading_index;
+        loading_index = -1;
+        if (music && index >= 0 && job_index < 0 && !quit) {
+            if (ready_music) Mix_FreeMusic(ready_music);
+            ready_music = music;
+            ready_index = index;
+        } else if (music) {
+            // Superseded while loading
+            Mix_FreeMusic(music);
+        }
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int preload_init() {
+    if (running) return 1;
+    quit = 0;
+    if (pthread_create(&worker, NULL, preload_worker, NULL) != 0) return 0;
+    running = 1;
+    return 1;
+}
+
+void preload_request(int index) {
+    if (!running || index < 0 || index >= player.tracks.count) return;
+
+    int decode = engine_accepts(index);
+    pthread_mutex_lock(&lock);
+    int done = decode ? engine_has_queued(track_path(index)) : index == ready_index;
+    if (!done && index != loading_index && index != job_index) {
+        char* path = strdup(track_path(index));
+        if (path) {
+            free(job_path);
+            job_path = path;
+            job_index = index;
+            job_decode = decode;
+            pthread_cond_signal(&cond);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Hand over the preloaded music for index, waiting if it is still being
+// opened. Returns NULL when something else was preloaded.
+Mix_Music* preload_take(int index) {
+    if (!running) return NULL;
+
+    pthread_mutex_lock(&lock);
+    while (loading_index == index || job_index == index) {
+        pthread_cond_wait(&cond, &lock);
+    }
+
+    Mix_Music* music = NULL;
+    if (ready_index == index) {
+        music = ready_music;
+        ready_music = NULL;
+        ready_index = -1;
+    }
+    pthread_mutex_unlock(&lock);
+    return music;
+}
+
+// Library update on the main thread: keep the indices on their tracks and
+// drop whatever was opened for a track that is gone
+void preload_remap(const TrackMap* map) {
+    if (!running) return;
+
+    pthread_mutex_lock(&lock);
+    job_index = track_map(map, job_index);
+    if (job_index < 0) {
+        free(job_path);
+        job_path = NULL;
+    }
+    loading_index = track_map(map, loading_index);
+    ready_index = track_map(map, ready_index);
+    if (ready_index < 0 && ready_music) {
+        Mix_FreeMusic(ready_music);
+        ready_music = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// The audio device is about to change format: wait out a load in progress
+// and drop everything opened for the old one
+void preload_flush() {
+    if (!running) return;
+
+    pthread_mutex_lock(&lock);
+    free(job_path);
+    job_path = NULL;
+    job_index = -1;
+    while (loading_index >= 0) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    if (ready_music) Mix_FreeMusic(ready_music);
+    ready_music = NULL;
+    ready_index = -1;
+    pthread_mutex_unlock(&lock);
+}
+
+void preload_shutdown() {
+    if (!running) return;
+
+    pthread_mutex_lock(&lock);
+    quit = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(worker, NULL);
+    running = 0;
+
+    free(job_path);
+    job_path = NULL;
+    job_index = -1;
+    if (ready_music) Mix_FreeMusic(ready_music);
+    ready_music = NULL;
+    ready_index = -1;
+}
+
+// Audio thread: stamp the natural end of a track
+void preload_mark_finished() {
+    __atomic_store_n(&finished_at, now_ns(), __ATOMIC_RELEASE);
+}
+
+// Main thread: the next playSong() is an automatic transition
+void preload_begin_transition() {
+    measuring = 1;
+}
+
+// Main thread: audio for the new track has been queued
+void preload_end_transition() {
+    uint64_t start = __atomic_exchange_n(&finished_at, 0, __ATOMIC_ACQUIRE);
+    if (!measuring || start == 0) {
+        measuring = 0;
+        return;
+    }
+    measuring = 0;
+
+    gap_last_ms = (now_ns() - start) / 1e6;
+    gap_total_ms += gap_last_ms;
+    if (gap_last_ms > gap_max_ms) gap_max_ms = gap_last_ms;
+    transitions++;
+}
+
+void preload_stats(unsigned long* count, double* last_ms, double* avg_ms, double* max_ms) {
+    if (count) *count = transitions;
+    if (last_ms) *last_ms = gap_last_ms;
+    if (avg_ms) *avg_ms = transitions ? gap_total_ms / transitions : 0;
+    if (max_ms) *max_ms = gap_max_ms;
+}
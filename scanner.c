@@ -0,0 +1,796 @@
+#include "cMusix.h"
+
+// Parallel directory scanner.
+//
+// Every directory becomes a ScanNode. A pool of worker threads pops nodes off
+// a shared stack, reads them with readdir() relying on d_type (falling back to
+// fstatat() only for symlinks and filesystems that report DT_UNKNOWN), opens
+// subdirectories with openat() relative to the parent fd and pushes them back
+// as new nodes. Once the pool drains, the main thread walks the tree
+// depth-first with entries sorted by name, so the playlist comes out in the
+// same order no matter how many threads ran or which finished first.
+// Workers also sniff the first bytes of every candidate file (classify.c)
+// and read each new file's tags and duration (metadata.c), so that work is
+// spread over the pool and lands in the index with the entries.
+//
+// load_folder() scans in the background (scan_start()): the workers run on
+// while the main thread merges every finished directory it can reach in
+// that same order, so tracks appear in the playlist in batches, already in
+// their final places, and the first one is playable long before the last
+// directory is read. The merge stops at the first directory still being
+// read and picks up from there on the next batch, and after
+// SCAN_MERGE_BATCH tracks, so a warm start from the index still draws
+// between batches. Workers wake the event loop through a pipe, at once
+// while nothing is playable yet, then at most every SCAN_PUBLISH_MS. A
+// directory finished inside that window is not left waiting for the next
+// one: after each merge the main thread looks again once the window is
+// over (scan_recheck()).
+
+// Cap on directory fds held open by queued nodes; beyond this children are
+// reopened by path when a worker picks them up.
+#define SCAN_MAX_OPEN_FDS 256
+#define SCAN_MAX_THREADS 64
+#define SCAN_PUBLISH_MS 50
+#define SCAN_MERGE_BATCH 4096   // tracks merged between two frames
+
+typedef struct ScanNode ScanNode;
+struct ScanNode {
+    char* path;
+    int fd;
+    int ok;
+    struct stat st;
+    const IndexDir* cached;
+    const char* entries;
+    char* owned_entries;
+    size_t entries_len;
+    int entry_count;
+    ScanNode** children;
+    int child_count;
+    int files;
+    int done;             // read by a worker, set last
+    ScanNode* next;
+};
+
+// Depth-first merge position in one directory
+typedef struct {
+    ScanNode* node;
+    const char* entry;    // next entry to merge, NULL until the node is entered
+    int next;
+    int child;
+} MergeFrame;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static ScanNode* queue_head = NULL;
+static int pending = 0;
+
+static int open_fds = 0;
+static long files_seen = 0;
+static long tags_dropped = 0;   // merge side only
+static long dirs_seen = 0;
+static long dirs_failed = 0;
+
+static pthread_t workers[SCAN_MAX_THREADS];
+static int started = 0;
+static int joined = 1;
+static int cancelled = 0;
+static ScanNode* root_node = NULL;
+static MergeFrame* merge_stack = NULL;
+static int merge_depth = 0;
+static int merge_cap = 0;
+static int count_before = 0;
+static uint64_t scan_began = 0;
+static uint64_t first_track = 0;
+
+// Background scan
+static int background = 0;
+static int notify_pipe[2] = { -1, -1 };
+static int notified = 0;
+static int published = 0;       // the playlist got its first track
+static uint64_t last_notify = 0;
+static int late = 0;            // a wakeup fell inside the window
+static ScanStats last_stats;
+static int have_stats = 0;
+static void (*rescan_done)(int ok, int first) = NULL;  // set by scan_rescan()
+
+static ScanNode* new_node(const char* parent, const char* name) {
+    ScanNode* node = calloc(1, sizeof(ScanNode));
+    if (!node) return NULL;
+    node->fd = -1;
+
+    size_t len = parent ? strlen(parent) + 1 + strlen(name) : strlen(name);
+    node->path = malloc(len + 1);
+    if (!node->path) {
+        free(node);
+        return NULL;
+    }
+    if (parent) {
+        sprintf(node->path, "%s/%s", parent, name);
+    } else {
+        memcpy(node->path, name, len + 1);
+    }
+    return node;
+}
+
+static void free_node(ScanNode* node) {
+    if (!node) return;
+    // Still queued when the scan was stopped: the parent opened it
+    if (!node->done && node->fd >= 0) close(node->fd);
+    for (int i = 0; i < node->child_count; i++) {
+        free_node(node->children[i]);
+    }
+    free(node->children);
+    free(node->owned_entries);
+    free(node->path);
+    free(node);
+}
+
+static int grow_entries(char** buf, size_t* cap, size_t needed) {
+    if (needed <= *cap) return 1;
+    size_t new_cap = *cap ? *cap * 2 : 1024;
+    while (needed > new_cap) new_cap *= 2;
+    char* grown = realloc(*buf, new_cap);
+    if (!grown) return 0;
+    *buf = grown;
+    *cap = new_cap;
+    return 1;
+}
+
+static int push_field(char** buf, size_t* len, size_t* cap, const char* text) {
+    size_t text_len = strlen(text);
+    if (!grow_entries(buf, cap, *len + text_len + 1)) return 0;
+    memcpy(*buf + *len, text, text_len + 1);
+    *len += text_len + 1;
+    return 1;
+}
+
+static int push_entry(char** buf, size_t* len, size_t* cap, char type, const char* name) {
+    if (!grow_entries(buf, cap, *len + 1)) return 0;
+    (*buf)[(*len)++] = type;
+    return push_field(buf, len, cap, name);
+}
+
+static int compare_entries(const void* a, const void* b) {
+    // Skip the type byte and compare names
+    return strcmp(*(const char* const*)a + 1, *(const char* const*)b + 1);
+}
+
+// Reorder an entry blob by name
+static void sort_entries(char** buf, size_t len, int count) {
+    if (count < 2) return;
+
+    const char** order = malloc(count * sizeof(char*));
+    char* sorted = malloc(len);
+    if (!order || !sorted) {
+        free(order);
+        free(sorted);
+        return;
+    }
+
+    const char* p = *buf;
+    for (int i = 0; i < count; i++) {
+        order[i] = p;
+        p += strlen(p + 1) + 2;
+    }
+    qsort(order, count, sizeof(char*), compare_entries);
+
+    size_t pos = 0;
+    for (int i = 0; i < count; i++) {
+        size_t entry_len = strlen(order[i] + 1) + 2;
+        memcpy(sorted + pos, order[i], entry_len);
+        pos += entry_len;
+    }
+
+    free(order);
+    free(*buf);
+    *buf = sorted;
+}
+
+// Keep the file entries whose content is audio, reading the candidates in
+// batches through the worker's sniffer. Returns the new entry count.
+static int sniff_entries(char* buf, size_t* len, int count, int fd, Sniffer* sniffer) {
+    int files = 0;
+    const char* p = buf;
+    for (int i = 0; i < count; i++) {
+        if (*p == 'f') files++;
+        p += strlen(p + 1) + 2;
+    }
+    if (files == 0) return count;
+
+    const char** names = malloc(files * sizeof(char*));
+    AudioKind* kinds = malloc(files * sizeof(AudioKind));
+    if (!names || !kinds) {
+        free(names);
+        free(kinds);
+        return count;
+    }
+
+    int n = 0;
+    p = buf;
+    for (int i = 0; i < count; i++) {
+        if (*p == 'f') names[n++] = p + 1;
+        p += strlen(p + 1) + 2;
+    }
+    sniff_files(sniffer, fd, names, files, kinds);
+
+    // Compact in place, dropping what is not audio
+    char* out = buf;
+    int kept = 0;
+    n = 0;
+    p = buf;
+    for (int i = 0; i < count; i++) {
+        size_t entry_len = strlen(p + 1) + 2;
+        int keep = *p != 'f' || kinds[n++] != AUDIO_NONE;
+        if (keep) {
+            memmove(out, p, entry_len);
+            out += entry_len;
+            kept++;
+        }
+        p += entry_len;
+    }
+    *len = (size_t)(out - buf);
+
+    free(names);
+    free(kinds);
+    return kept;
+}
+
+// Turn sorted name-only entries into index entries, reading tags from each
+// audio file through the directory fd when enabled
+static int tag_entries(char** buf, size_t* len, int count, int fd) {
+    char* out = NULL;
+    size_t out_len = 0, out_cap = 0;
+
+    const char* p = *buf;
+    for (int i = 0; i < count; i++) {
+        char type = *p;
+        const char* name = p + 1;
+        p += strlen(name) + 2;
+
+        if (!push_entry(&out, &out_len, &out_cap, type, name)) goto fail;
+        if (type != 'f') continue;
+
+        MediaInfo info;
+        int probed = 0;
+        if (config.read_tags) {
+            int file = openat(fd, name, O_RDONLY | O_CLOEXEC);
+            if (file >= 0) {
+                media_probe_fd(file, &info);
+                close(file);
+                probed = 1;
+            }
+        }
+
+        char track[16] = "";
+        char duration[24] = "";
+        if (probed) {
+            if (info.track > 0) snprintf(track, sizeof(track), "%d", info.track);
+            // 0 records "looked, unknown" so it is not probed again
+            snprintf(duration, sizeof(duration), "%ld",
+                     info.duration > 0 ? (long)(info.duration * 1000) : 0L);
+        }
+        if (!push_field(&out, &out_len, &out_cap, probed ? info.title : "") ||
+            !push_field(&out, &out_len, &out_cap, probed ? info.artist : "") ||
+            !push_field(&out, &out_len, &out_cap, probed ? info.album : "") ||
+            !push_field(&out, &out_len, &out_cap, track) ||
+            !push_field(&out, &out_len, &out_cap, duration)) {
+            goto fail;
+        }
+    }
+
+    free(*buf);
+    *buf = out;
+    *len = out_len;
+    return 1;
+
+fail:
+    free(out);
+    return 0;
+}
+
+// Read a directory through its fd and classify entries without stat()
+static int read_entries(ScanNode* node, DIR* dir, Sniffer* sniffer) {
+    char* buf = NULL;
+    size_t len = 0, cap = 0;
+    int count = 0;
+    long files = 0;
+    int fd = dirfd(dir);
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Skip hidden files and current/parent directory entries
+        if (entry->d_name[0] == '.') continue;
+
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            struct stat file_stat;
+            if (fstatat(fd, entry->d_name, &file_stat, 0) != 0) continue;
+            if (S_ISDIR(file_stat.st_mode)) {
+                type = DT_DIR;
+            } else if (S_ISREG(file_stat.st_mode)) {
+                type = DT_REG;
+            } else {
+                continue;
+            }
+        }
+
+        if (type == DT_DIR) {
+            if (!push_entry(&buf, &len, &cap, 'd', entry->d_name)) break;
+            count++;
+        } else if (type == DT_REG) {
+            files++;
+            if (audio_candidate(entry->d_name)) {
+                if (!push_entry(&buf, &len, &cap, 'f', entry->d_name)) break;
+                count++;
+            }
+        }
+    }
+
+    PROBE_START(sniff_start);
+    if (buf) count = sniff_entries(buf, &len, count, fd, sniffer);
+    PROBE_STOP(PROBE_SCAN_SNIFF, sniff_start);
+    sort_entries(&buf, len, count);
+    PROBE_START(tags_start);
+    int ok = tag_entries(&buf, &len, count, fd);
+    PROBE_STOP(PROBE_SCAN_TAGS, tags_start);
+
+    __atomic_fetch_add(&files_seen, files, __ATOMIC_RELAXED);
+    node->owned_entries = buf;
+    node->entries = buf;
+    node->entries_len = len;
+    node->entry_count = ok ? count : 0;
+    return ok;
+}
+
+// Create a child node for every subdirectory entry, opened relative to fd
+static void open_children(ScanNode* node, int fd) {
+    int dirs = 0;
+    const char* p = node->entries;
+    for (int i = 0; i < node->entry_count; i++) {
+        if (*p == 'd') dirs++;
+        p = index_next_entry(p);
+    }
+    node->files = node->entry_count - dirs;
+    if (node->cached) {
+        __atomic_fetch_add(&files_seen, (long)node->files, __ATOMIC_RELAXED);
+    }
+    if (dirs == 0) return;
+
+    node->children = calloc(dirs, sizeof(ScanNode*));
+    if (!node->children) return;
+
+    p = node->entries;
+    for (int i = 0; i < node->entry_count; i++) {
+        char type = *p;
+        const char* name = p + 1;
+        p = index_next_entry(p);
+        if (type != 'd') continue;
+
+        ScanNode* child = new_node(node->path, name);
+        if (!child) break;
+        node->children[node->child_count++] = child;
+
+        if (__atomic_load_n(&open_fds, __ATOMIC_RELAXED) < SCAN_MAX_OPEN_FDS) {
+            child->fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (child->fd >= 0) __atomic_fetch_add(&open_fds, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void scan_node(ScanNode* node, Sniffer* sniffer) {
+    if (node->fd >= 0) {
+        __atomic_fetch_sub(&open_fds, 1, __ATOMIC_RELAXED);
+    } else {
+        node->fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (node->fd < 0) {
+        __atomic_fetch_add(&dirs_failed, 1, __ATOMIC_RELAXED);
+        // Not over the interface
+        if (!background) printf("Warning: Could not open directory: %s\n", node->path);
+        return;
+    }
+    // Watch before reading, so a change made meanwhile is still reported
+    watch_add_dir(node->path);
+
+    if (fstat(node->fd, &node->st) != 0) {
+        close(node->fd);
+        return;
+    }
+    __atomic_fetch_add(&dirs_seen, 1, __ATOMIC_RELAXED);
+
+    // Unchanged directories come straight from the index
+    node->cached = index_lookup(node->path, &node->st, config.read_tags ? INDEX_TAGGED : 0);
+    if (node->cached) {
+        node->entries = index_entries(node->cached);
+        node->entry_count = index_entry_count(node->cached);
+        node->ok = 1;
+        open_children(node, node->fd);
+        close(node->fd);
+        return;
+    }
+
+    DIR* dir = fdopendir(node->fd);
+    if (!dir) {
+        close(node->fd);
+        return;
+    }
+    node->ok = read_entries(node, dir, sniffer);
+    open_children(node, dirfd(dir));
+    closedir(dir);
+}
+
+// Wake the main thread to merge. force skips the rate limit; the flag
+// keeps it to one byte in the pipe until the main thread has looked.
+static void notify(int force) {
+    if (!background) return;
+    uint64_t now = now_ns();
+    if (!force && now - __atomic_load_n(&last_notify, __ATOMIC_RELAXED) <
+                  SCAN_PUBLISH_MS * 1000000ULL) {
+        // Left to scan_recheck(), unless it has already looked: it clears
+        // last_notify before it reads late, so one of the two sees the other
+        __atomic_store_n(&late, 1, __ATOMIC_SEQ_CST);
+        if (now - __atomic_load_n(&last_notify, __ATOMIC_SEQ_CST) < SCAN_PUBLISH_MS * 1000000ULL) {
+            return;
+        }
+    }
+    if (__atomic_exchange_n(&notified, 1, __ATOMIC_ACQ_REL)) return;
+    __atomic_store_n(&last_notify, now, __ATOMIC_RELAXED);
+    char c = 0;
+    write(notify_pipe[1], &c, 1);
+}
+
+static void* scan_worker(void* arg) {
+    (void)arg;
+    Sniffer* sniffer = sniff_open();
+
+    pthread_mutex_lock(&queue_lock);
+    while (1) {
+        while (!queue_head && pending > 0 && !cancelled) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        if (!queue_head || cancelled) break;
+
+        ScanNode* node = queue_head;
+        queue_head = node->next;
+        pthread_mutex_unlock(&queue_lock);
+
+        PROBE_START(dir_start);
+        scan_node(node, sniffer);
+        PROBE_STOP(PROBE_SCAN_DIR, dir_start);
+        __atomic_store_n(&node->done, 1, __ATOMIC_RELEASE);
+        // Tracks the playlist is waiting for go out at once
+        notify(node->files > 0 && !__atomic_load_n(&published, __ATOMIC_RELAXED));
+
+        pthread_mutex_lock(&queue_lock);
+        // Push in reverse so the first child is scanned first
+        for (int i = node->child_count - 1; i >= 0; i--) {
+            node->children[i]->next = queue_head;
+            queue_head = node->children[i];
+        }
+        pending += node->child_count - 1;
+        // The last directory: whatever is left gets merged now
+        if (pending == 0) notify(1);
+        pthread_cond_broadcast(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    sniff_close(sniffer);
+    return NULL;
+}
+
+// Copy the tag fields following a file entry's name into the track store
+static void apply_fields(int index, const char* name) {
+    const char* title = name + strlen(name) + 1;
+    const char* artist = title + strlen(title) + 1;
+    const char* album = artist + strlen(artist) + 1;
+    const char* track = album + strlen(album) + 1;
+    const char* duration = track + strlen(track) + 1;
+
+    // Counted, not printed: a background scan runs under the interface
+    if (!track_set_tags(&player.tracks, index, title, artist, album, atoi(track))) {
+        tags_dropped++;
+    }
+    if (duration[0]) player.tracks.duration[index] = atol(duration) / 1000.0f;
+}
+
+static int merge_push(ScanNode* node) {
+    if (merge_depth == merge_cap) {
+        int cap = merge_cap ? merge_cap * 2 : 32;
+        MergeFrame* grown = realloc(merge_stack, cap * sizeof(MergeFrame));
+        if (!grown) return 0;
+        merge_stack = grown;
+        merge_cap = cap;
+    }
+    MergeFrame* frame = &merge_stack[merge_depth++];
+    frame->node = node;
+    frame->entry = NULL;
+    frame->next = 0;
+    frame->child = 0;
+    return 1;
+}
+
+// Single-threaded depth-first merge into the playlist and the new index, as
+// far as the workers have got or until budget tracks were added (no limit
+// if negative). Returns 1 once the whole tree is merged.
+static int merge_ready(int budget) {
+    int added = 0;
+    while (merge_depth > 0) {
+        MergeFrame* frame = &merge_stack[merge_depth - 1];
+        ScanNode* node = frame->node;
+
+        if (!frame->entry) {
+            if (!__atomic_load_n(&node->done, __ATOMIC_ACQUIRE)) return 0;
+            if (!node->ok) {
+                merge_depth--;
+                continue;
+            }
+            if (node->cached) {
+                index_keep(node->cached);
+            } else {
+                index_store(node->path, &node->st, config.read_tags ? INDEX_TAGGED : 0,
+                            node->entries ? node->entries : "", node->entries_len, node->entry_count);
+            }
+            frame->entry = node->entries ? node->entries : "";
+        }
+
+        int descended = 0;
+        while (frame->next < node->entry_count) {
+            if (budget >= 0 && added >= budget) return 0;
+
+            char type = *frame->entry;
+            const char* name = frame->entry + 1;
+            frame->entry = index_next_entry(frame->entry);
+            frame->next++;
+
+            if (type == 'd') {
+                // Pushing may move the stack: come back to this frame from the top
+                if (frame->child < node->child_count) {
+                    ScanNode* child = node->children[frame->child++];
+                    descended = merge_push(child);
+                    if (descended) break;
+                }
+                continue;
+            }
+
+            int index = add_song_in(node->path, name);
+            if (index >= 0) apply_fields(index, name);
+            added++;
+        }
+        if (!descended) merge_depth--;
+    }
+    return 1;
+}
+
+int scan_default_threads() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    // Scanning is mostly waiting on I/O, so oversubscribe a little
+    int threads = cpus > 0 ? (int)cpus * 2 : 4;
+    if (threads < 4) threads = 4;
+    if (threads > 16) threads = 16;
+    return threads;
+}
+
+static int scan_begin(const char* root, int threads) {
+    if (threads < 1) threads = scan_default_threads();
+    if (threads > SCAN_MAX_THREADS) threads = SCAN_MAX_THREADS;
+
+    root_node = new_node(NULL, root);
+    merge_depth = 0;
+    if (!root_node || !merge_push(root_node)) {
+        free_node(root_node);
+        root_node = NULL;
+        return 0;
+    }
+
+    scan_began = now_ns();
+    first_track = 0;
+    count_before = player.tracks.count;
+    files_seen = 0;
+    tags_dropped = 0;
+    dirs_seen = 0;
+    dirs_failed = 0;
+    open_fds = 0;
+    cancelled = 0;
+    queue_head = root_node;
+    pending = 1;
+
+    started = 0;
+    joined = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, scan_worker, NULL) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        scan_worker(NULL);
+    }
+    return 1;
+}
+
+// Merge what is ready, stamping the first track
+static int scan_merge(int budget) {
+    int before = player.tracks.count;
+    PROBE_START(merge_start);
+    int finished = merge_ready(budget);
+    PROBE_STOP(PROBE_SCAN_MERGE, merge_start);
+    if (player.tracks.count > before && !first_track) {
+        first_track = now_ns();
+        __atomic_store_n(&published, 1, __ATOMIC_RELAXED);
+    }
+    return finished;
+}
+
+static void scan_join() {
+    if (joined) return;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    joined = 1;
+}
+
+// Join the pool and free the tree. Returns whether the root could be read.
+static int scan_end(ScanStats* stats) {
+    scan_join();
+    int ok = root_node->ok;
+    free_node(root_node);
+    root_node = NULL;
+    merge_depth = 0;
+
+    if (stats) {
+        uint64_t end = now_ns();
+        stats->threads = started ? started : 1;
+        stats->dirs = dirs_seen;
+        stats->files = files_seen;
+        stats->failed = dirs_failed;
+        stats->tags_dropped = tags_dropped;
+        stats->added = player.tracks.count - count_before;
+        stats->seconds = (end - scan_began) / 1e9;
+        stats->first_seconds = first_track ? (first_track - scan_began) / 1e9 : 0;
+    }
+    return ok;
+}
+
+int scan_tree(const char* root, int threads, ScanStats* stats) {
+    if (background) return 0;
+    if (!scan_begin(root, threads)) return 0;
+    scan_join();
+    scan_merge(-1);
+    return scan_end(stats);
+}
+
+static void close_notify() {
+    if (notify_pipe[0] >= 0) {
+        event_unwatch(notify_pipe[0]);
+        close(notify_pipe[0]);
+    }
+    if (notify_pipe[1] >= 0) close(notify_pipe[1]);
+    notify_pipe[0] = notify_pipe[1] = -1;
+    background = 0;
+    rescan_done = NULL;
+}
+
+// A rescan is read through: merge it all at once and hand it over
+static void rescan_read() {
+    pthread_mutex_lock(&queue_lock);
+    int read = pending == 0;
+    pthread_mutex_unlock(&queue_lock);
+    if (!read) return;
+
+    void (*done)(int ok, int first) = rescan_done;
+    int first = player.tracks.count;
+    scan_merge(-1);
+    int ok = scan_end(NULL);
+    close_notify();
+    done(ok, first);
+    event_request_redraw();
+}
+
+static void on_scan_progress(int fd, void* data);
+
+// Main thread, a window after a merge: take what the workers held back
+static void scan_recheck() {
+    if (!background) return;
+    __atomic_store_n(&last_notify, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&late, 0, __ATOMIC_SEQ_CST)) on_scan_progress(notify_pipe[0], NULL);
+}
+
+static void on_scan_progress(int fd, void* data) {
+    (void)data;
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    // Before merging, so a directory finished meanwhile wakes us again
+    __atomic_exchange_n(&notified, 0, __ATOMIC_ACQ_REL);
+    if (rescan_done) {
+        rescan_read();
+        return;
+    }
+
+    int first = player.tracks.count;
+    int finished = scan_merge(SCAN_MERGE_BATCH);
+    if (player.tracks.count > first) playlist_added();
+    // More is ready: carry on once this batch is on screen
+    if (!finished && player.tracks.count - first >= SCAN_MERGE_BATCH) notify(1);
+    if (finished) {
+        int ok = scan_end(&last_stats);
+        have_stats = 1;
+        close_notify();
+        playlist_scanned(ok);
+    } else {
+        event_after(SCAN_PUBLISH_MS, scan_recheck);
+    }
+    event_request_redraw();
+}
+
+// Scan root in the background; tracks are added to the playlist from the
+// event loop as the directories are read, and playlist_scanned() is called
+// at the end
+int scan_start(const char* root, int threads) {
+    scan_stop();
+    if (pipe(notify_pipe) != 0) return 0;
+    for (int i = 0; i < 2; i++) {
+        fcntl(notify_pipe[i], F_SETFL, fcntl(notify_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(notify_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    background = 1;
+    notified = 0;
+    published = 0;
+    last_notify = 0;
+    late = 0;
+    if (!event_watch(notify_pipe[0], on_scan_progress, NULL) || !scan_begin(root, threads)) {
+        close_notify();
+        return 0;
+    }
+    return 1;
+}
+
+// Scan root again in the background, for a library already in the
+// playlist (watch.c). Nothing is merged until the whole tree has been read;
+// then its tracks are appended at once and done() gets whether root could
+// be read and where they start. Not counted in scan_stats().
+int scan_rescan(const char* root, int threads, void (*done)(int ok, int first)) {
+    if (!scan_start(root, threads)) return 0;
+    rescan_done = done;
+    return 1;
+}
+
+int scan_running() {
+    return background;
+}
+
+// Without an event loop (bench): merge until the scan is done
+void scan_wait() {
+    while (background) {
+        struct pollfd pfd = { notify_pipe[0], POLLIN, 0 };
+        int ready = poll(&pfd, 1, SCAN_PUBLISH_MS);
+        if (ready < 0 && errno != EINTR) break;
+        if (ready > 0) {
+            on_scan_progress(notify_pipe[0], NULL);
+        } else {
+            scan_recheck();
+        }
+    }
+}
+
+// Drop a background scan where it is; what was merged stays
+void scan_stop() {
+    if (!background) return;
+    pthread_mutex_lock(&queue_lock);
+    cancelled = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    scan_end(NULL);
+    queue_head = NULL;
+    pending = 0;
+    close_notify();
+}
+
+void scan_progress(long* dirs, long* files) {
+    if (dirs) *dirs = __atomic_load_n(&dirs_seen, __ATOMIC_RELAXED);
+    if (files) *files = __atomic_load_n(&files_seen, __ATOMIC_RELAXED);
+}
+
+// The last background scan that ran to the end; 0 if there was none
+int scan_stats(ScanStats* stats) {
+    if (have_stats && stats) *stats = last_stats;
+    return have_stats;
+}
@@ -0,0 +1,298 @@
+#include "cMusix.h"
+
+// Differential screen renderer.
+//
+// The interface draws into a back buffer of cells instead of printing. On
+// screen_flush() the back buffer is compared with what is already on the
+// terminal (the front buffer) and only the cells that changed are emitted,
+// with cursor moves and color changes only where they are needed. The whole
+// frame goes out in a single write().
+
+typedef struct {
+    char ch[4];   // UTF-8 bytes of the glyph, NUL padded
+    uint8_t fg;
+    uint8_t bg;
+    uint8_t width; // columns the glyph takes; 0 marks the right half of a wide glyph
+} Cell;
+
+static Cell* front = NULL;
+static Cell* back = NULL;
+static int screen_width = 0;
+static int screen_height = 0;
+static int full_redraw = 1;
+
+static char* out = NULL;
+static size_t out_len = 0;
+static size_t out_cap = 0;
+
+static size_t last_frame_bytes = 0;
+static unsigned long long total_bytes = 0;
+static unsigned long frame_count = 0;
+
+static void out_append(const char* data, size_t len) {
+    if (out_len + len > out_cap) {
+        size_t cap = out_cap ? out_cap * 2 : 4096;
+        while (out_len + len > cap) cap *= 2;
+        char* grown = realloc(out, cap);
+        if (!grown) return;
+        out = grown;
+        out_cap = cap;
+    }
+    memcpy(out + out_len, data, len);
+    out_len += len;
+}
+
+static void out_printf(const char* fmt, ...) {
+    char buf[64];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > 0) out_append(buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+}
+
+static int utf8_length(unsigned char c) {
+    if (c < 0x80) return 1;
+    if ((c & 0xE0) == 0xC0) return 2;
+    if ((c & 0xF0) == 0xE0) return 3;
+    if ((c & 0xF8) == 0xF0) return 4;
+    return 1; // stray continuation byte, treat as one column
+}
+
+// Columns the glyph at text takes on the terminal, with its length in
+// bytes. Returns -1 for a sequence cut short by the end of the string.
+int utf8_columns(const char* text, int* bytes) {
+    const unsigned char* s = (const unsigned char*)text;
+    int len = utf8_length(s[0]);
+    *bytes = 1;
+    if (len == 1) return 1;
+
+    uint32_t cp = s[0] & (0x7F >> len);
+    for (int i = 1; i < len; i++) {
+        if (!s[i]) return -1;
+        if ((s[i] & 0xC0) != 0x80) return 1; // broken sequence, lead byte alone
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    *bytes = len;
+
+    // Unprintable, or the locale doesn't know the character: one column
+    int width = wcwidth((wchar_t)cp);
+    return width < 0 ? 1 : width;
+}
+
+static void set_cell(Cell* cell, const char* glyph, int len, int width, int fg, int bg) {
+    memset(cell->ch, 0, sizeof(cell->ch));
+    memcpy(cell->ch, glyph, len);
+    cell->fg = (uint8_t)fg;
+    cell->bg = (uint8_t)bg;
+    cell->width = (uint8_t)width;
+}
+
+// Place a glyph of 1 or 2 columns at line[x]. A wide glyph partly
+// overwritten by this one is blanked so no half of it is left behind.
+static void put_glyph(Cell* line, int x, const char* glyph, int len, int width, int fg, int bg) {
+    if (line[x].width == 0 && x > 0) {
+        set_cell(&line[x - 1], " ", 1, 1, line[x - 1].fg, line[x - 1].bg);
+    }
+    int end = x + width;
+    if (end < screen_width && line[end].width == 0) {
+        set_cell(&line[end], " ", 1, 1, line[end].fg, line[end].bg);
+    }
+    set_cell(&line[x], glyph, len, width, fg, bg);
+    if (width == 2) set_cell(&line[x + 1], "", 0, 0, fg, bg);
+}
+
+int screen_resize(int width, int height) {
+    if (width == screen_width && height == screen_height && back) return 1;
+    if (width < 1) width = 1;
+    if (height < 1) height = 1;
+
+    size_t cells = (size_t)width * height;
+    Cell* new_front = malloc(cells * sizeof(Cell));
+    Cell* new_back = malloc(cells * sizeof(Cell));
+    if (!new_front || !new_back) {
+        free(new_front);
+        free(new_back);
+        return 0;
+    }
+
+    free(front);
+    free(back);
+    front = new_front;
+    back = new_back;
+    screen_width = width;
+    screen_height = height;
+    screen_invalidate();
+    screen_clear();
+    return 1;
+}
+
+void screen_invalidate() {
+    full_redraw = 1;
+}
+
+void screen_clear() {
+    size_t cells = (size_t)screen_width * screen_height;
+    for (size_t i = 0; i < cells; i++) {
+        set_cell(&back[i], " ", 1, 1, COLOR_RESET, COLOR_RESET);
+    }
+}
+
+// Write a UTF-8 string at row/col (1-based, like move_cursor), clipped to
+// the screen width. Wide glyphs take two cells and zero-width ones
+// (combining marks) are dropped. Returns the number of columns written.
+int screen_put(int row, int col, const char* text, int fg, int bg) {
+    if (!back || row < 1 || row > screen_height || col < 1) return 0;
+
+    Cell* line = back + (size_t)(row - 1) * screen_width;
+    int x = col - 1;
+    int written = 0;
+    while (*text && x < screen_width) {
+        int len;
+        int width = utf8_columns(text, &len);
+        if (width < 0 || x + width > screen_width) break;
+        if (width > 0) put_glyph(line, x, text, len, width, fg, bg);
+        text += len;
+        x += width;
+        written += width;
+    }
+    return written;
+}
+
+int screen_printf(int row, int col, int fg, int bg, const char* fmt, ...) {
+    char buf[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return screen_put(row, col, buf, fg, bg);
+}
+
+// Repeat a single glyph count times
+int screen_fill(int row, int col, int count, const char* glyph, int fg, int bg) {
+    if (!back || row < 1 || row > screen_height || col < 1) return 0;
+
+    int len;
+    int width = utf8_columns(glyph, &len);
+    if (width < 1) return 0;
+    Cell* line = back + (size_t)(row - 1) * screen_width;
+    int written = 0;
+    for (int x = col - 1; x + width <= screen_width && written < count; x += width) {
+        put_glyph(line, x, glyph, len, width, fg, bg);
+        written++;
+    }
+    return written;
+}
+
+static void emit_style(int fg, int bg) {
+    // Always reset first so a cell never inherits attributes (e.g. bold)
+    // from whatever happened to be emitted before it
+    if (fg == COLOR_RESET && bg == COLOR_RESET) {
+        out_append("\033[0m", 4);
+    } else if (bg == COLOR_RESET) {
+        out_printf("\033[0;%dm", fg);
+    } else {
+        out_printf("\033[0;%d;%dm", fg, bg);
+    }
+}
+
+size_t screen_flush() {
+    if (!back) return 0;
+
+    out_len = 0;
+    int cur_row = -1, cur_col = -1;
+    int cur_fg = -1, cur_bg = -1;
+
+    if (full_redraw) {
+        out_append("\033[?25l\033[0m\033[2J", 14);
+        // Force every cell to differ from the front buffer
+        memset(front, 0, (size_t)screen_width * screen_height * sizeof(Cell));
+        cur_fg = cur_bg = COLOR_RESET;
+        full_redraw = 0;
+    }
+
+    for (int row = 0; row < screen_height; row++) {
+        Cell* old_line = front + (size_t)row * screen_width;
+        Cell* new_line = back + (size_t)row * screen_width;
+
+        for (int col = 0; col < screen_width; col++) {
+            Cell* cell = &new_line[col];
+            if (memcmp(cell, &old_line[col], sizeof(Cell)) == 0) continue;
+
+            // The right half of a wide glyph is drawn by its left half: done
+            // if that was just emitted, otherwise go back and emit it
+            if (cell->width == 0) {
+                if ((cur_row == row && cur_col == col + 1) || col == 0) {
+                    old_line[col] = *cell;
+                    continue;
+                }
+                col--;
+                cell = &new_line[col];
+            }
+
+            if (cur_row != row || cur_col != col) {
+                // Over a short gap of same-styled cells, re-sending the
+                // glyphs is cheaper than a cursor move
+                int gap = col - cur_col;
+                int reuse = cur_row == row && gap > 0 && gap <= 4;
+                for (int i = cur_col; reuse && i < col; i++) {
+                    if (new_line[i].fg != cur_fg || new_line[i].bg != cur_bg) reuse = 0;
+                    if (new_line[i].width != 1) reuse = 0;
+                }
+                if (reuse) {
+                    for (int i = cur_col; i < col; i++) {
+                        out_append(new_line[i].ch, strnlen(new_line[i].ch, sizeof(new_line[i].ch)));
+                    }
+                } else {
+                    out_printf("\033[%d;%dH", row + 1, col + 1);
+                }
+            }
+            if (cell->fg != cur_fg || cell->bg != cur_bg) {
+                emit_style(cell->fg, cell->bg);
+                cur_fg = cell->fg;
+                cur_bg = cell->bg;
+            }
+
+            out_append(cell->ch, strnlen(cell->ch, sizeof(cell->ch)));
+            old_line[col] = *cell;
+            cur_row = row;
+            cur_col = col + cell->width;
+        }
+    }
+
+    if (out_len > 0 && (cur_fg != COLOR_RESET || cur_bg != COLOR_RESET)) {
+        out_append("\033[0m", 4);
+    }
+
+    // One write per frame; only loop on a short write. Anything still sitting
+    // in stdio's buffer must reach the terminal first.
+    fflush(stdout);
+    size_t written = 0;
+    while (written < out_len) {
+        ssize_t n = write(STDOUT_FILENO, out + written, out_len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += (size_t)n;
+    }
+
+    last_frame_bytes = out_len;
+    total_bytes += out_len;
+    frame_count++;
+    return out_len;
+}
+
+void screen_stats(size_t* last_bytes, unsigned long long* bytes, unsigned long* frames) {
+    if (last_bytes) *last_bytes = last_frame_bytes;
+    if (bytes) *bytes = total_bytes;
+    if (frames) *frames = frame_count;
+}
+
+void screen_free() {
+    free(front);
+    free(back);
+    free(out);
+    front = back = NULL;
+    out = NULL;
+    out_len = out_cap = 0;
+    screen_width = screen_height = 0;
+}
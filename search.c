@@ -0,0 +1,473 @@
+#include "cMusix.h"
+
+// Incremental playlist search.
+//
+// '/' opens a prompt and every keystroke re-filters the playlist over file
+// names and tags. The index is built the first time the prompt opens. Each
+// track gets one lowercased key (name, title, artist, album) packed into a
+// single buffer, and a 64-bit mask of the characters in it. A trigram table
+// in CSR form maps each trigram to the tracks containing it. Bucket offsets
+// point into one byte array of delta-encoded varint track numbers, about a
+// third of the size of plain 32-bit indices.
+//
+// Trigrams are taken over a 39-symbol alphabet (a-z, 0-9, space, field
+// separator, everything else), so a query made of letters, digits and
+// spaces hits exact buckets:
+//   1 character    the character masks alone
+//   2 characters   union of the trigram lists that start with the pair
+//   3+ characters  intersection of the rarest trigram lists, then a
+//                  substring check on what is left
+// Queries with other characters go the same way and confirm every candidate
+// against the key. Matches stay in playlist order and double as the play
+// order for nextSong().
+
+#define SEARCH_QUERY_LENGTH 128
+#define KEY_SEPARATOR '\x1f'
+#define SYMBOLS 39
+#define SYM_OTHER 38
+#define TRIGRAMS (SYMBOLS * SYMBOLS * SYMBOLS)
+#define MAX_INTERSECT 4   // trigram lists intersected before checking keys
+
+static char* keys = NULL;
+static uint32_t* key_off = NULL;      // count + 1 offsets, keys end at the next one
+static uint64_t* masks = NULL;
+static uint32_t* gram_start = NULL;   // TRIGRAMS + 1 byte offsets into postings
+static uint8_t* postings = NULL;
+static uint64_t* hits = NULL;         // one bit per track, for unions
+static unsigned char symbol[256];
+static int indexed = 0;
+
+static int* matches = NULL;
+static int match_count = 0;
+static int filtered = 0;    // a filter is applied to the playlist
+static int editing = 0;     // the prompt has the keyboard
+static char query[SEARCH_QUERY_LENGTH];
+static int saved_offset = 0;
+static double filter_ms = 0;
+static int out_of_memory = 0;  // the last '/' could not build the index
+
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+    int track;
+} Posting;
+
+static char fold(char c) {
+    // ASCII only: multi-byte UTF-8 sequences pass through unchanged
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static void init_symbols() {
+    for (int c = 0; c < 256; c++) {
+        if (c >= 'a' && c <= 'z') symbol[c] = c - 'a';
+        else if (c >= '0' && c <= '9') symbol[c] = 26 + c - '0';
+        else if (c == ' ') symbol[c] = 36;
+        else if (c == KEY_SEPARATOR) symbol[c] = 37;
+        else symbol[c] = SYM_OTHER;
+    }
+}
+
+static uint32_t trigram(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return ((uint32_t)symbol[u[0]] * SYMBOLS + symbol[u[1]]) * SYMBOLS + symbol[u[2]];
+}
+
+static int varint_len(uint32_t v) {
+    int len = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        len++;
+    }
+    return len;
+}
+
+static void posting_open(Posting* it, uint32_t gram) {
+    it->p = postings + gram_start[gram];
+    it->end = postings + gram_start[gram + 1];
+    it->track = -1;
+}
+
+static int posting_next(Posting* it) {
+    if (it->p >= it->end) return 0;
+    uint32_t delta = 0;
+    int shift = 0;
+    while (*it->p & 0x80) {
+        delta |= (uint32_t)(*it->p++ & 0x7F) << shift;
+        shift += 7;
+    }
+    delta |= (uint32_t)*it->p++ << shift;
+    it->track += (int)delta;
+    return 1;
+}
+
+static int append_key(char** buf, size_t* len, size_t* cap, const char* text) {
+    size_t text_len = strlen(text);
+    if (*len + text_len + 2 > *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 65536;
+        while (*len + text_len + 2 > new_cap) new_cap *= 2;
+        char* grown = realloc(*buf, new_cap);
+        if (!grown) return 0;
+        *buf = grown;
+        *cap = new_cap;
+    }
+    for (size_t i = 0; i < text_len; i++) (*buf)[(*len)++] = fold(text[i]);
+    (*buf)[(*len)++] = KEY_SEPARATOR;
+    return 1;
+}
+
+static void free_index() {
+    free(keys);
+    free(key_off);
+    free(masks);
+    free(gram_start);
+    free(postings);
+    free(hits);
+    free(matches);
+    keys = NULL;
+    key_off = NULL;
+    masks = NULL;
+    gram_start = NULL;
+    postings = NULL;
+    hits = NULL;
+    matches = NULL;
+    indexed = 0;
+}
+
+static int build_index() {
+    int count = player.tracks.count;
+    free_index();
+    init_symbols();
+
+    size_t len = 0, cap = 0;
+    key_off = malloc((count + 1) * sizeof(uint32_t));
+    masks = malloc((count ? count : 1) * sizeof(uint64_t));
+    matches = malloc((count ? count : 1) * sizeof(int));
+    hits = malloc(((count + 63) / 64 + 1) * sizeof(uint64_t));
+    gram_start = calloc(TRIGRAMS + 1, sizeof(uint32_t));
+    uint32_t* last = malloc(TRIGRAMS * sizeof(uint32_t));
+    uint32_t* fill = malloc(TRIGRAMS * sizeof(uint32_t));
+    if (!key_off || !masks || !matches || !hits || !gram_start || !last || !fill) goto fail;
+
+    // Every field, the last one included, ends with a separator, so each
+    // character pair is followed by a third symbol
+    for (int i = 0; i < count; i++) {
+        key_off[i] = (uint32_t)len;
+        if (!append_key(&keys, &len, &cap, track_name(i)) ||
+            !append_key(&keys, &len, &cap, track_title(i)) ||
+            !append_key(&keys, &len, &cap, track_artist(i)) ||
+            !append_key(&keys, &len, &cap, track_album(i))) {
+            goto fail;
+        }
+        keys[len++] = '\0';
+    }
+    key_off[count] = (uint32_t)len;
+
+    // First pass sizes every bucket, a track counted once per trigram
+    memset(last, 0xFF, TRIGRAMS * sizeof(uint32_t));
+    for (int i = 0; i < count; i++) {
+        const char* p = keys + key_off[i];
+        uint64_t mask = 0;
+        for (; p[2]; p++) {
+            mask |= 1ULL << symbol[(unsigned char)p[0]];
+            uint32_t gram = trigram(p);
+            if (last[gram] == (uint32_t)i) continue;
+            uint32_t delta = last[gram] == UINT32_MAX ? (uint32_t)i + 1 : i - last[gram];
+            gram_start[gram + 1] += varint_len(delta);
+            last[gram] = (uint32_t)i;
+        }
+        masks[i] = mask | (1ULL << symbol[(unsigned char)p[0]]) | (1ULL << symbol[(unsigned char)p[1]]);
+    }
+    for (int g = 0; g < TRIGRAMS; g++) gram_start[g + 1] += gram_start[g];
+
+    postings = malloc(gram_start[TRIGRAMS] ? gram_start[TRIGRAMS] : 1);
+    if (!postings) goto fail;
+
+    memset(last, 0xFF, TRIGRAMS * sizeof(uint32_t));
+    memcpy(fill, gram_start, TRIGRAMS * sizeof(uint32_t));
+    for (int i = 0; i < count; i++) {
+        for (const char* p = keys + key_off[i]; p[2]; p++) {
+            uint32_t gram = trigram(p);
+            if (last[gram] == (uint32_t)i) continue;
+            uint32_t delta = last[gram] == UINT32_MAX ? (uint32_t)i + 1 : i - last[gram];
+            last[gram] = (uint32_t)i;
+
+            uint8_t* out = postings + fill[gram];
+            while (delta >= 0x80) {
+                *out++ = (uint8_t)(delta | 0x80);
+                delta >>= 7;
+            }
+            *out++ = (uint8_t)delta;
+            fill[gram] = (uint32_t)(out - postings);
+        }
+    }
+
+    free(last);
+    free(fill);
+    indexed = 1;
+    return 1;
+
+fail:
+    free(last);
+    free(fill);
+    free_index();
+    return 0;
+}
+
+static int key_matches(int index, const char* q) {
+    return strstr(keys + key_off[index], q) != NULL;
+}
+
+// Keep only the candidates that also appear in the list of gram
+static void intersect(uint32_t gram) {
+    Posting it;
+    posting_open(&it, gram);
+    int n = 0;
+    int have = posting_next(&it);
+    for (int i = 0; i < match_count && have; i++) {
+        while (have && it.track < matches[i]) have = posting_next(&it);
+        if (have && it.track == matches[i]) matches[n++] = matches[i];
+    }
+    match_count = n;
+}
+
+static void run_filter() {
+    uint64_t start = now_ns();
+
+    char q[SEARCH_QUERY_LENGTH];
+    size_t q_len = strlen(query);
+    uint64_t q_mask = 0;
+    int exact = 1;
+    for (size_t i = 0; i <= q_len; i++) {
+        q[i] = fold(query[i]);
+        if (i == q_len) break;
+        int sym = symbol[(unsigned char)q[i]];
+        q_mask |= 1ULL << sym;
+        if (sym == SYM_OTHER) exact = 0;
+    }
+
+    int was_filtered = filtered;
+    filtered = q_len > 0;
+    match_count = 0;
+
+    if (q_len == 1) {
+        for (int i = 0; i < player.tracks.count; i++) {
+            if ((masks[i] & q_mask) == q_mask && (exact || key_matches(i, q))) {
+                matches[match_count++] = i;
+            }
+        }
+    } else if (q_len == 2) {
+        // A pair occurs iff some trigram starts with it
+        int words = (player.tracks.count + 63) / 64;
+        memset(hits, 0, words * sizeof(uint64_t));
+        uint32_t first = ((uint32_t)symbol[(unsigned char)q[0]] * SYMBOLS +
+                          symbol[(unsigned char)q[1]]) * SYMBOLS;
+        for (uint32_t gram = first; gram < first + SYMBOLS; gram++) {
+            Posting it;
+            posting_open(&it, gram);
+            while (posting_next(&it)) hits[it.track / 64] |= 1ULL << (it.track % 64);
+        }
+        for (int w = 0; w < words; w++) {
+            for (uint64_t bits = hits[w]; bits; bits &= bits - 1) {
+                int i = w * 64 + __builtin_ctzll(bits);
+                if (exact || key_matches(i, q)) matches[match_count++] = i;
+            }
+        }
+    } else if (q_len > 2) {
+        // Distinct trigrams of the query, rarest first
+        uint32_t grams[SEARCH_QUERY_LENGTH];
+        int gram_count = 0;
+        for (size_t i = 0; i + 2 < q_len; i++) {
+            uint32_t gram = trigram(q + i);
+            uint32_t size = gram_start[gram + 1] - gram_start[gram];
+            int j = gram_count;
+            int duplicate = 0;
+            for (int k = 0; k < gram_count; k++) duplicate |= grams[k] == gram;
+            if (duplicate) continue;
+            while (j > 0 && gram_start[grams[j - 1] + 1] - gram_start[grams[j - 1]] > size) {
+                grams[j] = grams[j - 1];
+                j--;
+            }
+            grams[j] = gram;
+            gram_count++;
+        }
+
+        Posting it;
+        posting_open(&it, grams[0]);
+        while (posting_next(&it)) matches[match_count++] = it.track;
+        for (int k = 1; k < gram_count && k < MAX_INTERSECT && match_count > 0; k++) {
+            intersect(grams[k]);
+        }
+
+        // Three exact symbols are exactly one trigram
+        if (!exact || q_len > 3) {
+            int n = 0;
+            for (int i = 0; i < match_count; i++) {
+                int track = matches[i];
+                if ((masks[track] & q_mask) == q_mask && key_matches(track, q)) matches[n++] = track;
+            }
+            match_count = n;
+        }
+    }
+
+    if (filtered || was_filtered) player.list_offset = 0;
+    filter_ms = (now_ns() - start) / 1e6;
+}
+
+// The filter decides what plays next: shuffle within it from scratch
+static void filter_committed() {
+    if (player.shuffle) shuffle_reshuffle();
+    if (player.is_playing) preload_upcoming();
+}
+
+void search_begin() {
+    if (player.tracks.count == 0) return;
+    // Shown on the status line until a later '/' gets the index built
+    out_of_memory = !indexed && !build_index();
+    if (out_of_memory) return;
+    if (!filtered) saved_offset = player.list_offset;
+    editing = 1;
+}
+
+void search_clear() {
+    int was_filtered = filtered;
+    editing = 0;
+    filtered = 0;
+    query[0] = '\0';
+    match_count = 0;
+    player.list_offset = saved_offset;
+    if (was_filtered) filter_committed();
+}
+
+void search_key(char ch) {
+    size_t len = strlen(query);
+
+    if (ch == '\r' || ch == '\n') {
+        editing = 0;
+        if (!filtered) {
+            search_clear();
+            return;
+        }
+        filter_committed();
+        // Jump to the top match unless the current track is one of them
+        if (match_count > 0 && search_step(player.current_index, 0) != player.current_index) {
+            player.current_index = matches[0];
+            playSong();
+        }
+    } else if (ch == 27) {
+        search_clear();
+    } else if (ch == 127 || ch == 8) {
+        if (len > 0) {
+            // Drop a whole UTF-8 sequence
+            do {
+                len--;
+            } while (len > 0 && ((unsigned char)query[len] & 0xC0) == 0x80);
+            query[len] = '\0';
+            run_filter();
+        }
+    } else if ((unsigned char)ch >= 32 && len + 1 < SEARCH_QUERY_LENGTH) {
+        query[len] = ch;
+        query[len + 1] = '\0';
+        // Wait for the rest of a multi-byte character before filtering
+        if (((unsigned char)ch & 0xC0) != 0xC0) run_filter();
+    }
+}
+
+// Library changed: track indices in the index and matches are stale
+void search_reset() {
+    editing = 0;
+    filtered = 0;
+    query[0] = '\0';
+    match_count = 0;
+    out_of_memory = 0;
+    free_index();
+}
+
+// Library update: the unfiltered scroll position follows its track; the
+// index and the matches wait for search_refresh()
+void search_remap(const TrackMap* map) {
+    int offset = track_map(map, saved_offset);
+    saved_offset = offset < 0 ? track_map_gap(map, saved_offset) : offset;
+}
+
+// After a batch of library updates: rebuild the index if a query needs it
+// now, otherwise drop it so the next '/' builds it fresh. The filter keeps
+// its query and scroll position.
+void search_refresh() {
+    if (saved_offset >= player.tracks.count) saved_offset = 0;
+    if (!indexed) return;
+    if (!filtered && !editing) {
+        free_index();
+        return;
+    }
+
+    int offset = player.list_offset;
+    if (!build_index() || player.tracks.count == 0) {
+        search_reset();
+        player.list_offset = saved_offset;
+        return;
+    }
+    if (filtered) run_filter();
+    player.list_offset = offset < match_count ? offset : 0;
+}
+
+int search_out_of_memory() {
+    return out_of_memory;
+}
+
+int search_editing() {
+    return editing;
+}
+
+int search_filtered() {
+    return filtered;
+}
+
+const char* search_query() {
+    return query;
+}
+
+int search_count() {
+    return match_count;
+}
+
+double search_last_ms() {
+    return filter_ms;
+}
+
+// Rows of the playlist view and the track shown on each
+int search_visible_count() {
+    return filtered ? match_count : player.tracks.count;
+}
+
+int search_row_track(int row) {
+    return filtered ? matches[row] : row;
+}
+
+// Match step positions away from index: 1 next, -1 previous, 0 the match
+// at or after it. Wraps around; index itself need not match.
+int search_step(int index, int step) {
+    if (match_count == 0) return index;
+
+    // Matches are sorted, find the first one >= index
+    int lo = 0, hi = match_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (matches[mid] < index) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int pos;
+    if (step > 0) {
+        pos = lo < match_count && matches[lo] == index ? lo + 1 : lo;
+    } else if (step < 0) {
+        pos = lo - 1;
+    } else {
+        pos = lo;
+    }
+    pos = ((pos % match_count) + match_count) % match_count;
+    return matches[pos];
+}
+
+void search_free() {
+    search_reset();
+}
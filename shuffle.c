@@ -0,0 +1,199 @@
+#include "cMusix.h"
+
+// Shuffle without repeats.
+//
+// The shuffle order is a keyed permutation of [0, n) computed on demand
+// instead of stored: a four-round Feistel network over the smallest
+// power-of-four domain covering n, cycle-walking any result >= n back into
+// range. Position i of the order is permute(i), so the whole state is a key
+// and a position, and reshuffling means drawing a new key. n is the playlist,
+// or the search matches while a filter is active. Once every track has
+// played, a new key starts the next round.
+//
+// Back and forward walk a fixed ring of the tracks actually played, so
+// previous returns to the last track heard rather than a new random one.
+// Nothing here grows with the library.
+
+#define HISTORY_SIZE 256
+#define FEISTEL_ROUNDS 4
+
+static uint64_t key = 0;
+static int domain = -1;         // n the key was drawn for, -1 before the first
+static int half_bits = 1;
+static uint64_t half_mask = 1;
+static int position = 0;        // next unplayed slot of the permutation
+
+static int history[HISTORY_SIZE];
+static int history_start = 0;   // ring slot of the oldest entry
+static int history_len = 0;
+static int history_pos = -1;    // entry of the current track, -1 if none
+
+static uint64_t mix64(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t random_key() {
+    static uint64_t counter = 0;
+    counter++;
+    return mix64(now_ns() ^ (counter * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)rand() << 32));
+}
+
+static uint64_t feistel(uint64_t x) {
+    uint64_t left = x >> half_bits;
+    uint64_t right = x & half_mask;
+    for (int round = 0; round < FEISTEL_ROUNDS; round++) {
+        uint64_t next = left ^ (mix64(right ^ key ^ ((uint64_t)round << 56)) & half_mask);
+        left = right;
+        right = next;
+    }
+    return (left << half_bits) | right;
+}
+
+// Slot i of the current order, within [0, domain)
+static int permute(int i) {
+    uint64_t x = (uint64_t)i;
+    do {
+        x = feistel(x);
+    } while (x >= (uint64_t)domain);
+    return (int)x;
+}
+
+// Tracks shuffle draws from
+static int pool_size() {
+    if (search_filtered() && search_count() > 0) return search_count();
+    return player.tracks.count;
+}
+
+static int pool_track(int i) {
+    return search_filtered() && search_count() > 0 ? search_row_track(i) : i;
+}
+
+void shuffle_reshuffle() {
+    domain = pool_size();
+    position = 0;
+    key = random_key();
+
+    // Each half gets at least one bit so the network is a proper bijection
+    int bits = 2;
+    while (bits < 62 && (1ULL << bits) < (uint64_t)domain) bits += 2;
+    half_bits = bits / 2;
+    half_mask = (1ULL << half_bits) - 1;
+}
+
+// Library replaced: the history points at tracks that are gone
+void shuffle_reset() {
+    history_len = 0;
+    history_pos = -1;
+    domain = -1;
+}
+
+// Library update: history follows its tracks, removed ones drop out. The
+// permutation reshuffles by itself if the pool changed size.
+void shuffle_remap(const TrackMap* map) {
+    int kept = 0, pos = -1;
+    for (int i = 0; i < history_len; i++) {
+        int slot = (history_start + i) % HISTORY_SIZE;
+        int track = track_map(map, history[slot]);
+        if (track >= 0) history[(history_start + kept++) % HISTORY_SIZE] = track;
+        if (i == history_pos) pos = kept - 1;
+    }
+    history_len = kept;
+    history_pos = pos;
+}
+
+// Permutation pick at slot pos, never the current track. Returns the track
+// and stores the slot after it in next_pos.
+static int pick(int pos, int* next_pos) {
+    if (domain != pool_size()) {
+        shuffle_reshuffle();
+        pos = 0;
+    }
+    if (domain <= 0) return -1;
+
+    for (int tries = 0; tries < 3; tries++) {
+        if (pos >= domain) {
+            // Round complete: same key would replay the same order
+            shuffle_reshuffle();
+            pos = 0;
+        }
+        int track = pool_track(permute(pos++));
+        if (track != player.current_index || domain == 1) {
+            *next_pos = pos;
+            return track;
+        }
+    }
+    *next_pos = pos;
+    return pool_track(permute(pos - 1));
+}
+
+// What shuffle plays next, without moving: forward history first
+int shuffle_peek() {
+    if (history_pos + 1 < history_len) {
+        return history[(history_start + history_pos + 1) % HISTORY_SIZE];
+    }
+    // pick() only reshuffles when it has to, and shuffle_next() then sees
+    // the same key and slot, so peeking and advancing agree
+    int next_pos;
+    return pick(position, &next_pos);
+}
+
+int shuffle_next() {
+    if (history_pos + 1 < history_len) {
+        history_pos++;
+        return history[(history_start + history_pos) % HISTORY_SIZE];
+    }
+    int next_pos;
+    int track = pick(position, &next_pos);
+    position = next_pos;
+    return track;
+}
+
+// Up to max tracks shuffle plays next, without moving: the forward history,
+// then the rest of this round. The next round is not drawn yet.
+int shuffle_ahead(int* tracks, int max) {
+    int n = 0;
+    for (int i = history_pos + 1; i < history_len && n < max; i++) {
+        tracks[n++] = history[(history_start + i) % HISTORY_SIZE];
+    }
+    if (domain != pool_size()) return n;
+    for (int pos = position; pos < domain && n < max; pos++) {
+        int track = pool_track(permute(pos));
+        if (track != player.current_index) tracks[n++] = track;
+    }
+    return n;
+}
+
+// Previously played track, -1 at the start of the history
+int shuffle_prev() {
+    if (history_pos <= 0) return -1;
+    history_pos--;
+    return history[(history_start + history_pos) % HISTORY_SIZE];
+}
+
+// Track at a slot of the current order, for slots below the pool size
+int shuffle_track(int slot) {
+    if (domain != pool_size()) shuffle_reshuffle();
+    return pool_track(permute(slot));
+}
+
+// Called for every track that starts. Moves through the history already
+// land on their entry; anything else is a new entry that drops the forward
+// part.
+void shuffle_played(int track) {
+    if (history_pos >= 0 && history[(history_start + history_pos) % HISTORY_SIZE] == track) return;
+
+    history_len = history_pos + 1;
+    if (history_len == HISTORY_SIZE) {
+        history_start = (history_start + 1) % HISTORY_SIZE;
+        history_len--;
+    }
+    history[(history_start + history_len) % HISTORY_SIZE] = track;
+    history_pos = history_len;
+    history_len++;
+}
@@ -0,0 +1,328 @@
+#include "cMusix.h"
+
+// Spectrum panel.
+//
+// The post-mix tap folds every buffer the device plays down to mono floats in
+// a ring the audio thread never waits on: it writes and publishes a frame
+// count, nothing else. The UI side copies the latest SPECTRUM_FFT samples at
+// a fixed frame rate, checks the writer did not lap the copy, and runs a
+// Hann window, a radix-2 FFT and log-spaced band binning to get bar heights.
+// A frame the main loop could not deliver on time, or one whose samples were
+// overwritten mid-copy, is dropped rather than caught up on. While the panel
+// is hidden the tap returns on one relaxed load and the timer is untouched.
+
+#define SPECTRUM_FFT 2048
+#define SPECTRUM_FFT_BITS 11
+#define SPECTRUM_RING 65536         // samples, a power of two above SPECTRUM_FFT + AUDIO_MAX_CHUNK
+#define SPECTRUM_MAX_BANDS 96
+#define SPECTRUM_LOW_HZ 30.0f
+#define SPECTRUM_HIGH_HZ 16000.0f
+#define SPECTRUM_FLOOR_DB -60.0f    // bottom of the bars, 0 dB is a full-scale sine
+#define SPECTRUM_FALL 1.5f          // full bar heights a bar can drop per second
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static int visible = 0;             // read by the audio thread
+static int ready = 0;
+static Uint16 format = AUDIO_S16SYS;
+static int channels = 2;
+static int sample_rate = 44100;
+
+// Written only by the audio thread; written counts every sample ever stored
+static float ring[SPECTRUM_RING];
+static uint64_t written = 0;
+
+static float window[SPECTRUM_FFT];
+static float twiddle_re[SPECTRUM_FFT / 2];
+static float twiddle_im[SPECTRUM_FFT / 2];
+static uint16_t bit_reverse[SPECTRUM_FFT];
+static float samples[SPECTRUM_FFT];
+static float re[SPECTRUM_FFT];
+static float im[SPECTRUM_FFT];
+static float power[SPECTRUM_FFT / 2];
+
+static int band_count = 0;
+static int band_bin[SPECTRUM_MAX_BANDS + 1];    // first FFT bin of each band
+static float level[SPECTRUM_MAX_BANDS];         // 0..1 of the bar height
+static int shown[SPECTRUM_MAX_BANDS];           // eighths of a cell last drawn
+static int shown_rms = 0, shown_peak = 0;       // whole dB last drawn
+static float rms_db = SPECTRUM_FLOOR_DB, peak_db = SPECTRUM_FLOOR_DB;
+
+static uint64_t last_written = 0;
+static uint64_t last_frame_ns = 0;
+static unsigned long frames = 0;
+static unsigned long dropped = 0;
+static uint64_t busy_ns = 0;
+
+void spectrum_init() {
+    // Called again when audio.c reopens the device; it is closed meanwhile
+    ready = 0;
+    band_count = 0;
+    int freq, chans;
+    Uint16 fmt;
+    if (!Mix_QuerySpec(&freq, &fmt, &chans) ||
+        (fmt != AUDIO_S16SYS && fmt != AUDIO_S32SYS && fmt != AUDIO_F32SYS)) {
+        visible = 0;
+        return;
+    }
+    format = fmt;
+    channels = chans;
+    sample_rate = freq;
+
+    for (int i = 0; i < SPECTRUM_FFT; i++) {
+        window[i] = 0.5f - 0.5f * (float)cos(2.0 * M_PI * i / (SPECTRUM_FFT - 1));
+        int r = 0;
+        for (int b = 0; b < SPECTRUM_FFT_BITS; b++) {
+            if (i & (1 << b)) r |= 1 << (SPECTRUM_FFT_BITS - 1 - b);
+        }
+        bit_reverse[i] = (uint16_t)r;
+    }
+    for (int i = 0; i < SPECTRUM_FFT / 2; i++) {
+        twiddle_re[i] = (float)cos(2.0 * M_PI * i / SPECTRUM_FFT);
+        twiddle_im[i] = (float)-sin(2.0 * M_PI * i / SPECTRUM_FFT);
+    }
+    ready = 1;
+}
+
+// Audio thread: append the buffer as mono samples
+void spectrum_feed(const Uint8* stream, int len) {
+    if (!__atomic_load_n(&visible, __ATOMIC_RELAXED)) return;
+
+    int count = len / (SDL_AUDIO_BITSIZE(format) / 8 * channels);
+    uint64_t pos = __atomic_load_n(&written, __ATOMIC_RELAXED);
+    float scale = 1.0f / channels;
+
+    if (format == AUDIO_S16SYS) {
+        const Sint16* in = (const Sint16*)stream;
+        scale /= 32768.0f;
+        for (int i = 0; i < count; i++, in += channels) {
+            float sum = 0;
+            for (int c = 0; c < channels; c++) sum += in[c];
+            ring[(pos + i) & (SPECTRUM_RING - 1)] = sum * scale;
+        }
+    } else if (format == AUDIO_S32SYS) {
+        const Sint32* in = (const Sint32*)stream;
+        scale /= 2147483648.0f;
+        for (int i = 0; i < count; i++, in += channels) {
+            float sum = 0;
+            for (int c = 0; c < channels; c++) sum += (float)in[c];
+            ring[(pos + i) & (SPECTRUM_RING - 1)] = sum * scale;
+        }
+    } else {
+        const float* in = (const float*)stream;
+        for (int i = 0; i < count; i++, in += channels) {
+            float sum = 0;
+            for (int c = 0; c < channels; c++) sum += in[c];
+            ring[(pos + i) & (SPECTRUM_RING - 1)] = sum * scale;
+        }
+    }
+    __atomic_store_n(&written, pos + count, __ATOMIC_RELEASE);
+}
+
+int spectrum_visible() {
+    return visible;
+}
+
+void spectrum_toggle() {
+    if (!ready) return;
+    if (!visible) {
+        // Stale bars would flash up from whatever played last time
+        memset(level, 0, sizeof(level));
+        last_frame_ns = 0;
+    }
+    __atomic_store_n(&visible, !visible, __ATOMIC_RELAXED);
+}
+
+int spectrum_interval_ms() {
+    return 1000 / SPECTRUM_FPS;
+}
+
+// Lines the panel takes below the separator: a heading and the bars
+int spectrum_rows() {
+    return SPECTRUM_ROWS + 1;
+}
+
+// In-place radix-2 decimation-in-time FFT over re[]/im[]
+static void fft() {
+    for (int i = 0; i < SPECTRUM_FFT; i++) {
+        int j = bit_reverse[i];
+        if (j > i) {
+            float t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+    for (int size = 2, step = SPECTRUM_FFT / 2; size <= SPECTRUM_FFT; size *= 2, step /= 2) {
+        int half = size / 2;
+        for (int start = 0; start < SPECTRUM_FFT; start += size) {
+            for (int k = 0; k < half; k++) {
+                float wr = twiddle_re[k * step], wi = twiddle_im[k * step];
+                int a = start + k, b = a + half;
+                float tr = re[b] * wr - im[b] * wi;
+                float ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+// Log-spaced bands from SPECTRUM_LOW_HZ up, each at least one bin wide
+static void layout_bands(int count) {
+    float bin_hz = (float)sample_rate / SPECTRUM_FFT;
+    float high = SPECTRUM_HIGH_HZ;
+    if (high > sample_rate / 2.0f) high = sample_rate / 2.0f;
+
+    band_count = count;
+    if (count == 0) return;
+    int bin = (int)(SPECTRUM_LOW_HZ / bin_hz);
+    if (bin < 1) bin = 1;
+    for (int b = 0; b <= count; b++) {
+        float hz = SPECTRUM_LOW_HZ * powf(high / SPECTRUM_LOW_HZ, (float)b / count);
+        int edge = (int)(hz / bin_hz + 0.5f);
+        if (b > 0 && edge <= bin) edge = bin + 1;
+        if (edge > SPECTRUM_FFT / 2) edge = SPECTRUM_FFT / 2;
+        band_bin[b] = b == 0 ? bin : edge;
+        bin = band_bin[b];
+    }
+}
+
+static int bands_for(int width) {
+    int count = (width - 1) / 2;
+    if (count > SPECTRUM_MAX_BANDS) count = SPECTRUM_MAX_BANDS;
+    return count > 0 ? count : 0;
+}
+
+static float to_db(float value) {
+    return value > 1e-10f ? 10.0f * log10f(value) : -100.0f;
+}
+
+// Analyse the latest audio; returns 1 if the panel now looks different
+int spectrum_tick() {
+    if (!visible || !ready) return 0;
+
+    uint64_t start_ns = now_ns();
+    uint64_t interval_ns = 1000000000ULL / SPECTRUM_FPS;
+    float elapsed = 1.0f / SPECTRUM_FPS;
+    if (last_frame_ns) {
+        // Ticks the loop missed are gone, the bars just fall further. A
+        // longer gap is the timer having been stopped by a pause.
+        uint64_t since = start_ns - last_frame_ns;
+        elapsed = since / 1e9f;
+        if (elapsed > 0.25f) {
+            elapsed = 0.25f;
+        } else if (since > interval_ns * 3 / 2) {
+            dropped += (unsigned long)(since / interval_ns - 1);
+        }
+    }
+    last_frame_ns = start_ns;
+
+    uint64_t end = __atomic_load_n(&written, __ATOMIC_ACQUIRE);
+    if (end == last_written || end < SPECTRUM_FFT) return 0;
+
+    uint64_t first = end - SPECTRUM_FFT;
+    int offset = (int)(first & (SPECTRUM_RING - 1));
+    int run = SPECTRUM_RING - offset;
+    if (run > SPECTRUM_FFT) run = SPECTRUM_FFT;
+    memcpy(samples, ring + offset, run * sizeof(float));
+    memcpy(samples + run, ring, (SPECTRUM_FFT - run) * sizeof(float));
+    // A feed stores its samples before it publishes them, so one may be
+    // under way past what written says. The fence keeps the copy above.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&written, __ATOMIC_RELAXED) + AUDIO_MAX_CHUNK - first > SPECTRUM_RING) {
+        // The audio thread wrapped over the copy
+        dropped++;
+        return 0;
+    }
+    last_written = end;
+
+    float sum = 0, peak = 0;
+    for (int i = 0; i < SPECTRUM_FFT; i++) {
+        sum += samples[i] * samples[i];
+        if (fabsf(samples[i]) > peak) peak = fabsf(samples[i]);
+    }
+    rms_db = to_db(sum / SPECTRUM_FFT);
+    peak_db = to_db(peak * peak);
+
+    // Straight-line loops over contiguous arrays, left to the vectoriser
+    for (int i = 0; i < SPECTRUM_FFT; i++) re[i] = samples[i] * window[i];
+    memset(im, 0, sizeof(im));
+
+    fft();
+    for (int k = 0; k < SPECTRUM_FFT / 2; k++) {
+        power[k] = re[k] * re[k] + im[k] * im[k];
+    }
+
+    int count = bands_for(player.terminal_width);
+    if (count != band_count) layout_bands(count);
+
+    // A full-scale sine peaks at |X| = N/4 through a Hann window, and the
+    // window spreads its power over 1.5 bins' worth of neighbours
+    float norm = 16.0f / (1.5f * SPECTRUM_FFT * SPECTRUM_FFT);
+    float fall = SPECTRUM_FALL * elapsed;
+    int changed = 0;
+    for (int b = 0; b < band_count; b++) {
+        float sum_power = 0;
+        for (int k = band_bin[b]; k < band_bin[b + 1]; k++) sum_power += power[k];
+        float target = (to_db(sum_power * norm) - SPECTRUM_FLOOR_DB) / -SPECTRUM_FLOOR_DB;
+        if (target < 0) target = 0;
+        if (target > 1) target = 1;
+
+        if (target >= level[b]) {
+            level[b] = target;
+        } else {
+            level[b] = level[b] - fall > target ? level[b] - fall : target;
+        }
+
+        int eighths = (int)(level[b] * SPECTRUM_ROWS * 8 + 0.5f);
+        if (eighths != shown[b]) changed = 1;
+    }
+    if ((int)rms_db != shown_rms || (int)peak_db != shown_peak) changed = 1;
+
+    frames++;
+    busy_ns += now_ns() - start_ns;
+    return changed;
+}
+
+void spectrum_draw(int row, int width) {
+    static const char* glyphs[] = { " ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+
+    int count = bands_for(width);
+    if (count != band_count) layout_bands(count);
+
+    shown_rms = (int)rms_db;
+    shown_peak = (int)peak_db;
+    int col = 1 + screen_put(row, 1, "SPECTRUM", COLOR_BOLD, COLOR_BG_BLACK);
+    if (player.is_playing && rms_db > SPECTRUM_FLOOR_DB) {
+        screen_printf(row, col + 2, COLOR_RESET, COLOR_RESET, "RMS %d dB  Peak %d dB",
+                      shown_rms, shown_peak);
+    }
+
+    for (int b = 0; b < band_count; b++) {
+        shown[b] = player.is_playing ? (int)(level[b] * SPECTRUM_ROWS * 8 + 0.5f) : 0;
+    }
+    for (int r = 0; r < SPECTRUM_ROWS; r++) {
+        // Bars grow upwards; the top lines warn of a hot signal
+        int base = (SPECTRUM_ROWS - 1 - r) * 8;
+        int fg = r == 0 ? COLOR_RED : r == 1 ? COLOR_YELLOW : COLOR_GREEN;
+        for (int b = 0; b < band_count; b++) {
+            int fill = shown[b] - base;
+            if (fill < 0) fill = 0;
+            if (fill > 8) fill = 8;
+            screen_put(row + 1 + r, 2 + b * 2, glyphs[fill], fg, COLOR_BG_BLACK);
+        }
+    }
+}
+
+void spectrum_stats(unsigned long* frame_count, unsigned long* dropped_count, double* avg_us) {
+    if (frame_count) *frame_count = frames;
+    if (dropped_count) *dropped_count = dropped;
+    if (avg_us) *avg_us = frames ? busy_ns / 1000.0 / frames : 0;
+}
@@ -0,0 +1,395 @@
+#include "cMusix.h"
+
+// Stamped per-file results.
+//
+// Loudness levelling and duplicate detection both work through every track
+// in the background, keep what they find for each file and must not redo it
+// on the next run unless the file changed. A StampCache holds that: one
+// fixed-size value per path, stamped with the file's size and mtime, in a
+// hash table keyed by path, loaded from and saved to a file next to the
+// library index (library-<hash>.<ext>).
+//
+// It also runs the work. A pass queues every track of the playlist; worker
+// threads at idle priority hand each path to the owner's job(), which looks
+// it up with stamp_fresh() and stores a result with stamp_store(). When the
+// queue runs dry, pass_end() may queue a further phase over the same pass.
+// After the last one, files no pass confirmed are forgotten and the cache is
+// written out.
+//
+// File layout: header, then per file a StampRecord, the value and the path
+// with its NUL, each of the last two padded to 8 bytes.
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} StampHeader;
+
+typedef struct {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t path_len;
+    uint32_t value_len;
+} StampRecord;
+
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+static uint64_t hash_path(const char* path) {
+    return hash_bytes(path, strlen(path));
+}
+
+// Lock held for all of these, as for the owner's lookups
+int stamp_find(StampCache* cache, const char* path) {
+    if (!cache->slots) return -1;
+    size_t slot = hash_path(path) & cache->slot_mask;
+    while (cache->slots[slot] >= 0) {
+        int i = cache->slots[slot];
+        if (strcmp(cache->entries[i].path, path) == 0) return i;
+        slot = (slot + 1) & cache->slot_mask;
+    }
+    return -1;
+}
+
+static int rehash(StampCache* cache, size_t count) {
+    int* table = malloc(count * sizeof(*table));
+    if (!table) return 0;
+    memset(table, 0xff, count * sizeof(*table));
+    free(cache->slots);
+    cache->slots = table;
+    cache->slot_mask = count - 1;
+    for (int i = 0; i < cache->entry_count; i++) {
+        size_t slot = hash_path(cache->entries[i].path) & cache->slot_mask;
+        while (table[slot] >= 0) slot = (slot + 1) & cache->slot_mask;
+        table[slot] = i;
+    }
+    return 1;
+}
+
+void* stamp_value(StampCache* cache, int index) {
+    return cache->values + (size_t)index * cache->value_size;
+}
+
+// Entry for path, created with a zeroed value if missing. -1 when out of
+// memory.
+static int insert(StampCache* cache, const char* path) {
+    int i = stamp_find(cache, path);
+    if (i >= 0) return i;
+
+    if (cache->entry_count == cache->entry_cap) {
+        int cap = cache->entry_cap ? cache->entry_cap * 2 : 1024;
+        StampEntry* entries = realloc(cache->entries, cap * sizeof(*entries));
+        if (!entries) return -1;
+        cache->entries = entries;
+        unsigned char* values = realloc(cache->values, (size_t)cap * cache->value_size);
+        if (!values) return -1;
+        cache->values = values;
+        cache->entry_cap = cap;
+    }
+    if (!cache->slots || (size_t)(cache->entry_count + 1) * 2 > cache->slot_mask + 1) {
+        size_t count = cache->slots ? (cache->slot_mask + 1) * 2 : 2048;
+        if (!rehash(cache, count)) return -1;
+    }
+
+    char* copy = strdup(path);
+    if (!copy) return -1;
+    i = cache->entry_count++;
+    memset(&cache->entries[i], 0, sizeof(cache->entries[i]));
+    cache->entries[i].path = copy;
+    memset(stamp_value(cache, i), 0, cache->value_size);
+
+    size_t slot = hash_path(path) & cache->slot_mask;
+    while (cache->slots[slot] >= 0) slot = (slot + 1) & cache->slot_mask;
+    cache->slots[slot] = i;
+    return i;
+}
+
+// Entry for path if it was stored for the file as it is now, confirmed for
+// the current pass; -1 if it has to be worked out again
+int stamp_fresh(StampCache* cache, const char* path, const struct stat* st) {
+    int i = stamp_find(cache, path);
+    if (i < 0) return -1;
+    StampEntry* entry = &cache->entries[i];
+    if (entry->size != (int64_t)st->st_size || entry->mtime_sec != (int64_t)st->st_mtime ||
+        entry->mtime_nsec != (int64_t)ST_MTIME_NSEC(st)) {
+        return -1;
+    }
+    entry->live = 1;
+    return i;
+}
+
+// Entry to store a new result for path in, stamped with st. The value keeps
+// whatever it held before. -1 when out of memory.
+int stamp_store(StampCache* cache, const char* path, const struct stat* st) {
+    int i = insert(cache, path);
+    if (i < 0) return -1;
+    StampEntry* entry = &cache->entries[i];
+    entry->size = (int64_t)st->st_size;
+    entry->mtime_sec = (int64_t)st->st_mtime;
+    entry->mtime_nsec = (int64_t)ST_MTIME_NSEC(st);
+    entry->live = 1;
+    cache->dirty = 1;
+    return i;
+}
+
+static void load(StampCache* cache) {
+    FILE* f = fopen(cache->path, "rb");
+    if (!f) return;
+
+    StampHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, cache->magic, sizeof(header.magic)) != 0 ||
+        header.version != cache->version) {
+        fclose(f);
+        return;
+    }
+
+    size_t value_stored = PAD8(cache->value_size);
+    unsigned char* value = malloc(value_stored ? value_stored : 1);
+    char path[MAX_PATH_LENGTH + 8];
+    for (uint32_t n = 0; value && n < header.count; n++) {
+        StampRecord record;
+        if (fread(&record, sizeof(record), 1, f) != 1 || record.value_len != cache->value_size) break;
+        size_t path_stored = PAD8((size_t)record.path_len + 1);
+        if (record.path_len >= MAX_PATH_LENGTH || fread(value, 1, value_stored, f) != value_stored ||
+            fread(path, 1, path_stored, f) != path_stored) {
+            break;
+        }
+        path[record.path_len] = '\0';
+
+        int i = insert(cache, path);
+        if (i < 0) break;
+        cache->entries[i].mtime_sec = record.mtime_sec;
+        cache->entries[i].mtime_nsec = record.mtime_nsec;
+        cache->entries[i].size = record.size;
+        memcpy(stamp_value(cache, i), value, cache->value_size);
+    }
+    free(value);
+    fclose(f);
+}
+
+typedef struct {
+    const unsigned char* data;
+    size_t len;
+} StampData;
+
+static int write_data(FILE* file, void* arg) {
+    const StampData* out = arg;
+    return fwrite(out->data, 1, out->len, file) == out->len;
+}
+
+// Serialise under the lock, write without it
+static int save(StampCache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    if (!cache->dirty || !cache->path[0]) {
+        pthread_mutex_unlock(&cache->lock);
+        return 1;
+    }
+
+    size_t value_stored = PAD8(cache->value_size);
+    size_t len = sizeof(StampHeader);
+    for (int i = 0; i < cache->entry_count; i++) {
+        len += sizeof(StampRecord) + value_stored + PAD8(strlen(cache->entries[i].path) + 1);
+    }
+    unsigned char* data = calloc(1, len);
+    if (!data) {
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    StampHeader* header = (StampHeader*)data;
+    memcpy(header->magic, cache->magic, strlen(cache->magic) + 1);
+    header->version = cache->version;
+    header->count = (uint32_t)cache->entry_count;
+    size_t pos = sizeof(StampHeader);
+    for (int i = 0; i < cache->entry_count; i++) {
+        const StampEntry* entry = &cache->entries[i];
+        StampRecord record = {
+            entry->mtime_sec, entry->mtime_nsec, entry->size,
+            (uint32_t)strlen(entry->path), (uint32_t)cache->value_size
+        };
+        memcpy(data + pos, &record, sizeof(record));
+        pos += sizeof(record);
+        memcpy(data + pos, stamp_value(cache, i), cache->value_size);
+        pos += value_stored;
+        memcpy(data + pos, entry->path, record.path_len);
+        pos += PAD8((size_t)record.path_len + 1);
+    }
+    cache->dirty = 0;
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s", cache->path);
+    pthread_mutex_unlock(&cache->lock);
+
+    StampData out = { data, len };
+    int ok = write_file_atomic(path, write_data, &out);
+    free(data);
+    return ok;
+}
+
+// Lock held: a pass finished, forget files that are no longer in the library
+static void prune(StampCache* cache) {
+    int kept = 0;
+    for (int i = 0; i < cache->entry_count; i++) {
+        if (cache->entries[i].live) {
+            if (kept != i) {
+                cache->entries[kept] = cache->entries[i];
+                memcpy(stamp_value(cache, kept), stamp_value(cache, i), cache->value_size);
+            }
+            kept++;
+        } else {
+            free(cache->entries[i].path);
+            cache->dirty = 1;
+        }
+    }
+    if (kept != cache->entry_count) {
+        cache->entry_count = kept;
+        rehash(cache, cache->slot_mask + 1);
+    }
+}
+
+static void free_jobs(StampCache* cache) {
+    for (int i = 0; i < cache->job_count; i++) free(cache->jobs[i]);
+    free(cache->jobs);
+    cache->jobs = NULL;
+    cache->job_count = 0;
+    cache->job_next = 0;
+}
+
+// Lock held: replace the queue with jobs (taken over) as the next phase of
+// the current pass, for pass_end()
+void stamp_queue(StampCache* cache, char** jobs, int count) {
+    free_jobs(cache);
+    cache->jobs = jobs;
+    cache->job_count = count;
+    cache->phase++;
+    pthread_cond_broadcast(&cache->cond);
+}
+
+static void* stamp_worker(void* arg) {
+    StampCache* cache = arg;
+#if defined(__linux__) && defined(SCHED_IDLE)
+    // Only runs when a core would otherwise sit idle
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+    pthread_mutex_lock(&cache->lock);
+    while (!cache->quit) {
+        if (cache->job_next >= cache->job_count) {
+            if (!cache->pass_done && cache->busy == 0) {
+                if (cache->pass_end && cache->pass_end()) continue;
+                cache->pass_done = 1;
+                prune(cache);
+                pthread_mutex_unlock(&cache->lock);
+                save(cache);
+                if (cache->saved) cache->saved();
+                pthread_mutex_lock(&cache->lock);
+                continue;
+            }
+            pthread_cond_wait(&cache->cond, &cache->lock);
+            continue;
+        }
+
+        char path[MAX_PATH_LENGTH];
+        snprintf(path, sizeof(path), "%s", cache->jobs[cache->job_next++]);
+        int phase = cache->phase;
+        cache->busy++;
+        pthread_mutex_unlock(&cache->lock);
+
+        cache->job(path, phase);
+
+        pthread_mutex_lock(&cache->lock);
+        cache->busy--;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+// Load the cache for a library root and start a pass over the playlist.
+// Returns 0 if no worker could be started.
+int stamp_open(StampCache* cache, const char* root, const char* ext) {
+    stamp_close(cache);
+
+    if (!index_cache_path(root, ext, cache->path, sizeof(cache->path))) cache->path[0] = '\0';
+    pthread_mutex_lock(&cache->lock);
+    load(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    int threads = cache->threads;
+    if (threads < 1) threads = 1;
+    if (threads > STAMP_MAX_THREADS) threads = STAMP_MAX_THREADS;
+
+    cache->quit = 0;
+    for (cache->worker_count = 0; cache->worker_count < threads; cache->worker_count++) {
+        if (pthread_create(&cache->workers[cache->worker_count], NULL, stamp_worker, cache) != 0) break;
+    }
+    if (cache->worker_count == 0) return 0;
+
+    stamp_refresh(cache);
+    return 1;
+}
+
+// Queue a pass over the library, after loading it or after a live update.
+// Files seen before cost a stat() in the owner's job().
+void stamp_refresh(StampCache* cache) {
+    if (cache->worker_count == 0) return;
+
+    int count = player.tracks.count;
+    char** list = malloc((count > 0 ? count : 1) * sizeof(*list));
+    if (!list) return;
+    int made = 0;
+    for (; made < count; made++) {
+        list[made] = strdup(track_path(made));
+        if (!list[made]) break;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    free_jobs(cache);
+    cache->jobs = list;
+    cache->job_count = made;
+    cache->phase = 0;
+    cache->pass_done = made < count; // an incomplete list must not prune
+    for (int i = 0; i < cache->entry_count; i++) cache->entries[i].live = 0;
+    pthread_cond_broadcast(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Stop the workers, write what was found and free it all. Returns 0 if the
+// cache file could not be written.
+int stamp_close(StampCache* cache) {
+    if (cache->worker_count > 0) {
+        pthread_mutex_lock(&cache->lock);
+        cache->quit = 1;
+        pthread_cond_broadcast(&cache->cond);
+        pthread_mutex_unlock(&cache->lock);
+        for (int i = 0; i < cache->worker_count; i++) pthread_join(cache->workers[i], NULL);
+        cache->worker_count = 0;
+    }
+
+    int ok = save(cache);
+
+    pthread_mutex_lock(&cache->lock);
+    free_jobs(cache);
+    for (int i = 0; i < cache->entry_count; i++) free(cache->entries[i].path);
+    free(cache->entries);
+    free(cache->values);
+    free(cache->slots);
+    cache->entries = NULL;
+    cache->values = NULL;
+    cache->slots = NULL;
+    cache->entry_count = cache->entry_cap = 0;
+    cache->dirty = 0;
+    cache->phase = 0;
+    cache->pass_done = 1;
+    cache->path[0] = '\0';
+    pthread_mutex_unlock(&cache->lock);
+    return ok;
+}
+
+// Jobs queued or running
+int stamp_pending(StampCache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    int pending = cache->job_count - cache->job_next + cache->busy;
+    pthread_mutex_unlock(&cache->lock);
+    return pending;
+}
@@ -22,7 +22,7 @@ void rawModeOn() {
 
 void get_terminal_size() {
     struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
         player.terminal_width = ws.ws_col;
         player.terminal_height = ws.ws_row;
     } else {
@@ -31,12 +31,6 @@ void get_terminal_size() {
     }
 }
 
-void resize(int sig) {
-    (void)sig;  // Suppress unused parameter warning
-    get_terminal_size();
-    signal(SIGWINCH, resize);
-}
-
 void clear_screen() {
     printf("\033[2J\033[H");
 }
@@ -0,0 +1,360 @@
+#include "cMusix.h"
+
+// Growable track store.
+//
+// All paths live back to back in a single arena, NUL-terminated. Per-track
+// data is kept in parallel arrays (structure of arrays): the offset of the
+// path in the arena and the offset of the file name inside that path, so
+// the name is never stored twice, plus its cached duration. Tags, when a
+// file has any, are appended to the same arena as "title\0artist\0album\0"
+// and found through tag_off. A track costs its path bytes plus sixteen bytes
+// of bookkeeping.
+//
+// Tracks are kept in playlist order, which is path order with '/' sorting
+// before any other byte (depth-first, names sorted in each directory), so a
+// path is found by binary search. Live updates insert, remove and move
+// ranges of the parallel arrays; strings they orphan stay in the arena as
+// dead bytes until track_compact() copies the live ones out.
+
+static int reserve_tracks(TrackStore* store, int needed) {
+    if (needed <= store->capacity) return 1;
+
+    int capacity = store->capacity ? store->capacity : 64;
+    while (capacity < needed) capacity *= 2;
+
+    uint32_t* path_off = realloc(store->path_off, capacity * sizeof(uint32_t));
+    if (!path_off) return 0;
+    store->path_off = path_off;
+
+    uint16_t* name_off = realloc(store->name_off, capacity * sizeof(uint16_t));
+    if (!name_off) return 0;
+    store->name_off = name_off;
+
+    float* duration = realloc(store->duration, capacity * sizeof(float));
+    if (!duration) return 0;
+    store->duration = duration;
+
+    uint32_t* tag_off = realloc(store->tag_off, capacity * sizeof(uint32_t));
+    if (!tag_off) return 0;
+    store->tag_off = tag_off;
+
+    uint16_t* track_no = realloc(store->track_no, capacity * sizeof(uint16_t));
+    if (!track_no) return 0;
+    store->track_no = track_no;
+
+    store->capacity = capacity;
+    return 1;
+}
+
+static char* reserve_arena(TrackStore* store, size_t len) {
+    if (store->arena_len + len > UINT32_MAX) return NULL;
+
+    if (store->arena_len + len > store->arena_cap) {
+        size_t capacity = store->arena_cap ? store->arena_cap : 4096;
+        while (store->arena_len + len > capacity) capacity *= 2;
+        char* arena = realloc(store->arena, capacity);
+        if (!arena) return NULL;
+        store->arena = arena;
+        store->arena_cap = capacity;
+    }
+    return store->arena + store->arena_len;
+}
+
+// Append "dir/name", or a full path in name when dir is NULL. Returns the
+// new index or -1 when out of memory.
+int track_add(TrackStore* store, const char* dir, const char* name) {
+    size_t dir_len = dir ? strlen(dir) + 1 : 0;
+    size_t name_len = strlen(name);
+    size_t base = dir_len;
+    if (!dir) {
+        const char* slash = strrchr(name, '/');
+        if (slash) base = (size_t)(slash - name) + 1;
+    }
+    if (base > UINT16_MAX) return -1;
+
+    if (!reserve_tracks(store, store->count + 1)) return -1;
+    char* p = reserve_arena(store, dir_len + name_len + 1);
+    if (!p) return -1;
+
+    if (dir) {
+        memcpy(p, dir, dir_len - 1);
+        p[dir_len - 1] = '/';
+    }
+    memcpy(p + dir_len, name, name_len + 1);
+
+    int index = store->count++;
+    store->path_off[index] = (uint32_t)store->arena_len;
+    store->name_off[index] = (uint16_t)base;
+    store->duration[index] = -1; // not read yet
+    store->tag_off[index] = NO_TAGS;
+    store->track_no[index] = 0;
+    store->arena_len += dir_len + name_len + 1;
+    return index;
+}
+
+static size_t tags_len(const TrackStore* store, int index) {
+    uint32_t off = store->tag_off[index];
+    if (off == NO_TAGS) return 0;
+    const char* p = store->arena + off;
+    for (int field = 0; field < 3; field++) p += strlen(p) + 1;
+    return (size_t)(p - (store->arena + off));
+}
+
+// Attach tags read by media_probe(), replacing any the track had. Returns 0
+// when out of memory.
+int track_set_tags(TrackStore* store, int index, const char* title, const char* artist,
+                   const char* album, int track_no) {
+    store->arena_dead += tags_len(store, index);
+    store->tag_off[index] = NO_TAGS;
+    store->track_no[index] = 0;
+
+    if (track_no > 0 && track_no <= UINT16_MAX) store->track_no[index] = (uint16_t)track_no;
+    if (!title[0] && !artist[0] && !album[0]) return 1;
+
+    size_t title_len = strlen(title) + 1;
+    size_t artist_len = strlen(artist) + 1;
+    size_t album_len = strlen(album) + 1;
+    char* p = reserve_arena(store, title_len + artist_len + album_len);
+    if (!p) return 0;
+
+    memcpy(p, title, title_len);
+    memcpy(p + title_len, artist, artist_len);
+    memcpy(p + title_len + artist_len, album, album_len);
+    store->tag_off[index] = (uint32_t)store->arena_len;
+    store->arena_len += title_len + artist_len + album_len;
+    return 1;
+}
+
+// Point a track at a new path, keeping its tags. Returns 0 when out of
+// memory.
+int track_rename(TrackStore* store, int index, const char* path) {
+    const char* slash = strrchr(path, '/');
+    size_t base = slash ? (size_t)(slash - path) + 1 : 0;
+    size_t len = strlen(path) + 1;
+    if (base > UINT16_MAX) return 0;
+
+    char* p = reserve_arena(store, len);
+    if (!p) return 0;
+    memcpy(p, path, len);
+
+    store->arena_dead += strlen(store->arena + store->path_off[index]) + 1;
+    store->path_off[index] = (uint32_t)store->arena_len;
+    store->name_off[index] = (uint16_t)base;
+    store->arena_len += len;
+    return 1;
+}
+
+// Move elements [from, from + count) of an array so they start at to, where
+// to is counted after the move
+static void move_range(void* array, size_t size, int from, int count, int to, void* scratch) {
+    char* a = array;
+    if (to == from) return;
+    memcpy(scratch, a + (size_t)from * size, (size_t)count * size);
+    if (to < from) {
+        memmove(a + (size_t)(to + count) * size, a + (size_t)to * size, (size_t)(from - to) * size);
+    } else {
+        memmove(a + (size_t)from * size, a + (size_t)(from + count) * size, (size_t)(to - from) * size);
+    }
+    memcpy(a + (size_t)to * size, scratch, (size_t)count * size);
+}
+
+// Move tracks [from, from + count) to start at to. Returns 0 when out of
+// memory, leaving the order unchanged.
+int track_move(TrackStore* store, int from, int count, int to) {
+    if (count <= 0 || to == from) return 1;
+    void* scratch = malloc((size_t)count * sizeof(uint32_t));
+    if (!scratch) return 0;
+    move_range(store->path_off, sizeof(uint32_t), from, count, to, scratch);
+    move_range(store->name_off, sizeof(uint16_t), from, count, to, scratch);
+    move_range(store->duration, sizeof(float), from, count, to, scratch);
+    move_range(store->tag_off, sizeof(uint32_t), from, count, to, scratch);
+    move_range(store->track_no, sizeof(uint16_t), from, count, to, scratch);
+    free(scratch);
+    return 1;
+}
+
+void track_remove(TrackStore* store, int from, int count) {
+    if (count <= 0) return;
+    for (int i = from; i < from + count; i++) {
+        store->arena_dead += strlen(store->arena + store->path_off[i]) + 1 + tags_len(store, i);
+    }
+
+    int tail = store->count - from - count;
+    memmove(store->path_off + from, store->path_off + from + count, tail * sizeof(uint32_t));
+    memmove(store->name_off + from, store->name_off + from + count, tail * sizeof(uint16_t));
+    memmove(store->duration + from, store->duration + from + count, tail * sizeof(float));
+    memmove(store->tag_off + from, store->tag_off + from + count, tail * sizeof(uint32_t));
+    memmove(store->track_no + from, store->track_no + from + count, tail * sizeof(uint16_t));
+    store->count -= count;
+}
+
+// Where index ends up after track_move(from, count, to), or after
+// track_remove(from, count) when to is -1; -1 if it was removed
+int track_remap(int index, int from, int count, int to) {
+    if (index < 0) return index;
+    if (index >= from && index < from + count) return to < 0 ? -1 : to + (index - from);
+    if (index >= from + count) index -= count;
+    if (to >= 0 && index >= to) index += count;
+    return index;
+}
+
+// Where index ends up after the change map describes; -1 if it was removed
+int track_map(const TrackMap* map, int index) {
+    if (!map->table) return track_remap(index, map->from, map->count, map->to);
+    if (index < map->from) return index;
+    if (index >= map->from + map->count) return -1;
+    int to = map->table[index - map->from];
+    return to < 0 ? -1 : to;
+}
+
+// For a removed index: where the tracks after it now start
+int track_map_gap(const TrackMap* map, int index) {
+    if (!map->table) return map->from;
+    return -1 - map->table[index - map->from];
+}
+
+// Copy the live strings into a fresh arena once at least half of it is dead
+int track_compact(TrackStore* store) {
+    if (store->arena_dead < store->arena_len / 2) return 1;
+
+    size_t live = 0;
+    for (int i = 0; i < store->count; i++) {
+        live += strlen(store->arena + store->path_off[i]) + 1 + tags_len(store, i);
+    }
+    char* arena = malloc(live ? live : 1);
+    if (!arena) return 0;
+
+    size_t len = 0;
+    for (int i = 0; i < store->count; i++) {
+        const char* path = store->arena + store->path_off[i];
+        size_t path_len = strlen(path) + 1;
+        memcpy(arena + len, path, path_len);
+        store->path_off[i] = (uint32_t)len;
+        len += path_len;
+
+        size_t tag_len = tags_len(store, i);
+        if (tag_len) {
+            memcpy(arena + len, store->arena + store->tag_off[i], tag_len);
+            store->tag_off[i] = (uint32_t)len;
+            len += tag_len;
+        }
+    }
+
+    free(store->arena);
+    store->arena = arena;
+    store->arena_len = len;
+    store->arena_cap = live ? live : 1;
+    store->arena_dead = 0;
+    return 1;
+}
+
+// Keep only the tracks from first on whose keep flag is set, in order. If
+// table is not NULL it receives where each went, for a TrackMap; otherwise
+// nothing may refer to the dropped ones.
+void track_keep(TrackStore* store, int first, const char* keep, int* table) {
+    int kept = first;
+    for (int i = first; i < store->count; i++) {
+        if (!keep[i - first]) {
+            store->arena_dead += strlen(store->arena + store->path_off[i]) + 1 + tags_len(store, i);
+            if (table) table[i - first] = -1 - kept;
+            continue;
+        }
+        if (table) table[i - first] = kept;
+        store->path_off[kept] = store->path_off[i];
+        store->name_off[kept] = store->name_off[i];
+        store->duration[kept] = store->duration[i];
+        store->tag_off[kept] = store->tag_off[i];
+        store->track_no[kept] = store->track_no[i];
+        kept++;
+    }
+    store->count = kept;
+}
+
+// Playlist order: plain byte order except that '/' sorts first
+int track_path_compare(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    int ca = *a == '/' ? 1 : (unsigned char)*a;
+    int cb = *b == '/' ? 1 : (unsigned char)*b;
+    return ca - cb;
+}
+
+// First of the first limit tracks that does not sort before path
+int track_lower_bound(int limit, const char* path) {
+    int lo = 0, hi = limit;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (track_path_compare(track_path(mid), path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int track_find(const char* path) {
+    int index = track_lower_bound(player.tracks.count, path);
+    if (index < player.tracks.count && strcmp(track_path(index), path) == 0) return index;
+    return -1;
+}
+
+void track_clear(TrackStore* store) {
+    store->count = 0;
+    store->arena_len = 0;
+    store->arena_dead = 0;
+}
+
+void track_free(TrackStore* store) {
+    free(store->arena);
+    free(store->path_off);
+    free(store->name_off);
+    free(store->duration);
+    free(store->tag_off);
+    free(store->track_no);
+    memset(store, 0, sizeof(*store));
+}
+
+const char* track_path(int index) {
+    return player.tracks.arena + player.tracks.path_off[index];
+}
+
+const char* track_name(int index) {
+    return track_path(index) + player.tracks.name_off[index];
+}
+
+// Tag fields are "" when the file had none
+const char* track_title(int index) {
+    uint32_t off = player.tracks.tag_off[index];
+    return off == NO_TAGS ? "" : player.tracks.arena + off;
+}
+
+const char* track_artist(int index) {
+    if (player.tracks.tag_off[index] == NO_TAGS) return "";
+    const char* title = track_title(index);
+    return title + strlen(title) + 1;
+}
+
+const char* track_album(int index) {
+    if (player.tracks.tag_off[index] == NO_TAGS) return "";
+    const char* artist = track_artist(index);
+    return artist + strlen(artist) + 1;
+}
+
+// What the interface shows for a track: "Artist - Title" when tagged,
+// otherwise the file name
+void track_display_name(int index, char* buf, size_t size) {
+    const char* title = track_title(index);
+    const char* artist = track_artist(index);
+    if (title[0] && artist[0]) {
+        snprintf(buf, size, "%s - %s", artist, title);
+    } else if (title[0]) {
+        snprintf(buf, size, "%s", title);
+    } else {
+        snprintf(buf, size, "%s", track_name(index));
+    }
+}
+
+size_t track_memory(const TrackStore* store) {
+    return store->arena_cap +
+           (size_t)store->capacity * (2 * sizeof(uint32_t) + 2 * sizeof(uint16_t) + sizeof(float));
+}
@@ -0,0 +1,771 @@
+#include "cMusix.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#endif
+
+// Live library updates.
+//
+// After load_folder() every directory of the tree carries an inotify watch,
+// added by the scanner as it opens each one, so nothing can change unseen
+// between the scan and the watch. Events are not applied one by one: they
+// collect until the tree has been quiet for WATCH_SETTLE_MS (at most
+// WATCH_MAX_DELAY_MS during a long copy), then the batch is applied to the
+// track store on the main thread:
+//   renames      paired by cookie; the tracks keep their tags and move to
+//                their new place in the playlist, replacing any at the
+//                new path
+//   files        deduplicated, then made to match the disk: added, removed
+//                or, after a write or a rename over them, their tags read
+//                again
+//   directories  scanned in the background, one at a time, and merged
+//                in once read, or dropped with everything under them
+// Events name a watch and an entry, and the watch's path is looked up only
+// when the batch is applied, after the renames in it, so an event in a
+// directory renamed later in the same batch still lands in the right place.
+// Every change to the store goes through playlist_remap(), which keeps the
+// playing track, the scroll position, the preloader and the shuffle history
+// on the same tracks. A queue overflow rescans the whole tree in the
+// background and merges it once read. Batches that settle while a scan is
+// still running wait for it to finish.
+// Other systems keep the library as loaded.
+
+#define WATCH_SETTLE_MS 300
+#define WATCH_MAX_DELAY_MS 2000
+
+#ifdef __linux__
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | \
+                    IN_ONLYDIR | IN_EXCL_UNLINK)
+
+typedef struct {
+    int wd;
+    char* path;
+} WatchDir;
+
+typedef struct {
+    int wd;
+    uint32_t mask;
+    uint32_t cookie;
+    char* name;
+} Change;
+
+typedef struct {
+    char* path;
+    uint32_t mask;
+} Check;
+
+static int inotify_fd = -1;
+static int settle_fd = -1;
+static char* root_path = NULL;
+
+// Written by the scanner's workers too
+static pthread_mutex_t dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+static WatchDir* dirs = NULL;
+static int dir_count = 0;
+static int dir_cap = 0;
+static int* wd_slots = NULL;        // indices into dirs, hashed by wd, -1 when free
+static size_t wd_mask = 0;
+static unsigned long unwatched = 0;  // directories past the inotify limit
+
+static Change* changes = NULL;
+static int change_count = 0;
+static int change_cap = 0;
+static int overflowed = 0;
+static uint64_t first_change = 0;
+
+// Directories waiting for a background scan, and the one being scanned
+static char** merges = NULL;
+static int merge_count = 0;
+static int merge_cap = 0;
+static char* merging = NULL;
+
+static unsigned long batches = 0;
+static unsigned long updated = 0;
+
+static size_t wd_hash(int wd) {
+    return ((uint32_t)wd * 2654435761u) & wd_mask;
+}
+
+// Slot holding wd, or the free one where it would go. dirs_lock held, as
+// for everything on dirs.
+static size_t wd_slot(int wd) {
+    size_t slot = wd_hash(wd);
+    while (wd_slots[slot] >= 0 && dirs[wd_slots[slot]].wd != wd) slot = (slot + 1) & wd_mask;
+    return slot;
+}
+
+static int find_dir(int wd) {
+    if (!wd_slots) return -1;
+    return wd_slots[wd_slot(wd)];
+}
+
+static int wd_rehash(size_t count) {
+    int* table = malloc(count * sizeof(*table));
+    if (!table) return 0;
+    memset(table, 0xff, count * sizeof(*table));
+    free(wd_slots);
+    wd_slots = table;
+    wd_mask = count - 1;
+    for (int i = 0; i < dir_count; i++) wd_slots[wd_slot(dirs[i].wd)] = i;
+    return 1;
+}
+
+// Free wd's slot, shifting back the entries that probed past it
+static void wd_erase(int wd) {
+    size_t hole = wd_slot(wd);
+    wd_slots[hole] = -1;
+    for (size_t slot = (hole + 1) & wd_mask; wd_slots[slot] >= 0; slot = (slot + 1) & wd_mask) {
+        size_t home = wd_hash(dirs[wd_slots[slot]].wd);
+        // Stays unless its home lies cyclically outside (hole, slot]
+        if (((slot - home) & wd_mask) < ((slot - hole) & wd_mask)) continue;
+        wd_slots[hole] = wd_slots[slot];
+        wd_slots[slot] = -1;
+        hole = slot;
+    }
+}
+
+static void drop_dir(int i) {
+    wd_erase(dirs[i].wd);
+    free(dirs[i].path);
+    if (i != --dir_count) {
+        dirs[i] = dirs[dir_count];
+        wd_slots[wd_slot(dirs[i].wd)] = i;
+    }
+}
+
+// Scanner workers, for every directory they open
+void watch_add_dir(const char* path) {
+    if (inotify_fd < 0) return;
+
+    pthread_mutex_lock(&dirs_lock);
+    int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+    if (wd < 0) {
+        // Counted for the exit summary: the screen belongs to the interface
+        if (errno == ENOSPC || errno == ENOMEM) unwatched++;
+    } else if (find_dir(wd) < 0) {
+        // A directory reached twice (through a symlink) keeps its first path
+        if (dir_count == dir_cap) {
+            int cap = dir_cap ? dir_cap * 2 : 64;
+            WatchDir* grown = realloc(dirs, cap * sizeof(WatchDir));
+            if (grown) {
+                dirs = grown;
+                dir_cap = cap;
+            }
+        }
+        if (!wd_slots || (size_t)(dir_count + 1) * 2 > wd_mask + 1) {
+            wd_rehash(wd_slots ? (wd_mask + 1) * 2 : 128);
+        }
+        char* copy = dir_count < dir_cap && wd_slots && (size_t)dir_count < wd_mask ? strdup(path) : NULL;
+        if (copy) {
+            dirs[dir_count].wd = wd;
+            dirs[dir_count].path = copy;
+            wd_slots[wd_slot(wd)] = dir_count;
+            dir_count++;
+        } else {
+            inotify_rm_watch(inotify_fd, wd);
+        }
+    }
+    pthread_mutex_unlock(&dirs_lock);
+}
+
+// path is dir or somewhere below it
+static int under(const char* path, const char* dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '/' || path[dir_len] == '\0');
+}
+
+static void unwatch_tree(const char* dir) {
+    size_t len = strlen(dir);
+    pthread_mutex_lock(&dirs_lock);
+    for (int i = dir_count - 1; i >= 0; i--) {
+        if (under(dirs[i].path, dir, len)) {
+            inotify_rm_watch(inotify_fd, dirs[i].wd);
+            drop_dir(i);
+        }
+    }
+    pthread_mutex_unlock(&dirs_lock);
+}
+
+// Join a prefix and a suffix into a new string
+static char* join(const char* a, const char* sep, const char* b) {
+    size_t len = strlen(a) + strlen(sep) + strlen(b) + 1;
+    char* path = malloc(len);
+    if (path) snprintf(path, len, "%s%s%s", a, sep, b);
+    return path;
+}
+
+// Watches stay on a renamed directory's inodes; only their paths change
+static void rename_watches(const char* from, const char* to) {
+    size_t from_len = strlen(from);
+    pthread_mutex_lock(&dirs_lock);
+    for (int i = 0; i < dir_count; i++) {
+        if (!under(dirs[i].path, from, from_len)) continue;
+        char* path = join(to, "", dirs[i].path + from_len);
+        if (!path) continue;
+        free(dirs[i].path);
+        dirs[i].path = path;
+    }
+    pthread_mutex_unlock(&dirs_lock);
+}
+
+// Full path of a change, NULL if its directory is no longer watched
+static char* change_path(const Change* change) {
+    pthread_mutex_lock(&dirs_lock);
+    int i = find_dir(change->wd);
+    char* path = i < 0 ? NULL : join(dirs[i].path, "/", change->name);
+    pthread_mutex_unlock(&dirs_lock);
+    return path;
+}
+
+// Tracks [first, *end) of the first limit are under dir
+static int tree_range(const char* dir, int limit, int* end) {
+    size_t len = strlen(dir);
+    int first = track_lower_bound(limit, dir);
+    int last = first;
+    while (last < limit && under(track_path(last), dir, len)) last++;
+    *end = last;
+    return first;
+}
+
+static void remove_tracks(int from, int count) {
+    if (count <= 0) return;
+    track_remove(&player.tracks, from, count);
+    playlist_remap(from, count, -1);
+    updated += count;
+}
+
+static int move_tracks(int from, int count, int to) {
+    if (!track_move(&player.tracks, from, count, to)) return 0;
+    playlist_remap(from, count, to);
+    return 1;
+}
+
+// Move the sorted tracks appended at [first, count) into playlist order.
+// Runs that land between the same two old tracks move together.
+static void place_appended(int first) {
+    while (first < player.tracks.count) {
+        int to = track_lower_bound(first, track_path(first));
+        int run = 1;
+        while (first + run < player.tracks.count &&
+               track_lower_bound(first, track_path(first + run)) == to) {
+            run++;
+        }
+        // Out of memory leaves them at the end, still playable
+        if (!move_tracks(first, run, to)) return;
+        updated += run;
+        first += run;
+    }
+}
+
+static void probe_track(int index) {
+    if (!config.read_tags) return;
+    MediaInfo info;
+    if (!media_probe(track_path(index), &info)) return;
+    track_set_tags(&player.tracks, index, info.title, info.artist, info.album, info.track);
+    player.tracks.duration[index] = info.duration > 0 ? (float)info.duration : 0;
+}
+
+// Make the playlist under dir match a scan of it appended to the store at
+// [appended, count): tracks that were already there keep their place, the
+// ones it no longer has are removed and the new ones moved in.
+static void merge_scanned(const char* dir, int appended) {
+    int old_end;
+    int old_first = tree_range(dir, appended, &old_end);
+    int total = player.tracks.count;
+
+    char* keep = calloc(total - appended + 1, 1);
+    char* gone = calloc(old_end - old_first + 1, 1);
+    if (!keep || !gone) {
+        free(keep);
+        free(gone);
+        track_remove(&player.tracks, appended, total - appended);
+        return;
+    }
+
+    // Both runs are in playlist order, so one pass pairs them up
+    int i = old_first, j = appended;
+    while (i < old_end || j < total) {
+        int cmp = i >= old_end ? 1 : j >= total ? -1
+                : track_path_compare(track_path(i), track_path(j));
+        if (cmp < 0) {
+            gone[i++ - old_first] = 1;
+        } else if (cmp > 0) {
+            keep[j++ - appended] = 1;
+        } else {
+            i++;
+            j++;
+        }
+    }
+    track_keep(&player.tracks, appended, keep, NULL);
+    free(keep);
+
+    // From the back, so the runs still to go keep their indices
+    for (i = old_end - 1; i >= old_first; i--) {
+        if (!gone[i - old_first]) continue;
+        int run = 1;
+        while (i - run >= old_first && gone[i - run - old_first]) run++;
+        remove_tracks(i - run + 1, run);
+        appended -= run;
+        i -= run - 1;
+    }
+    free(gone);
+
+    place_appended(appended);
+}
+
+// The directory is scanned as at startup, onto the end of the store. On
+// the main thread: only for when a background scan cannot be started.
+static void merge_tree(const char* dir) {
+    int appended = player.tracks.count;
+    scan_tree(dir, config.scan_threads, NULL);
+    merge_scanned(dir, appended);
+}
+
+// Take dir (allocated) for a background merge, unless a directory above it
+// is waiting already; the ones below it are covered by it
+static void queue_merge(char* dir) {
+    size_t len = strlen(dir);
+    for (int i = merge_count - 1; i >= 0; i--) {
+        if (under(dir, merges[i], strlen(merges[i]))) {
+            free(dir);
+            return;
+        }
+        if (under(merges[i], dir, len)) {
+            free(merges[i]);
+            merges[i] = merges[--merge_count];
+        }
+    }
+    if (merge_count == merge_cap) {
+        int cap = merge_cap ? merge_cap * 2 : 16;
+        char** grown = realloc(merges, cap * sizeof(char*));
+        if (!grown) {
+            // Out of memory: merge it now rather than not at all
+            merge_tree(dir);
+            free(dir);
+            return;
+        }
+        merges = grown;
+        merge_cap = cap;
+    }
+    merges[merge_count++] = dir;
+}
+
+static void drop_tree(const char* dir) {
+    int end;
+    int first = tree_range(dir, player.tracks.count, &end);
+    remove_tracks(first, end - first);
+    unwatch_tree(dir);
+}
+
+static int hidden(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return (slash ? slash[1] : path[0]) == '.';
+}
+
+// A file or directory changed: bring the playlist in line with the disk
+static void check_path(const char* path, uint32_t mask) {
+    if (hidden(path)) return;
+
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+
+    if (mask & IN_ISDIR) {
+        if (exists && S_ISDIR(st.st_mode)) {
+            char* dir = strdup(path);
+            if (dir) queue_merge(dir);
+        } else {
+            drop_tree(path);
+        }
+        return;
+    }
+
+    int index = track_find(path);
+    if (!exists || !S_ISREG(st.st_mode) || audio_file_at(AT_FDCWD, path) == AUDIO_NONE) {
+        if (index >= 0) remove_tracks(index, 1);
+        return;
+    }
+    if (index >= 0) {
+        // Written in place, or saved as a new file renamed over it
+        if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            probe_track(index);
+            updated++;
+            // A write in place leaves the directory's mtime alone, and with
+            // it the tags in the saved index
+            const char* slash = strrchr(path, '/');
+            if (slash && slash > path) {
+                char dir[MAX_PATH_LENGTH];
+                snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+                index_invalidate(root_path, dir);
+            }
+        }
+        return;
+    }
+
+    int appended = player.tracks.count;
+    int added = track_add(&player.tracks, NULL, path);
+    if (added < 0) return;
+    probe_track(added);
+    place_appended(appended);
+}
+
+// Rename tracks in place, moving them to their new spot. Returns 0 when
+// there was nothing to move and the two paths should just be checked.
+static int rename_tracks(const char* from, const char* to, int is_dir) {
+    // The content decided it is audio, a new name does not change that
+    if (hidden(to)) return 0;
+
+    int first, end;
+    if (is_dir) {
+        first = tree_range(from, player.tracks.count, &end);
+    } else {
+        first = track_find(from);
+        end = first + 1;
+    }
+    int count = end - first;
+    if (first < 0 || count <= 0) return 0;
+
+    // Renamed over tracks (an atomic save): they are replaced, and the
+    // store keeps one track per path
+    int to_end;
+    int to_first = is_dir ? tree_range(to, player.tracks.count, &to_end) : track_find(to);
+    if (!is_dir) to_end = to_first + 1;
+    if (to_first >= 0 && to_end > to_first) {
+        remove_tracks(to_first, to_end - to_first);
+        if (to_first < first) first -= to_end - to_first;
+    }
+
+    // Park them at the end, rename, and insert them where they now sort
+    int parked = player.tracks.count - count;
+    if (!move_tracks(first, count, parked)) return 0;
+    size_t from_len = strlen(from);
+    for (int i = parked; i < player.tracks.count; i++) {
+        char* path = join(to, "", track_path(i) + from_len);
+        if (!path || !track_rename(&player.tracks, i, path)) {
+            free(path);
+            return 0;
+        }
+        free(path);
+    }
+    move_tracks(parked, count, track_lower_bound(parked, to));
+    updated += count;
+    return 1;
+}
+
+static void queue_check(Check** checks, int* count, int* cap, char* path, uint32_t mask) {
+    if (!path) return;
+    if (*count == *cap) {
+        int new_cap = *cap ? *cap * 2 : 64;
+        Check* grown = realloc(*checks, new_cap * sizeof(Check));
+        if (!grown) {
+            free(path);
+            return;
+        }
+        *checks = grown;
+        *cap = new_cap;
+    }
+    (*checks)[*count].path = path;
+    (*checks)[*count].mask = mask;
+    (*count)++;
+}
+
+static int compare_checks(const void* a, const void* b) {
+    return strcmp(((const Check*)a)->path, ((const Check*)b)->path);
+}
+
+// The store changed: bring everything that indexes it up to date
+static void changes_applied() {
+    batches++;
+    track_compact(&player.tracks);
+    search_refresh();
+    loudness_refresh();
+    dedup_refresh();
+    if (player.is_playing) preload_upcoming();
+    event_request_redraw();
+}
+
+static void drop_changes() {
+    for (int i = 0; i < change_count; i++) free(changes[i].name);
+    change_count = 0;
+    first_change = 0;
+}
+
+static void on_rescanned(int ok, int first);
+
+// Start the next waiting merge. Returns 0 when none is under way.
+static int next_merge() {
+    while (merge_count > 0 && !merging) {
+        char* dir = merges[0];
+        memmove(merges, merges + 1, --merge_count * sizeof(char*));
+        merging = dir;
+        if (scan_rescan(dir, config.scan_threads, on_rescanned)) return 1;
+        merging = NULL;
+        merge_tree(dir);
+        free(dir);
+        changes_applied();
+    }
+    return merging != NULL;
+}
+
+// A directory scanned in the background has been read and appended at first
+static void on_rescanned(int ok, int first) {
+    if (!merging) {
+        // The watch was stopped under it
+        track_remove(&player.tracks, first, player.tracks.count - first);
+        return;
+    }
+    if (ok) {
+        merge_scanned(merging, first);
+    } else {
+        track_remove(&player.tracks, first, player.tracks.count - first);
+    }
+    free(merging);
+    merging = NULL;
+    changes_applied();
+    // Then the next one, and what changed while they ran
+    if (!next_merge()) watch_flush();
+}
+
+static void apply_changes() {
+    Check* checks = NULL;
+    int check_count = 0, check_cap = 0;
+
+    if (overflowed) {
+        // Events were lost: only a full rescan can tell what changed, and
+        // every event so far is in it
+        drop_changes();
+        char* root = strdup(root_path);
+        if (!root) return;
+        overflowed = 0;
+        queue_merge(root);
+        next_merge();
+        return;
+    }
+
+    for (int i = 0; i < change_count; i++) {
+        Change* change = &changes[i];
+        if (!change->name) continue;
+
+        // A move inside the tree is a pair sharing a cookie
+        if (change->mask & IN_MOVED_FROM) {
+            for (int j = i + 1; j < change_count; j++) {
+                if (changes[j].name && (changes[j].mask & IN_MOVED_TO) &&
+                    changes[j].cookie == change->cookie) {
+                    char* from = change_path(change);
+                    char* to = change_path(&changes[j]);
+                    int is_dir = (change->mask & IN_ISDIR) != 0;
+                    if (from && to && rename_tracks(from, to, is_dir)) {
+                        if (is_dir) rename_watches(from, to);
+                        free(from);
+                        free(to);
+                    } else {
+                        queue_check(&checks, &check_count, &check_cap, from, change->mask);
+                        queue_check(&checks, &check_count, &check_cap, to, changes[j].mask);
+                    }
+                    free(changes[j].name);
+                    changes[j].name = NULL;
+                    free(change->name);
+                    change->name = NULL;
+                    break;
+                }
+            }
+            if (!change->name) continue;
+        }
+        queue_check(&checks, &check_count, &check_cap, change_path(change), change->mask);
+    }
+
+    // One look at the disk per path, whatever happened to it
+    qsort(checks, check_count, sizeof(Check), compare_checks);
+    for (int i = 0; i < check_count; i++) {
+        uint32_t mask = checks[i].mask;
+        while (i + 1 < check_count && strcmp(checks[i].path, checks[i + 1].path) == 0) {
+            free(checks[i].path);
+            mask |= checks[++i].mask;
+        }
+        check_path(checks[i].path, mask);
+        free(checks[i].path);
+    }
+    free(checks);
+
+    drop_changes();
+    changes_applied();
+    // New directories are read off the main thread
+    next_merge();
+}
+
+static void arm_settle_timer() {
+    uint64_t waited_ms = (now_ns() - first_change) / 1000000;
+    long delay = WATCH_SETTLE_MS;
+    if (waited_ms + delay > WATCH_MAX_DELAY_MS) {
+        delay = waited_ms < WATCH_MAX_DELAY_MS ? (long)(WATCH_MAX_DELAY_MS - waited_ms) : 1;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = delay / 1000;
+    spec.it_value.tv_nsec = (delay % 1000) * 1000000L;
+    timerfd_settime(settle_fd, 0, &spec, NULL);
+}
+
+static void queue_change(const struct inotify_event* event) {
+    if (change_count == change_cap) {
+        int cap = change_cap ? change_cap * 2 : 64;
+        Change* grown = realloc(changes, cap * sizeof(Change));
+        if (!grown) {
+            overflowed = 1;
+            return;
+        }
+        changes = grown;
+        change_cap = cap;
+    }
+    char* name = strdup(event->name);
+    if (!name) {
+        overflowed = 1;
+        return;
+    }
+    changes[change_count].wd = event->wd;
+    changes[change_count].mask = event->mask;
+    changes[change_count].cookie = event->cookie;
+    changes[change_count].name = name;
+    change_count++;
+}
+
+static void on_inotify(int fd, void* data) {
+    (void)data;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    int queued = 0;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len;) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = 1;
+                queued = 1;
+            } else if (event->mask & IN_IGNORED) {
+                // Directory gone or unwatched; its parent reports the why
+                pthread_mutex_lock(&dirs_lock);
+                int i = find_dir(event->wd);
+                if (i >= 0) drop_dir(i);
+                pthread_mutex_unlock(&dirs_lock);
+            } else if (event->len > 0 && event->name[0] != '.') {
+                queue_change(event);
+                queued = 1;
+            }
+        }
+    }
+
+    if (!queued) return;
+    if (first_change == 0) first_change = now_ns();
+    arm_settle_timer();
+}
+
+static void on_settled(int fd, void* data) {
+    (void)data;
+    uint64_t expirations;
+    while (read(fd, &expirations, sizeof(expirations)) > 0) {
+    }
+    // A background scan is still merging: the batch waits for watch_flush()
+    if (scan_running()) return;
+    if (change_count > 0 || overflowed) apply_changes();
+}
+
+// A background scan finished: apply what changed while it ran
+void watch_flush() {
+    if (change_count > 0 || overflowed) apply_changes();
+}
+
+// Start over for a new library. Called before it is scanned; the scanner
+// then adds a watch for every directory it opens.
+int watch_start(const char* root) {
+    watch_stop();
+
+    root_path = strdup(root);
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    settle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!root_path || inotify_fd < 0 || settle_fd < 0 ||
+        !event_watch(inotify_fd, on_inotify, NULL) || !event_watch(settle_fd, on_settled, NULL)) {
+        watch_stop();
+        return 0;
+    }
+    return 1;
+}
+
+void watch_stop() {
+    if (inotify_fd >= 0) {
+        event_unwatch(inotify_fd);
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    if (settle_fd >= 0) {
+        event_unwatch(settle_fd);
+        close(settle_fd);
+        settle_fd = -1;
+    }
+
+    for (int i = 0; i < dir_count; i++) free(dirs[i].path);
+    free(dirs);
+    free(wd_slots);
+    dirs = NULL;
+    wd_slots = NULL;
+    wd_mask = 0;
+    dir_count = 0;
+    dir_cap = 0;
+
+    for (int i = 0; i < change_count; i++) free(changes[i].name);
+    free(changes);
+    changes = NULL;
+    change_count = 0;
+    change_cap = 0;
+    overflowed = 0;
+    first_change = 0;
+
+    for (int i = 0; i < merge_count; i++) free(merges[i]);
+    free(merges);
+    free(merging);
+    merges = NULL;
+    merging = NULL;
+    merge_count = 0;
+    merge_cap = 0;
+
+    free(root_path);
+    root_path = NULL;
+}
+
+#else
+
+int watch_start(const char* root) {
+    (void)root;
+    return 0;
+}
+
+void watch_add_dir(const char* path) {
+    (void)path;
+}
+
+void watch_flush() {
+}
+
+void watch_stop() {
+}
+
+#endif
+
+void watch_stats(unsigned long* batch_count, unsigned long* track_count,
+                 unsigned long* unwatched_count) {
+#ifdef __linux__
+    if (batch_count) *batch_count = batches;
+    if (track_count) *track_count = updated;
+    if (unwatched_count) {
+        pthread_mutex_lock(&dirs_lock);
+        *unwatched_count = unwatched;
+        pthread_mutex_unlock(&dirs_lock);
+    }
+#else
+    if (batch_count) *batch_count = 0;
+    if (track_count) *track_count = 0;
+    if (unwatched_count) *unwatched_count = 0;
+#endif
+}